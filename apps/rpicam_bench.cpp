@@ -0,0 +1,230 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * rpicam_bench.cpp - end-to-end pipeline benchmark app.
+ *
+ * Runs one scripted scenario against the real camera pipeline and emits a
+ * single machine-readable result line, so each release can be regression
+ * tested across the hardware matrix without stopwatches or log scraping.
+ * Scenarios: "capture" (viewfinder frames only), "postproc" (capture with
+ * the stages from --post-process-file), "encode" (capture plus video encode)
+ * and "still-burst" (continuous full-resolution still stream).
+ *
+ * Example: rpicam-bench --scenario encode --codec h264 --width 1920 --height 1080 --frames 300
+ */
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+#include "core/rpicam_encoder.hpp"
+
+struct BenchOptions : public VideoOptions
+{
+	BenchOptions() : VideoOptions()
+	{
+		using namespace boost::program_options;
+		options_->add_options()
+			("scenario", value<std::string>(&scenario)->default_value("capture"),
+			 "Benchmark scenario, one of capture, postproc, encode or still-burst")
+			;
+	}
+
+	std::string scenario;
+
+	virtual void Print() const override
+	{
+		VideoOptions::Print();
+		std::cerr << "    scenario: " << scenario << std::endl;
+	}
+};
+
+class RPiCamBenchApp : public RPiCamEncoder
+{
+public:
+	RPiCamBenchApp() : RPiCamEncoder(std::make_unique<BenchOptions>()) {}
+	BenchOptions *GetOptions() const { return static_cast<BenchOptions *>(RPiCamApp::GetOptions()); }
+};
+
+static uint64_t now_ns(clockid_t clock)
+{
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double percentile(std::vector<double> const &sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size() / 100.0));
+	return sorted[i];
+}
+
+// Print one phase's latency percentiles as key=value pairs on the result line.
+
+static void report_phase(std::ostream &os, std::string const &name, std::vector<double> &samples)
+{
+	std::sort(samples.begin(), samples.end());
+	os << " " << name << "_p50_ms=" << percentile(samples, 50) << " " << name << "_p90_ms=" << percentile(samples, 90)
+	   << " " << name << "_p99_ms=" << percentile(samples, 99);
+}
+
+static int get_colourspace_flags(std::string const &codec)
+{
+	if (codec == "mjpeg" || codec == "yuv420")
+		return RPiCamEncoder::FLAG_VIDEO_JPEG_COLOURSPACE;
+	else
+		return RPiCamEncoder::FLAG_VIDEO_NONE;
+}
+
+// The main event loop for the application.
+
+static void event_loop(RPiCamBenchApp &app)
+{
+	BenchOptions *options = app.GetOptions();
+	std::string const &scenario = options->scenario;
+	bool encoding = scenario == "encode";
+	unsigned int num_frames = options->Get().frames ? options->Get().frames : 300;
+
+	// Encode latency is measured from submission to the output callback; the
+	// encoders return outputs in order, so a queue of submit times suffices.
+	std::mutex mutex;
+	std::deque<uint64_t> submit_times;
+	std::vector<double> encode_latencies;
+	uint64_t encoded_bytes = 0;
+
+	app.OpenCamera();
+	if (scenario == "still-burst")
+		app.ConfigureStill();
+	else
+		app.ConfigureVideo(get_colourspace_flags(options->Get().codec));
+	if (encoding)
+	{
+		app.SetEncodeOutputReadyCallback(
+			[&](void *, size_t bytes, int64_t, bool)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!submit_times.empty())
+				{
+					encode_latencies.push_back((now_ns(CLOCK_MONOTONIC) - submit_times.front()) / 1e6);
+					submit_times.pop_front();
+				}
+				encoded_bytes += bytes;
+			});
+		app.StartEncoder();
+	}
+	app.StartCamera();
+
+	libcamera::Stream *stream = scenario == "still-burst" ? app.StillStream() : app.VideoStream();
+	std::vector<double> capture_latencies, frame_intervals;
+	capture_latencies.reserve(num_frames);
+	frame_intervals.reserve(num_frames);
+	uint64_t last_sensor_ts = 0;
+
+	rusage ru_start, ru_end;
+	getrusage(RUSAGE_SELF, &ru_start);
+	uint64_t t_start = now_ns(CLOCK_MONOTONIC);
+
+	for (unsigned int count = 0; count < num_frames;)
+	{
+		RPiCamApp::Msg msg = app.Wait();
+		if (msg.type == RPiCamApp::MsgType::Timeout)
+		{
+			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+			app.StopCamera();
+			app.StartCamera();
+			continue;
+		}
+		if (msg.type == RPiCamApp::MsgType::Quit)
+			return;
+		else if (msg.type != RPiCamApp::MsgType::RequestComplete)
+			throw std::runtime_error("unrecognised message!");
+
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+
+		// Sensor timestamps are on the same clock as the kernel's frame
+		// timestamps, so "now" minus the sensor timestamp is the capture
+		// latency: exposure to the frame arriving in this thread, including
+		// the ISP and any post-processing stages.
+		auto ts = completed_request->metadata.get(libcamera::controls::SensorTimestamp);
+		uint64_t sensor_ts = ts ? *ts : completed_request->buffers.begin()->second->metadata().timestamp;
+		capture_latencies.push_back((now_ns(CLOCK_BOOTTIME) - sensor_ts) / 1e6);
+		if (last_sensor_ts)
+			frame_intervals.push_back((sensor_ts - last_sensor_ts) / 1e6);
+		last_sensor_ts = sensor_ts;
+
+		if (encoding)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				submit_times.push_back(now_ns(CLOCK_MONOTONIC));
+			}
+			if (!app.EncodeBuffer(completed_request, stream))
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				submit_times.pop_back();
+			}
+		}
+		count++;
+	}
+
+	app.StopCamera();
+	if (encoding)
+		app.StopEncoder();
+
+	uint64_t t_end = now_ns(CLOCK_MONOTONIC);
+	getrusage(RUSAGE_SELF, &ru_end);
+
+	double elapsed_s = (t_end - t_start) / 1e9;
+	double cpu_s = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) +
+				   (ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec) / 1e6 +
+				   (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) +
+				   (ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec) / 1e6;
+
+	std::ostream &os = std::cout;
+	os << "rpicam-bench: scenario=" << scenario << " frames=" << num_frames << " fps=" << num_frames / elapsed_s;
+	report_phase(os, "capture", capture_latencies);
+	report_phase(os, "interval", frame_intervals);
+	if (encoding)
+	{
+		report_phase(os, "encode", encode_latencies);
+		os << " bitrate_mbps=" << encoded_bytes * 8 / elapsed_s / 1e6;
+	}
+	os << " cpu_percent=" << 100.0 * cpu_s / elapsed_s << " maxrss_kb=" << ru_end.ru_maxrss << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamBenchApp app;
+		BenchOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			options->Set().nopreview = true;
+			std::string const &scenario = options->scenario;
+			if (scenario != "capture" && scenario != "postproc" && scenario != "encode" && scenario != "still-burst")
+				throw std::runtime_error("unrecognised scenario " + scenario);
+			if (scenario == "postproc" && options->Get().post_process_file.empty())
+				throw std::runtime_error("postproc scenario needs a --post-process-file");
+			if (scenario != "postproc")
+				options->Set().post_process_file = "";
+			if (options->Get().verbose >= 2)
+				options->Get().Print();
+
+			event_loop(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
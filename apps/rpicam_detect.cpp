@@ -8,6 +8,7 @@
 // Example: rpicam-detect --post-process-file object_detect_tf.json --lores-width 400 --lores-height 300 -t 0 --object cat -o cat%03d.jpg
 
 #include <chrono>
+#include <deque>
 
 #include "core/rpicam_app.hpp"
 #include "core/still_options.hpp"
@@ -25,12 +26,16 @@ struct DetectOptions : public StillOptions
 			("object", value<std::string>(&object), "Name of object to detect")
 			("gap", value<unsigned int>(&gap)->default_value(30), "Smallest gap between captures in frames")
 			("timeformat", value<std::string>(&timeformat)->default_value("%m%d%H%M%S"), "Date/Time format string - see C++ strftime()")
+			("pre-roll", value<unsigned int>(&pre_roll)->default_value(0),
+			 "Also save this many viewfinder frames from before each detection (must be less "
+			 "than the camera buffer count)")
 			;
 	}
 
 	std::string object;
 	unsigned int gap;
 	std::string timeformat;
+	unsigned int pre_roll;
 
 	virtual void Print() const override
 	{
@@ -38,6 +43,7 @@ struct DetectOptions : public StillOptions
 		std::cerr << "    object: " << object << std::endl;
 		std::cerr << "    gap: " << gap << std::endl;
 		std::cerr << "    timeformat: " << timeformat << std::endl;
+		std::cerr << "    pre-roll: " << pre_roll << std::endl;
 	}
 };
 
@@ -48,6 +54,32 @@ public:
 	DetectOptions *GetOptions() const { return static_cast<DetectOptions *>(RPiCamApp::GetOptions()); }
 };
 
+// Generate a filename for the next output image.
+
+static std::string generate_filename(DetectOptions *options)
+{
+	char filename[128];
+	uint32_t framestart = options->Get().framestart;
+	if (options->Get().datetime)
+	{
+		std::time_t raw_time;
+		std::time(&raw_time);
+		char time_string[32];
+		std::tm *time_info = std::localtime(&raw_time);
+		std::strftime(time_string, sizeof(time_string), options->timeformat.c_str(), time_info);
+		snprintf(filename, sizeof(filename), "%s%s.%s", options->Get().output.c_str(), time_string,
+				 options->Get().encoding.c_str());
+	}
+	else if (options->Get().timestamp)
+		snprintf(filename, sizeof(filename), "%s%u.%s", options->Get().output.c_str(), (unsigned)time(NULL),
+				 options->Get().encoding.c_str());
+	else
+		snprintf(filename, sizeof(filename), options->Get().output.c_str(), framestart);
+	filename[sizeof(filename) - 1] = 0;
+	options->Set().framestart = framestart + 1;
+	return std::string(filename);
+}
+
 // The main even loop for the application.
 
 static void event_loop(RPiCamDetectApp &app)
@@ -58,6 +90,10 @@ static void event_loop(RPiCamDetectApp &app)
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 	unsigned int last_capture_frame = 0;
+	// Recent completed requests, newest at the back. Holding them keeps their
+	// camera buffers out of circulation, so the depth is bounded by --pre-roll
+	// (which must stay below the buffer count or the camera stalls).
+	std::deque<CompletedRequestPtr> pre_roll_ring;
 
 	for (unsigned int count = 0;; count++)
 	{
@@ -65,6 +101,7 @@ static void event_loop(RPiCamDetectApp &app)
 		if (msg.type == RPiCamApp::MsgType::Timeout)
 		{
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+			pre_roll_ring.clear();
 			app.StopCamera();
 			app.StartCamera();
 			continue;
@@ -93,10 +130,29 @@ static void event_loop(RPiCamDetectApp &app)
 			if (detected)
 			{
 				app.StopCamera();
+				LOG(1, options->object << " detected");
+				// Flush the pre-roll frames - the ones from before the object
+				// was spotted - through the save path before the buffers they
+				// reference go away in Teardown.
+				StreamInfo info;
+				libcamera::Stream *stream = app.ViewfinderStream(&info);
+				for (CompletedRequestPtr &pre_roll_request : pre_roll_ring)
+				{
+					BufferReadSync r(&app, pre_roll_request->buffers[stream]);
+					std::string filename = generate_filename(options);
+					LOG(1, "Save pre-roll image " << filename);
+					jpeg_save(r.Get(), info, pre_roll_request->metadata, filename, app.CameraModel(), options);
+				}
+				pre_roll_ring.clear();
 				app.Teardown();
 				app.ConfigureStill();
 				app.StartCamera();
-				LOG(1, options->object << " detected");
+			}
+			else if (options->pre_roll)
+			{
+				pre_roll_ring.push_back(completed_request);
+				if (pre_roll_ring.size() > options->pre_roll)
+					pre_roll_ring.pop_front();
 			}
 		}
 		// In still capture mode, save a jpeg and go back to preview.
@@ -109,29 +165,11 @@ static void event_loop(RPiCamDetectApp &app)
 			libcamera::Stream *stream = app.StillStream(&info);
 			BufferReadSync r(&app, completed_request->buffers[stream]);
 			const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
-			uint32_t framestart = options->Get().framestart;
 
 			// Generate a filename for the output and save it.
-			char filename[128];
-			if (options->Get().datetime)
-			{
-				std::time_t raw_time;
-				std::time(&raw_time);
-				char time_string[32];
-				std::tm *time_info = std::localtime(&raw_time);
-				std::strftime(time_string, sizeof(time_string), options->timeformat.c_str(), time_info);
-				snprintf(filename, sizeof(filename), "%s%s.%s", options->Get().output.c_str(), time_string,
-						 options->Get().encoding.c_str());
-			}
-			else if (options->Get().timestamp)
-				snprintf(filename, sizeof(filename), "%s%u.%s", options->Get().output.c_str(), (unsigned)time(NULL),
-						 options->Get().encoding.c_str());
-			else
-				snprintf(filename, sizeof(filename), options->Get().output.c_str(), framestart);
-			filename[sizeof(filename) - 1] = 0;
-			options->Set().framestart = framestart + 1;
+			std::string filename = generate_filename(options);
 			LOG(1, "Save image " << filename);
-			jpeg_save(mem, info, completed_request->metadata, std::string(filename), app.CameraModel(), options);
+			jpeg_save(mem, info, completed_request->metadata, filename, app.CameraModel(), options);
 
 			// Restart camera in preview mode.
 			app.Teardown();
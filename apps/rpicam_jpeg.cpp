@@ -34,10 +34,25 @@ public:
 static void event_loop(RPiCamJpegApp &app)
 {
 	StillOptions const *options = app.GetOptions();
+
+	// Keep a startup-phase timing breakdown: OpenCamera overlaps the preview
+	// and post-processing setup with the camera probing internally, so this is
+	// the place to look when time-to-first-capture regresses.
+	using namespace std::chrono;
+	auto launch_time = high_resolution_clock::now();
+	auto phase_ms = [&launch_time](auto t0, auto t1)
+	{ return duration_cast<milliseconds>(t1 - t0).count(); };
+
 	app.OpenCamera();
+	auto open_time = high_resolution_clock::now();
 	app.ConfigureViewfinder();
+	auto configure_time = high_resolution_clock::now();
 	app.StartCamera();
-	auto start_time = std::chrono::high_resolution_clock::now();
+	auto start_time = high_resolution_clock::now();
+	LOG(1, "Startup: open " << phase_ms(launch_time, open_time) << "ms, configure "
+							<< phase_ms(open_time, configure_time) << "ms, start "
+							<< phase_ms(configure_time, start_time) << "ms");
+	bool first_frame = true;
 
 	for (;;)
 	{
@@ -68,6 +83,11 @@ static void event_loop(RPiCamJpegApp &app)
 			}
 			else
 			{
+				if (first_frame)
+				{
+					LOG(1, "Startup: capture ready " << phase_ms(launch_time, now) << "ms after launch");
+					first_frame = false;
+				}
 				CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
 				app.ShowPreview(completed_request, app.ViewfinderStream());
 			}
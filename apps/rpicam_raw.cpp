@@ -5,6 +5,10 @@
  * rpicam_raw.cpp - libcamera raw video record app.
  */
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <chrono>
 
 #include "core/rpicam_encoder.hpp"
@@ -23,18 +27,87 @@ protected:
 	void createEncoder() { encoder_ = std::unique_ptr<Encoder>(new NullEncoder(GetOptions())); }
 };
 
+// Writes raw frames to a single output file with O_DIRECT, straight from the
+// dma-buf mappings. This skips the page cache entirely - at raw Bayer data
+// rates the kernel would otherwise spend a core on writeback and dirty page
+// reclaim - as well as the NullEncoder/Output thread hops, since each frame
+// here is one synchronous zero-copy write. (For buffered output with encode
+// overlap, --async-io on the normal path uses io_uring instead.)
+
+class DirectWriter
+{
+public:
+	DirectWriter(std::string const &filename)
+	{
+		fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+		if (fd_ < 0 && errno == EINVAL)
+		{
+			// Filesystem without O_DIRECT support (e.g. tmpfs).
+			LOG(1, "DirectWriter: filesystem rejected O_DIRECT, falling back to buffered writes");
+			direct_ = false;
+			fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		}
+		if (fd_ < 0)
+			throw std::runtime_error("DirectWriter: failed to open output file " + filename);
+	}
+	~DirectWriter()
+	{
+		if (fd_ >= 0)
+			close(fd_);
+	}
+	void Write(uint8_t const *mem, size_t size)
+	{
+		// O_DIRECT needs block-aligned addresses and lengths. The dma-buf
+		// mappings are page aligned, but an odd frame length forces us back to
+		// buffered writes - once, as the frame size never changes.
+		if (direct_ && (size & (ALIGN - 1)))
+		{
+			LOG(1, "DirectWriter: frame length " << size << " not " << ALIGN
+												 << "-byte aligned, falling back to buffered writes");
+			fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+			direct_ = false;
+		}
+		for (size_t offset = 0; offset < size;)
+		{
+			ssize_t written = write(fd_, mem + offset, size - offset);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw std::runtime_error("DirectWriter: failed to write output file");
+			}
+			offset += written;
+		}
+	}
+
+private:
+	static constexpr size_t ALIGN = 4096;
+	int fd_ = -1;
+	bool direct_ = true;
+};
+
 // The main even loop for the application.
 
 static void event_loop(LibcameraRaw &app)
 {
 	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	std::unique_ptr<DirectWriter> direct_writer;
+	std::unique_ptr<Output> output;
+	if (options->Get().direct)
+		direct_writer = std::make_unique<DirectWriter>(options->Get().output);
+	else
+	{
+		output = std::unique_ptr<Output>(Output::Create(options));
+		app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+		if (output->WantsFd())
+			app.SetEncodeOutputReadyFdCallback(std::bind(&Output::OutputReadyFd, output.get(), _1, _2, _3, _4));
+		app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	}
 
 	app.OpenCamera();
 	app.ConfigureVideo(LibcameraRaw::FLAG_VIDEO_RAW);
-	app.StartEncoder();
+	if (!direct_writer)
+		app.StartEncoder();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 
@@ -63,11 +136,19 @@ static void event_loop(LibcameraRaw &app)
 		if (options->Get().timeout && (now - start_time) > options->Get().timeout.value)
 		{
 			app.StopCamera();
-			app.StopEncoder();
+			if (!direct_writer)
+				app.StopEncoder();
 			return;
 		}
 
-		if (!app.EncodeBuffer(std::get<CompletedRequestPtr>(msg.payload), app.RawStream()))
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		if (direct_writer)
+		{
+			BufferReadSync r(&app, completed_request->buffers[app.RawStream()]);
+			libcamera::Span<uint8_t> buffer = r.Get()[0];
+			direct_writer->Write(buffer.data(), buffer.size());
+		}
+		else if (!app.EncodeBuffer(completed_request, app.RawStream()))
 		{
 			// Keep advancing our "start time" if we're still waiting to start recording (e.g.
 			// waiting for synchronisation with another camera).
@@ -88,6 +169,14 @@ int main(int argc, char *argv[])
 			options->Set().codec = "yuv420";
 			options->Set().denoise = "cdn_off";
 			options->Set().nopreview = true;
+			if (options->Get().direct &&
+				(options->Get().output.empty() || options->Get().output == "-" ||
+				 options->Get().output.find('%') != std::string::npos || options->Get().split ||
+				 options->Get().segment || options->Get().circular))
+			{
+				LOG_ERROR("WARNING: --direct needs a plain output file, ignoring");
+				options->Set().direct = false;
+			}
 			if (options->Get().verbose >= 2)
 				options->Get().Print();
 
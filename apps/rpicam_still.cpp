@@ -5,13 +5,15 @@
  * rpicam_still.cpp - libcamera stills capture app.
  */
 #include <chrono>
+#include <condition_variable>
 #include <filesystem>
+#include <mutex>
 #include <poll.h>
+#include <queue>
 #include <signal.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
-
-#include <chrono>
+#include <thread>
 
 #include "core/frame_info.hpp"
 #include "core/rpicam_app.hpp"
@@ -77,6 +79,28 @@ static void update_latest_link(std::string const &filename, StillOptions const *
 	}
 }
 
+static void configure_still(RPiCamStillApp &app, unsigned int still_flags)
+{
+	StillOptions const *options = app.GetOptions();
+	// If we're making JPEGs with an EXIF thumbnail and no lores stream was
+	// asked for, request one at the thumbnail size: the ISP then scales the
+	// thumbnail source in hardware and the software downscale of the full
+	// resolution frame disappears from the shot-to-shot path.
+	bool lores_for_thumbnail = options->Get().encoding == "jpg" && options->Get().thumb_quality &&
+							   options->Get().thumb_width && options->Get().thumb_height &&
+							   !(options->Get().lores_width && options->Get().lores_height);
+	if (lores_for_thumbnail)
+	{
+		options->Set().lores_width = options->Get().thumb_width;
+		options->Set().lores_height = options->Get().thumb_height;
+	}
+	app.ConfigureStill(still_flags);
+	// Put the options back, so a return to the viewfinder (timelapse, say)
+	// doesn't drag the extra stream along with it.
+	if (lores_for_thumbnail)
+		options->Set().lores_width = options->Set().lores_height = 0;
+}
+
 static void save_image(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream *stream,
 					   std::string const &filename)
 {
@@ -87,7 +111,19 @@ static void save_image(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream
 	if (stream == app.RawStream())
 		dng_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
 	else if (options->Get().encoding == "jpg")
-		jpeg_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
+	{
+		// When a lores stream was configured, use that (hardware-scaled) image
+		// as the EXIF thumbnail source rather than downscaling the main image.
+		StreamInfo lores_info;
+		Stream *lores_stream = app.LoresStream(&lores_info);
+		if (lores_stream && payload->buffers.count(lores_stream))
+		{
+			BufferReadSync lr(&app, payload->buffers[lores_stream]);
+			jpeg_save(mem, info, lr.Get()[0], lores_info, payload->metadata, filename, app.CameraModel(), options);
+		}
+		else
+			jpeg_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
+	}
 	else if (options->Get().encoding == "png")
 		png_save(mem, info, filename, options);
 	else if (options->Get().encoding == "bmp")
@@ -97,17 +133,131 @@ static void save_image(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream
 	LOG(2, "Saved image " << info.width << " x " << info.height << " to file " << filename);
 }
 
-static void save_images(RPiCamStillApp &app, CompletedRequestPtr &payload)
+// Background save queue. The capture loop hands each completed request over
+// to a worker thread (the shared_ptr keeps its buffers alive) and immediately
+// goes back to taking frames, so file encoding and disk writes overlap with
+// the next exposure. The queue is bounded, so a slow disk applies
+// back-pressure to the captures rather than hoarding all the camera buffers.
+class SaveQueue
 {
-	StillOptions *options = app.GetOptions();
-	std::string filename = generate_filename(options);
-	save_image(app, payload, app.StillStream(), filename);
-	update_latest_link(filename, options);
-	if (options->Get().raw)
+public:
+	SaveQueue(RPiCamStillApp &app, unsigned int num_workers, unsigned int max_depth)
+		: app_(app), max_depth_(max_depth), sequence_(0), link_sequence_(0), busy_(0), quit_(false)
+	{
+		for (unsigned int i = 0; i < num_workers; i++)
+			workers_.emplace_back(&SaveQueue::workerThread, this);
+	}
+	~SaveQueue()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			quit_ = true;
+		}
+		cond_var_.notify_all();
+		for (auto &worker : workers_)
+			worker.join();
+	}
+	void Enqueue(CompletedRequestPtr const &payload, std::string const &filename)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_var_.wait(lock, [this] { return queue_.size() < max_depth_; });
+		queue_.push({ payload, filename, sequence_++ });
+		cond_var_.notify_all();
+	}
+	// Wait for all queued saves to finish. Necessary before Teardown(), which
+	// unmaps the very buffers the workers are reading. Any error from a worker
+	// is rethrown here.
+	void Drain()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_var_.wait(lock, [this] { return queue_.empty() && !busy_; });
+		if (!error_.empty())
+		{
+			std::string error;
+			std::swap(error, error_);
+			throw std::runtime_error(error);
+		}
+	}
+
+private:
+	struct Item
 	{
-		filename = filename.substr(0, filename.rfind('.')) + ".dng";
-		save_image(app, payload, app.RawStream(), filename);
+		CompletedRequestPtr payload;
+		std::string filename;
+		uint64_t sequence;
+	};
+	void workerThread()
+	{
+		while (true)
+		{
+			Item item;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cond_var_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+				if (queue_.empty())
+					return; // quitting, and nothing left to do
+				item = std::move(queue_.front());
+				queue_.pop();
+				busy_++;
+			}
+			cond_var_.notify_all(); // there's room in the queue now
+			try
+			{
+				saveItem(item);
+			}
+			catch (std::exception const &e)
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (error_.empty())
+					error_ = e.what();
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				busy_--;
+			}
+			cond_var_.notify_all();
+		}
+	}
+	void saveItem(Item &item)
+	{
+		StillOptions const *options = app_.GetOptions();
+		save_image(app_, item.payload, app_.StillStream(), item.filename);
+		{
+			// Workers can finish out of order, so only ever move the "latest"
+			// link forwards.
+			std::lock_guard<std::mutex> lock(link_mutex_);
+			if (item.sequence >= link_sequence_)
+			{
+				link_sequence_ = item.sequence + 1;
+				update_latest_link(item.filename, options);
+			}
+		}
+		if (options->Get().raw)
+		{
+			std::string raw_filename = item.filename.substr(0, item.filename.rfind('.')) + ".dng";
+			save_image(app_, item.payload, app_.RawStream(), raw_filename);
+		}
 	}
+
+	RPiCamStillApp &app_;
+	unsigned int max_depth_;
+	uint64_t sequence_;
+	uint64_t link_sequence_;
+	unsigned int busy_;
+	bool quit_;
+	std::string error_;
+	std::queue<Item> queue_;
+	std::mutex mutex_;
+	std::mutex link_mutex_;
+	std::condition_variable cond_var_;
+	std::vector<std::thread> workers_;
+};
+
+static void save_images(RPiCamStillApp &app, SaveQueue &save_queue, CompletedRequestPtr &payload)
+{
+	StillOptions *options = app.GetOptions();
+	std::string filename = generate_filename(options);
+	save_queue.Enqueue(payload, filename);
 	options->Set().framestart++;
 	if (options->Get().wrap)
 		options->Set().framestart %= options->Get().wrap;
@@ -182,6 +332,11 @@ static void event_loop(RPiCamStillApp &app)
 
 	app.OpenCamera();
 
+	// A couple of save workers is plenty - the jpeg and dng savers are
+	// internally multithreaded, so this is about overlapping the disk I/O
+	// with the next capture, not about encode parallelism.
+	SaveQueue save_queue(app, 2, 4);
+
 	// Monitoring for keypresses and signals.
 	signal(SIGUSR1, default_signal_handler);
 	signal(SIGUSR2, default_signal_handler);
@@ -189,7 +344,7 @@ static void event_loop(RPiCamStillApp &app)
 
 	if (options->Get().immediate)
 	{
-		app.ConfigureStill(still_flags);
+		configure_still(app, still_flags);
 		while (keypress)
 		{
 			int key = get_key_or_signal(options, p);
@@ -206,9 +361,16 @@ static void event_loop(RPiCamStillApp &app)
 		app.ConfigureViewfinder();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
-	auto timelapse_time = start_time;
+	// Timelapse captures are scheduled at absolute instants (start + n *
+	// interval) rather than by sleeping the interval after each capture, so
+	// pipeline and reconfiguration latency can't accumulate into drift. A
+	// missed instant is skipped, keeping the schedule anchored.
+	auto next_capture_time = start_time + options->Get().timelapse.value;
 	int timelapse_frames = 0;
 	constexpr int TIMELAPSE_MIN_FRAMES = 6; // at least this many preview frames between captures
+	// Woken from a timelapse quiesce this far ahead of the capture instant, the
+	// camera has time to restart and give the 3A those frames to settle on.
+	constexpr auto TIMELAPSE_PRE_WAKE = 700ms;
 	bool keypressed = false;
 	enum
 	{
@@ -219,6 +381,10 @@ static void event_loop(RPiCamStillApp &app)
 	int af_wait_timeout = 0;
 
 	bool want_capture = options->Get().immediate;
+	// In burst mode we hang on to each frame (so its buffers are not requeued)
+	// until we have them all, then hand the whole lot to the save workers.
+	std::vector<CompletedRequestPtr> burst_frames;
+	unsigned int burst = std::max(1u, options->Get().burst);
 	for (unsigned int count = 0;; count++)
 	{
 		RPiCamApp::Msg msg = app.Wait();
@@ -251,8 +417,7 @@ static void event_loop(RPiCamStillApp &app)
 			timelapse_frames++;
 
 			bool timed_out = options->Get().timeout && (now - start_time) > options->Get().timeout.value;
-			bool timelapse_timed_out = options->Get().timelapse &&
-									   (now - timelapse_time) > options->Get().timelapse.value &&
+			bool timelapse_timed_out = options->Get().timelapse && now >= next_capture_time &&
 									   timelapse_frames >= TIMELAPSE_MIN_FRAMES;
 
 			if (af_wait_state != AF_WAIT_NONE)
@@ -289,12 +454,15 @@ static void event_loop(RPiCamStillApp &app)
 					return;
 				keypressed = false;
 				af_wait_state = AF_WAIT_NONE;
-				timelapse_time = std::chrono::high_resolution_clock::now();
+				// Advance the schedule to the next instant still in the future,
+				// so a late capture doesn't push all the later ones back.
+				while (options->Get().timelapse && next_capture_time <= now)
+					next_capture_time += options->Get().timelapse.value;
 				if (!options->Get().zsl)
 				{
 					app.StopCamera();
 					app.Teardown();
-					app.ConfigureStill(still_flags);
+					configure_still(app, still_flags);
 				}
 				if (options->Get().af_on_capture)
 				{
@@ -313,11 +481,16 @@ static void event_loop(RPiCamStillApp &app)
 		// otherwise quit.
 		else if (app.StillStream() && want_capture)
 		{
+			LOG(1, "Still capture image received");
+			burst_frames.push_back(completed_request);
+			if (burst_frames.size() < burst)
+				continue; // keep the camera running at sensor rate for the rest of the burst
 			want_capture = false;
 			if (!options->Get().zsl)
 				app.StopCamera();
-			LOG(1, "Still capture image received");
-			save_images(app, completed_request);
+			for (auto &frame : burst_frames)
+				save_images(app, save_queue, frame);
+			burst_frames.clear();
 			if (!options->Get().metadata.empty())
 				save_metadata(options, completed_request->metadata);
 			timelapse_frames = 0;
@@ -326,7 +499,27 @@ static void event_loop(RPiCamStillApp &app)
 			{
 				if (!options->Get().zsl)
 				{
+					// Teardown() unmaps the buffers the save workers may still
+					// be reading. (In zsl mode there's no teardown, and the
+					// saves genuinely overlap with the next capture.)
+					save_queue.Drain();
 					app.Teardown();
+					// For widely-spaced timelapse shots, stay quiesced (the
+					// camera is already stopped and torn down - no sensor
+					// streaming, no preview frames nobody looks at) and wake
+					// just ahead of the next scheduled instant. This is where
+					// the idle power goes on battery deployments.
+					while (options->Get().timelapse &&
+						   std::chrono::high_resolution_clock::now() < next_capture_time - TIMELAPSE_PRE_WAKE)
+					{
+						int k = get_key_or_signal(options, p);
+						if (k == 'x' || k == 'X')
+							return;
+						if (options->Get().timeout &&
+							(std::chrono::high_resolution_clock::now() - start_time) > options->Get().timeout.value)
+							return;
+						std::this_thread::sleep_for(100ms);
+					}
 					app.ConfigureViewfinder();
 				}
 				if (options->Get().af_on_capture && options->Get().afMode_index == -1)
@@ -341,7 +534,11 @@ static void event_loop(RPiCamStillApp &app)
 				af_wait_state = AF_WAIT_NONE;
 			}
 			else
+			{
+				// Drain explicitly so that any save error still reaches the caller.
+				save_queue.Drain();
 				return;
+			}
 		}
 	}
 }
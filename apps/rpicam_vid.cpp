@@ -6,50 +6,62 @@
  */
 
 #include <chrono>
-#include <poll.h>
+#include <optional>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "core/rpicam_encoder.hpp"
 #include "output/output.hpp"
 
 using namespace std::placeholders;
 
-// Some keypress/signal handling.
+// All the wakeup sources - camera messages, keypresses, signals and the
+// --timeout deadline - are multiplexed by a single epoll loop, so the steady
+// state is one blocking syscall per batch of work instead of a zero-timeout
+// poll() on every frame, and the timeout fires on its own timerfd rather than
+// being checked against the clock once per frame.
 
-static int signal_received;
-static void default_signal_handler(int signal_number)
+// The signals we want delivered through the signalfd. They must be blocked
+// before any threads are created, or one of them could take the (process-wide)
+// default action instead.
+static sigset_t block_signals()
 {
-	signal_received = signal_number;
-	LOG(1, "Received signal " << signal_number);
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGUSR1);
+	sigaddset(&sigmask, SIGUSR2);
+	// SIGPIPE gets raised when trying to write to an already closed socket. This can happen, when
+	// you're using TCP to stream to VLC and the user presses the stop button in VLC. Catching the
+	// signal to be able to react on it, otherwise the app terminates.
+	sigaddset(&sigmask, SIGPIPE);
+	// SIGHUP re-reads the post-processing configuration without stopping capture.
+	sigaddset(&sigmask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &sigmask, nullptr);
+	return sigmask;
 }
 
-static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
+// Translate a signal into the same "keys" the keyboard produces.
+
+static int signal_to_key(int signal_number, VideoOptions const *options)
 {
-	int key = 0;
-	if (signal_received == SIGINT)
+	LOG(1, "Received signal " << signal_number);
+	if (signal_number == SIGINT)
 		return 'x';
-	if (options->Get().keypress)
-	{
-		poll(p, 1, 0);
-		if (p[0].revents & POLLIN)
-		{
-			char *user_string = nullptr;
-			size_t len;
-			[[maybe_unused]] size_t r = getline(&user_string, &len, stdin);
-			key = user_string[0];
-		}
-	}
+	if (signal_number == SIGHUP)
+		return 'r';
 	if (options->Get().signal)
 	{
-		if (signal_received == SIGUSR1)
-			key = '\n';
-		else if ((signal_received == SIGUSR2) || (signal_received == SIGPIPE))
-			key = 'x';
-		signal_received = 0;
+		if (signal_number == SIGUSR1)
+			return '\n';
+		else if (signal_number == SIGUSR2 || signal_number == SIGPIPE)
+			return 'x';
 	}
-	return key;
+	return 0;
 }
 
 static int get_colourspace_flags(std::string const &codec)
@@ -62,70 +74,163 @@ static int get_colourspace_flags(std::string const &codec)
 
 // The main even loop for the application.
 
-static void event_loop(RPiCamEncoder &app)
+static void event_loop(RPiCamEncoder &app, sigset_t const &sigmask)
 {
 	VideoOptions const *options = app.GetOptions();
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
 	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+	// Outputs that pass the frame's dma-buf along (shm://) take the fd-based
+	// path; only the NullEncoder (--codec yuv420) delivers frames this way.
+	if (output->WantsFd())
+		app.SetEncodeOutputReadyFdCallback(std::bind(&Output::OutputReadyFd, output.get(), _1, _2, _3, _4));
 	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	// Outputs that sense congestion on their transport can step the encoder
+	// bitrate down (and back up) instead of letting their send queue grow.
+	output->SetBitrateFeedbackCallback([&app](uint64_t bps) { app.SetEncoderBitrate(bps); });
 
 	app.OpenCamera();
 	app.ConfigureVideo(get_colourspace_flags(options->Get().codec));
 	app.StartEncoder();
+
+	// Set up the event loop fds before the camera starts, so that no message
+	// can be posted before the wakeup eventfd exists.
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int signal_fd = signalfd(-1, &sigmask, SFD_CLOEXEC | SFD_NONBLOCK);
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	int msg_fd = app.GetMsgEventFd();
+	if (epoll_fd < 0 || signal_fd < 0 || timer_fd < 0 || msg_fd < 0)
+		throw std::runtime_error("failed to create event loop fds");
+	auto add_fd = [epoll_fd](int fd)
+	{
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			throw std::runtime_error("failed to add fd to epoll");
+	};
+	add_fd(msg_fd);
+	add_fd(signal_fd);
+	add_fd(timer_fd);
+	if (options->Get().keypress)
+		add_fd(STDIN_FILENO);
+
+	// One-shot timer for --timeout; re-armed if recording hasn't really started
+	// yet (e.g. still waiting for synchronisation with another camera).
+	auto arm_timeout = [timer_fd, options]()
+	{
+		if (options->Get().frames || !options->Get().timeout)
+			return;
+		std::chrono::nanoseconds ns = options->Get().timeout.value;
+		itimerspec its = {};
+		its.it_value.tv_sec = ns.count() / 1000000000;
+		its.it_value.tv_nsec = ns.count() % 1000000000;
+		timerfd_settime(timer_fd, 0, &its, nullptr);
+	};
+	arm_timeout();
+
 	app.StartCamera();
-	auto start_time = std::chrono::high_resolution_clock::now();
 
-	// Monitoring for keypresses and signals.
-	signal(SIGUSR1, default_signal_handler);
-	signal(SIGUSR2, default_signal_handler);
-	signal(SIGINT, default_signal_handler);
-	// SIGPIPE gets raised when trying to write to an already closed socket. This can happen, when
-	// you're using TCP to stream to VLC and the user presses the stop button in VLC. Catching the
-	// signal to be able to react on it, otherwise the app terminates.
-	signal(SIGPIPE, default_signal_handler);
-	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
+	auto stop = [&]()
+	{
+		app.StopCamera(); // stop complains if encoder very slow to close
+		app.StopEncoder();
+		close(timer_fd);
+		close(signal_fd);
+		close(epoll_fd);
+	};
 
-	for (unsigned int count = 0; ; count++)
+	for (unsigned int count = 0;;)
 	{
-		RPiCamEncoder::Msg msg = app.Wait();
-		if (msg.type == RPiCamApp::MsgType::Timeout)
+		epoll_event events[4];
+		int nfds = epoll_wait(epoll_fd, events, 4, -1);
+		if (nfds < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("epoll_wait failed");
+		}
+
+		int key = 0;
+		bool timed_out = false;
+		for (int i = 0; i < nfds; i++)
 		{
-			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
-			continue;
+			int fd = events[i].data.fd;
+			uint64_t ticks;
+			if (fd == timer_fd)
+				timed_out = read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks);
+			else if (fd == signal_fd)
+			{
+				signalfd_siginfo info;
+				while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+				{
+					int k = signal_to_key(info.ssi_signo, options);
+					if (k)
+						key = k;
+				}
+			}
+			else if (fd == STDIN_FILENO)
+			{
+				char *user_string = nullptr;
+				size_t len;
+				[[maybe_unused]] size_t r = getline(&user_string, &len, stdin);
+				key = user_string[0];
+			}
+			else
+			{
+				// msg_fd - just acknowledge the wakeup, the queue is drained below.
+				[[maybe_unused]] ssize_t r = read(msg_fd, &ticks, sizeof(ticks));
+			}
 		}
-		if (msg.type == RPiCamEncoder::MsgType::Quit)
+
+		if (timed_out)
+		{
+			LOG(1, "Halting: reached timeout of " << options->Get().timeout.get<std::chrono::milliseconds>()
+												  << " milliseconds.");
+			stop();
 			return;
-		else if (msg.type != RPiCamEncoder::MsgType::RequestComplete)
-			throw std::runtime_error("unrecognised message!");
-		int key = get_key_or_signal(options, p);
+		}
 		if (key == '\n')
 			output->Signal();
-
-		LOG(2, "Viewfinder frame " << count);
-		auto now = std::chrono::high_resolution_clock::now();
-		bool timeout = !options->Get().frames && options->Get().timeout &&
-					   ((now - start_time) > options->Get().timeout.value);
-		bool frameout = options->Get().frames && count >= options->Get().frames;
-		if (timeout || frameout || key == 'x' || key == 'X')
+		else if (key == 'r' || key == 'R')
+			app.ReconfigurePostProcessing();
+		else if (key == 'x' || key == 'X')
 		{
-			if (timeout)
-				LOG(1, "Halting: reached timeout of " << options->Get().timeout.get<std::chrono::milliseconds>()
-													  << " milliseconds.");
-			app.StopCamera(); // stop complains if encoder very slow to close
-			app.StopEncoder();
+			stop();
 			return;
 		}
-		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		if (!app.EncodeBuffer(completed_request, app.VideoStream()))
+
+		// Drain every camera message that's ready.
+		while (std::optional<RPiCamEncoder::Msg> msg = app.TryWait())
 		{
-			// Keep advancing our "start time" if we're still waiting to start recording (e.g.
-			// waiting for synchronisation with another camera).
-			start_time = now;
-			count = 0; // reset the "frames encoded" counter too
+			if (msg->type == RPiCamApp::MsgType::Timeout)
+			{
+				LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+				app.StopCamera();
+				app.StartCamera();
+				continue;
+			}
+			if (msg->type == RPiCamEncoder::MsgType::Quit)
+				return;
+			else if (msg->type != RPiCamEncoder::MsgType::RequestComplete)
+				throw std::runtime_error("unrecognised message!");
+
+			count++;
+			LOG(2, "Viewfinder frame " << count);
+			if (options->Get().frames && count > options->Get().frames)
+			{
+				stop();
+				return;
+			}
+			CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg->payload);
+			if (!app.EncodeBuffer(completed_request, app.VideoStream()))
+			{
+				// Keep pushing back our deadline if we're still waiting to start
+				// recording; reset the "frames encoded" counter too.
+				arm_timeout();
+				count = 0;
+			}
+			app.ShowPreview(completed_request, app.VideoStream());
 		}
-		app.ShowPreview(completed_request, app.VideoStream());
 	}
 }
 
@@ -133,6 +238,9 @@ int main(int argc, char *argv[])
 {
 	try
 	{
+		// Must happen before any threads exist, see above.
+		sigset_t sigmask = block_signals();
+
 		RPiCamEncoder app;
 		VideoOptions *options = app.GetOptions();
 		if (options->Parse(argc, argv))
@@ -140,7 +248,7 @@ int main(int argc, char *argv[])
 			if (options->Get().verbose >= 2)
 				options->Get().Print();
 
-			event_loop(app);
+			event_loop(app, sigmask);
 		}
 	}
 	catch (std::exception const &e)
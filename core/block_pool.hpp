@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * block_pool.hpp - fixed-size block recycler for per-frame allocations.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <new>
+#include <vector>
+
+// The capture loop makes a handful of small heap allocations per frame
+// (the CompletedRequest, its shared_ptr control block, stage metadata map
+// nodes), which slowly fragments the allocator on long-running units and
+// shows up as periodic latency spikes. A BlockPool hands the same few
+// blocks round and round instead, so the steady state never touches
+// malloc; anything bigger than the block size falls through to the
+// regular heap.
+class BlockPool
+{
+public:
+	BlockPool(size_t block_size) : block_size_(block_size) { free_blocks_.reserve(64); }
+	~BlockPool()
+	{
+		for (void *mem : free_blocks_)
+			::operator delete(mem);
+	}
+
+	void *Allocate(size_t size)
+	{
+		if (size <= block_size_)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!free_blocks_.empty())
+			{
+				void *mem = free_blocks_.back();
+				free_blocks_.pop_back();
+				return mem;
+			}
+			size = block_size_;
+		}
+		return ::operator new(size);
+	}
+
+	void Free(void *mem, size_t size)
+	{
+		if (size <= block_size_)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			free_blocks_.push_back(mem);
+			return;
+		}
+		::operator delete(mem);
+	}
+
+private:
+	const size_t block_size_;
+	std::mutex mutex_;
+	std::vector<void *> free_blocks_;
+};
+
+// Shared pool for the small per-frame allocations; 128 bytes covers a
+// metadata map node or a control block on 64-bit platforms.
+inline BlockPool &SmallBlockPool()
+{
+	static BlockPool pool(128);
+	return pool;
+}
+
+template <typename T>
+struct PoolAllocator
+{
+	using value_type = T;
+
+	PoolAllocator() = default;
+	template <typename U>
+	PoolAllocator(PoolAllocator<U> const &)
+	{
+	}
+
+	T *allocate(size_t n) { return static_cast<T *>(SmallBlockPool().Allocate(n * sizeof(T))); }
+	void deallocate(T *mem, size_t n) { SmallBlockPool().Free(mem, n * sizeof(T)); }
+};
+
+// All PoolAllocators share the one pool, so containers using them can be
+// swapped, moved and merged freely.
+template <typename T, typename U>
+bool operator==(PoolAllocator<T> const &, PoolAllocator<U> const &)
+{
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(PoolAllocator<T> const &, PoolAllocator<U> const &)
+{
+	return false;
+}
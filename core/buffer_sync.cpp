@@ -13,12 +13,78 @@
 #include "core/rpicam_app.hpp"
 #include "core/logging.hpp"
 
-BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
-	: fb_(fb)
+BufferSync::Policy BufferSync::policy_ = BufferSync::Policy::Auto;
+std::map<libcamera::Stream const *, bool> BufferSync::stream_policy_;
+
+void BufferSync::SetPolicy(Policy policy)
+{
+	policy_ = policy;
+}
+
+void BufferSync::SetStreamPolicy(libcamera::Stream const *stream, bool sync)
+{
+	stream_policy_[stream] = sync;
+}
+
+bool BufferSync::Required(RPiCamApp *app, libcamera::Stream const *stream)
+{
+	if (stream)
+	{
+		auto it = stream_policy_.find(stream);
+		if (it != stream_policy_.end())
+			return it->second;
+	}
+
+	if (policy_ == Policy::Always)
+		return true;
+	else if (policy_ == Policy::Never)
+		return false;
+
+	// Policy::Auto - when the buffers come from a coherent heap the CPU cache
+	// needs no maintenance and the ioctl pairs are pure overhead.
+	return !app->dma_heap_.coherent();
+}
+
+void BufferSync::StartReadSync(RPiCamApp *app, libcamera::Request *request)
 {
 	struct dma_buf_sync dma_sync {};
-	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
 
+	for (auto const &buffer_map : request->buffers())
+	{
+		auto it = app->mapped_buffers_.find(buffer_map.second);
+		if (it == app->mapped_buffers_.end())
+			throw std::runtime_error("failed to identify request complete buffer");
+
+		if (!Required(app, buffer_map.first))
+			continue;
+
+		int ret = ::ioctl(buffer_map.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+		if (ret)
+			throw std::runtime_error("failed to sync dma buf on request complete");
+	}
+}
+
+void BufferSync::EndReadSync(RPiCamApp *app, libcamera::Stream const *stream, libcamera::FrameBuffer *buffer)
+{
+	auto it = app->mapped_buffers_.find(buffer);
+	if (it == app->mapped_buffers_.end())
+		throw std::runtime_error("failed to identify queue request buffer");
+
+	if (!Required(app, stream))
+		return;
+
+	struct dma_buf_sync dma_sync {};
+	dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+
+	int ret = ::ioctl(buffer->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+	if (ret)
+		throw std::runtime_error("failed to sync dma buf on queue request");
+}
+
+BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
+	: fb_(fb), synced_(false)
+{
 	auto it = app->mapped_buffers_.find(fb_);
 	if (it == app->mapped_buffers_.end())
 	{
@@ -26,11 +92,18 @@ BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 		return;
 	}
 
-	int ret = ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-	if (ret)
+	if (BufferSync::Required(app))
 	{
-		LOG_ERROR("failed to lock-sync-write dma buf");
-		return;
+		struct dma_buf_sync dma_sync {};
+		dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+
+		int ret = ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+		if (ret)
+		{
+			LOG_ERROR("failed to lock-sync-write dma buf");
+			return;
+		}
+		synced_ = true;
 	}
 
 	planes_ = it->second;
@@ -38,6 +111,9 @@ BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 
 BufferWriteSync::~BufferWriteSync()
 {
+	if (!synced_)
+		return;
+
 	struct dma_buf_sync dma_sync {};
 	dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
 
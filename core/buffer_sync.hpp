@@ -7,10 +7,43 @@
 
 #pragma once
 
+#include <map>
+
 #include <libcamera/framebuffer.h>
+#include <libcamera/request.h>
+#include <libcamera/stream.h>
 
 class RPiCamApp;
 
+// Central policy for dma-buf CPU access syncs. Every sync funnels through here
+// so the per-frame ioctl pairs can be elided entirely when the heap is known to
+// be coherent (or the user forces it), and so a whole request's buffers can be
+// begun/ended with a single call.
+class BufferSync
+{
+public:
+	enum class Policy
+	{
+		Auto, // sync unless the dma heap is known coherent
+		Always,
+		Never,
+	};
+
+	static void SetPolicy(Policy policy);
+	// Overrides the global policy for buffers of one particular stream.
+	static void SetStreamPolicy(libcamera::Stream const *stream, bool sync);
+	static bool Required(RPiCamApp *app, libcamera::Stream const *stream = nullptr);
+
+	// Begin a CPU read of every buffer in a completed request with one call.
+	static void StartReadSync(RPiCamApp *app, libcamera::Request *request);
+	// End the CPU read of a buffer about to be handed back to the camera.
+	static void EndReadSync(RPiCamApp *app, libcamera::Stream const *stream, libcamera::FrameBuffer *buffer);
+
+private:
+	static Policy policy_;
+	static std::map<libcamera::Stream const *, bool> stream_policy_;
+};
+
 class BufferWriteSync
 {
 public:
@@ -21,6 +54,7 @@ public:
 
 private:
 	libcamera::FrameBuffer *fb_;
+	bool synced_;
 	std::vector<libcamera::Span<uint8_t>> planes_;
 };
 
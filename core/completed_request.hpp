@@ -21,8 +21,11 @@ struct CompletedRequest
 	using Request = libcamera::Request;
 
 	CompletedRequest(unsigned int seq, Request *r)
-		: sequence(seq), buffers(r->buffers()), metadata(r->metadata()), request(r)
+		: sequence(seq), buffers(r->buffers()), metadata(std::move(r->metadata())), request(r)
 	{
+		// The request is about to be reused (which clears its metadata), so the
+		// ControlList can be moved out rather than deep-copied. Stages and
+		// frame_info all read this one list by reference.
 		r->reuse();
 	}
 	unsigned int sequence;
@@ -7,8 +7,10 @@
 
 #include "dma_heaps.hpp"
 
+#include <algorithm>
 #include <array>
 #include <fcntl.h>
+#include <filesystem>
 #include <linux/dma-buf.h>
 #include <linux/dma-heap.h>
 #include <sys/ioctl.h>
@@ -37,6 +39,12 @@ DmaHeap::DmaHeap()
 		}
 
 		dmaHeapHandle_ = libcamera::UniqueFD(ret);
+
+		// If the node is a symlink to the (uncached) system heap, CPU accesses
+		// are coherent with the device and dma-buf syncs can be skipped.
+		std::error_code ec;
+		std::filesystem::path target = std::filesystem::read_symlink(name, ec);
+		coherent_ = !ec && target.string().find("system") != std::string::npos;
 		break;
 	}
 
@@ -77,3 +85,40 @@ libcamera::UniqueFD DmaHeap::alloc(const char *name, std::size_t size) const
 
 	return allocFd;
 }
+
+libcamera::SharedFD DmaHeap::acquire(const char *name, std::size_t size)
+{
+	// Prefer a free buffer of exactly the right size left over from a previous
+	// configuration; only fall back to the heap when the arena has none.
+	for (ArenaBuffer &buffer : arena_)
+	{
+		if (!buffer.in_use && buffer.size == size)
+		{
+			buffer.in_use = true;
+			if (name)
+				::ioctl(buffer.fd.get(), DMA_BUF_SET_NAME, name);
+			return libcamera::SharedFD(buffer.fd.get());
+		}
+	}
+
+	libcamera::UniqueFD fd = alloc(name, size);
+	if (!fd.isValid())
+		return {};
+
+	arena_.push_back({ std::move(fd), size, true });
+	LOG(2, "dmaHeap arena grown to " << arena_.size() << " buffers");
+	// SharedFD duplicates the fd, so the arena keeps the allocation alive.
+	return libcamera::SharedFD(arena_.back().fd.get());
+}
+
+void DmaHeap::releaseBuffers()
+{
+	for (ArenaBuffer &buffer : arena_)
+		buffer.in_use = false;
+}
+
+void DmaHeap::trim()
+{
+	auto rem = std::remove_if(arena_.begin(), arena_.end(), [](ArenaBuffer const &b) { return !b.in_use; });
+	arena_.erase(rem, arena_.end());
+}
@@ -9,6 +9,9 @@
 
 #include <stddef.h>
 
+#include <vector>
+
+#include <libcamera/base/shared_fd.h>
 #include <libcamera/base/unique_fd.h>
 
 class DmaHeap
@@ -17,8 +20,27 @@ public:
 	DmaHeap();
 	~DmaHeap();
 	bool isValid() const { return dmaHeapHandle_.isValid(); }
+	// Whether the heap we opened is CPU-coherent (i.e. needs no dma-buf syncs).
+	bool coherent() const { return coherent_; }
 	libcamera::UniqueFD alloc(const char *name, std::size_t size) const;
 
+	// The arena interface. Buffers acquired here are owned by the DmaHeap and
+	// merely marked free again by releaseBuffers(), so a subsequent stream
+	// reconfiguration re-uses the same CMA memory instead of round-tripping
+	// the heap. The arena grows on demand; trim() gives everything back.
+	libcamera::SharedFD acquire(const char *name, std::size_t size);
+	void releaseBuffers();
+	void trim();
+
 private:
+	struct ArenaBuffer
+	{
+		libcamera::UniqueFD fd;
+		std::size_t size;
+		bool in_use;
+	};
+
 	libcamera::UniqueFD dmaHeapHandle_;
+	bool coherent_ = false;
+	std::vector<ArenaBuffer> arena_;
 };
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * frame_trace.cpp - per-frame pipeline tracing
+ */
+
+#include <fstream>
+#include <mutex>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include <sys/syscall.h>
+
+#include "core/frame_trace.hpp"
+#include "core/logging.hpp"
+
+std::atomic<bool> FrameTrace::enabled_ = { false };
+
+namespace
+{
+
+struct TraceEvent
+{
+	char const *name; // string literal, or nullptr if the slot is unused
+	uint64_t frame;
+	uint64_t begin_ns;
+	uint64_t end_ns; // equal to begin_ns for an instantaneous event
+	uint32_t tid;
+};
+
+std::vector<TraceEvent> ring;
+std::atomic<uint64_t> next_slot { 0 };
+std::string trace_file;
+
+uint32_t thread_id()
+{
+	static thread_local uint32_t tid = static_cast<uint32_t>(::syscall(SYS_gettid));
+	return tid;
+}
+
+struct TraceLifetime
+{
+	TraceLifetime()
+	{
+		char const *env = getenv("RPICAM_TRACE");
+		if (env && env[0])
+			FrameTrace::Enable(env);
+	}
+	~TraceLifetime() { FrameTrace::Dump(); }
+} trace_lifetime;
+
+} // namespace
+
+uint64_t FrameTrace::Now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void FrameTrace::Enable(std::string const &filename, unsigned int capacity)
+{
+	if (enabled_.load(std::memory_order_relaxed))
+		return;
+
+	trace_file = filename;
+	ring.resize(capacity);
+	enabled_.store(true, std::memory_order_release);
+	LOG(1, "Frame tracing enabled, " << capacity << " events to " << filename);
+}
+
+void FrameTrace::Record(char const *name, uint64_t frame, uint64_t begin_ns, uint64_t end_ns)
+{
+	if (!enabled_.load(std::memory_order_acquire))
+		return;
+
+	uint64_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % ring.size();
+	ring[slot] = { name, frame, begin_ns, end_ns, thread_id() };
+}
+
+void FrameTrace::Mark(char const *name, uint64_t frame)
+{
+	uint64_t now = Now();
+	Record(name, frame, now, now);
+}
+
+void FrameTrace::Dump()
+{
+	if (!enabled_.exchange(false))
+		return;
+
+	std::ofstream ofs(trace_file);
+	if (!ofs)
+	{
+		LOG_ERROR("failed to write trace file " << trace_file);
+		return;
+	}
+
+	ofs << "{\"traceEvents\":[";
+	bool first = true;
+	for (TraceEvent const &event : ring)
+	{
+		if (!event.name)
+			continue;
+		if (!first)
+			ofs << ",";
+		first = false;
+		ofs << "\n{\"name\":\"" << event.name << "\",\"cat\":\"rpicam\",\"pid\":" << getpid()
+			<< ",\"tid\":" << event.tid << ",\"ts\":" << event.begin_ns / 1000 << "."
+			<< (event.begin_ns % 1000) << ",\"args\":{\"frame\":" << event.frame << "}";
+		if (event.end_ns > event.begin_ns)
+			ofs << ",\"ph\":\"X\",\"dur\":" << (event.end_ns - event.begin_ns) / 1000 << "."
+				<< ((event.end_ns - event.begin_ns) % 1000) << "}";
+		else
+			ofs << ",\"ph\":\"i\",\"s\":\"t\"}";
+	}
+	ofs << "\n]}\n";
+
+	LOG(1, "Frame trace written to " << trace_file);
+}
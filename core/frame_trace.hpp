@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * frame_trace.hpp - per-frame pipeline tracing
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+// Lightweight tracing of per-frame spans across capture, post-processing,
+// encode and output. Events are written into a preallocated ring with a single
+// atomic increment - no allocation or locking on the hot path - and dumped on
+// exit as chrome://tracing ("Trace Event Format") JSON.
+//
+// Enable with FrameTrace::Enable(), or by setting RPICAM_TRACE=<filename> in
+// the environment.
+class FrameTrace
+{
+public:
+	static void Enable(std::string const &filename, unsigned int capacity = 1 << 16);
+	static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+	// Record a complete span. The name must be a string literal (it is stored
+	// by pointer, not copied).
+	static void Record(char const *name, uint64_t frame, uint64_t begin_ns, uint64_t end_ns);
+	// Record an instantaneous event.
+	static void Mark(char const *name, uint64_t frame);
+	static uint64_t Now();
+	static void Dump();
+
+	// RAII helper recording the span between construction and destruction.
+	class Span
+	{
+	public:
+		Span(char const *name, uint64_t frame) : name_(name), frame_(frame), begin_(Enabled() ? Now() : 0) {}
+		~Span()
+		{
+			if (begin_)
+				Record(name_, frame_, begin_, Now());
+		}
+
+	private:
+		char const *name_;
+		uint64_t frame_;
+		uint64_t begin_;
+	};
+
+private:
+	static std::atomic<bool> enabled_;
+};
@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * logging.cpp - asynchronous log writer
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "core/logging.hpp"
+
+namespace
+{
+
+// A bounded multi-producer single-consumer ring of formatted lines. Any
+// thread may log, so unlike the encoders' single-producer rings a slot is
+// claimed with a compare-exchange on the head; each slot carries a sequence
+// number that says whose turn it is (the producer that claimed it, or the
+// writer thread once the text has been stored). Nothing on the producer side
+// ever takes a lock or blocks - a full ring just drops the line.
+class LogWriter
+{
+public:
+	LogWriter()
+	{
+		for (uint32_t i = 0; i < SIZE; i++)
+			ring_[i].seq.store(i, std::memory_order_relaxed);
+		thread_ = std::thread(&LogWriter::writerThread, this);
+	}
+
+	~LogWriter()
+	{
+		quit_ = true;
+		cv_.notify_one();
+		thread_.join();
+		// Anything still queued gets written on this (the last) thread.
+		drain();
+		uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+		if (dropped)
+			std::cerr << "(" << dropped << " log messages dropped)" << std::endl;
+	}
+
+	void Submit(std::string &&line)
+	{
+		uint32_t pos = head_.load(std::memory_order_relaxed);
+		Slot *slot;
+		while (true)
+		{
+			slot = &ring_[pos & MASK];
+			int32_t dif = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+			if (dif == 0)
+			{
+				// Our turn, claim it (or learn who beat us to it).
+				if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+			{
+				// The writer hasn't released this slot yet: the ring is full.
+				dropped_.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			else
+				pos = head_.load(std::memory_order_relaxed);
+		}
+		slot->text = std::move(line);
+		slot->seq.store(pos + 1, std::memory_order_release);
+		cv_.notify_one();
+	}
+
+private:
+	static constexpr uint32_t SIZE = 256;
+	static constexpr uint32_t MASK = SIZE - 1;
+	struct Slot
+	{
+		std::atomic<uint32_t> seq;
+		std::string text;
+	};
+
+	bool drain()
+	{
+		bool wrote = false;
+		while (true)
+		{
+			Slot &slot = ring_[tail_ & MASK];
+			if ((int32_t)(slot.seq.load(std::memory_order_acquire) - (tail_ + 1)) < 0)
+				break;
+			std::cerr << slot.text << std::endl;
+			slot.text.clear();
+			slot.seq.store(tail_ + SIZE, std::memory_order_release);
+			tail_++;
+			wrote = true;
+		}
+		return wrote;
+	}
+
+	void writerThread()
+	{
+		while (true)
+		{
+			if (!drain())
+			{
+				using namespace std::chrono_literals;
+				// Check the abort only when the ring is empty, so every line
+				// submitted before shutdown still comes out.
+				if (quit_)
+					break;
+				std::unique_lock<std::mutex> lock(mutex_);
+				cv_.wait_for(lock, 200ms);
+			}
+		}
+	}
+
+	Slot ring_[SIZE];
+	std::atomic<uint32_t> head_ { 0 };
+	uint32_t tail_ = 0; // owned by the writer thread
+	std::atomic<uint64_t> dropped_ { 0 };
+	std::atomic<bool> quit_ { false };
+	std::mutex mutex_; // parks the writer thread only, never taken by producers
+	std::condition_variable cv_;
+	std::thread thread_;
+};
+
+} // namespace
+
+void Logging::Submit(std::string &&line)
+{
+	// Constructed on first use so logging works whenever it is called, and
+	// destroyed (flushing the queue) after main() returns.
+	static LogWriter writer;
+	writer.Submit(std::move(line));
+}
@@ -1,9 +1,38 @@
 #include "core/rpicam_app.hpp"
 
+#include <sstream>
+
+// The maximum log level compiled into the binary: LOG() calls above it expand
+// to nothing at all - no branch, no ostream chain. Build with
+// -DRPICAM_LOG_MAX_LEVEL=0 to strip logging from the hot paths entirely.
+#ifndef RPICAM_LOG_MAX_LEVEL
+#define RPICAM_LOG_MAX_LEVEL 2
+#endif
+
+namespace Logging
+{
+
+// Hand a formatted line to the background writer thread. Formatting happens
+// on the calling thread (the text may refer to locals that are gone by the
+// time LOG() returns), but the stderr write - the part that blocks - does
+// not. Lines are dropped rather than waited for if the writer cannot keep up.
+void Submit(std::string &&line);
+
+} // namespace Logging
+
 #define LOG(level, text)                                                                                               \
 	do                                                                                                                 \
 	{                                                                                                                  \
-		if (RPiCamApp::GetVerbosity() >= level)                                                                     \
-			std::cerr << text << std::endl;                                                                            \
+		if constexpr ((level) <= RPICAM_LOG_MAX_LEVEL)                                                                 \
+		{                                                                                                              \
+			if (RPiCamApp::GetVerbosity() >= (level))                                                                  \
+			{                                                                                                          \
+				std::ostringstream line_;                                                                              \
+				line_ << text;                                                                                         \
+				Logging::Submit(line_.str());                                                                          \
+			}                                                                                                          \
+		}                                                                                                              \
 	} while (0)
+// Errors are written synchronously: they are rare, often precede a throw, and
+// must not sit in a queue when the process is about to die.
 #define LOG_ERROR(text) std::cerr << text << std::endl
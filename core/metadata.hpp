@@ -13,6 +13,8 @@
 #include <mutex>
 #include <string>
 
+#include "core/block_pool.hpp"
+
 class Metadata
 {
 public:
@@ -102,5 +104,8 @@ public:
 
 private:
 	mutable std::mutex mutex_;
-	std::map<std::string, std::any> data_;
+	// Map nodes recycle through the block pool, so per-frame stage metadata
+	// stops costing heap allocations once the pool has warmed up.
+	std::map<std::string, std::any, std::less<std::string>, PoolAllocator<std::pair<const std::string, std::any>>>
+		data_;
 };
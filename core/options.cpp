@@ -5,6 +5,7 @@
  * options.cpp - common program options helpers
  */
 #include <algorithm>
+#include <cstring>
 #include <fcntl.h>
 #include <filesystem>
 #include <iomanip>
@@ -14,12 +15,14 @@
 #include <map>
 #include <string>
 #include <sys/ioctl.h>
+#include <unistd.h>
 
 #include <libcamera/formats.h>
 #include <libcamera/logging.h>
 #include <libcamera/property_ids.h>
 
 #include "core/options.hpp"
+#include "core/thread_tuning.hpp"
 
 namespace fs = std::filesystem;
 
@@ -231,8 +234,9 @@ Options::Options()
 			"Set the output image height (0 = use default value)")
 		("timeout,t", value<std::string>(&v_->timeout_)->default_value("5sec"),
 			"Time for which program runs. If no units are provided default to ms.")
-		("output,o", value<std::string>(&v_->output),
-			"Set the output file name")
+		("output,o", value<std::vector<std::string>>(&v_->outputs)->composing(),
+			"Set the output file name. For video, may be given several times to send the "
+			"encoded stream to all of the named outputs at once")
 		("post-process-file", value<std::string>(&v_->post_process_file),
 			"Set the file name for configuring the post-processing")
 		("post-process-libs", value<std::string>(&v_->post_process_libs),
@@ -245,6 +249,8 @@ Options::Options()
 			"Use a fullscreen preview window")
 		("qt-preview", value<bool>(&v_->qt_preview)->default_value(false)->implicit_value(true),
 			"Use Qt-based preview window (WARNING: causes heavy CPU load, fullscreen not supported)")
+		("async-flip", value<bool>(&v_->async_flip)->default_value(false)->implicit_value(true),
+			"Allow the DRM preview to flip without waiting for vblank (may tear, lowest latency)")
 		("preview-libs", value<std::string>(&v_->preview_libs)->default_value(""),
 			"Set a custom location for the preview library .so files")
 		("hflip", value<bool>(&v_->hflip_)->default_value(false)->implicit_value(true), "Request a horizontal flip transform")
@@ -297,12 +303,26 @@ Options::Options()
 			"Height of low resolution frames (use 0 to omit low resolution stream)")
 		("lores-par", value<bool>(&v_->lores_par)->default_value(false)->implicit_value(true),
 			"Preserve the pixel aspect ratio of the low res image (where possible) by applying a different crop on the stream.")
+		("lores-preview", value<bool>(&v_->lores_preview)->default_value(false)->implicit_value(true),
+			"Feed the preview window from the low resolution stream instead of the main stream")
 		("mode", value<std::string>(&v_->mode_string),
 			"Camera mode as W:H:bit-depth:packing, where packing is P (packed) or U (unpacked)")
 		("viewfinder-mode", value<std::string>(&v_->viewfinder_mode_string),
 			"Camera mode for preview as W:H:bit-depth:packing, where packing is P (packed) or U (unpacked)")
 		("buffer-count", value<unsigned int>(&v_->buffer_count)->default_value(0), "Number of in-flight requests (and buffers) configured for video, raw, and still.")
 		("viewfinder-buffer-count", value<unsigned int>(&v_->viewfinder_buffer_count)->default_value(0), "Number of in-flight requests (and buffers) configured for preview window.")
+		("raw-buffer-count", value<unsigned int>(&v_->raw_buffer_count)->default_value(0),
+			"Number of buffers for the raw stream, when it can be shallower than the main stream. "
+			"Raw sensor buffers are the largest CMA consumers; applications that keep a raw stream only "
+			"to pin the sensor mode can run it with 1 or 2 buffers, in which case the raw image is "
+			"delivered on just the subset of frames carrying one of them. Do not use when every raw "
+			"frame is consumed (rpicam-raw, DNG capture). Set to 0 to match the main stream's count.")
+		("prefault-buffers", value<bool>(&v_->prefault_buffers)->default_value(false)->implicit_value(true),
+			"Prefault all frame buffer mappings during configuration, avoiding page-fault latency on the first frames")
+		("pipeline-cpus", value<std::string>(&v_->pipeline_cpus)->default_value(""),
+			"Comma-separated list of CPUs to pin the camera pipeline threads to, e.g. 2,3")
+		("pipeline-priority", value<int>(&v_->pipeline_priority)->default_value(0),
+			"Run the camera pipeline threads at this SCHED_FIFO priority (0 leaves normal scheduling)")
 		("no-raw", value<bool>(&v_->no_raw)->default_value(false)->implicit_value(true),
 			"Disable requesting of a RAW stream. Will override any manual mode reqest the mode choice when setting framerate.")
 		("autofocus-mode", value<std::string>(&v_->afMode)->default_value("default"),
@@ -335,9 +355,300 @@ Options::Options()
 	platform_ = get_platform();
 }
 
+// Parsing the command line and config file through boost::program_options and
+// validating the result costs tens of milliseconds on the smaller Pis, yet the
+// outcome depends only on the invocation itself. As with the sensor mode
+// cache, we snapshot the fully validated OptsInternal state on disk, keyed by
+// a hash of argv, the config file contents and the application version, so
+// that a repeated identical invocation restores the snapshot and skips boost
+// entirely. Parsing's side effects (environment, camera manager, log levels)
+// are replayed by OptsInternal::Restore().
+
+static constexpr uint32_t OPTIONS_CACHE_VERSION = 5;
+
+static void put(std::ostream &os, std::string const &s)
+{
+	uint32_t len = s.size();
+	os.write(reinterpret_cast<const char *>(&len), sizeof(len));
+	os.write(s.data(), len);
+}
+
+static void put(std::ostream &os, std::vector<std::string> const &v)
+{
+	uint32_t count = v.size();
+	os.write(reinterpret_cast<const char *>(&count), sizeof(count));
+	for (auto const &s : v)
+		put(os, s);
+}
+
+template <typename T>
+static void put(std::ostream &os, T const &v)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "field needs a serialiser");
+	os.write(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+template <typename T>
+static void put(std::ostream &os, std::optional<T> const &o)
+{
+	put(os, o.has_value());
+	if (o)
+		put(os, *o);
+}
+
+template <typename D>
+static void put(std::ostream &os, TimeVal<D> const &t)
+{
+	put(os, static_cast<int64_t>(t.value.count()));
+}
+
+static bool get(std::istream &is, std::string &s)
+{
+	uint32_t len;
+	if (!is.read(reinterpret_cast<char *>(&len), sizeof(len)) || len > (1 << 20))
+		return false;
+	s.resize(len);
+	return !!is.read(&s[0], len);
+}
+
+static bool get(std::istream &is, std::vector<std::string> &v)
+{
+	uint32_t count;
+	if (!is.read(reinterpret_cast<char *>(&count), sizeof(count)) || count > (1 << 16))
+		return false;
+	v.resize(count);
+	for (auto &s : v)
+		if (!get(is, s))
+			return false;
+	return true;
+}
+
+template <typename T>
+static bool get(std::istream &is, T &v)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "field needs a serialiser");
+	return !!is.read(reinterpret_cast<char *>(&v), sizeof(v));
+}
+
+template <typename T>
+static bool get(std::istream &is, std::optional<T> &o)
+{
+	bool has_value;
+	if (!get(is, has_value))
+		return false;
+	if (!has_value)
+	{
+		o.reset();
+		return true;
+	}
+	T v;
+	if (!get(is, v))
+		return false;
+	o = v;
+	return true;
+}
+
+template <typename D>
+static bool get(std::istream &is, TimeVal<D> &t)
+{
+	int64_t ns;
+	if (!get(is, ns))
+		return false;
+	t.value = std::chrono::nanoseconds(ns);
+	return true;
+}
+
+struct OptionsWriter
+{
+	std::ostream &os;
+	template <typename T>
+	bool operator()(T const &v)
+	{
+		put(os, v);
+		return static_cast<bool>(os);
+	}
+};
+
+struct OptionsReader
+{
+	std::istream &is;
+	template <typename T>
+	bool operator()(T &v)
+	{
+		return get(is, v);
+	}
+};
+
+// One field list for both directions, so the two can never fall out of step.
+// The Bitrate members are deliberately absent: they cannot be restored
+// directly, but ParseVideo()/ParseStill() re-run after a restore and recompute
+// them (and the other derived video/still fields) from the strings below.
+template <typename Archive>
+static bool visit_options(Archive &ar, OptsInternal &v)
+{
+	return ar(v.help) && ar(v.version) && ar(v.list_cameras) && ar(v.verbose) && ar(v.timeout) &&
+		   ar(v.config_file) && ar(v.output) && ar(v.outputs) && ar(v.post_process_file) &&
+		   ar(v.post_process_libs) && ar(v.width) && ar(v.height) && ar(v.nopreview) && ar(v.preview) &&
+		   ar(v.fullscreen) && ar(v.preview_x) && ar(v.preview_y) && ar(v.preview_width) &&
+		   ar(v.preview_height) && ar(v.transform) && ar(v.roi) && ar(v.roi_x) && ar(v.roi_y) &&
+		   ar(v.roi_width) && ar(v.roi_height) && ar(v.shutter) && ar(v.gain) && ar(v.metering) &&
+		   ar(v.metering_index) && ar(v.exposure) && ar(v.exposure_index) && ar(v.ev) && ar(v.awb) &&
+		   ar(v.awb_index) && ar(v.awbgains) && ar(v.awb_gain_r) && ar(v.awb_gain_b) && ar(v.ccm) &&
+		   ar(v.ccm_values) && ar(v.flush) && ar(v.wrap) && ar(v.brightness) && ar(v.contrast) &&
+		   ar(v.saturation) && ar(v.sharpness) && ar(v.framerate) && ar(v.denoise) && ar(v.info_text) &&
+		   ar(v.viewfinder_width) && ar(v.viewfinder_height) && ar(v.tuning_file) && ar(v.qt_preview) &&
+		   ar(v.async_flip) && ar(v.lores_width) && ar(v.lores_height) && ar(v.lores_par) &&
+		   ar(v.lores_preview) && ar(v.camera) && ar(v.mode_string) && ar(v.mode) &&
+		   ar(v.viewfinder_mode_string) && ar(v.viewfinder_mode) && ar(v.buffer_count) &&
+		   ar(v.viewfinder_buffer_count) && ar(v.raw_buffer_count) && ar(v.prefault_buffers) &&
+		   ar(v.pipeline_cpus) &&
+		   ar(v.pipeline_priority) && ar(v.afMode) && ar(v.afMode_index) && ar(v.afRange) &&
+		   ar(v.afRange_index) && ar(v.afSpeed) && ar(v.afSpeed_index) && ar(v.afWindow) &&
+		   ar(v.afWindow_x) && ar(v.afWindow_y) && ar(v.afWindow_width) && ar(v.afWindow_height) &&
+		   ar(v.lens_position) && ar(v.set_default_lens_position) && ar(v.af_on_capture) &&
+		   ar(v.metadata) && ar(v.metadata_format) && ar(v.hdr) && ar(v.flicker_period) && ar(v.no_raw) &&
+		   ar(v.hflip_) && ar(v.vflip_) && ar(v.rotation_) && ar(v.framerate_) && ar(v.lens_position_) &&
+		   ar(v.timeout_) && ar(v.shutter_) && ar(v.flicker_period_) &&
+		   ar(v.profile) && ar(v.level) && ar(v.intra) && ar(v.inline_headers) && ar(v.codec) &&
+		   ar(v.libav_video_codec) && ar(v.libav_video_codec_opts) && ar(v.libav_format) &&
+		   ar(v.libav_audio) && ar(v.audio_codec) && ar(v.audio_device) && ar(v.audio_source) &&
+		   ar(v.audio_channels) && ar(v.audio_samplerate) && ar(v.audio_fragment_size) && ar(v.av_sync) && ar(v.save_pts) &&
+		   ar(v.save_pts_format) && ar(v.quality) && ar(v.listen) && ar(v.keypress) && ar(v.signal) &&
+		   ar(v.initial) && ar(v.pause) && ar(v.split) && ar(v.segment) && ar(v.circular) &&
+		   ar(v.frames) && ar(v.low_latency) && ar(v.encoder_threads) && ar(v.udp_mtu) &&
+		   ar(v.srt_latency) && ar(v.async_io) && ar(v.direct) && ar(v.sync) &&
+		   ar(v.bitrate_) && ar(v.av_sync_) && ar(v.audio_bitrate_) && ar(v.udp_pace_) && ar(v.sync_) &&
+		   ar(v.exif) && ar(v.timelapse) && ar(v.framestart) && ar(v.datetime) && ar(v.timestamp) &&
+		   ar(v.restart) && ar(v.png_level) && ar(v.thumb) && ar(v.thumb_width) && ar(v.thumb_height) &&
+		   ar(v.thumb_quality) && ar(v.encoding) && ar(v.preserve_stride) && ar(v.raw) && ar(v.latest) &&
+		   ar(v.immediate) && ar(v.zsl) && ar(v.burst) && ar(v.timelapse_) &&
+		   ar(v.preview_libs) && ar(v.encoder_libs);
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	while (len--)
+		hash = (hash ^ *p++) * 0x100000001b3ull;
+	return hash;
+}
+
+static uint64_t hash_invocation(int argc, char *argv[])
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	std::string version = RPiCamAppsVersion();
+	hash = fnv1a(hash, version.data(), version.size());
+	for (int i = 0; i < argc; i++)
+		hash = fnv1a(hash, argv[i], strlen(argv[i]) + 1); // the NUL separates the arguments
+
+	// The config file feeds the same variables, so its contents are part of
+	// the key. Mirror boost's handling of the implicit value: an attached
+	// value names the file, a bare -c/--config means config.txt.
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg(argv[i]);
+		std::string file;
+		if (arg == "-c" || arg == "--config")
+			file = "config.txt";
+		else if (arg.rfind("--config=", 0) == 0)
+			file = arg.substr(9);
+		else if (arg.rfind("-c", 0) == 0 && arg.length() > 2 && arg[2] != '-')
+			file = arg.substr(2);
+		if (file.empty())
+			continue;
+		// A missing file hashes as empty, matching the parser's behaviour.
+		std::ifstream ifs(file, std::ios::binary);
+		std::stringstream contents;
+		contents << ifs.rdbuf();
+		hash = fnv1a(hash, contents.str().data(), contents.str().size());
+	}
+	return hash;
+}
+
+static std::string options_cache_file(uint64_t key)
+{
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	std::string base;
+	if (cache_home && cache_home[0])
+		base = cache_home;
+	else
+	{
+		const char *home = getenv("HOME");
+		if (!home || !home[0])
+			return {};
+		base = std::string(home) + "/.cache";
+	}
+
+	std::stringstream ss;
+	ss << base << "/rpicam-apps/options-" << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+	return ss.str();
+}
+
+static bool load_options_cache(const std::string &file, OptsInternal &v)
+{
+	if (file.empty())
+		return false;
+
+	std::ifstream ifs(file, std::ios::binary);
+	if (!ifs)
+		return false;
+
+	uint32_t version;
+	if (!ifs.read(reinterpret_cast<char *>(&version), sizeof(version)) || version != OPTIONS_CACHE_VERSION)
+		return false;
+
+	// Deserialise into a scratch copy so a truncated or stale file never
+	// leaves the live options half-written.
+	OptsInternal restored;
+	OptionsReader reader { ifs };
+	if (!visit_options(reader, restored) || ifs.peek() != EOF)
+		return false;
+
+	v = std::move(restored);
+	LOG(2, "Restored options from cache");
+	return true;
+}
+
+static void save_options_cache(const std::string &file, OptsInternal &v)
+{
+	if (file.empty())
+		return;
+
+	std::error_code ec;
+	fs::create_directories(fs::path(file).parent_path(), ec);
+	if (ec)
+		return;
+
+	// Write to a temporary file and rename so a concurrent start never sees a partial cache.
+	std::string tmp = file + ".tmp" + std::to_string(getpid());
+	std::ofstream ofs(tmp, std::ios::binary);
+	if (!ofs)
+		return;
+
+	uint32_t version = OPTIONS_CACHE_VERSION;
+	ofs.write(reinterpret_cast<const char *>(&version), sizeof(version));
+	OptionsWriter writer { ofs };
+	visit_options(writer, v);
+	ofs.close();
+
+	if (!ofs)
+		fs::remove(tmp, ec);
+	else
+	{
+		fs::rename(tmp, file, ec);
+		if (ec)
+			fs::remove(tmp, ec);
+	}
+}
+
 bool Options::Parse(int argc, char *argv[])
 {
 	using namespace boost::program_options;
+
+	std::string cache_file = options_cache_file(hash_invocation(argc, argv));
+	if (load_options_cache(cache_file, *v_))
+		return v_->Restore(app_);
+
 	variables_map vm;
 	// Read options from the command line
 	store(parse_command_line(argc, argv, *options_), vm);
@@ -356,7 +667,12 @@ bool Options::Parse(int argc, char *argv[])
 		return false;
 	}
 
-	return v_->Parse(vm, app_);
+	bool ok = v_->Parse(vm, app_);
+	// Parsing rewrites the hdr setting depending on which camera is fitted,
+	// so those invocations are never cached.
+	if (ok && v_->hdr == "off")
+		save_options_cache(cache_file, *v_);
+	return ok;
 }
 
 bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *app)
@@ -368,6 +684,17 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 	if (framerate_ != -1.0)
 		framerate = framerate_;
 
+	// Most code only cares about a single output; extra ones (video only) are
+	// handled by the tee in Output::Create().
+	if (!outputs.empty())
+		output = outputs[0];
+
+	// Applied by each pipeline thread as it starts.
+	ThreadTuning::Configure(pipeline_cpus, pipeline_priority);
+
+	if (lores_preview && !(lores_width && lores_height))
+		throw std::runtime_error("--lores-preview requires --lores-width and --lores-height");
+
 	// Check if --nopreview is set, and if no info-text string was provided
 	// null the defaulted string so nothing gets displayed to stderr.
 	if (nopreview && vm["info-text"].defaulted())
@@ -680,6 +1007,43 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 	return true;
 }
 
+bool OptsInternal::Restore(RPiCamApp *app)
+{
+	// Replays the per-invocation side effects of Parse() on a snapshot whose
+	// values are already fully validated; everything here must stay in step
+	// with the code above. Help, version and list-cameras invocations never
+	// get cached, as Parse() returns false for them before a save.
+	ThreadTuning::Configure(pipeline_cpus, pipeline_priority);
+
+	if (tuning_file != "-")
+		setenv("LIBCAMERA_RPI_TUNING_FILE", tuning_file.c_str(), 1);
+
+	if (!verbose)
+		libcamera::logSetTarget(libcamera::LoggingTargetNone);
+
+	app->initCameraManager();
+
+	bool log_env_set = getenv("LIBCAMERA_LOG_LEVELS");
+	if (!log_env_set)
+		libcamera::logSetLevel("*", "ERROR");
+
+	// Snapshots are only ever saved with hdr "off", but sensor HDR may be
+	// left enabled from a previous run and still needs turning off.
+	std::vector<std::shared_ptr<libcamera::Camera>> cameras = app->GetCameras();
+	if (camera < cameras.size())
+	{
+		const std::string cam_id = *cameras[camera]->properties().get(libcamera::properties::Model);
+		if (cam_id.find("imx708") != std::string::npos && set_imx708_subdev_hdr_ctrl(0, cameras[camera]->id()))
+			app->initCameraManager();
+	}
+
+	if (verbose && !log_env_set)
+		libcamera::logSetLevel("*", "INFO");
+	RPiCamApp::verbosity = verbose;
+
+	return true;
+}
+
 void OptsInternal::Print() const
 {
 	std::cerr << "Options:" << std::endl;
@@ -703,6 +1067,12 @@ void OptsInternal::Print() const
 		std::cerr << "    preview: " << preview_x << "," << preview_y << "," << preview_width << ","
 					<< preview_height << std::endl;
 	std::cerr << "    qt-preview: " << qt_preview << std::endl;
+	if (async_flip)
+		std::cerr << "    async-flip: " << async_flip << std::endl;
+	if (!pipeline_cpus.empty())
+		std::cerr << "    pipeline-cpus: " << pipeline_cpus << std::endl;
+	if (pipeline_priority)
+		std::cerr << "    pipeline-priority: " << pipeline_priority << std::endl;
 	std::cerr << "    transform: " << transformToString(transform) << std::endl;
 	if (roi_width == 0 || roi_height == 0)
 		std::cerr << "    roi: all" << std::endl;
@@ -734,6 +1104,8 @@ void OptsInternal::Print() const
 	std::cerr << "    lores-width: " << lores_width << std::endl;
 	std::cerr << "    lores-height: " << lores_height << std::endl;
 	std::cerr << "    lores-par: " << lores_par << std::endl;
+	if (lores_preview)
+		std::cerr << "    lores-preview: " << lores_preview << std::endl;
 	if (afMode_index != -1)
 		std::cerr << "    autofocus-mode: " << afMode << std::endl;
 	if (afRange_index != -1)
@@ -754,6 +1126,8 @@ void OptsInternal::Print() const
 		std::cerr << "    buffer-count: " << buffer_count << std::endl;
 	if (viewfinder_buffer_count > 0)
 		std::cerr << "    viewfinder-buffer-count: " << viewfinder_buffer_count << std::endl;
+	if (raw_buffer_count > 0)
+		std::cerr << "    raw-buffer-count: " << raw_buffer_count << std::endl;
 	std::cerr << "    metadata: " << metadata << std::endl;
 	std::cerr << "    metadata-format: " << metadata_format << std::endl;
 }
@@ -763,6 +1137,7 @@ bool OptsInternal::ParseVideo()
 	bitrate.set(bitrate_);
 	av_sync.set(av_sync_);
 	audio_bitrate.set(audio_bitrate_);
+	udp_pace.set(udp_pace_);
 	if (width == 0)
 		width = 640;
 	if (height == 0)
@@ -783,6 +1158,8 @@ bool OptsInternal::ParseVideo()
 		pause = false;
 	else
 		throw std::runtime_error("incorrect initial value " + initial);
+	if (save_pts_format != "txt" && save_pts_format != "binary")
+		throw std::runtime_error("unrecognised save-pts format " + save_pts_format);
 	if ((pause || split || segment || circular) && !inline_headers)
 		LOG_ERROR("WARNING: consider inline headers with 'pause'/split/segment/circular");
 	if ((split || segment) && output.find('%') == std::string::npos)
@@ -796,7 +1173,6 @@ bool OptsInternal::ParseVideo()
 		level = "4.2";
 	}
 
-#ifndef DISABLE_RPI_FEATURES
 	if (strcasecmp(sync_.c_str(), "off") == 0)
 		sync = 0;
 	else if (strcasecmp(sync_.c_str(), "server") == 0)
@@ -805,7 +1181,6 @@ bool OptsInternal::ParseVideo()
 		sync = 2;
 	else
 		throw std::runtime_error("incorrect sync value " + sync_);
-#endif
 
 	return true;
 }
@@ -818,6 +1193,8 @@ void OptsInternal::PrintVideo() const
 	std::cerr << "    intra: " << intra << std::endl;
 	std::cerr << "    inline: " << inline_headers << std::endl;
 	std::cerr << "    save-pts: " << save_pts << std::endl;
+	if (!save_pts.empty())
+		std::cerr << "    save-pts-format: " << save_pts_format << std::endl;
 	std::cerr << "    codec: " << codec << std::endl;
 	std::cerr << "    quality (for MJPEG): " << quality << std::endl;
 	std::cerr << "    keypress: " << keypress << std::endl;
@@ -826,9 +1203,14 @@ void OptsInternal::PrintVideo() const
 	std::cerr << "    split: " << split << std::endl;
 	std::cerr << "    segment: " << segment << std::endl;
 	std::cerr << "    circular: " << circular << std::endl;
-#ifndef DISABLE_RPI_FEATURES
+	if (udp_mtu)
+		std::cerr << "    udp-mtu: " << udp_mtu << std::endl;
+	if (udp_pace)
+		std::cerr << "    udp-pace: " << udp_pace.kbps() << "kbps" << std::endl;
+	std::cerr << "    srt-latency: " << srt_latency << "ms" << std::endl;
+	std::cerr << "    async-io: " << async_io << std::endl;
+	std::cerr << "    direct: " << direct << std::endl;
 	std::cerr << "    sync: " << sync << std::endl;
-#endif
 }
 
 bool OptsInternal::ParseStill()
@@ -864,7 +1246,9 @@ void OptsInternal::PrintStill() const
 	std::cerr << "    encoding: " << encoding << std::endl;
 	std::cerr << "    quality: " << quality << std::endl;
 	std::cerr << "    raw: " << raw << std::endl;
+	std::cerr << "    preserve stride: " << preserve_stride << std::endl;
 	std::cerr << "    restart: " << restart << std::endl;
+	std::cerr << "    png level: " << png_level << std::endl;
 	std::cerr << "    timelapse: " << timelapse.get() << "ms" << std::endl;
 	std::cerr << "    framestart: " << framestart << std::endl;
 	std::cerr << "    datetime: " << datetime << std::endl;
@@ -878,6 +1262,7 @@ void OptsInternal::PrintStill() const
 	std::cerr << "    immediate " << immediate << std::endl;
 	std::cerr << "    AF on capture: " << af_on_capture << std::endl;
 	std::cerr << "    Zero shutter lag: " << zsl << std::endl;
+	std::cerr << "    burst: " << burst << std::endl;
 	for (auto &s : exif)
 		std::cerr << "    EXIF: " << s << std::endl;
 }
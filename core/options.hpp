@@ -173,6 +173,7 @@ struct OptsInternal
 	}
 
 	bool Parse(boost::program_options::variables_map &vm, RPiCamApp *app);
+	bool Restore(RPiCamApp *app); // replay Parse's side effects on a cached snapshot
 	void Print() const;
 
 	bool ParseVideo();
@@ -187,7 +188,8 @@ struct OptsInternal
 	unsigned int verbose;
 	TimeVal<std::chrono::milliseconds> timeout;
 	std::string config_file;
-	std::string output;
+	std::string output; // the first (often only) output
+	std::vector<std::string> outputs; // every --output given on the command line
 	std::string post_process_file;
 	std::string post_process_libs;
 	unsigned int width;
@@ -226,9 +228,11 @@ struct OptsInternal
 	unsigned int viewfinder_height;
 	std::string tuning_file;
 	bool qt_preview;
+	bool async_flip;
 	unsigned int lores_width;
 	unsigned int lores_height;
 	bool lores_par;
+	bool lores_preview;
 	unsigned int camera;
 	std::string mode_string;
 	Mode mode;
@@ -236,6 +240,10 @@ struct OptsInternal
 	Mode viewfinder_mode;
 	unsigned int buffer_count;
 	unsigned int viewfinder_buffer_count;
+	unsigned int raw_buffer_count;
+	bool prefault_buffers;
+	std::string pipeline_cpus;
+	int pipeline_priority;
 	std::string afMode;
 	int afMode_index;
 	std::string afRange;
@@ -277,8 +285,10 @@ struct OptsInternal
 	uint32_t audio_channels;
 	Bitrate audio_bitrate;
 	uint32_t audio_samplerate;
+	uint32_t audio_fragment_size;
 	TimeVal<std::chrono::microseconds> av_sync;
 	std::string save_pts;
+	std::string save_pts_format;
 	int quality;
 	bool listen;
 	bool keypress;
@@ -290,15 +300,18 @@ struct OptsInternal
 	size_t circular;
 	uint32_t frames;
 	bool low_latency;
-#ifndef DISABLE_RPI_FEATURES
+	unsigned int encoder_threads;
+	unsigned int udp_mtu;
+	Bitrate udp_pace;
+	unsigned int srt_latency;
+	bool async_io;
+	bool direct;
 	uint32_t sync;
-#endif
 	std::string bitrate_;
 	std::string av_sync_;
 	std::string audio_bitrate_;
-#ifndef DISABLE_RPI_FEATURES
+	std::string udp_pace_;
 	std::string sync_;
-#endif
 
 	//int quality;
 	std::vector<std::string> exif;
@@ -307,15 +320,18 @@ struct OptsInternal
 	bool datetime;
 	bool timestamp;
 	unsigned int restart;
+	int png_level;
 	//bool keypress;
 	//bool signal;
 	std::string thumb;
 	unsigned int thumb_width, thumb_height, thumb_quality;
 	std::string encoding;
+	bool preserve_stride;
 	bool raw;
 	std::string latest;
 	bool immediate;
 	bool zsl;
+	unsigned int burst;
 	std::string timelapse_;
 
 	std::string preview_libs;
@@ -9,10 +9,15 @@
 #include <filesystem>
 #include <iostream>
 #include <map>
+#include <set>
 
+#include "core/dl_lib.hpp"
+#include "core/frame_trace.hpp"
 #include "core/options.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/post_processor.hpp"
+#include "core/stats.hpp"
+#include "core/thread_tuning.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
@@ -25,33 +30,73 @@
 
 namespace fs = std::filesystem;
 
+namespace
+{
+
+// The loaded modules are shared by every PostProcessor in the process, so
+// that multi-camera applications load each stage library only once.
+std::mutex load_mutex;
+std::vector<DlLib> loaded_libs;
+std::set<std::string> loaded_paths;
+// Optional manifest mapping stage names to the library providing them.
+std::map<std::string, std::string> stage_manifest;
+
+void loadLibrary(const std::string &path)
+{
+	if (loaded_paths.insert(path).second)
+		loaded_libs.emplace_back(path);
+}
+
+} // namespace
+
 PostProcessor::PostProcessor(RPiCamApp *app) : app_(app)
 {
 }
 
 PostProcessor::~PostProcessor()
 {
-	// Must clear stages_ before dynamic_stages_ as the latter will unload the necessary symbols.
+	// The stage libraries live in process-wide statics and are never unloaded,
+	// so the stages' code stays mapped for as long as anything may call it.
 	stages_.clear();
-	dynamic_stages_.clear();
 }
 
 void PostProcessor::LoadModules(const std::string &lib_dir)
 {
-	static std::vector<DlLib> dynamic_stages_;
-
 	const fs::path path(!lib_dir.empty() ? lib_dir : POSTPROC_LIB_DIR);
 	const std::string ext(".so");
 
 	if (!fs::exists(path))
 		return;
 
-	// Dynamically load all .so files from the system postprocessing lib path.
-	// This will automatically register the stages with the factory.
+	std::lock_guard<std::mutex> lock(load_mutex);
+
+	// If the directory carries a manifest mapping stage names to libraries, we
+	// defer loading: createPostProcessingStage() will dlopen just the libraries
+	// providing the stages that the JSON config actually names. This keeps
+	// startup fast and lean when large optional stage sets (TFLite, Hailo) are
+	// installed but unused.
+	const fs::path manifest = path / "stages.json";
+	if (fs::exists(manifest))
+	{
+		boost::property_tree::ptree root;
+		boost::property_tree::read_json(manifest.string(), root);
+		for (auto const &key_and_value : root)
+		{
+			fs::path lib(key_and_value.second.get_value<std::string>());
+			if (lib.is_relative())
+				lib = path / lib;
+			stage_manifest[key_and_value.first] = lib.string();
+		}
+		LOG(2, "Read post processing manifest with " << stage_manifest.size() << " stages");
+		return;
+	}
+
+	// Otherwise dynamically load all .so files from the system postprocessing
+	// lib path. This will automatically register the stages with the factory.
 	for (auto const &p : fs::recursive_directory_iterator(path))
 	{
 		if (p.path().extension() == ext)
-			dynamic_stages_.emplace_back(p.path().string());
+			loadLibrary(p.path().string());
 	}
 }
 
@@ -62,57 +107,130 @@ void PostProcessor::Read(std::string const &filename)
 	for (auto const &key_and_value : root)
 	{
 		if (key_and_value.first == "rpicam-apps")
-		{
-			boost::property_tree::ptree const &node = key_and_value.second;
+			readAppConfig(key_and_value.second);
+		else
+			readStage(key_and_value.first, key_and_value.second, stages_, stage_budgets_ns_);
+	}
+}
 
-			if (node.find("lores") != node.not_found())
-			{
-				static std::map<std::string, libcamera::PixelFormat> formats {
-					{ "rgb", libcamera::formats::BGR888 },
-					{ "bgr", libcamera::formats::RGB888 },
-					{ "yuv420", libcamera::formats::YUV420 },
-				};
-
-				unsigned int lores_width = node.get<unsigned int>("lores.width");
-				unsigned int lores_height = node.get<unsigned int>("lores.height");
-				bool lores_par = node.get<bool>("lores.par", app_->GetOptions()->Get().lores_par);
-				std::string lores_format_str = node.get<std::string>("lores.format", "yuv420");
-
-				libcamera::PixelFormat lores_format = libcamera::formats::YUV420;
-
-				auto it = formats.find(lores_format_str);
-				if (it == formats.end())
-					LOG_ERROR("Unknown requested lores format: " << lores_format_str);
-				else
-					lores_format = it->second;
-
-				app_->GetOptions()->Set().lores_width = lores_width;
-				app_->GetOptions()->Set().lores_height = lores_height;
-				app_->GetOptions()->Set().lores_par = lores_par;
-				app_->lores_format_ = lores_format;
-
-				LOG(1, "Postprocessing requested lores: " << lores_width << "x" << lores_height << " " << lores_format);
-			}
-		}
+void PostProcessor::readAppConfig(boost::property_tree::ptree const &node)
+{
+	if (node.find("lores") != node.not_found())
+	{
+		static std::map<std::string, libcamera::PixelFormat> formats {
+			{ "rgb", libcamera::formats::BGR888 },
+			{ "bgr", libcamera::formats::RGB888 },
+			{ "yuv420", libcamera::formats::YUV420 },
+		};
+
+		unsigned int lores_width = node.get<unsigned int>("lores.width");
+		unsigned int lores_height = node.get<unsigned int>("lores.height");
+		bool lores_par = node.get<bool>("lores.par", app_->GetOptions()->Get().lores_par);
+		std::string lores_format_str = node.get<std::string>("lores.format", "yuv420");
+
+		libcamera::PixelFormat lores_format = libcamera::formats::YUV420;
+
+		auto it = formats.find(lores_format_str);
+		if (it == formats.end())
+			LOG_ERROR("Unknown requested lores format: " << lores_format_str);
 		else
+			lores_format = it->second;
+
+		app_->GetOptions()->Set().lores_width = lores_width;
+		app_->GetOptions()->Set().lores_height = lores_height;
+		app_->GetOptions()->Set().lores_par = lores_par;
+		app_->lores_format_ = lores_format;
+
+		LOG(1, "Postprocessing requested lores: " << lores_width << "x" << lores_height << " " << lores_format);
+	}
+}
+
+void PostProcessor::readStage(std::string const &name, boost::property_tree::ptree const &params,
+							  std::vector<StagePtr> &stages, std::vector<uint64_t> &budgets)
+{
+	PostProcessingStage *stage = createPostProcessingStage(name.c_str());
+	if (stage)
+	{
+		LOG(1, "Reading post processing stage \"" << name << "\"");
+		stage->Read(params);
+		stages.push_back(StagePtr(stage));
+		// An optional "budget_us" in any stage's config makes the executor bypass
+		// that stage (rather than stall the pipeline) when it keeps overrunning.
+		budgets.push_back(params.get<uint64_t>("budget_us", 0) * 1000);
+	}
+	else
+		LOG(1, "No post processing stage found for \"" << name << "\"");
+}
+
+bool PostProcessor::Reconfigure(std::string const &filename)
+{
+	// Build and configure the replacement pipeline entirely on the side while
+	// the current one keeps running, so the swap itself costs little.
+	std::vector<StagePtr> new_stages;
+	std::vector<uint64_t> new_budgets;
+
+	try
+	{
+		boost::property_tree::ptree root;
+		boost::property_tree::read_json(filename, root);
+
+		for (auto const &key_and_value : root)
 		{
-			PostProcessingStage *stage = createPostProcessingStage(key_and_value.first.c_str());
-			if (stage)
-			{
-				LOG(1, "Reading post processing stage \"" << key_and_value.first << "\"");
-				stage->Read(key_and_value.second);
-				stages_.push_back(StagePtr(stage));
-			}
+			// Stream changes (e.g. the lores size) need a camera reconfiguration,
+			// which is exactly what we are avoiding here.
+			if (key_and_value.first == "rpicam-apps")
+				LOG(1, "Ignoring \"rpicam-apps\" config block on reconfiguration");
 			else
-				LOG(1, "No post processing stage found for \"" << key_and_value.first << "\"");
+				readStage(key_and_value.first, key_and_value.second, new_stages, new_budgets);
 		}
+
+		for (auto &stage : new_stages)
+			stage->Configure();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("Post processing reconfiguration failed, keeping current pipeline: " << e.what());
+		return false;
 	}
+
+	// Drain the running pipeline, swap the new stages in and restart the
+	// workers. Frames are held up only for the duration of the swap.
+	std::lock_guard<std::mutex> lock(process_mutex_);
+
+	for (auto &stage : stages_)
+		stage->Stop();
+	stopThreads();
+	for (auto &stage : stages_)
+		stage->Teardown();
+
+	stages_ = std::move(new_stages);
+	stage_budgets_ns_ = std::move(new_budgets);
+	Start();
+
+	return true;
 }
 
 PostProcessingStage *PostProcessor::createPostProcessingStage(char const *name)
 {
 	auto it = GetPostProcessingStages().find(std::string(name));
-	return it != GetPostProcessingStages().end() ? (*it->second)(app_) : nullptr;
+	if (it == GetPostProcessingStages().end())
+	{
+		// Not registered yet - perhaps the manifest knows which library provides
+		// it, in which case load that now and look again.
+		std::lock_guard<std::mutex> lock(load_mutex);
+		auto entry = stage_manifest.find(name);
+		if (entry == stage_manifest.end())
+			return nullptr;
+
+		LOG(2, "Loading " << entry->second << " for stage \"" << name << "\"");
+		loadLibrary(entry->second);
+
+		it = GetPostProcessingStages().find(std::string(name));
+		if (it == GetPostProcessingStages().end())
+			return nullptr;
+	}
+
+	return (*it->second)(app_);
 }
 
 void PostProcessor::SetCallback(PostProcessorCallback callback)
@@ -136,9 +254,41 @@ void PostProcessor::Configure()
 	}
 }
 
+// Histogram bucket upper bounds, chosen around typical frame budgets (a final
+// unbounded bucket catches everything slower). Must match NUM_HISTOGRAM_BUCKETS.
+static constexpr uint64_t HISTOGRAM_BOUNDS_NS[] = { 1000000, 4000000, 16000000, 64000000 };
+static const char *HISTOGRAM_NAMES[] = { "le_1ms", "le_4ms", "le_16ms", "le_64ms", "gt_64ms" };
+
+// A stage trips its budget after this many consecutive overruns, and is then
+// bypassed for this many frames before being tried again.
+static constexpr unsigned int BUDGET_TRIP_FRAMES = 5;
+static constexpr unsigned int BUDGET_BYPASS_FRAMES = 30;
+
 void PostProcessor::Start()
 {
-	quit_ = false;
+	// Resolve the per-stage timing counters and histograms up front so the
+	// processing threads only pay a relaxed atomic add.
+	stage_timing_.clear();
+	for (unsigned int i = 0; i < stages_.size(); i++)
+	{
+		std::string prefix = std::string("postproc.") + stages_[i]->Name() + ".";
+		StageTiming timing;
+		timing.time_ns = &Stats::Get().Counter(prefix + "ns");
+		timing.frames = &Stats::Get().Counter(prefix + "frames");
+		timing.bypassed = &Stats::Get().Counter(prefix + "bypassed");
+		for (unsigned int b = 0; b < NUM_HISTOGRAM_BUCKETS; b++)
+			timing.histogram[b] = &Stats::Get().Counter(prefix + HISTOGRAM_NAMES[b]);
+		timing.budget_ns = i < stage_budgets_ns_.size() ? stage_budgets_ns_[i] : 0;
+		stage_timing_.push_back(timing);
+	}
+
+	stage_queues_.clear();
+	for (unsigned int i = 0; i < stages_.size(); i++)
+		stage_queues_.push_back(std::make_unique<StageQueue>());
+	output_queue_.quit = false;
+
+	for (unsigned int i = 0; i < stages_.size(); i++)
+		stage_threads_.emplace_back(&PostProcessor::stageThread, this, i);
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
 
 	for (auto &stage : stages_)
@@ -147,66 +297,141 @@ void PostProcessor::Start()
 	}
 }
 
+void PostProcessor::push(StageQueue &queue, PipelineItem &&item)
+{
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.items.push(std::move(item));
+	}
+	queue.cv.notify_one();
+}
+
 void PostProcessor::Process(CompletedRequestPtr &request)
 {
+	// Uncontended in normal running; held by Reconfigure() during a pipeline swap.
+	std::lock_guard<std::mutex> lock(process_mutex_);
+
 	if (stages_.empty())
 	{
 		callback_(request);
 		return;
 	}
 
-	std::unique_lock<std::mutex> l(mutex_);
-	requests_.push(std::move(request)); // caller has given us ownership of this reference
+	PipelineItem item;
+	item.request = std::move(request); // caller has given us ownership of this reference
+	push(*stage_queues_[0], std::move(item));
+}
+
+void PostProcessor::stageThread(unsigned int index)
+{
+	ThreadTuning::Apply((std::string("postproc") + std::to_string(index)).c_str());
+	StageQueue &queue = *stage_queues_[index];
+	StageQueue &next = index + 1 < stage_queues_.size() ? *stage_queues_[index + 1] : output_queue_;
 
-	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
-		bool drop_request = false;
-		for (auto &stage : stages_)
+	while (true)
+	{
+		PipelineItem item;
 		{
-			if (stage->Process(request))
-			{
-				drop_request = true;
+			std::unique_lock<std::mutex> lock(queue.mutex);
+			queue.cv.wait(lock, [&queue] { return queue.quit || !queue.items.empty(); });
+			// Only quit once the queue has been drained, so every frame reaches the output thread.
+			if (queue.items.empty())
 				break;
+			item = std::move(queue.items.front());
+			queue.items.pop();
+		}
+
+		StageTiming &timing = stage_timing_[index];
+		if (item.drop)
+			; // a dropped frame travels the rest of the pipeline untouched (see below)
+		else if (timing.bypass_remaining)
+		{
+			// This stage kept overrunning its budget, so we skip it for a while
+			// rather than let it hold up the whole pipeline. Its feature degrades;
+			// the capture rate does not.
+			timing.bypass_remaining--;
+			timing.bypassed->fetch_add(1, std::memory_order_relaxed);
+			if (!timing.bypass_remaining)
+				timing.over_budget_count = 0; // give the stage another chance
+		}
+		else
+		{
+			uint64_t begin = FrameTrace::Now();
+			bool stage_drop = stages_[index]->Process(item.request);
+			uint64_t end = FrameTrace::Now(), duration = end - begin;
+			if (FrameTrace::Enabled())
+				FrameTrace::Record(stages_[index]->Name(), item.request->sequence, begin, end);
+
+			timing.time_ns->fetch_add(duration, std::memory_order_relaxed);
+			timing.frames->fetch_add(1, std::memory_order_relaxed);
+			unsigned int bucket = 0;
+			while (bucket < NUM_HISTOGRAM_BUCKETS - 1 && duration > HISTOGRAM_BOUNDS_NS[bucket])
+				bucket++;
+			timing.histogram[bucket]->fetch_add(1, std::memory_order_relaxed);
+
+			if (timing.budget_ns)
+			{
+				if (duration <= timing.budget_ns)
+					timing.over_budget_count = 0;
+				else if (++timing.over_budget_count >= BUDGET_TRIP_FRAMES)
+				{
+					timing.bypass_remaining = BUDGET_BYPASS_FRAMES;
+					LOG(1, "Stage " << stages_[index]->Name() << " over budget (" << duration / 1000 << "us > "
+									<< timing.budget_ns / 1000 << "us) for " << timing.over_budget_count
+									<< " frames, bypassing for " << BUDGET_BYPASS_FRAMES << " frames");
+				}
 			}
+
+			// A dropped frame still travels the rest of the pipeline (skipping the
+			// stages) so that the output thread sees frames strictly in order.
+			item.drop = stage_drop;
 		}
-		promise.set_value(drop_request);
-		cv_.notify_one();
-	};
 
-	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
-	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
-	futures_.push(promise.get_future());
-	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
+		push(next, std::move(item));
+	}
 }
 
 void PostProcessor::outputThread()
 {
+	ThreadTuning::Apply("post-proc");
 	while (true)
 	{
-		CompletedRequestPtr request;
-
-		bool drop_request = false;
+		PipelineItem item;
 		{
-			std::unique_lock<std::mutex> l(mutex_);
-
-			cv_.wait(l, [this] {
-				return (quit_ && futures_.empty()) ||
-					   (!futures_.empty() && futures_.front().wait_for(0s) == std::future_status::ready);
-			});
-
-			// Only quit when the futures_ queue is empty.
-			if (quit_ && futures_.empty())
+			std::unique_lock<std::mutex> lock(output_queue_.mutex);
+			output_queue_.cv.wait(lock, [this] { return output_queue_.quit || !output_queue_.items.empty(); });
+			if (output_queue_.items.empty())
 				break;
+			item = std::move(output_queue_.items.front());
+			output_queue_.items.pop();
+		}
 
-			drop_request = futures_.front().get();
-			futures_.pop();
-			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
-			requests_.pop();
+		if (!item.drop)
+			callback_(item.request); // callback can take over ownership from us
+	}
+}
+
+void PostProcessor::stopThreads()
+{
+	// Shut the workers down front to back: each one drains its queue and forwards
+	// everything before exiting, so no in-flight frame is lost.
+	for (unsigned int i = 0; i < stage_threads_.size(); i++)
+	{
+		{
+			std::lock_guard<std::mutex> lock(stage_queues_[i]->mutex);
+			stage_queues_[i]->quit = true;
 		}
+		stage_queues_[i]->cv.notify_one();
+		stage_threads_[i].join();
+	}
+	stage_threads_.clear();
 
-		if (!drop_request)
-			callback_(request); // callback can take over ownership from us
+	{
+		std::lock_guard<std::mutex> lock(output_queue_.mutex);
+		output_queue_.quit = true;
 	}
+	output_queue_.cv.notify_one();
+	output_thread_.join();
 }
 
 void PostProcessor::Stop()
@@ -216,13 +441,17 @@ void PostProcessor::Stop()
 		stage->Stop();
 	}
 
+	stopThreads();
+
+	for (unsigned int i = 0; i < stage_timing_.size(); i++)
 	{
-		std::unique_lock<std::mutex> l(mutex_);
-		quit_ = true;
-		cv_.notify_one();
+		uint64_t frames = stage_timing_[i].frames->load(std::memory_order_relaxed);
+		uint64_t bypassed = stage_timing_[i].bypassed->load(std::memory_order_relaxed);
+		if (frames)
+			LOG(2, "Stage " << stages_[i]->Name() << ": " << frames << " frames, mean "
+							<< stage_timing_[i].time_ns->load(std::memory_order_relaxed) / frames / 1000 << "us"
+							<< (bypassed ? ", " + std::to_string(bypassed) + " bypassed" : ""));
 	}
-
-	output_thread_.join();
 }
 
 void PostProcessor::Teardown()
@@ -7,14 +7,15 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
-#include <future>
 #include <mutex>
 #include <queue>
 
+#include <boost/property_tree/ptree_fwd.hpp>
+
 #include "core/completed_request.hpp"
-#include "core/dl_lib.hpp"
 #include "core/logging.hpp"
 
 namespace libcamera
@@ -41,6 +42,13 @@ public:
 
 	void Read(std::string const &filename);
 
+	// Replace the running stage pipeline with one built from the given file,
+	// without restarting capture. The new stages are constructed and configured
+	// on the side; frames are held up only while the old pipeline drains and
+	// the new one is swapped in. Returns false (leaving the current pipeline
+	// untouched) if the new configuration cannot be read.
+	bool Reconfigure(std::string const &filename);
+
 	void SetCallback(PostProcessorCallback callback);
 
 	void AdjustConfig(std::string const &use_case, StreamConfiguration *config);
@@ -57,17 +65,58 @@ public:
 
 private:
 	PostProcessingStage *createPostProcessingStage(char const *name);
+	void readAppConfig(boost::property_tree::ptree const &node);
+	void readStage(std::string const &name, boost::property_tree::ptree const &params, std::vector<StagePtr> &stages,
+				   std::vector<uint64_t> &budgets);
+	void stopThreads();
 
 	RPiCamApp *app_;
 	std::vector<StagePtr> stages_;
-	std::vector<DlLib> dynamic_stages_;
+	std::mutex process_mutex_; // serializes Process() against Reconfigure()
+
+	// Per-stage timing, preallocated in Start() so the worker threads only pay
+	// relaxed atomic increments. The histogram buckets are bounded by
+	// HISTOGRAM_BOUNDS_NS, with a final unbounded bucket. The budget fields are
+	// touched only by the stage's own worker thread.
+	static constexpr unsigned int NUM_HISTOGRAM_BUCKETS = 5;
+	struct StageTiming
+	{
+		std::atomic<uint64_t> *time_ns;
+		std::atomic<uint64_t> *frames;
+		std::atomic<uint64_t> *bypassed;
+		std::atomic<uint64_t> *histogram[NUM_HISTOGRAM_BUCKETS];
+		uint64_t budget_ns = 0;
+		unsigned int over_budget_count = 0; // consecutive frames over budget
+		unsigned int bypass_remaining = 0;
+	};
+	std::vector<StageTiming> stage_timing_; // parallel to stages_
+	std::vector<uint64_t> stage_budgets_ns_; // parallel to stages_, 0 means no budget
+
+	// The stages form a pipeline: every stage has its own worker thread and
+	// input queue, so stage i works on frame N while stage i-1 works on frame
+	// N+1, and throughput is set by the slowest stage rather than the sum of
+	// them all. Frames travel every queue in order (even dropped ones, as
+	// markers), which keeps the output callback strictly ordered. The number
+	// of frames in flight is naturally bounded by the camera buffer count.
+	struct PipelineItem
+	{
+		CompletedRequestPtr request;
+		bool drop = false;
+	};
+	struct StageQueue
+	{
+		std::queue<PipelineItem> items;
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool quit = false;
+	};
+	void stageThread(unsigned int index);
 	void outputThread();
+	static void push(StageQueue &queue, PipelineItem &&item);
 
-	std::queue<CompletedRequestPtr> requests_;
-	std::queue<std::future<bool>> futures_;
+	std::vector<std::unique_ptr<StageQueue>> stage_queues_; // parallel to stages_
+	StageQueue output_queue_;
+	std::vector<std::thread> stage_threads_;
 	std::thread output_thread_;
-	bool quit_;
 	PostProcessorCallback callback_;
-	std::mutex mutex_;
-	std::condition_variable cv_;
 };
@@ -7,13 +7,22 @@
 
 #include "preview/preview.hpp"
 
+#include "core/block_pool.hpp"
 #include "core/frame_info.hpp"
+#include "core/frame_trace.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/options.hpp"
+#include "core/stats.hpp"
+#include "core/thread_tuning.hpp"
 
 #include <cmath>
 #include <fcntl.h>
+#include <filesystem>
+#include <fstream>
 #include <stdlib.h>
+#include <thread>
+
+#include <sys/utsname.h>
 
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -25,6 +34,7 @@
 #include <libcamera/orientation.h>
 
 unsigned int RPiCamApp::verbosity = 1;
+std::atomic<uint64_t> RPiCamApp::sync_timestamp_base_ = { 0 };
 
 static libcamera::PixelFormat mode_to_pixel_format(Mode const &mode)
 {
@@ -76,6 +86,111 @@ static void set_pipeline_configuration(Platform platform)
 	}
 }
 
+// Enumerating the sensor modes requires us to configure the sensor once per mode
+// when a framerate has been requested, which dominates a cold start. The mode table
+// only changes with the sensor or the kernel, so we cache it on disk keyed by both.
+
+static std::string sensor_mode_cache_file(const std::string &cam_id)
+{
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	std::string base;
+	if (cache_home && cache_home[0])
+		base = cache_home;
+	else
+	{
+		const char *home = getenv("HOME");
+		if (!home || !home[0])
+			return {};
+		base = std::string(home) + "/.cache";
+	}
+
+	utsname uts;
+	if (uname(&uts) < 0)
+		return {};
+
+	std::string id(cam_id);
+	std::replace(id.begin(), id.end(), '/', '_');
+	return base + "/rpicam-apps/sensor_modes-" + id + "-" + uts.release + ".txt";
+}
+
+static bool load_sensor_mode_cache(const std::string &cam_id, bool need_fps,
+								   std::vector<RPiCamApp::SensorMode> &sensor_modes)
+{
+	std::string file = sensor_mode_cache_file(cam_id);
+	if (file.empty())
+		return false;
+
+	std::ifstream ifs(file);
+	if (!ifs)
+		return false;
+
+	// The header records whether framerates were probed when the cache was written.
+	std::string header;
+	if (!std::getline(ifs, header) || (header != "fps" && header != "nofps"))
+		return false;
+	if (need_fps && header != "fps")
+		return false;
+
+	std::vector<RPiCamApp::SensorMode> modes;
+	std::string line;
+	while (std::getline(ifs, line))
+	{
+		char fmt[32];
+		unsigned int w, h;
+		double fps;
+		if (sscanf(line.c_str(), "%31s %u %u %lf", fmt, &w, &h, &fps) != 4)
+			return false;
+		libcamera::PixelFormat pix = libcamera::PixelFormat::fromString(fmt);
+		if (!pix.isValid())
+			return false;
+		modes.emplace_back(libcamera::Size(w, h), pix, fps);
+	}
+
+	if (modes.empty())
+		return false;
+
+	sensor_modes = std::move(modes);
+	LOG(2, "Loaded " << sensor_modes.size() << " sensor modes from cache");
+	return true;
+}
+
+static void save_sensor_mode_cache(const std::string &cam_id, bool have_fps,
+								   std::vector<RPiCamApp::SensorMode> const &sensor_modes)
+{
+	std::string file = sensor_mode_cache_file(cam_id);
+	if (file.empty())
+		return;
+
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(file).parent_path(), ec);
+	if (ec)
+		return;
+
+	// Write to a temporary file and rename so a concurrent start never sees a partial cache.
+	std::string tmp = file + ".tmp" + std::to_string(getpid());
+	std::ofstream ofs(tmp);
+	if (!ofs)
+		return;
+
+	ofs << (have_fps ? "fps" : "nofps") << "\n";
+	for (auto const &mode : sensor_modes)
+		ofs << mode.format.toString() << " " << mode.size.width << " " << mode.size.height << " " << mode.fps << "\n";
+	ofs.close();
+
+	if (!ofs || ::rename(tmp.c_str(), file.c_str()) < 0)
+		::unlink(tmp.c_str());
+}
+
+// CompletedRequests are created and destroyed once per frame; recycle their
+// storage rather than going back to the heap every time. An application can
+// still hold one past StopCamera(), so the pool outlives any single camera
+// session.
+static BlockPool &completed_request_pool()
+{
+	static BlockPool pool(sizeof(CompletedRequest));
+	return pool;
+}
+
 RPiCamApp::RPiCamApp(std::unique_ptr<Options> opts)
 	: options_(std::move(opts)), controls_(controls::controls), post_processor_(this)
 {
@@ -99,6 +214,9 @@ RPiCamApp::RPiCamApp(std::unique_ptr<Options> opts)
 	}
 
 	set_pipeline_configuration(platform);
+
+	Stats::Get().SetGauge("frames.dropped.backpressure", [this] { return msg_queue_.Dropped(); });
+	Stats::Get().SetGauge("frames.dropped.preview", [this] { return (uint64_t)preview_frames_dropped_; });
 }
 
 RPiCamApp::~RPiCamApp()
@@ -107,6 +225,8 @@ RPiCamApp::~RPiCamApp()
 		LOG(2, "Closing RPiCam application"
 				   << "(frames displayed " << preview_frames_displayed_ << ", dropped " << preview_frames_dropped_
 				   << ")");
+	Stats::Get().RemoveGauge("frames.dropped.backpressure");
+	Stats::Get().RemoveGauge("frames.dropped.preview");
 	StopCamera();
 	Teardown();
 	CloseCamera();
@@ -114,11 +234,23 @@ RPiCamApp::~RPiCamApp()
 
 void RPiCamApp::initCameraManager()
 {
+	// A single CameraManager is shared by every RPiCamApp instance in the process,
+	// so that multi-camera applications pay for startup and enumeration only once.
+	// The manager is restarted only when no other instance still holds it.
+	static std::mutex cm_mutex;
+	static std::weak_ptr<CameraManager> cm_singleton;
+
+	std::lock_guard<std::mutex> lock(cm_mutex);
 	camera_manager_.reset();
-	camera_manager_ = std::make_unique<CameraManager>();
+	camera_manager_ = cm_singleton.lock();
+	if (camera_manager_)
+		return;
+
+	camera_manager_ = std::make_shared<CameraManager>();
 	int ret = camera_manager_->start();
 	if (ret)
 		throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+	cm_singleton = camera_manager_;
 }
 
 std::string const &RPiCamApp::CameraId() const
@@ -134,84 +266,141 @@ std::string RPiCamApp::CameraModel() const
 
 void RPiCamApp::OpenCamera()
 {
-	// Make a preview window.
-	preview_ = std::unique_ptr<Preview>(make_preview(RPiCamApp::GetOptions()));
-	preview_->SetDoneCallback(std::bind(&RPiCamApp::previewDoneCallback, this, std::placeholders::_1));
+	// Opening the camera device, making the preview window and loading the
+	// post-processing modules are independent, and each can take hundreds of
+	// milliseconds (EGL/DRM setup, dlopen and JSON parsing, sensor probing).
+	// Run the latter two on worker threads while this thread talks to the
+	// camera, and rendezvous before returning so nothing runs before
+	// StartCamera() with the workers still going.
+
+	std::exception_ptr preview_error, postproc_error;
+	std::thread preview_thread(
+		[this, &preview_error]()
+		{
+			try
+			{
+				preview_ = std::unique_ptr<Preview>(make_preview(RPiCamApp::GetOptions()));
+				preview_->SetDoneCallback(std::bind(&RPiCamApp::previewDoneCallback, this, std::placeholders::_1));
+			}
+			catch (...)
+			{
+				preview_error = std::current_exception();
+			}
+		});
+	std::thread postproc_thread(
+		[this, &postproc_error]()
+		{
+			try
+			{
+				if (!options_->Get().post_process_file.empty())
+				{
+					post_processor_.LoadModules(options_->Get().post_process_libs);
+					post_processor_.Read(options_->Get().post_process_file);
+				}
+			}
+			catch (...)
+			{
+				postproc_error = std::current_exception();
+			}
+		});
+	auto rendezvous = [&]()
+	{
+		preview_thread.join();
+		postproc_thread.join();
+		if (preview_error)
+			std::rethrow_exception(preview_error);
+		if (postproc_error)
+			std::rethrow_exception(postproc_error);
+	};
 
 	LOG(2, "Opening camera...");
 
-	if (!camera_manager_)
-		initCameraManager();
+	try
+	{
+		if (!camera_manager_)
+			initCameraManager();
 
-	std::vector<std::shared_ptr<libcamera::Camera>> cameras = GetCameras();
-	if (cameras.size() == 0)
-		throw std::runtime_error("no cameras available");
+		std::vector<std::shared_ptr<libcamera::Camera>> cameras = GetCameras();
+		if (cameras.size() == 0)
+			throw std::runtime_error("no cameras available");
 
-	if (options_->Get().camera >= cameras.size())
-		throw std::runtime_error("selected camera is not available");
+		if (options_->Get().camera >= cameras.size())
+			throw std::runtime_error("selected camera is not available");
 
-	std::string const &cam_id = cameras[options_->Get().camera]->id();
-	camera_ = camera_manager_->get(cam_id);
-	if (!camera_)
-		throw std::runtime_error("failed to find camera " + cam_id);
+		std::string const &cam_id = cameras[options_->Get().camera]->id();
+		camera_ = camera_manager_->get(cam_id);
+		if (!camera_)
+			throw std::runtime_error("failed to find camera " + cam_id);
 
-	if (camera_->acquire())
-		throw std::runtime_error("failed to acquire camera " + cam_id);
-	camera_acquired_ = true;
+		if (camera_->acquire())
+			throw std::runtime_error("failed to acquire camera " + cam_id);
+		camera_acquired_ = true;
 
-	LOG(2, "Acquired camera " << cam_id);
+		LOG(2, "Acquired camera " << cam_id);
 
-	if (!options_->Get().post_process_file.empty())
-	{
-		post_processor_.LoadModules(options_->Get().post_process_libs);
-		post_processor_.Read(options_->Get().post_process_file);
-	}
-	// The queue takes over ownership from the post-processor.
-	post_processor_.SetCallback(
-		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
+		// We're going to make a list of all the available sensor modes, but we only populate
+		// the framerate field if the user has requested a framerate (as this requires us actually
+		// to configure the sensor, which is otherwise best avoided). A warm start can skip the
+		// probing entirely if the on-disk cache for this sensor and kernel is still valid.
 
-	// We're going to make a list of all the available sensor modes, but we only populate
-	// the framerate field if the user has requested a framerate (as this requires us actually
-	// to configure the sensor, which is otherwise best avoided).
+		bool need_fps = !!options_->Get().framerate;
+		if (!load_sensor_mode_cache(cam_id, need_fps, sensor_modes_))
+		{
+			std::unique_ptr<CameraConfiguration> config =
+				camera_->generateConfiguration({ libcamera::StreamRole::Raw });
+			const libcamera::StreamFormats &formats = config->at(0).formats();
 
-	std::unique_ptr<CameraConfiguration> config = camera_->generateConfiguration({ libcamera::StreamRole::Raw });
-	const libcamera::StreamFormats &formats = config->at(0).formats();
+			bool log_env_set = getenv("LIBCAMERA_LOG_LEVELS");
+			// Suppress log messages when enumerating camera modes.
+			if (!log_env_set)
+			{
+				libcamera::logSetLevel("RPI", "ERROR");
+				libcamera::logSetLevel("Camera", "ERROR");
+			}
 
-	bool log_env_set = getenv("LIBCAMERA_LOG_LEVELS");
-	// Suppress log messages when enumerating camera modes.
-	if (!log_env_set)
-	{
-		libcamera::logSetLevel("RPI", "ERROR");
-		libcamera::logSetLevel("Camera", "ERROR");
-	}
+			for (const auto &pix : formats.pixelformats())
+			{
+				for (const auto &size : formats.sizes(pix))
+				{
+					double framerate = 0;
+					if (options_->Get().framerate)
+					{
+						SensorMode sensorMode(size, pix, 0);
+						config->at(0).size = size;
+						config->at(0).pixelFormat = pix;
+						config->sensorConfig = libcamera::SensorConfiguration();
+						config->sensorConfig->outputSize = size;
+						config->sensorConfig->bitDepth = sensorMode.depth();
+						config->validate();
+						camera_->configure(config.get());
+						auto fd_ctrl = camera_->controls().find(&controls::FrameDurationLimits);
+						framerate = 1.0e6 / fd_ctrl->second.min().get<int64_t>();
+					}
+					sensor_modes_.emplace_back(size, pix, framerate);
+				}
+			}
 
-	for (const auto &pix : formats.pixelformats())
-	{
-		for (const auto &size : formats.sizes(pix))
-		{
-			double framerate = 0;
-			if (options_->Get().framerate)
+			if (!log_env_set)
 			{
-				SensorMode sensorMode(size, pix, 0);
-				config->at(0).size = size;
-				config->at(0).pixelFormat = pix;
-				config->sensorConfig = libcamera::SensorConfiguration();
-				config->sensorConfig->outputSize = size;
-				config->sensorConfig->bitDepth = sensorMode.depth();
-				config->validate();
-				camera_->configure(config.get());
-				auto fd_ctrl = camera_->controls().find(&controls::FrameDurationLimits);
-				framerate = 1.0e6 / fd_ctrl->second.min().get<int64_t>();
+				libcamera::logSetLevel("RPI", "INFO");
+				libcamera::logSetLevel("Camera", "INFO");
 			}
-			sensor_modes_.emplace_back(size, pix, framerate);
+
+			save_sensor_mode_cache(cam_id, need_fps, sensor_modes_);
 		}
 	}
-
-	if (!log_env_set)
+	catch (...)
 	{
-		libcamera::logSetLevel("RPI", "INFO");
-		libcamera::logSetLevel("Camera", "INFO");
+		// Don't leave the workers running (touching members) past a throw.
+		preview_thread.join();
+		postproc_thread.join();
+		throw;
 	}
+
+	rendezvous();
+	// The queue takes over ownership from the post-processor.
+	post_processor_.SetCallback(
+		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
 }
 
 void RPiCamApp::CloseCamera()
@@ -279,6 +468,15 @@ Mode RPiCamApp::selectMode(const Mode &mode) const
 	return { best_mode.size.width, best_mode.size.height, best_mode.depth(), mode.packed };
 }
 
+unsigned int RPiCamApp::rawBufferCount(unsigned int main_count) const
+{
+	// Raw sensor buffers dominate the CMA footprint, so the raw stream may be
+	// configured with a shallower queue than the other streams; requests beyond
+	// its depth then simply carry no raw buffer.
+	unsigned int count = options_->Get().raw_buffer_count;
+	return count > 0 ? std::min(count, main_count) : main_count;
+}
+
 void RPiCamApp::ConfigureViewfinder()
 {
 	LOG(2, "Configuring viewfinder...");
@@ -349,7 +547,7 @@ void RPiCamApp::ConfigureViewfinder()
 
 		configuration_->at(raw_stream_num).size = options_->Get().viewfinder_mode.Size();
 		configuration_->at(raw_stream_num).pixelFormat = mode_to_pixel_format(options_->Get().viewfinder_mode);
-		configuration_->at(raw_stream_num).bufferCount = configuration_->at(0).bufferCount;
+		configuration_->at(raw_stream_num).bufferCount = rawBufferCount(configuration_->at(0).bufferCount);
 		configuration_->sensorConfig = libcamera::SensorConfiguration();
 		configuration_->sensorConfig->outputSize = options_->Get().viewfinder_mode.Size();
 		configuration_->sensorConfig->bitDepth = options_->Get().viewfinder_mode.bit_depth;
@@ -358,10 +556,20 @@ void RPiCamApp::ConfigureViewfinder()
 	configuration_->orientation = libcamera::Orientation::Rotate0 * options_->Get().transform;
 
 	post_processor_.AdjustConfig("viewfinder", &configuration_->at(0));
+	// Stages consuming the lores stream get a chance to ask for it in another
+	// format (typically RGB), pushing the conversion into the ISP.
+	if (have_lores_stream)
+		post_processor_.AdjustConfig("lores", &configuration_->at(lores_stream_num));
+	PixelFormat lores_requested =
+		have_lores_stream ? configuration_->at(lores_stream_num).pixelFormat : PixelFormat();
 
 	configureDenoise(options_->Get().denoise == "auto" ? "cdn_off" : options_->Get().denoise);
 	setupCapture();
 
+	if (have_lores_stream && configuration_->at(lores_stream_num).pixelFormat != lores_requested)
+		LOG(1, "Lores stream adjusted to " << configuration_->at(lores_stream_num).pixelFormat << " (requested "
+										   << lores_requested << "), stages will convert in software");
+
 	streams_["viewfinder"] = configuration_->at(0).stream();
 	if (have_lores_stream)
 		streams_["lores"] = configuration_->at(lores_stream_num).stream();
@@ -416,7 +624,7 @@ void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 		configuration_->sensorConfig = libcamera::SensorConfiguration();
 		configuration_->sensorConfig->outputSize = options_->Get().mode.Size();
 		configuration_->sensorConfig->bitDepth = options_->Get().mode.bit_depth;
-		configuration_->at(2).bufferCount = configuration_->at(0).bufferCount;
+		configuration_->at(2).bufferCount = rawBufferCount(configuration_->at(0).bufferCount);
 	}
 
 	Size size(1280, 960);
@@ -475,9 +683,13 @@ void RPiCamApp::ConfigureStill(unsigned int flags)
 	// Always request a raw stream as this forces the full resolution capture mode,
 	// unless the no-raw option is used.
 	// (options_->Get().mode can override the choice of camera mode, however.)
+	bool have_lores_stream = options_->Get().lores_width && options_->Get().lores_height;
 	StreamRoles stream_roles = { StreamRole::StillCapture };
+	int lores_index = 1;
 	if (!options_->Get().no_raw)
-		stream_roles.push_back(StreamRole::Raw);
+		stream_roles.push_back(StreamRole::Raw), lores_index++;
+	if (have_lores_stream)
+		stream_roles.push_back(StreamRole::Viewfinder);
 	configuration_ = camera_->generateConfiguration(stream_roles);
 	if (!configuration_)
 		throw std::runtime_error("failed to generate still capture configuration");
@@ -518,15 +730,39 @@ void RPiCamApp::ConfigureStill(unsigned int flags)
 		configuration_->sensorConfig = libcamera::SensorConfiguration();
 		configuration_->sensorConfig->outputSize = options_->Get().mode.Size();
 		configuration_->sensorConfig->bitDepth = options_->Get().mode.bit_depth;
-		configuration_->at(1).bufferCount = configuration_->at(0).bufferCount;
+		configuration_->at(1).bufferCount = rawBufferCount(configuration_->at(0).bufferCount);
+	}
+
+	if (have_lores_stream)
+	{
+		// A hardware-scaled companion image from the ISP - rpicam-still uses it
+		// as the EXIF thumbnail source so the thumbnail never needs a software
+		// downscale of the full resolution frame.
+		Size lores_size(options_->Get().lores_width, options_->Get().lores_height);
+		lores_size.alignDownTo(2, 2);
+		if (lores_size.width > configuration_->at(0).size.width ||
+			lores_size.height > configuration_->at(0).size.height)
+			throw std::runtime_error("Low res image larger than still capture");
+		configuration_->at(lores_index).pixelFormat = lores_format_;
+		configuration_->at(lores_index).size = lores_size;
+		configuration_->at(lores_index).bufferCount = configuration_->at(0).bufferCount;
+		configuration_->at(lores_index).colorSpace = configuration_->at(0).colorSpace;
+		post_processor_.AdjustConfig("lores", &configuration_->at(lores_index));
 	}
+	PixelFormat lores_requested = have_lores_stream ? configuration_->at(lores_index).pixelFormat : PixelFormat();
 
 	configureDenoise(options_->Get().denoise == "auto" ? "cdn_hq" : options_->Get().denoise);
 	setupCapture();
 
+	if (have_lores_stream && configuration_->at(lores_index).pixelFormat != lores_requested)
+		LOG(1, "Lores stream adjusted to " << configuration_->at(lores_index).pixelFormat << " (requested "
+										   << lores_requested << "), stages will convert in software");
+
 	streams_["still"] = configuration_->at(0).stream();
 	if (!options_->Get().no_raw)
 		streams_["raw"] = configuration_->at(1).stream();
+	if (have_lores_stream)
+		streams_["lores"] = configuration_->at(lores_index).stream();
 
 	post_processor_.Configure();
 
@@ -578,7 +814,7 @@ void RPiCamApp::ConfigureVideo(unsigned int flags)
 		configuration_->sensorConfig = libcamera::SensorConfiguration();
 		configuration_->sensorConfig->outputSize = options_->Get().mode.Size();
 		configuration_->sensorConfig->bitDepth = options_->Get().mode.bit_depth;
-		configuration_->at(1).bufferCount = configuration_->at(0).bufferCount;
+		configuration_->at(1).bufferCount = rawBufferCount(configuration_->at(0).bufferCount);
 	}
 
 	if (have_lores_stream)
@@ -592,12 +828,20 @@ void RPiCamApp::ConfigureVideo(unsigned int flags)
 		configuration_->at(lores_index).size = lores_size;
 		configuration_->at(lores_index).bufferCount = configuration_->at(0).bufferCount;
 		configuration_->at(lores_index).colorSpace = configuration_->at(0).colorSpace;
+		// Stages consuming the lores stream get a chance to ask for it in
+		// another format (typically RGB), pushing the conversion into the ISP.
+		post_processor_.AdjustConfig("lores", &configuration_->at(lores_index));
 	}
+	PixelFormat lores_requested = have_lores_stream ? configuration_->at(lores_index).pixelFormat : PixelFormat();
 	configuration_->orientation = libcamera::Orientation::Rotate0 * options_->Get().transform;
 
 	configureDenoise(options_->Get().denoise == "auto" ? "cdn_fast" : options_->Get().denoise);
 	setupCapture();
 
+	if (have_lores_stream && configuration_->at(lores_index).pixelFormat != lores_requested)
+		LOG(1, "Lores stream adjusted to " << configuration_->at(lores_index).pixelFormat << " (requested "
+										   << lores_requested << "), stages will convert in software");
+
 	streams_["video"] = configuration_->at(0).stream();
 	if (!options_->Get().no_raw)
 		streams_["raw"] = configuration_->at(1).stream();
@@ -631,6 +875,12 @@ void RPiCamApp::Teardown()
 
 	frame_buffers_.clear();
 
+	// The buffers go back to the dma-heap arena, not to the kernel, so the next
+	// configuration can re-use the same CMA memory.
+	dma_heap_.releaseBuffers();
+
+	Stats::Get().RemoveGauge("buffers.dmabuf_bytes");
+
 	streams_.clear();
 }
 
@@ -818,6 +1068,19 @@ void RPiCamApp::StartCamera()
 	LOG(2, "Camera started!");
 }
 
+bool RPiCamApp::ReconfigurePostProcessing(std::string const &filename)
+{
+	const std::string &file = filename.empty() ? options_->Get().post_process_file : filename;
+	if (file.empty())
+	{
+		LOG_ERROR("No post processing file to reconfigure from");
+		return false;
+	}
+
+	LOG(1, "Reconfiguring post processing from " << file);
+	return post_processor_.Reconfigure(file);
+}
+
 void RPiCamApp::StopCamera()
 {
 	{
@@ -880,7 +1143,8 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 	}
 
 	Request *request = completed_request->request;
-	delete completed_request;
+	completed_request->~CompletedRequest();
+	completed_request_pool().Free(completed_request, sizeof(CompletedRequest));
 	assert(request);
 
 	if (!camera_started_ || !request_found)
@@ -888,16 +1152,7 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 
 	for (auto const &p : buffers)
 	{
-		struct dma_buf_sync dma_sync {};
-		dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
-
-		auto it = mapped_buffers_.find(p.second);
-		if (it == mapped_buffers_.end())
-			throw std::runtime_error("failed to identify queue request buffer");
-
-		int ret = ::ioctl(p.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-		if (ret)
-			throw std::runtime_error("failed to sync dma buf on queue request");
+		BufferSync::EndReadSync(this, p.first, p.second);
 
 		if (request->addBuffer(p.first, p.second) < 0)
 			throw std::runtime_error("failed to add buffer to request in QueueRequest");
@@ -973,6 +1228,33 @@ const libcamera::CameraManager *RPiCamApp::GetCameraManager()
 
 void RPiCamApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stream)
 {
+	// When requested, present the lores stream instead of the one the app
+	// nominated: at 4K capture the preview path then touches a quarter (or
+	// less) of the memory, and the display scales it up just the same.
+	if (options_->Get().lores_preview)
+	{
+		Stream *lores = LoresStream();
+		if (lores && completed_request->buffers.count(lores))
+			stream = lores;
+	}
+
+	// If recent renders have been taking longer than a frame interval, skip
+	// submissions proactively so the preview degrades to a stable lower rate
+	// instead of dropping in bursts. The credit accumulator earns one frame
+	// interval per frame and spends one (measured) render time per submission.
+	double interval_ns = completed_request->framerate ? 1e9 / completed_request->framerate : 0.0;
+	double render_ns = preview_render_time_ns_.load(std::memory_order_relaxed);
+	if (interval_ns && render_ns > interval_ns)
+	{
+		preview_credit_ns_ += interval_ns;
+		if (preview_credit_ns_ < render_ns)
+		{
+			preview_frames_dropped_++;
+			return;
+		}
+		preview_credit_ns_ -= render_ns;
+	}
+
 	std::lock_guard<std::mutex> lock(preview_item_mutex_);
 	if (!preview_item_.stream)
 		preview_item_ = PreviewItem(completed_request, stream); // copy the shared_ptr here
@@ -981,6 +1263,11 @@ void RPiCamApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stre
 	preview_cond_var_.notify_one();
 }
 
+bool RPiCamApp::SetPreviewOverlay(uint8_t const *argb, unsigned int width, unsigned int height, unsigned int stride)
+{
+	return preview_ && preview_->SetOverlay(argb, width, height, stride);
+}
+
 void RPiCamApp::SetControls(const ControlList &controls)
 {
 	std::lock_guard<std::mutex> lock(control_mutex_);
@@ -1026,6 +1313,7 @@ void RPiCamApp::setupCapture()
 
 	// Next allocate all the buffers we need, mmap them and store them on a free list.
 
+	uint64_t total_dmabuf_bytes = 0;
 	for (StreamConfiguration &config : *configuration_)
 	{
 		Stream *stream = config.stream();
@@ -1034,25 +1322,39 @@ void RPiCamApp::setupCapture()
 		for (unsigned int i = 0; i < config.bufferCount; i++)
 		{
 			std::string name("rpicam-apps" + std::to_string(i));
-			libcamera::UniqueFD fd = dma_heap_.alloc(name.c_str(), config.frameSize);
+			libcamera::SharedFD fd = dma_heap_.acquire(name.c_str(), config.frameSize);
 
 			if (!fd.isValid())
 				throw std::runtime_error("failed to allocate capture buffers for stream");
 
 			std::vector<FrameBuffer::Plane> plane(1);
-			plane[0].fd = libcamera::SharedFD(std::move(fd));
+			plane[0].fd = std::move(fd);
 			plane[0].offset = 0;
 			plane[0].length = config.frameSize;
 
 			fb.push_back(std::make_unique<FrameBuffer>(plane));
-			void *memory = mmap(NULL, config.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, plane[0].fd.get(), 0);
+			// MAP_POPULATE prefaults the whole mapping now, so the first frames
+			// through a new configuration don't take page faults in the
+			// post-processing or encode paths.
+			int mmap_flags = MAP_SHARED;
+			if (options_->Get().prefault_buffers)
+				mmap_flags |= MAP_POPULATE;
+			void *memory = mmap(NULL, config.frameSize, PROT_READ | PROT_WRITE, mmap_flags, plane[0].fd.get(), 0);
 			mapped_buffers_[fb.back().get()].push_back(
 						libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), config.frameSize));
 		}
 
 		frame_buffers_[stream] = std::move(fb);
+
+		uint64_t stream_bytes = (uint64_t)config.bufferCount * config.frameSize;
+		total_dmabuf_bytes += stream_bytes;
+		LOG(2, "Stream " << config.toString() << ": " << config.bufferCount << " buffers, " << (stream_bytes >> 10)
+						 << " kB of dma-buf memory");
 	}
-	LOG(2, "Buffers allocated and mapped");
+	LOG(2, "Buffers allocated and mapped (" << (total_dmabuf_bytes >> 10) << " kB of dma-buf memory in total)");
+	// Published so the CMA budget of a running multi-camera box can be audited
+	// per process through the stats socket.
+	Stats::Get().SetGauge("buffers.dmabuf_bytes", [total_dmabuf_bytes] { return total_dmabuf_bytes; });
 
 	startPreview();
 
@@ -1088,7 +1390,14 @@ void RPiCamApp::makeRequests()
 				requests_.push_back(std::move(request));
 			}
 			else if (free_buffers[stream].empty())
+			{
+				// A stream configured with a shallower queue (--raw-buffer-count)
+				// runs out first; it just drops out of the remaining requests and
+				// delivers only on the frames that carry one of its buffers.
+				if (config.bufferCount < configuration_->at(0).bufferCount)
+					continue;
 				throw std::runtime_error("concurrent streams need matching numbers of buffers");
+			}
 
 			FrameBuffer *buffer = free_buffers[stream].front();
 			free_buffers[stream].pop();
@@ -1110,21 +1419,18 @@ void RPiCamApp::requestComplete(Request *request)
 		return;
 	}
 
-	struct dma_buf_sync dma_sync {};
-	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
-	for (auto const &buffer_map : request->buffers())
-	{
-		auto it = mapped_buffers_.find(buffer_map.second);
-		if (it == mapped_buffers_.end())
-			throw std::runtime_error("failed to identify request complete buffer");
+	BufferSync::StartReadSync(this, request);
 
-		int ret = ::ioctl(buffer_map.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-		if (ret)
-			throw std::runtime_error("failed to sync dma buf on request complete");
-	}
+	static std::atomic<uint64_t> &frames_captured = Stats::Get().Counter("frames.captured");
+	frames_captured.fetch_add(1, std::memory_order_relaxed);
 
-	CompletedRequest *r = new CompletedRequest(sequence_++, request);
-	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
+	// Requests recycle through a pool, and the allocator puts the shared_ptr
+	// control block there too, so the steady-state capture loop performs no
+	// heap allocations per frame.
+	CompletedRequest *r =
+		new (completed_request_pool().Allocate(sizeof(CompletedRequest))) CompletedRequest(sequence_++, request);
+	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); },
+								PoolAllocator<CompletedRequest>());
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
 		completed_requests_.insert(r);
@@ -1145,6 +1451,12 @@ void RPiCamApp::requestComplete(Request *request)
 		payload->framerate = 1e9 / (timestamp - last_timestamp_);
 	last_timestamp_ = timestamp;
 
+	uint64_t expected = 0;
+	sync_timestamp_base_.compare_exchange_strong(expected, timestamp, std::memory_order_relaxed);
+
+	if (FrameTrace::Enabled())
+		FrameTrace::Record("capture", payload->sequence, timestamp, FrameTrace::Now());
+
 	post_processor_.Process(payload); // post-processor can re-use our shared_ptr
 }
 
@@ -1155,6 +1467,17 @@ void RPiCamApp::previewDoneCallback(int fd)
 	if (it == preview_completed_requests_.end())
 		throw std::runtime_error("previewDoneCallback: missing fd " + std::to_string(fd));
 	preview_completed_requests_.erase(it); // drop shared_ptr reference
+
+	// Fold the measured render duration into a moving average which
+	// ShowPreview() uses to pace its submissions.
+	auto ts = preview_show_times_.find(fd);
+	if (ts != preview_show_times_.end())
+	{
+		uint64_t duration = FrameTrace::Now() - ts->second;
+		preview_show_times_.erase(ts);
+		uint64_t avg = preview_render_time_ns_.load(std::memory_order_relaxed);
+		preview_render_time_ns_.store(avg ? (7 * avg + duration) / 8 : duration, std::memory_order_relaxed);
+	}
 }
 
 void RPiCamApp::startPreview()
@@ -1176,10 +1499,12 @@ void RPiCamApp::stopPreview()
 	preview_thread_.join();
 	preview_item_ = PreviewItem();
 	preview_completed_requests_.clear();
+	preview_show_times_.clear();
 }
 
 void RPiCamApp::previewThread()
 {
+	ThreadTuning::Apply("preview");
 	while (true)
 	{
 		PreviewItem item;
@@ -1213,6 +1538,7 @@ void RPiCamApp::previewThread()
 			std::lock_guard<std::mutex> lock(preview_mutex_);
 			// the reference to the shared_ptr moves to the map here
 			preview_completed_requests_[fd] = std::move(item.completed_request);
+			preview_show_times_[fd] = FrameTrace::Now();
 		}
 		if (preview_->Quit())
 		{
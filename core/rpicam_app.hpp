@@ -7,12 +7,18 @@
 
 #pragma once
 
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
+#include <array>
+#include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
 #include <sstream>
@@ -77,6 +83,14 @@ public:
 		MsgType type;
 		MsgPayload payload;
 	};
+	// Policy for what to do when completed requests back up beyond the
+	// configured in-flight depth limit.
+	enum class DropPolicy
+	{
+		Block, // wait for the consumer to make space
+		DropOldest, // recycle the oldest unprocessed frame immediately
+		DropNewest, // recycle the frame that has just completed
+	};
 	struct SensorMode
 	{
 		SensorMode()
@@ -144,9 +158,31 @@ public:
 	void StartCamera();
 	void StopCamera();
 
+	// Swap the post-processing pipeline for one read from the given file (or
+	// re-read the configured --post-process-file if none is given) without
+	// stopping the camera. Returns false if the new configuration is unusable,
+	// in which case the current pipeline keeps running.
+	bool ReconfigurePostProcessing(std::string const &filename = "");
+
 	Msg Wait();
 	void PostMessage(MsgType &t, MsgPayload &p);
 
+	// For event loops that multiplex the camera with other file descriptors:
+	// the eventfd becomes readable whenever a message is waiting, after which
+	// TryWait() drains the queue without blocking. Fetch the fd before starting
+	// the camera so that no message can be posted before it exists.
+	int GetMsgEventFd() { return msg_queue_.GetEventFd(); }
+	std::optional<Msg> TryWait() { return msg_queue_.TryWait(); }
+
+	// Bound the number of unprocessed completed requests. When the encoder or
+	// post-processor falls behind, frames are recycled according to the policy
+	// (their buffers go straight back to the camera) rather than queuing up.
+	void SetQueueDepthLimit(unsigned int depth, DropPolicy policy)
+	{
+		msg_queue_.SetDepthLimit(depth, policy, [](Msg const &msg) { return msg.type == MsgType::RequestComplete; });
+	}
+	uint64_t FramesDropped() const { return msg_queue_.Dropped(); }
+
 	Stream *GetStream(std::string const &name, StreamInfo *info = nullptr) const;
 	Stream *ViewfinderStream(StreamInfo *info = nullptr) const;
 	Stream *StillStream(StreamInfo *info = nullptr) const;
@@ -162,6 +198,10 @@ public:
 	}
 
 	void ShowPreview(CompletedRequestPtr &completed_request, Stream *stream);
+	// Hand an ARGB8888 overlay image to the preview window, for annotations
+	// that should be composited by the display rather than burned into the
+	// stream. Returns false if the preview can't composite overlays.
+	bool SetPreviewOverlay(uint8_t const *argb, unsigned int width, unsigned int height, unsigned int stride);
 
 	void SetControls(const ControlList &controls);
 	StreamInfo GetStreamInfo(Stream const *stream) const;
@@ -173,6 +213,11 @@ public:
 	static unsigned int verbosity;
 	static unsigned int GetVerbosity() { return verbosity; }
 
+	// All cameras in the process stamp frames from the same clock. The first
+	// frame completed by any camera records a common base, giving multi-camera
+	// applications a shared timeline for hardware-level frame pairing.
+	static uint64_t GetSyncTimestampBase() { return sync_timestamp_base_.load(std::memory_order_relaxed); }
+
 	static std::vector<std::shared_ptr<libcamera::Camera>> GetCameras(const CameraManager *cm)
 	{
 		std::vector<std::shared_ptr<libcamera::Camera>> cameras = cm->cameras();
@@ -184,6 +229,7 @@ public:
 		return cameras;
 	}
 
+	friend class BufferSync;
 	friend class BufferWriteSync;
 	friend class BufferReadSync;
 	friend class PostProcessor;
@@ -193,35 +239,175 @@ protected:
 	std::unique_ptr<Options> options_;
 
 private:
+	// The message queue is a single-producer/single-consumer ring - the libcamera
+	// callback thread posts completed requests and the application event loop
+	// consumes them. On the hot path neither side takes the mutex; it is only
+	// used to park the consumer when the ring is empty, and the producer in the
+	// (unlikely) case that the ring fills up, such as around shutdown.
 	template <typename T>
 	class MessageQueue
 	{
 	public:
+		~MessageQueue()
+		{
+			if (event_fd_ >= 0)
+				close(event_fd_);
+		}
+		void SetDepthLimit(size_t depth, DropPolicy policy, std::function<bool(T const &)> droppable = {})
+		{
+			depth_limit_ = depth;
+			policy_ = policy;
+			droppable_ = std::move(droppable);
+		}
+		uint64_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
 		template <typename U>
 		void Post(U &&msg)
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_.push(std::forward<U>(msg));
-			cond_.notify_one();
+			size_t tail = tail_.load(std::memory_order_relaxed);
+			size_t const limit = depth_limit_ ? std::min(depth_limit_, SIZE) : SIZE;
+			std::vector<T> kept;
+
+			if (tail - head_.load(std::memory_order_acquire) >= limit)
+			{
+				if (policy_ == DropPolicy::DropNewest && (!droppable_ || droppable_(msg)))
+				{
+					// Destroying the message recycles its buffers immediately.
+					dropped_.fetch_add(1, std::memory_order_relaxed);
+					return;
+				}
+				else if (policy_ == DropPolicy::DropOldest)
+				{
+					// Steal slots from the head; the consumer may be racing us
+					// for them, hence the compare-exchange.
+					while (tail - head_.load(std::memory_order_acquire) >= limit)
+					{
+						size_t head = head_.load(std::memory_order_relaxed);
+						if (tail - head < limit)
+							break;
+						if (!head_.compare_exchange_strong(head, head + 1, std::memory_order_acq_rel))
+							continue;
+						T stolen = std::move(ring_[head & MASK].value());
+						ring_[head & MASK].reset();
+						if (droppable_ && !droppable_(stolen))
+							kept.push_back(std::move(stolen)); // e.g. Quit - must not be lost
+						else
+							dropped_.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+				else
+				{
+					// Ring full (or Block policy) - wait for the consumer to make space.
+					std::unique_lock<std::mutex> lock(mutex_);
+					producer_waiting_.store(true, std::memory_order_release);
+					space_cond_.wait(lock,
+									 [this, tail, limit] { return tail - head_.load(std::memory_order_acquire) < limit; });
+					producer_waiting_.store(false, std::memory_order_release);
+				}
+			}
+			for (auto &m : kept)
+			{
+				ring_[tail & MASK] = std::move(m);
+				tail++;
+			}
+			ring_[tail & MASK] = std::forward<U>(msg);
+			tail_.store(tail + 1, std::memory_order_release);
+			if (consumer_waiting_.load(std::memory_order_acquire))
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				cond_.notify_one();
+			}
+			if (event_fd_ >= 0)
+			{
+				uint64_t one = 1;
+				[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
+			}
 		}
 		T Wait()
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			cond_.wait(lock, [this] { return !queue_.empty(); });
-			T msg = std::move(queue_.front());
-			queue_.pop();
-			return msg;
+			while (true)
+			{
+				size_t head = head_.load(std::memory_order_acquire);
+				if (tail_.load(std::memory_order_acquire) == head)
+				{
+					consumer_waiting_.store(true, std::memory_order_release);
+					std::unique_lock<std::mutex> lock(mutex_);
+					cond_.wait(lock, [this]
+							   { return tail_.load(std::memory_order_acquire) != head_.load(std::memory_order_acquire); });
+					consumer_waiting_.store(false, std::memory_order_release);
+					continue;
+				}
+				// Claim the slot before reading it, as the producer may be
+				// stealing slots from the head under backpressure.
+				if (!head_.compare_exchange_strong(head, head + 1, std::memory_order_acq_rel))
+					continue;
+				T msg = std::move(ring_[head & MASK].value());
+				ring_[head & MASK].reset();
+				if (producer_waiting_.load(std::memory_order_acquire))
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					space_cond_.notify_one();
+				}
+				return msg;
+			}
+		}
+		// Non-blocking variant of Wait() for consumers woken via the eventfd.
+		std::optional<T> TryWait()
+		{
+			while (true)
+			{
+				size_t head = head_.load(std::memory_order_acquire);
+				if (tail_.load(std::memory_order_acquire) == head)
+					return {};
+				// Claim the slot before reading it, as the producer may be
+				// stealing slots from the head under backpressure.
+				if (!head_.compare_exchange_strong(head, head + 1, std::memory_order_acq_rel))
+					continue;
+				T msg = std::move(ring_[head & MASK].value());
+				ring_[head & MASK].reset();
+				if (producer_waiting_.load(std::memory_order_acquire))
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					space_cond_.notify_one();
+				}
+				return msg;
+			}
+		}
+		// The eventfd is created on first use; it must be fetched before the
+		// producer starts posting. Reading its counter merely acknowledges the
+		// wakeup - consume the actual messages with TryWait().
+		int GetEventFd()
+		{
+			if (event_fd_ < 0)
+				event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			return event_fd_;
 		}
 		void Clear()
 		{
+			// Only safe to call once the producer has stopped posting.
 			std::unique_lock<std::mutex> lock(mutex_);
-			queue_ = {};
+			for (size_t head = head_.load(std::memory_order_relaxed);
+				 head != tail_.load(std::memory_order_relaxed); head++)
+				ring_[head & MASK].reset();
+			head_.store(tail_.load(std::memory_order_relaxed), std::memory_order_release);
+			space_cond_.notify_one();
 		}
 
 	private:
-		std::queue<T> queue_;
+		static constexpr size_t SIZE = 64; // must be a power of two
+		static constexpr size_t MASK = SIZE - 1;
+		std::array<std::optional<T>, SIZE> ring_;
+		std::atomic<size_t> head_ = { 0 }; // next slot the consumer will read
+		std::atomic<size_t> tail_ = { 0 }; // next slot the producer will write
+		std::atomic<bool> consumer_waiting_ = { false };
+		std::atomic<bool> producer_waiting_ = { false };
+		size_t depth_limit_ = 0; // 0 means unbounded (up to the ring size)
+		DropPolicy policy_ = DropPolicy::Block;
+		std::function<bool(T const &)> droppable_;
+		std::atomic<uint64_t> dropped_ = { 0 };
 		std::mutex mutex_;
 		std::condition_variable cond_;
+		std::condition_variable space_cond_;
+		int event_fd_ = -1;
 	};
 	struct PreviewItem
 	{
@@ -249,8 +435,9 @@ private:
 	void previewThread();
 	void configureDenoise(const std::string &denoise_mode);
 	Mode selectMode(const Mode &mode) const;
+	unsigned int rawBufferCount(unsigned int main_count) const;
 
-	std::unique_ptr<CameraManager> camera_manager_;
+	std::shared_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
 	bool camera_acquired_ = false;
 	std::unique_ptr<CameraConfiguration> configuration_;
@@ -275,11 +462,16 @@ private:
 	bool preview_abort_ = false;
 	uint32_t preview_frames_displayed_ = 0;
 	uint32_t preview_frames_dropped_ = 0;
+	// For adaptive preview frame dropping.
+	std::map<int, uint64_t> preview_show_times_;
+	std::atomic<uint64_t> preview_render_time_ns_ = { 0 };
+	double preview_credit_ns_ = 0;
 	std::thread preview_thread_;
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
 	// Other:
+	static std::atomic<uint64_t> sync_timestamp_base_;
 	uint64_t last_timestamp_;
 	uint64_t sequence_ = 0;
 	PostProcessor post_processor_;
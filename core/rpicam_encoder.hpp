@@ -7,13 +7,17 @@
 
 #pragma once
 
+#include "core/frame_trace.hpp"
 #include "core/rpicam_app.hpp"
+#include "core/stats.hpp"
 #include "core/stream_info.hpp"
+#include "core/sync_service.hpp"
 #include "core/video_options.hpp"
 
 #include "encoder/encoder.hpp"
 
 typedef std::function<void(void *, size_t, int64_t, bool)> EncodeOutputReadyCallback;
+typedef std::function<void(int, size_t, int64_t, bool)> EncodeOutputReadyFdCallback;
 typedef std::function<void(libcamera::ControlList &)> MetadataReadyCallback;
 
 class RPiCamEncoder : public RPiCamApp
@@ -23,12 +27,18 @@ public:
 	using FrameBuffer = libcamera::FrameBuffer;
 
 	RPiCamEncoder() : RPiCamApp(std::make_unique<VideoOptions>()) {}
+	// For derived apps that extend VideoOptions.
+	RPiCamEncoder(std::unique_ptr<VideoOptions> options) : RPiCamApp(std::move(options)) {}
 
 	void StartEncoder()
 	{
 		createEncoder();
 		encoder_->SetInputDoneCallback(std::bind(&RPiCamEncoder::encodeBufferDone, this, std::placeholders::_1));
 		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		if (encode_output_ready_fd_callback_)
+			encoder_->SetOutputReadyFdCallback(encode_output_ready_fd_callback_);
+		Stats::Get().SetGauge("encoder.queue_depth",
+							  [this] { return encode_queue_depth_.load(std::memory_order_relaxed); });
 
 #ifndef DISABLE_RPI_FEATURES
 		// Set up the encode function to wait for synchronisation with another camera system,
@@ -42,11 +52,59 @@ public:
 		else if (options->Get().sync == 2)
 			cl.set(libcamera::controls::rpi::SyncMode, libcamera::controls::rpi::SyncModeClient);
 		SetControls(cl);
+#else
+		// Without the pipeline handler's native sync algorithm, fall back to
+		// the software phase lock on sensor timestamps.
+		if (GetOptions()->Get().sync)
+			sync_service_ = std::make_unique<SyncService>(GetOptions()->Get().sync == 1,
+														  [this](libcamera::ControlList &cl) { SetControls(cl); });
 #endif
 	}
+	// Attach a further encoder to the same capture stream (simulcast). Every
+	// EncodeBuffer() call submits the same read-mapped input buffer to all
+	// attached encoders, zero-copy, each delivering encoded output to its own
+	// callback - e.g. two H264 encoders at different bitrates plus an mjpeg
+	// preview from one capture pipeline. Call after ConfigureVideo() and
+	// before StartEncoder().
+	void AddEncoder(std::unique_ptr<VideoOptions> options, EncodeOutputReadyCallback callback)
+	{
+		StreamInfo info;
+		VideoStream(&info);
+		if (!info.width || !info.height || !info.stride)
+			throw std::runtime_error("video stream is not configured");
+		size_t index = extra_encoders_.size();
+		auto encoder = std::unique_ptr<Encoder>(Encoder::Create(options.get(), info));
+		encoder->SetInputDoneCallback(std::bind(&RPiCamEncoder::extraEncodeBufferDone, this, index));
+		encoder->SetOutputReadyCallback(callback);
+		extra_encoders_.push_back({ std::move(options), std::move(encoder), {} });
+	}
 	// This is callback when the encoder gives you the encoded output data.
 	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
+	// Alternative fd-based callback for encoders with a passthrough mode (the
+	// NullEncoder); the output receives the frame's dma-buf fd and need never
+	// map the data.
+	void SetEncodeOutputReadyFdCallback(EncodeOutputReadyFdCallback callback)
+	{
+		encode_output_ready_fd_callback_ = callback;
+	}
 	void SetMetadataReadyCallback(MetadataReadyCallback callback) { metadata_ready_callback_ = callback; }
+	// Adjust the running encoder between frames - no teardown, no restart
+	// glitch - for links whose capacity varies. Each returns false if the
+	// encoder cannot change that parameter on the fly.
+	bool SetEncoderBitrate(uint64_t bps) { return encoder_ && encoder_->SetBitrate(bps); }
+	bool SetEncoderIntraPeriod(unsigned int period) { return encoder_ && encoder_->SetIntraPeriod(period); }
+	// As well as telling the encoder, retime the camera so that frames really
+	// start arriving at the new rate.
+	bool SetEncoderFramerate(double fps)
+	{
+		if (fps <= 0.0 || !encoder_ || !encoder_->SetFramerate(fps))
+			return false;
+		int64_t frame_time = 1000000 / fps; // in us
+		libcamera::ControlList cl;
+		cl.set(controls::FrameDurationLimits, libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
+		SetControls(cl);
+		return true;
+	}
 	bool EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
 		assert(encoder_);
@@ -56,6 +114,18 @@ public:
 		// caller through the return value that we're not yet encoding anything.
 		if (GetOptions()->Get().sync && !completed_request->metadata.get(controls::rpi::SyncReady).value_or(false))
 			return false;
+#else
+		// The software sync service plays the same role: feed it every frame's
+		// timing, and skip frames until it declares phase lock.
+		if (sync_service_)
+		{
+			auto sensor_ts = completed_request->metadata.get(controls::SensorTimestamp);
+			auto duration = completed_request->metadata.get(controls::FrameDuration);
+			if (sensor_ts && duration)
+				sync_service_->FrameReceived(*sensor_ts, *duration);
+			if (!sync_service_->Ready())
+				return false;
+		}
 #endif
 
 		StreamInfo info = GetStreamInfo(stream);
@@ -70,14 +140,35 @@ public:
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
 			encode_buffer_queue_.push(completed_request); // creates a new reference
+			encode_queue_depth_.fetch_add(1, std::memory_order_relaxed);
+			// Each extra encoder holds its own reference; the shared input
+			// buffer stays mapped until the last of them is done with it.
+			for (auto &extra : extra_encoders_)
+				extra.queue.push(completed_request);
 		}
+		FrameTrace::Mark("encode submit", completed_request->sequence);
+		// Stages that rate the frame's regions by importance (motion or object
+		// detectors, say) let the encoder put the bits where they matter. Only
+		// forward the tag when a stage actually published one, so the encoder
+		// holds its last setting across frames the stage skipped.
+		std::vector<RegionOfInterest> regions;
+		if (completed_request->post_process_metadata.Get("roi.regions", regions) == 0)
+			encoder_->SetRegionsOfInterest(regions);
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
+		for (auto &extra : extra_encoders_)
+			extra.encoder->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 
 		// Tell our caller that encoding is underway.
 		return true;
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(RPiCamApp::GetOptions()); }
-	void StopEncoder() { encoder_.reset(); }
+	void StopEncoder()
+	{
+		Stats::Get().RemoveGauge("encoder.queue_depth");
+		sync_service_.reset();
+		extra_encoders_.clear();
+		encoder_.reset();
+	}
 
 protected:
 	virtual void createEncoder()
@@ -103,14 +194,40 @@ private:
 			if (encode_buffer_queue_.empty())
 				throw std::runtime_error("no buffer available to return");
 			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
+			FrameTrace::Mark("encode done", completed_request->sequence);
 			if (metadata_ready_callback_ && !GetOptions()->Get().metadata.empty())
 				metadata_ready_callback_(completed_request->metadata);
 			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			encode_queue_depth_.fetch_sub(1, std::memory_order_relaxed);
 		}
 	}
 
+	void extraEncodeBufferDone(size_t index)
+	{
+		// Encoders return buffers in order, so each just pops its own queue.
+		std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+		ExtraEncoder &extra = extra_encoders_[index];
+		if (extra.queue.empty())
+			throw std::runtime_error("no buffer available to return");
+		extra.queue.pop(); // drop shared_ptr reference
+	}
+
+	// The options must outlive the encoder, which keeps a pointer to them -
+	// hence they're declared (and so destroyed) in this order.
+	struct ExtraEncoder
+	{
+		std::unique_ptr<VideoOptions> options;
+		std::unique_ptr<Encoder> encoder;
+		std::queue<CompletedRequestPtr> queue;
+	};
+	std::vector<ExtraEncoder> extra_encoders_;
+
+	std::unique_ptr<SyncService> sync_service_; // software sync fallback; unused when the pipeline syncs
+
 	std::queue<CompletedRequestPtr> encode_buffer_queue_;
+	std::atomic<uint64_t> encode_queue_depth_ = { 0 };
 	std::mutex encode_buffer_queue_mutex_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
+	EncodeOutputReadyFdCallback encode_output_ready_fd_callback_;
 	MetadataReadyCallback metadata_ready_callback_;
 };
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * stats.cpp - runtime statistics counters and reporting socket
+ */
+
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "core/logging.hpp"
+#include "core/stats.hpp"
+
+Stats &Stats::Get()
+{
+	static Stats stats;
+	return stats;
+}
+
+Stats::Stats()
+{
+	char const *env = getenv("RPICAM_STATS_SOCKET");
+	if (env && env[0])
+		Serve(env);
+}
+
+Stats::~Stats()
+{
+	if (listen_fd_ >= 0)
+	{
+		quit_ = true;
+		::shutdown(listen_fd_, SHUT_RDWR);
+		server_thread_.join();
+		::close(listen_fd_);
+		::unlink(socket_path_.c_str());
+	}
+}
+
+std::atomic<uint64_t> &Stats::Counter(std::string const &name)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	// std::map nodes are stable, so the reference remains valid forever.
+	return counters_.try_emplace(name, 0).first->second;
+}
+
+void Stats::SetGauge(std::string const &name, std::function<uint64_t()> fn)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	gauges_[name] = std::move(fn);
+}
+
+void Stats::RemoveGauge(std::string const &name)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	gauges_.erase(name);
+}
+
+std::string Stats::Snapshot()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::stringstream ss;
+	ss << "{";
+	bool first = true;
+	for (auto const &[name, value] : counters_)
+	{
+		ss << (first ? "" : ",") << "\n\"" << name << "\": " << value.load(std::memory_order_relaxed);
+		first = false;
+	}
+	for (auto const &[name, fn] : gauges_)
+	{
+		ss << (first ? "" : ",") << "\n\"" << name << "\": " << fn();
+		first = false;
+	}
+	ss << "\n}\n";
+	return ss.str();
+}
+
+void Stats::Serve(std::string const &socket_path)
+{
+	if (listen_fd_ >= 0)
+		return;
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		LOG_ERROR("failed to create stats socket");
+		return;
+	}
+
+	sockaddr_un addr {};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+	::unlink(socket_path.c_str());
+
+	if (::bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(fd, 4) < 0)
+	{
+		LOG_ERROR("failed to bind stats socket " << socket_path);
+		::close(fd);
+		return;
+	}
+
+	socket_path_ = socket_path;
+	listen_fd_ = fd;
+	server_thread_ = std::thread(&Stats::serverThread, this);
+	LOG(1, "Stats socket listening on " << socket_path);
+}
+
+void Stats::serverThread()
+{
+	while (!quit_)
+	{
+		int conn = ::accept(listen_fd_, nullptr, nullptr);
+		if (conn < 0)
+			continue;
+
+		std::string snapshot = Snapshot();
+		size_t written = 0;
+		while (written < snapshot.size())
+		{
+			ssize_t ret = ::write(conn, snapshot.data() + written, snapshot.size() - written);
+			if (ret <= 0)
+				break;
+			written += ret;
+		}
+		::close(conn);
+	}
+}
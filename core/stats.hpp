@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * stats.hpp - runtime statistics counters and reporting socket
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+// Process-wide statistics registry. Hot paths resolve a counter once (the
+// returned reference is stable) and thereafter pay only a relaxed atomic
+// increment. Values that are cheaper to read on demand than to count, such as
+// queue depths, register as gauges instead.
+//
+// Snapshots are served as JSON over a unix socket, one snapshot per
+// connection. The socket is started with Serve(), or automatically when
+// RPICAM_STATS_SOCKET=<path> is set in the environment.
+class Stats
+{
+public:
+	static Stats &Get();
+
+	std::atomic<uint64_t> &Counter(std::string const &name);
+	void SetGauge(std::string const &name, std::function<uint64_t()> fn);
+	void RemoveGauge(std::string const &name);
+
+	void Serve(std::string const &socket_path);
+	std::string Snapshot();
+
+	~Stats();
+
+private:
+	Stats();
+	void serverThread();
+
+	std::mutex mutex_;
+	std::map<std::string, std::atomic<uint64_t>> counters_;
+	std::map<std::string, std::function<uint64_t()>> gauges_;
+	std::string socket_path_;
+	int listen_fd_ = -1;
+	std::atomic<bool> quit_ = { false };
+	std::thread server_thread_;
+};
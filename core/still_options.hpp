@@ -32,6 +32,8 @@ struct StillOptions : public Options
 			 "Use system timestamps for output file names")
 			("restart", value<unsigned int>(&v_->restart)->default_value(0),
 			 "Set JPEG restart interval")
+			("png-level", value<int>(&v_->png_level)->default_value(1),
+			 "Set the PNG zlib compression level, 0 (fastest) to 9 (smallest file)")
 			("keypress,k", value<bool>(&v_->keypress)->default_value(false)->implicit_value(true),
 			 "Perform capture when ENTER pressed")
 			("signal,s", value<bool>(&v_->signal)->default_value(false)->implicit_value(true),
@@ -42,6 +44,8 @@ struct StillOptions : public Options
 			 "Set the desired output encoding, either jpg, png, rgb/rgb24, rgb48, bmp or yuv420")
 			("raw,r", value<bool>(&v_->raw)->default_value(false)->implicit_value(true),
 			 "Also save raw file in DNG format")
+			("preserve-stride", value<bool>(&v_->preserve_stride)->default_value(false)->implicit_value(true),
+			 "Write uncompressed yuv/rgb output with the capture stride preserved, as a single large write")
 			("latest", value<std::string>(&v_->latest),
 			 "Create a symbolic link with this name to most recent saved file")
 			("immediate", value<bool>(&v_->immediate)->default_value(false)->implicit_value(true),
@@ -50,6 +54,9 @@ struct StillOptions : public Options
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
 			("zsl", value<bool>(&v_->zsl)->default_value(false)->implicit_value(true),
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
+			("burst", value<unsigned int>(&v_->burst)->default_value(1),
+			 "Capture this many consecutive frames at sensor rate per still capture, deferring all "
+			 "encoding until the burst completes (needs --buffer-count of at least this many; best with --zsl)")
 			;
 		// clang-format on
 	}
@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * sync_service.cpp - software frame synchronisation between cameras
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <libcamera/control_ids.h>
+
+#include "core/logging.hpp"
+#include "core/sync_service.hpp"
+
+namespace
+{
+
+// The same fixed multicast group for everyone, like the pipeline handler's
+// native sync; anything on the local network segment can pair up.
+constexpr char SYNC_GROUP[] = "239.255.255.250";
+constexpr uint16_t SYNC_PORT = 32723;
+
+// How often a client measures its phase against the server, how closely the
+// phases must agree (for several consecutive measurements) to declare lock,
+// and the largest trim ever applied to the frame duration (so the servo can
+// never disturb the video timing visibly).
+constexpr int64_t MEASURE_INTERVAL_US = 500000;
+constexpr int64_t LOCK_THRESHOLD_US = 200;
+constexpr unsigned int LOCK_COUNT = 3;
+constexpr int64_t MAX_TRIM_PERMILLE = 10;
+
+struct SyncPacket
+{
+	uint32_t magic;
+	uint32_t type; // REQUEST from a client, REPLY from the server
+	int64_t client_wall_us; // echoed back so the client can compute the round trip
+	int64_t server_wall_us;
+	int64_t server_phase_us; // wall-clock instant of the server's latest frame
+	int64_t frame_duration_us;
+};
+
+constexpr uint32_t SYNC_MAGIC = 0x52505359; // "RPSY"
+constexpr uint32_t SYNC_REQUEST = 1;
+constexpr uint32_t SYNC_REPLY = 2;
+
+int64_t clock_us(clockid_t id)
+{
+	timespec ts;
+	clock_gettime(id, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+} // namespace
+
+SyncService::SyncService(bool server, SetControlsFunc set_controls)
+	: server_(server), set_controls_(set_controls)
+{
+	fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("sync: unable to open socket");
+
+	// Both sides poll with a short receive timeout rather than blocking, so
+	// shutdown never waits on the network.
+	timeval tv = { 0, 200000 };
+	setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (server_)
+	{
+		int one = 1;
+		setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = INADDR_ANY;
+		addr.sin_port = htons(SYNC_PORT);
+		if (bind(fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+			throw std::runtime_error("sync: unable to bind server socket");
+		ip_mreq mreq = {};
+		mreq.imr_multiaddr.s_addr = inet_addr(SYNC_GROUP);
+		mreq.imr_interface.s_addr = INADDR_ANY;
+		if (setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+			throw std::runtime_error("sync: unable to join multicast group");
+		thread_ = std::thread(&SyncService::serverThread, this);
+	}
+	else
+		thread_ = std::thread(&SyncService::clientThread, this);
+}
+
+SyncService::~SyncService()
+{
+	quit_ = true;
+	thread_.join();
+	close(fd_);
+}
+
+void SyncService::FrameReceived(int64_t sensor_timestamp_ns, int64_t frame_duration_us)
+{
+	// Map the sensor timestamp (CLOCK_BOOTTIME) onto the wall clock, which is
+	// the one clock the two machines can compare.
+	int64_t wall_us = clock_us(CLOCK_REALTIME) - (clock_us(CLOCK_BOOTTIME) - sensor_timestamp_ns / 1000);
+	last_frame_wall_us_.store(wall_us, std::memory_order_relaxed);
+	frame_duration_us_.store(frame_duration_us, std::memory_order_relaxed);
+	// A server free-runs: it is "in sync" as soon as it has frames to report.
+	if (server_)
+		ready_.store(true, std::memory_order_relaxed);
+}
+
+void SyncService::serverThread()
+{
+	while (!quit_)
+	{
+		SyncPacket pkt;
+		sockaddr_in from;
+		socklen_t from_len = sizeof(from);
+		ssize_t len = recvfrom(fd_, &pkt, sizeof(pkt), 0, (sockaddr *)&from, &from_len);
+		if (len != sizeof(pkt) || pkt.magic != SYNC_MAGIC || pkt.type != SYNC_REQUEST)
+			continue;
+		if (!last_frame_wall_us_.load(std::memory_order_relaxed))
+			continue; // no frames yet, nothing to report
+
+		pkt.type = SYNC_REPLY;
+		pkt.server_wall_us = clock_us(CLOCK_REALTIME);
+		pkt.server_phase_us = last_frame_wall_us_.load(std::memory_order_relaxed);
+		pkt.frame_duration_us = frame_duration_us_.load(std::memory_order_relaxed);
+		sendto(fd_, &pkt, sizeof(pkt), 0, (sockaddr *)&from, from_len);
+	}
+}
+
+void SyncService::clientThread()
+{
+	sockaddr_in server_addr = {};
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = inet_addr(SYNC_GROUP);
+	server_addr.sin_port = htons(SYNC_PORT);
+
+	unsigned int locked_count = 0;
+	int64_t last_measure_us = 0;
+
+	while (!quit_)
+	{
+		int64_t now = clock_us(CLOCK_REALTIME);
+		if (now - last_measure_us < MEASURE_INTERVAL_US)
+		{
+			usleep(10000);
+			continue;
+		}
+		last_measure_us = now;
+
+		SyncPacket pkt = {};
+		pkt.magic = SYNC_MAGIC;
+		pkt.type = SYNC_REQUEST;
+		pkt.client_wall_us = now;
+		sendto(fd_, &pkt, sizeof(pkt), 0, (sockaddr *)&server_addr, sizeof(server_addr));
+
+		ssize_t len = recv(fd_, &pkt, sizeof(pkt), 0);
+		int64_t received = clock_us(CLOCK_REALTIME);
+		if (len != sizeof(pkt) || pkt.magic != SYNC_MAGIC || pkt.type != SYNC_REPLY ||
+			pkt.client_wall_us != now || !pkt.frame_duration_us)
+			continue;
+
+		int64_t duration = frame_duration_us_.load(std::memory_order_relaxed);
+		int64_t our_phase = last_frame_wall_us_.load(std::memory_order_relaxed);
+		if (!our_phase || !duration)
+			continue; // no local frames yet
+
+		// The reply was generated roughly half the round trip after we sent
+		// the request; the difference between the server's clock then and
+		// ours is the clock offset, which brings the server's frame phase
+		// into our clock.
+		int64_t offset = pkt.server_wall_us - (now + (received - now) / 2);
+		int64_t server_phase = pkt.server_phase_us - offset;
+
+		// Phase error in (-duration / 2, duration / 2]: how far our frames
+		// run ahead of the server's, modulo the frame interval.
+		int64_t error = (our_phase - server_phase) % pkt.frame_duration_us;
+		if (error > pkt.frame_duration_us / 2)
+			error -= pkt.frame_duration_us;
+		else if (error <= -pkt.frame_duration_us / 2)
+			error += pkt.frame_duration_us;
+
+		if (std::abs(error) < LOCK_THRESHOLD_US)
+		{
+			if (++locked_count == LOCK_COUNT && !ready_.exchange(true))
+				LOG(1, "Sync: locked to server (error " << error << "us)");
+		}
+		else
+			locked_count = 0;
+
+		// Spread the correction over the frames until the next measurement,
+		// bounded so the adjustment is invisible in the output. Locked
+		// clients keep servoing - clocks drift - but ready_ never goes back.
+		int64_t frames = std::max<int64_t>(MEASURE_INTERVAL_US / pkt.frame_duration_us, 1);
+		int64_t trim = -error / frames;
+		int64_t max_trim = pkt.frame_duration_us * MAX_TRIM_PERMILLE / 1000;
+		trim = std::clamp(trim, -max_trim, max_trim);
+
+		int64_t frame_time = pkt.frame_duration_us + trim;
+		libcamera::ControlList cl;
+		cl.set(libcamera::controls::FrameDurationLimits,
+			   libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
+		set_controls_(cl);
+		LOG(2, "Sync: phase error " << error << "us, offset " << offset << "us, trim " << trim << "us");
+	}
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * sync_service.hpp - software frame synchronisation between cameras
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include <libcamera/controls.h>
+
+// Software synchronisation of sensor frame timing across processes or
+// machines, for builds where the pipeline handler's native sync algorithm is
+// unavailable. The server publishes the wall-clock phase of its frames over
+// UDP multicast on request; a client measures the network offset from the
+// round trip, compares the server's phase with its own, and trims
+// FrameDurationLimits by a fraction of a percent - through the normal
+// control-setting path - until its sensor runs in lock step with the
+// server's. Ready() mirrors the pipeline's SyncReady metadata: false until
+// phase lock is achieved (immediately true for a server), and callers are
+// expected to drop frames until then.
+class SyncService
+{
+public:
+	using SetControlsFunc = std::function<void(libcamera::ControlList &)>;
+
+	SyncService(bool server, SetControlsFunc set_controls);
+	~SyncService();
+
+	// Call with every completed frame's SensorTimestamp (CLOCK_BOOTTIME, in
+	// ns) and FrameDuration (in us) metadata.
+	void FrameReceived(int64_t sensor_timestamp_ns, int64_t frame_duration_us);
+	bool Ready() const { return ready_.load(std::memory_order_relaxed); }
+
+private:
+	void serverThread();
+	void clientThread();
+
+	bool server_;
+	SetControlsFunc set_controls_;
+	// The wall-clock instant of the most recent frame, and its duration, as
+	// reported by FrameReceived. Written by the capture thread, read by the
+	// socket thread.
+	std::atomic<int64_t> last_frame_wall_us_ { 0 };
+	std::atomic<int64_t> frame_duration_us_ { 0 };
+	std::atomic<bool> ready_ { false };
+	std::atomic<bool> quit_ { false };
+	int fd_ = -1;
+	std::thread thread_;
+};
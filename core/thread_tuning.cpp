@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * thread_tuning.cpp - affinity and scheduling for pipeline threads
+ */
+
+#include <sstream>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "core/logging.hpp"
+#include "core/thread_tuning.hpp"
+
+namespace
+{
+cpu_set_t cpus;
+bool have_cpus = false;
+int rt_priority = 0;
+} // namespace
+
+void ThreadTuning::Configure(std::string const &cpu_list, int priority)
+{
+	if (priority < 0 || priority > sched_get_priority_max(SCHED_FIFO))
+		throw std::runtime_error("invalid pipeline thread priority " + std::to_string(priority));
+	rt_priority = priority;
+
+	CPU_ZERO(&cpus);
+	have_cpus = false;
+	std::stringstream ss(cpu_list);
+	std::string token;
+	while (std::getline(ss, token, ','))
+	{
+		int cpu;
+		try
+		{
+			cpu = std::stoi(token);
+		}
+		catch (std::exception const &e)
+		{
+			throw std::runtime_error("invalid cpu list " + cpu_list);
+		}
+		if (cpu < 0 || cpu >= CPU_SETSIZE)
+			throw std::runtime_error("invalid cpu " + token);
+		CPU_SET(cpu, &cpus);
+		have_cpus = true;
+	}
+}
+
+void ThreadTuning::Apply(char const *name)
+{
+	// The name always gets set - it makes ps/htop/tracing output legible.
+	pthread_setname_np(pthread_self(), name);
+
+	if (have_cpus && sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+		LOG(1, "ThreadTuning: failed to set affinity for " << name);
+
+	if (rt_priority)
+	{
+		sched_param param = { rt_priority };
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+			LOG(1, "ThreadTuning: failed to set priority for " << name << " (needs CAP_SYS_NICE)");
+	}
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * thread_tuning.hpp - affinity and scheduling for pipeline threads
+ */
+
+#pragma once
+
+#include <string>
+
+// Optional CPU pinning and real-time scheduling for the camera pipeline
+// threads (preview, post-processing, encoder poll/output and friends), so
+// the capture/encode path can be isolated from the rest of the system.
+namespace ThreadTuning
+{
+
+// Called once during option parsing. cpus is a comma-separated CPU list
+// (e.g. "2,3"), rt_priority a SCHED_FIFO priority, either may be empty/zero.
+void Configure(std::string const &cpus, int rt_priority);
+
+// Called at the top of each pipeline thread; also names the thread (15
+// character limit) for ps/htop. Does nothing if nothing was configured.
+void Apply(char const *name);
+
+} // namespace ThreadTuning
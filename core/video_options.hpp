@@ -38,6 +38,9 @@ struct VideoOptions : public Options
 			 "Set a custom location for the encoder library .so files")
 			("save-pts", value<std::string>(&v_->save_pts),
 			 "Save a timestamp file with this name")
+			("save-pts-format", value<std::string>(&v_->save_pts_format)->default_value("txt"),
+			 "Format for the --save-pts file, either txt (the usual text format) or binary "
+			 "(batched fixed-size records; convert with utils/pts2txt.py)")
 			("quality,q", value<int>(&v_->quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
 			("listen,l", value<bool>(&v_->listen)->default_value(false)->implicit_value(true),
@@ -88,15 +91,38 @@ struct VideoOptions : public Options
 			 "Set the audio bitrate for encoding. If no units are provided, default to bits/second.")
 			("audio-samplerate", value<uint32_t>(&v_->audio_samplerate)->default_value(0),
 			 "Set the audio sampling rate in Hz for encoding. Set to 0 to use the input sample rate.")
+			("audio-fragment-size", value<uint32_t>(&v_->audio_fragment_size)->default_value(0),
+			 "Audio capture fragment size in bytes, passed to the input device (pulse only). "
+			 "Smaller fragments mean lower capture latency but more frequent wakeups. "
+			 "Set to 0 to use the device default.")
 			("av-sync", value<std::string>(&v_->av_sync_)->default_value("0us"),
 			 "Add a time offset (in microseconds if no units provided) to the audio stream, relative to the video stream. "
 			 "The offset value can be either positive or negative.")
 			("low-latency", value<bool>(&v_->low_latency)->default_value(false)->implicit_value(true),
-			 "Enables the libav/libx264 low latency presets for video encoding.")
-#ifndef DISABLE_RPI_FEATURES
+			 "Enables the libav/libx264 low latency presets for video encoding. "
+			 "For the hardware h264 codec, encodes each frame as multiple slices, delivered "
+			 "to the output as each completes so a network output can transmit mid-frame. "
+			 "For mjpeg, encodes each frame as parallel slices joined with restart markers.")
+			("encoder-threads", value<unsigned int>(&v_->encoder_threads)->default_value(0),
+			 "Number of software encode threads (mjpeg only). Set to 0 to use all available cores.")
+			("udp-mtu", value<unsigned int>(&v_->udp_mtu)->default_value(0),
+			 "Fragment each frame into chunks of this many bytes, submitted with a single sendmmsg call "
+			 "(udp output only; 0 sends each frame as one large datagram)")
+			("udp-pace", value<std::string>(&v_->udp_pace_)->default_value("0bps"),
+			 "Token-bucket pace UDP transmission at this rate to smooth out keyframe bursts. "
+			 "If no units are provided, default to bits/second. 0 disables pacing.")
+			("srt-latency", value<unsigned int>(&v_->srt_latency)->default_value(120),
+			 "SRT latency window in milliseconds: the link absorbs up to this much network jitter "
+			 "and retransmission delay (srt:// outputs with the libav codec only)")
+			("async-io", value<bool>(&v_->async_io)->default_value(false)->implicit_value(true),
+			 "Write output files asynchronously via io_uring, so storage latency spikes never stall "
+			 "the encode pipeline (needs liburing at build time)")
+			("direct", value<bool>(&v_->direct)->default_value(false)->implicit_value(true),
+			 "Write frames to the output file straight from the camera buffers with O_DIRECT, "
+			 "bypassing the encoder pipeline and the page cache (rpicam-raw only; plain output "
+			 "files only, no segment/split/circular)")
 			 ("sync", value<std::string>(&v_->sync_)->default_value("off"),
 			  "Whether to synchronise with another camera. Use \"off\", \"server\" or \"client\".")
-#endif
 		;
 		// clang-format on
 	}
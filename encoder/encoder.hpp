@@ -9,12 +9,23 @@
 
 #include <functional>
 #include <map>
+#include <vector>
 
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
+// A region a post-processing stage considers important in the frame about to
+// be encoded. Coordinates are fractions of the frame, so a stage working on
+// the lores stream can express regions independently of the encode resolution.
+struct RegionOfInterest
+{
+	float x, y, width, height;
+	float importance; // 0 = background, 1 = keep full quality
+};
+
 typedef std::function<void(void *)> InputDoneCallback;
 typedef std::function<void(void *, size_t, int64_t, bool)> OutputReadyCallback;
+typedef std::function<void(int, size_t, int64_t, bool)> OutputReadyFdCallback;
 
 class Encoder
 {
@@ -30,13 +41,34 @@ public:
 	// available. The application may not hang on to the memory once it returns
 	// (but the callback is already running in its own thread).
 	void SetOutputReadyCallback(OutputReadyCallback callback) { output_ready_callback_ = callback; }
+	// An alternative to the above for encoders that can pass the output on as
+	// a dma-buf fd without touching the data - currently only the NullEncoder,
+	// whose "output" is the raw input frame. Outputs capable of fd-based I/O
+	// (V4L2 qbuf, for instance) can then consume the frame without it ever
+	// being mapped. Only one of the two output callbacks should be set.
+	void SetOutputReadyFdCallback(OutputReadyFdCallback callback) { output_ready_fd_callback_ = callback; }
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// Declare which parts of the next frame matter. Post-processing stages
+	// publish regions through the "roi.regions" metadata tag and RPiCamEncoder
+	// passes them on just before each frame is submitted, so this is always
+	// called on the same thread as EncodeBuffer(). An empty vector means the
+	// whole frame is background. Encoders that cannot steer quality spatially
+	// may approximate, or ignore this altogether.
+	virtual void SetRegionsOfInterest(std::vector<RegionOfInterest> const &regions) {}
+	// Runtime reconfiguration, applied between frames: adjust the rate control
+	// target, frame rate or GOP length of a running encoder without tearing
+	// anything down. Each returns false if the encoder cannot change that
+	// parameter on the fly, which is also what the base class says.
+	virtual bool SetBitrate(uint64_t bps) { return false; }
+	virtual bool SetFramerate(double fps) { return false; }
+	virtual bool SetIntraPeriod(unsigned int period) { return false; }
 
 protected:
 	InputDoneCallback input_done_callback_;
 	OutputReadyCallback output_ready_callback_;
+	OutputReadyFdCallback output_ready_fd_callback_;
 	VideoOptions const *options_;
 };
 
@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * encoder_bench.cpp - encoder throughput and latency benchmark.
+ *
+ * Feeds synthetic YUV420 frames from preallocated dma-heap buffers through
+ * the selected Encoder and reports fps, per-frame latency percentiles and
+ * CPU time per frame, so encoder changes can be quantified on real hardware:
+ *
+ *     encoder-bench --codec h264 --width 1920 --height 1080 --frames 300
+ */
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include <libcamera/formats.h>
+
+#include "core/dma_heaps.hpp"
+#include "core/stream_info.hpp"
+#include "core/video_options.hpp"
+
+#include "encoder/encoder.hpp"
+
+struct BenchBuffer
+{
+	libcamera::SharedFD fd;
+	void *mem;
+	size_t size;
+};
+
+static uint64_t now_us()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static double percentile(std::vector<double> const &sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size() / 100.0));
+	return sorted[i];
+}
+
+static void usage()
+{
+	std::cerr << "Usage: encoder-bench [--codec h264|mjpeg|libav|yuv420] [--width W] [--height H]"
+			  << " [--frames N] [--bitrate B] [--quality Q]" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int width = 1920, height = 1080, num_frames = 300;
+	VideoOptions options;
+
+	try
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			auto value = [&]() -> std::string
+			{
+				if (++i == argc)
+					throw std::runtime_error("missing value for " + arg);
+				return argv[i];
+			};
+			if (arg == "--codec")
+				options.Set().codec = value();
+			else if (arg == "--width")
+				width = std::stoi(value());
+			else if (arg == "--height")
+				height = std::stoi(value());
+			else if (arg == "--frames")
+				num_frames = std::stoi(value());
+			else if (arg == "--bitrate")
+				options.Set().bitrate.set(value());
+			else if (arg == "--quality")
+				options.Set().quality = std::stoi(value());
+			else
+			{
+				usage();
+				return arg == "--help" || arg == "-h" ? 0 : -1;
+			}
+		}
+
+		options.Set().width = width;
+		options.Set().height = height;
+		options.Set().framerate = DEFAULT_FRAMERATE;
+
+		StreamInfo info;
+		info.width = width;
+		info.height = height;
+		info.stride = (width + 63) & ~63;
+		info.pixel_format = libcamera::formats::YUV420;
+		info.colour_space = libcamera::ColorSpace::Rec709;
+
+		// Allocate a small pool of frame buffers from the dma heap, just as the
+		// camera pipeline would, and fill them with a gradient so the encoders
+		// have something non-trivial to chew on.
+		constexpr unsigned int NUM_BUFFERS = 4;
+		size_t size = info.stride * info.height * 3 / 2;
+		DmaHeap heap;
+		BenchBuffer buffers[NUM_BUFFERS];
+		for (auto &buf : buffers)
+		{
+			buf.fd = heap.acquire("bench", size);
+			buf.size = size;
+			buf.mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, buf.fd.get(), 0);
+			if (buf.mem == MAP_FAILED)
+				throw std::runtime_error("failed to mmap bench buffer");
+			uint8_t *p = (uint8_t *)buf.mem;
+			for (unsigned int y = 0; y < height * 3 / 2; y++)
+				for (unsigned int x = 0; x < width; x++)
+					p[y * info.stride + x] = x + 2 * y;
+		}
+
+		std::unique_ptr<Encoder> encoder(Encoder::Create(&options, info));
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		unsigned int in_flight = 0, frames_out = 0;
+		uint64_t total_bytes = 0;
+		std::vector<double> latencies;
+		latencies.reserve(num_frames);
+
+		encoder->SetInputDoneCallback(
+			[&](void *)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				in_flight--;
+				cv.notify_one();
+			});
+		encoder->SetOutputReadyCallback(
+			[&](void *mem, size_t bytes, int64_t timestamp_us, bool keyframe)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				latencies.push_back((now_us() - timestamp_us) / 1000.0);
+				total_bytes += bytes;
+				frames_out++;
+			});
+
+		rusage ru_start, ru_end;
+		getrusage(RUSAGE_SELF, &ru_start);
+		uint64_t t_start = now_us();
+
+		for (unsigned int i = 0; i < num_frames; i++)
+		{
+			BenchBuffer &buf = buffers[i % NUM_BUFFERS];
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&] { return in_flight < NUM_BUFFERS; });
+				in_flight++;
+			}
+			// Dirty one row per frame so consecutive frames aren't identical.
+			memset((uint8_t *)buf.mem + (i % height) * info.stride, i & 0xff, info.stride);
+			encoder->EncodeBuffer(buf.fd.get(), buf.size, buf.mem, info, now_us());
+		}
+
+		// Wait for the encoder to hand every input back, then destroy it so
+		// that codecs which buffer frames internally flush their last outputs.
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&] { return in_flight == 0; });
+		}
+		encoder.reset();
+
+		uint64_t t_end = now_us();
+		getrusage(RUSAGE_SELF, &ru_end);
+
+		for (auto &buf : buffers)
+			munmap(buf.mem, buf.size);
+
+		if (!frames_out)
+			throw std::runtime_error("encoder produced no output");
+
+		double elapsed_s = (t_end - t_start) / 1e6;
+		double cpu_us = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) * 1e6 +
+						(ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec) +
+						(ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) * 1e6 +
+						(ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec);
+		std::sort(latencies.begin(), latencies.end());
+
+		std::cout << options.Get().codec << " " << width << "x" << height << ": " << frames_out << " frames in "
+				  << elapsed_s << "s (" << frames_out / elapsed_s << " fps)" << std::endl;
+		std::cout << "latency (ms): p50 " << percentile(latencies, 50) << " p90 " << percentile(latencies, 90)
+				  << " p99 " << percentile(latencies, 99) << " max " << latencies.back() << std::endl;
+		std::cout << "cpu/frame: " << cpu_us / frames_out / 1000.0 << "ms, output: "
+				  << total_bytes * 8 / elapsed_s / 1e6 << " Mbps" << std::endl;
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -6,15 +6,18 @@
  */
 
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
 #include <linux/videodev2.h>
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 
+#include "core/thread_tuning.hpp"
+
 #include "h264_encoder.hpp"
 
 static int xioctl(int fd, unsigned long ctl, void *arg)
@@ -101,6 +104,28 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
 			throw std::runtime_error("failed to set inline headers");
 	}
+	if (options->Get().low_latency)
+	{
+		// Encode each frame as several slices, each emitted in its own capture
+		// buffer as soon as the codec finishes it. Downstream sees more, smaller,
+		// output callbacks (sharing the frame's timestamp), so a network output
+		// can start packetizing before the rest of the frame has been encoded.
+		unsigned int mbs_wide = (info.width + 15) / 16;
+		unsigned int mbs_high = (info.height + 15) / 16;
+		ctrl.id = V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE;
+		ctrl.value = V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			LOG(1, "H264: codec does not support slice mode, ignoring low latency request");
+		else
+		{
+			ctrl.id = V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB;
+			ctrl.value = mbs_wide * ((mbs_high + NUM_SLICES - 1) / NUM_SLICES);
+			if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+				LOG(1, "H264: failed to set slice size, ignoring low latency request");
+			else
+				LOG(2, "H264: encoding with " << NUM_SLICES << " slices per frame");
+		}
+	}
 
 	// Set the output and capture formats. We know exactly what they will be.
 
@@ -157,8 +182,12 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 
 	// We have to maintain a list of the buffers we can use when our caller gives
 	// us another frame to encode.
+	if (reqbufs.count >= INPUT_RING_SIZE)
+		throw std::runtime_error("too many output buffers granted");
+	num_output_buffers_ = reqbufs.count;
+	input_head_ = input_tail_ = 0;
 	for (unsigned int i = 0; i < reqbufs.count; i++)
-		input_buffers_available_.push(i);
+		input_buffers_available_[input_head_++ & INPUT_RING_MASK] = i;
 
 	reqbufs = {};
 	reqbufs.count = NUM_CAPTURE_BUFFERS;
@@ -201,6 +230,15 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		throw std::runtime_error("failed to start capture streaming");
 	LOG(2, "Codec streaming started");
 
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0)
+		throw std::runtime_error("failed to create epoll instance");
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = fd_;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd_, &event) < 0)
+		throw std::runtime_error("failed to add encoder to epoll instance");
+
 	output_thread_ = std::thread(&H264Encoder::outputThread, this);
 	poll_thread_ = std::thread(&H264Encoder::pollThread, this);
 }
@@ -239,22 +277,21 @@ H264Encoder::~H264Encoder()
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		LOG(1, "Request to free capture buffers failed");
 
+	close(epoll_fd_);
 	close(fd_);
 	LOG(2, "H264Encoder closed");
 }
 
 void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
-	int index;
-	{
-		// We need to find an available output buffer (input to the codec) to
-		// "wrap" the DMABUF.
-		std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-		if (input_buffers_available_.empty())
-			throw std::runtime_error("no buffers available to queue codec input");
-		index = input_buffers_available_.front();
-		input_buffers_available_.pop();
-	}
+	// We need to find an available output buffer (input to the codec) to
+	// "wrap" the DMABUF. Only the poll thread pushes to the free list, so
+	// popping needs no lock.
+	unsigned int tail = input_tail_.load(std::memory_order_relaxed);
+	if (tail == input_head_.load(std::memory_order_acquire))
+		throw std::runtime_error("no buffers available to queue codec input");
+	int index = input_buffers_available_[tail & INPUT_RING_MASK];
+	input_tail_.store(tail + 1, std::memory_order_release);
 	v4l2_buffer buf = {};
 	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
 	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
@@ -272,24 +309,109 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 		throw std::runtime_error("failed to queue input to codec");
 }
 
+bool H264Encoder::SetBitrate(uint64_t bps)
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+	ctrl.value = bps;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG(1, "H264: runtime bitrate change failed");
+		return false;
+	}
+	LOG(2, "H264: bitrate changed to " << bps);
+	return true;
+}
+
+bool H264Encoder::SetFramerate(double fps)
+{
+	if (fps <= 0.0)
+		return false;
+	v4l2_streamparm parm = {};
+	parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	parm.parm.output.timeperframe.numerator = 90000.0 / fps;
+	parm.parm.output.timeperframe.denominator = 90000;
+	if (xioctl(fd_, VIDIOC_S_PARM, &parm) < 0)
+	{
+		LOG(1, "H264: runtime framerate change failed");
+		return false;
+	}
+	LOG(2, "H264: framerate changed to " << fps);
+	return true;
+}
+
+bool H264Encoder::SetIntraPeriod(unsigned int period)
+{
+	if (!period)
+		return false;
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+	ctrl.value = period;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG(1, "H264: runtime intra period change failed");
+		return false;
+	}
+	LOG(2, "H264: intra period changed to " << period);
+	return true;
+}
+
+void H264Encoder::SetRegionsOfInterest(std::vector<RegionOfInterest> const &regions)
+{
+	// The Pi's V4L2 encoder offers no spatial QP map, so we collapse the
+	// regions to a single per-frame importance and steer the QP floor with
+	// that: frames containing something important keep the fine floor, frames
+	// that are all background have it raised, and rate control spends the bits
+	// saved there on the frames - and hence the regions - that matter. Called
+	// on the same thread as EncodeBuffer(), ahead of the frame it applies to.
+	if (!roi_supported_)
+		return;
+
+	float importance = 0.0;
+	for (auto const &region : regions)
+		importance = std::max(importance, region.importance);
+	importance = std::clamp(importance, 0.0f, 1.0f);
+
+	int min_qp = QP_MIN_ACTIVE + (1.0f - importance) * (QP_MIN_STATIC - QP_MIN_ACTIVE) + 0.5f;
+	if (min_qp == roi_min_qp_)
+		return;
+
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_H264_MIN_QP;
+	ctrl.value = min_qp;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG(1, "H264: QP control not supported, ignoring regions of interest");
+		roi_supported_ = false;
+		return;
+	}
+	roi_min_qp_ = min_qp;
+}
+
 void H264Encoder::pollThread()
 {
+	ThreadTuning::Apply("h264-poll");
 	while (true)
 	{
-		pollfd p = { fd_, POLLIN, 0 };
-		int ret = poll(&p, 1, 200);
-		{
-			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-			if (abortPoll_ && input_buffers_available_.size() == NUM_OUTPUT_BUFFERS)
-				break;
-		}
+		epoll_event event;
+		int ret = epoll_wait(epoll_fd_, &event, 1, 200);
+		if (abortPoll_ && input_head_.load() - input_tail_.load() == num_output_buffers_)
+			break;
 		if (ret == -1)
 		{
 			if (errno == EINTR)
 				continue;
-			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from poll");
+			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from epoll_wait");
 		}
-		if (p.revents & POLLIN)
+		if (!ret)
+			continue;
+
+		// Drain everything the codec has ready in this one wakeup, rather than
+		// paying a syscall round trip per buffer. First the returned input
+		// buffers: note each one, identified by its index, as available for
+		// queueing up another frame.
+		unsigned int returned = 0;
+		while (true)
 		{
 			v4l2_buffer buf = {};
 			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -297,47 +419,53 @@ void H264Encoder::pollThread()
 			buf.memory = V4L2_MEMORY_DMABUF;
 			buf.length = 1;
 			buf.m.planes = planes;
-			int ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
-			if (ret == 0)
-			{
-				// Return this to the caller, first noting that this buffer, identified
-				// by its index, is available for queueing up another frame.
-				{
-					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-					input_buffers_available_.push(buf.index);
-				}
-				input_done_callback_(nullptr);
-			}
-
-			buf = {};
-			memset(planes, 0, sizeof(planes));
+			if (xioctl(fd_, VIDIOC_DQBUF, &buf) < 0)
+				break;
+			unsigned int head = input_head_.load(std::memory_order_relaxed);
+			input_buffers_available_[head & INPUT_RING_MASK] = buf.index;
+			input_head_.store(head + 1, std::memory_order_release);
+			returned++;
+		}
+		for (; returned; returned--)
+			input_done_callback_(nullptr);
+
+		// Then the encoded buffers, which we push to another thread so that
+		// our application can take its time with the data without blocking the
+		// encode process. Batching them means one lock and one notify per
+		// wakeup.
+		OutputItem items[NUM_CAPTURE_BUFFERS];
+		unsigned int num_items = 0;
+		while (num_items < NUM_CAPTURE_BUFFERS)
+		{
+			v4l2_buffer buf = {};
+			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
 			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 			buf.memory = V4L2_MEMORY_MMAP;
 			buf.length = 1;
 			buf.m.planes = planes;
-			ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
-			if (ret == 0)
-			{
-				// We push this encoded buffer to another thread so that our
-				// application can take its time with the data without blocking the
-				// encode process.
-				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
-				OutputItem item = { buffers_[buf.index].mem,
-									buf.m.planes[0].bytesused,
-									buf.m.planes[0].length,
-									buf.index,
-									!!(buf.flags & V4L2_BUF_FLAG_KEYFRAME),
-									timestamp_us };
-				std::lock_guard<std::mutex> lock(output_mutex_);
-				output_queue_.push(item);
-				output_cond_var_.notify_one();
-			}
+			if (xioctl(fd_, VIDIOC_DQBUF, &buf) < 0)
+				break;
+			int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+			items[num_items++] = { buffers_[buf.index].mem,
+								   buf.m.planes[0].bytesused,
+								   buf.m.planes[0].length,
+								   buf.index,
+								   !!(buf.flags & V4L2_BUF_FLAG_KEYFRAME),
+								   timestamp_us };
+		}
+		if (num_items)
+		{
+			std::lock_guard<std::mutex> lock(output_mutex_);
+			for (unsigned int i = 0; i < num_items; i++)
+				output_queue_.push(items[i]);
+			output_cond_var_.notify_one();
 		}
 	}
 }
 
 void H264Encoder::outputThread()
 {
+	ThreadTuning::Apply("h264-output");
 	OutputItem item;
 	while (true)
 	{
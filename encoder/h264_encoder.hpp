@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <queue>
@@ -21,14 +23,32 @@ public:
 	~H264Encoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// The hardware has no spatial QP map, so regions steer the per-frame QP
+	// floor instead - see the implementation for the reasoning.
+	void SetRegionsOfInterest(std::vector<RegionOfInterest> const &regions) override;
+	// The codec accepts these controls while streaming; they take effect from
+	// the next queued frame.
+	bool SetBitrate(uint64_t bps) override;
+	bool SetFramerate(double fps) override;
+	bool SetIntraPeriod(unsigned int period) override;
 
 private:
+	// QP floor when something in the frame matters (the hardware default) and
+	// when the whole frame is background.
+	static constexpr int QP_MIN_ACTIVE = 20;
+	static constexpr int QP_MIN_STATIC = 36;
+	int roi_min_qp_ = -1;
+	bool roi_supported_ = true;
 	// We want at least as many output buffers as there are in the camera queue
 	// (we always want to be able to queue them when they arrive). Make loads
 	// of capture buffers, as this is our buffering mechanism in case of delays
 	// dealing with the output bitstream.
 	static constexpr int NUM_OUTPUT_BUFFERS = 6;
 	static constexpr int NUM_CAPTURE_BUFFERS = 12;
+	// Slices per frame in low latency mode. More slices shave more off the
+	// glass-to-glass latency but cost bitrate (each slice resets the entropy
+	// coder and carries its own header).
+	static constexpr int NUM_SLICES = 4;
 
 	// This thread just sits waiting for the encoder to finish stuff. It will either:
 	// * receive "output" buffers (codec inputs), which we must return to the caller
@@ -43,6 +63,7 @@ private:
 	bool abortPoll_;
 	bool abortOutput_;
 	int fd_;
+	int epoll_fd_;
 	struct BufferDescription
 	{
 		void *mem;
@@ -51,8 +72,16 @@ private:
 	BufferDescription buffers_[NUM_CAPTURE_BUFFERS];
 	int num_capture_buffers_;
 	std::thread poll_thread_;
-	std::mutex input_buffers_available_mutex_;
-	std::queue<int> input_buffers_available_;
+	// Lock-free free list of input (codec "output" queue) buffer indices. The
+	// poll thread is the only producer and the caller's thread the only
+	// consumer, so a single-producer single-consumer ring suffices, like the
+	// message queue in rpicam_app.hpp. Power-of-2 sized, with room to spare
+	// should the driver grant more buffers than we asked for.
+	static constexpr unsigned int INPUT_RING_SIZE = 32;
+	static constexpr unsigned int INPUT_RING_MASK = INPUT_RING_SIZE - 1;
+	std::array<int, INPUT_RING_SIZE> input_buffers_available_;
+	std::atomic<unsigned int> input_head_, input_tail_;
+	unsigned int num_output_buffers_;
 	struct OutputItem
 	{
 		void *mem;
@@ -17,6 +17,8 @@
 #include <chrono>
 #include <iostream>
 
+#include "core/thread_tuning.hpp"
+
 #include "libav_encoder.hpp"
 
 namespace {
@@ -117,6 +119,20 @@ const std::map<std::string, std::function<void(VideoOptions const *, AVCodecCont
 	{ "libx264", encoderOptionsLibx264 },
 };
 
+bool codecSupportsDrmPrime(const AVCodec *codec, AVCodecContext *ctx)
+{
+#if LIBAVCODEC_VERSION_MAJOR < 61
+	const enum AVPixelFormat *pix_fmts = codec->pix_fmts;
+#else
+	const enum AVPixelFormat *pix_fmts = nullptr;
+	avcodec_get_supported_config(ctx, codec, AV_CODEC_CONFIG_PIX_FORMAT, 0, (const void **)&pix_fmts, nullptr);
+#endif
+	for (; pix_fmts && *pix_fmts != AV_PIX_FMT_NONE; pix_fmts++)
+		if (*pix_fmts == AV_PIX_FMT_DRM_PRIME)
+			return true;
+	return false;
+}
+
 } // namespace
 
 void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const &info)
@@ -183,19 +199,40 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 	if (fn != optionsMap.end())
 		fn->second(options, codec_ctx_[Video]);
 
+	// Our buffers are dma-bufs from the DmaHeap, so any encoder that accepts
+	// DRM prime frames can import them directly, with no CPU copy or software
+	// format conversion per frame.
+	if (codec_ctx_[Video]->pix_fmt != AV_PIX_FMT_DRM_PRIME && codecSupportsDrmPrime(codec, codec_ctx_[Video]))
+	{
+		codec_ctx_[Video]->pix_fmt = AV_PIX_FMT_DRM_PRIME;
+		LOG(2, "libav: using zero-copy DRM prime input for " << options->Get().libav_video_codec);
+	}
+
 	// Apply general options.
 	encoderOptionsGeneral(options, codec_ctx_[Video]);
 
 	const std::string tcp { "tcp://" };
 	const std::string udp { "udp://" };
+	const std::string srt { "srt://" };
+	const std::string rtmp { "rtmp://" };
+
+	// SRT and RTMP urls get first-class streaming treatment: the protocol
+	// implies the container (SRT carries MPEG-TS, RTMP carries FLV), and the
+	// mux is configured for low latency below.
+	srt_output_ = output_file_.find(srt.c_str(), 0, srt.length()) != std::string::npos;
+	rtmp_output_ = output_file_.find(rtmp.c_str(), 0, rtmp.length()) != std::string::npos;
 
 	// Setup an appropriate stream/container format.
 	const char *format = nullptr;
 	if (options->Get().libav_format.empty())
 	{
+		if (srt_output_)
+			format = "mpegts";
+		else if (rtmp_output_)
+			format = "flv";
 		// Check if output_file_ starts with a "tcp://" or "udp://" url.
-		// C++ 20 has a convenient starts_with() function for this which we may eventually use.		
-		if (output_file_.empty() ||
+		// C++ 20 has a convenient starts_with() function for this which we may eventually use.
+		else if (output_file_.empty() ||
 			output_file_.find(tcp.c_str(), 0, tcp.length()) != std::string::npos ||
 			output_file_.find(udp.c_str(), 0, udp.length()) != std::string::npos)
 		{
@@ -236,6 +273,11 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 	if (!out_fmt_ctx_)
 		throw std::runtime_error("libav: cannot allocate output context, try setting with --libav-format");
 
+	// For live streaming, push every packet to the network as soon as it is
+	// muxed rather than letting the AVIO layer batch them up.
+	if (srt_output_ || rtmp_output_)
+		out_fmt_ctx_->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+
 	if (out_fmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER)
 		codec_ctx_[Video]->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
@@ -278,6 +320,12 @@ void LibAvEncoder::initAudioInCodec(VideoOptions const *options, StreamInfo cons
 	if (options->Get().audio_channels != 0)
 		ret = av_dict_set_int(&format_opts, "channels", options->Get().audio_channels, 0);
 
+	// Smaller capture fragments wake the capture thread more often, but bound
+	// how much audio a device overrun can cost. Input devices without the
+	// option (alsa) simply ignore it.
+	if (options->Get().audio_fragment_size != 0)
+		ret = av_dict_set_int(&format_opts, "fragment_size", options->Get().audio_fragment_size, 0);
+
 	ret = avformat_open_input(&in_fmt_ctx_, options->Get().audio_device.c_str(), input_fmt, &format_opts);
 	if (ret < 0)
 	{
@@ -367,7 +415,8 @@ void LibAvEncoder::initAudioOutCodec(VideoOptions const *options, StreamInfo con
 }
 
 LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
-	: Encoder(options), output_ready_(false), abort_video_(false), abort_audio_(false), video_start_ts_(0),
+	: Encoder(options), output_ready_(false), abort_video_(false), abort_capture_(false), abort_audio_(false),
+	  abort_mux_(false), video_start_ts_(0), video_packets_shed_(0), audio_packets_dropped_(0),
 	  in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr), output_file_(options->Get().output), output_initialised_(false),
 	  elementary_stream_(false)
 {
@@ -388,23 +437,43 @@ LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 
 	LOG(2, "libav: codec init completed");
 
+	mux_thread_ = std::thread(&LibAvEncoder::muxThread, this);
 	video_thread_ = std::thread(&LibAvEncoder::videoThread, this);
 
 	if (options->Get().libav_audio)
+	{
 		audio_thread_ = std::thread(&LibAvEncoder::audioThread, this);
+		audio_capture_thread_ = std::thread(&LibAvEncoder::audioCaptureThread, this);
+	}
 }
 
 LibAvEncoder::~LibAvEncoder()
 {
 	if (options_->Get().libav_audio)
 	{
+		// The capture thread goes first - it stops feeding the ring - then the
+		// audio thread drains what's left and flushes its encoder.
+		abort_capture_ = true;
+		audio_capture_thread_.join();
 		abort_audio_ = true;
+		audio_cv_.notify_one();
 		audio_thread_.join();
 	}
 
 	abort_video_ = true;
 	video_thread_.join();
 
+	// The mux thread must go last, once the encoders have flushed their final
+	// packets into the queues.
+	abort_mux_ = true;
+	mux_cv_.notify_one();
+	mux_thread_.join();
+
+	for (auto &frame : frame_pool_)
+		av_frame_free(&frame);
+	for (auto &pkt : packet_pool_)
+		av_packet_free(&pkt);
+
 	avformat_free_context(out_fmt_ctx_);
 	avcodec_free_context(&codec_ctx_[Video]);
 
@@ -418,11 +487,57 @@ LibAvEncoder::~LibAvEncoder()
 	LOG(2, "libav: codec closed");
 }
 
-void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+AVFrame *LibAvEncoder::getFrame()
 {
+	{
+		std::scoped_lock<std::mutex> lock(frame_pool_mutex_);
+		if (!frame_pool_.empty())
+		{
+			AVFrame *frame = frame_pool_.back();
+			frame_pool_.pop_back();
+			return frame;
+		}
+	}
 	AVFrame *frame = av_frame_alloc();
 	if (!frame)
 		throw std::runtime_error("libav: could not allocate AVFrame");
+	return frame;
+}
+
+void LibAvEncoder::recycleFrame(AVFrame *frame)
+{
+	av_frame_unref(frame);
+	std::scoped_lock<std::mutex> lock(frame_pool_mutex_);
+	frame_pool_.push_back(frame);
+}
+
+AVPacket *LibAvEncoder::getPacket()
+{
+	{
+		std::scoped_lock<std::mutex> lock(packet_pool_mutex_);
+		if (!packet_pool_.empty())
+		{
+			AVPacket *pkt = packet_pool_.back();
+			packet_pool_.pop_back();
+			return pkt;
+		}
+	}
+	AVPacket *pkt = av_packet_alloc();
+	if (!pkt)
+		throw std::runtime_error("libav: could not allocate AVPacket");
+	return pkt;
+}
+
+void LibAvEncoder::recyclePacket(AVPacket *pkt)
+{
+	av_packet_unref(pkt);
+	std::scoped_lock<std::mutex> lock(packet_pool_mutex_);
+	packet_pool_.push_back(pkt);
+}
+
+void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	AVFrame *frame = getFrame();
 
 	if (!video_start_ts_)
 	{
@@ -440,13 +555,14 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 
 	if (codec_ctx_[Video]->pix_fmt == AV_PIX_FMT_DRM_PRIME)
 	{
-		std::scoped_lock<std::mutex> lock(drm_queue_lock_);
-		drm_frame_queue_.emplace(std::make_unique<AVDRMFrameDescriptor>());
-		frame->buf[0] = av_buffer_create((uint8_t *)drm_frame_queue_.back().get(), sizeof(AVDRMFrameDescriptor),
-										 &LibAvEncoder::releaseBuffer, this, 0);
+		// The descriptor travels with the frame and is freed when the codec
+		// releases it, so no queue (or lock) is needed to track it.
+		AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)av_mallocz(sizeof(AVDRMFrameDescriptor));
+		if (!desc)
+			throw std::runtime_error("libav: could not allocate DRM frame descriptor");
+		frame->buf[0] = av_buffer_create((uint8_t *)desc, sizeof(AVDRMFrameDescriptor),
+										 &LibAvEncoder::releaseDrmBuffer, this, 0);
 		frame->data[0] = frame->buf[0]->data;
-
-		AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
 		desc->nb_objects = 1;
 		desc->objects[0].fd = fd;
 		desc->objects[0].size = size;
@@ -494,7 +610,20 @@ void LibAvEncoder::initOutput()
 		if (filename == "-")
 			filename = std::string("pipe:");
 
-		ret = avio_open2(&out_fmt_ctx_->pb, filename.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr);
+		AVDictionary *opts = nullptr;
+		if (srt_output_)
+		{
+			// Live transmission mode with the configured latency window (libsrt
+			// takes it in microseconds): the protocol retransmits lost packets
+			// for up to this long before giving up on them.
+			av_dict_set(&opts, "transtype", "live", 0);
+			av_dict_set_int(&opts, "latency", (int64_t)options_->Get().srt_latency * 1000, 0);
+		}
+		else if (rtmp_output_)
+			av_dict_set(&opts, "rtmp_live", "live", 0);
+
+		ret = avio_open2(&out_fmt_ctx_->pb, filename.c_str(), AVIO_FLAG_WRITE, nullptr, &opts);
+		av_dict_free(&opts);
 		if (ret < 0)
 		{
 			av_strerror(ret, err, sizeof(err));
@@ -559,17 +688,28 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 
 		if (!elementary_stream_)
 		{
-			std::scoped_lock<std::mutex> lock(output_mutex_);
-			// pkt is now blank (av_interleaved_write_frame() takes ownership of
-			// its contents and resets pkt), so that no unreferencing is necessary.
-			// This would be different if one used av_write_frame().
-			ret = av_interleaved_write_frame(out_fmt_ctx_, pkt);
-			if (ret < 0)
+			// Hand the packet to the mux thread through this stream's ring.
+			// If the ring is backing up (the disk has stalled, perhaps), shed
+			// video packets - non-keyframes for preference - rather than let
+			// them delay the audio.
+			MuxQueue &q = mux_queue_[stream_id];
+			unsigned int head = q.head.load(std::memory_order_relaxed);
+			unsigned int occupancy = head - q.tail.load(std::memory_order_acquire);
+			bool shed = occupancy == MUX_QUEUE_SIZE;
+			if (stream_id == Video && occupancy >= VIDEO_SHED_WATERMARK && !(pkt->flags & AV_PKT_FLAG_KEY))
+				shed = true;
+			if (shed)
 			{
-				char err[AV_ERROR_MAX_STRING_SIZE];
-				av_strerror(ret, err, sizeof(err));
-				throw std::runtime_error("libav: error writing output: " + std::string(err));
+				if (stream_id == Video && !(video_packets_shed_++ & 63))
+					LOG(1, "libav: mux queue backed up, shedding video packets");
+				av_packet_unref(pkt);
+				continue;
 			}
+			AVPacket *mux_pkt = getPacket();
+			av_packet_move_ref(mux_pkt, pkt);
+			q.ring[head & MUX_QUEUE_MASK] = mux_pkt;
+			q.head.store(head + 1, std::memory_order_release);
+			mux_cv_.notify_one();
 		}
 		else
 		{
@@ -585,15 +725,21 @@ extern "C" void LibAvEncoder::releaseBuffer(void *opaque, uint8_t *data)
 	LibAvEncoder *enc = static_cast<LibAvEncoder *>(opaque);
 
 	enc->input_done_callback_(nullptr);
+}
+
+extern "C" void LibAvEncoder::releaseDrmBuffer(void *opaque, uint8_t *data)
+{
+	LibAvEncoder *enc = static_cast<LibAvEncoder *>(opaque);
+
+	enc->input_done_callback_(nullptr);
 
-	// Pop the entry from the queue to release the AVDRMFrameDescriptor allocation
-	std::scoped_lock<std::mutex> lock(enc->drm_queue_lock_);
-	if (!enc->drm_frame_queue_.empty())
-		enc->drm_frame_queue_.pop();
+	// The buffer data is the AVDRMFrameDescriptor we allocated in EncodeBuffer.
+	av_free(data);
 }
 
 void LibAvEncoder::videoThread()
 {
+	ThreadTuning::Apply("libav-video");
 	AVPacket *pkt = av_packet_alloc();
 	AVFrame *frame = nullptr;
 
@@ -620,12 +766,22 @@ void LibAvEncoder::videoThread()
 			}
 		}
 
+		// This thread owns the codec context once encoding has started, so
+		// between frames is the one safe place to apply a requested bitrate
+		// change.
+		uint64_t bitrate = pending_bitrate_.exchange(0, std::memory_order_relaxed);
+		if (bitrate)
+		{
+			codec_ctx_[Video]->bit_rate = bitrate;
+			LOG(2, "libav: bitrate changed to " << bitrate);
+		}
+
 		int ret = avcodec_send_frame(codec_ctx_[Video], frame);
 		if (ret < 0)
 			throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
 
 		encode(pkt, Video);
-		av_frame_free(&frame);
+		recycleFrame(frame);
 	}
 
 done:
@@ -634,11 +790,93 @@ done:
 	encode(pkt, Video);
 
 	av_packet_free(&pkt);
+}
+
+void LibAvEncoder::muxThread()
+{
+	ThreadTuning::Apply("libav-mux");
+	while (true)
+	{
+		bool wrote = false;
+		for (auto &q : mux_queue_)
+		{
+			while (true)
+			{
+				unsigned int tail = q.tail.load(std::memory_order_relaxed);
+				if (tail == q.head.load(std::memory_order_acquire))
+					break;
+				AVPacket *pkt = q.ring[tail & MUX_QUEUE_MASK];
+				q.tail.store(tail + 1, std::memory_order_release);
+				int ret = av_interleaved_write_frame(out_fmt_ctx_, pkt);
+				recyclePacket(pkt);
+				if (ret < 0)
+				{
+					char err[AV_ERROR_MAX_STRING_SIZE];
+					av_strerror(ret, err, sizeof(err));
+					throw std::runtime_error("libav: error writing output: " + std::string(err));
+				}
+				wrote = true;
+			}
+		}
+		if (!wrote)
+		{
+			using namespace std::chrono_literals;
+			// Must check the abort only when the queues are empty, so that
+			// the encoders' final flushed packets still get written.
+			if (abort_mux_)
+				break;
+			std::unique_lock<std::mutex> lock(mux_mutex_);
+			mux_cv_.wait_for(lock, 200ms);
+		}
+	}
+
 	deinitOutput();
 }
 
+void LibAvEncoder::audioCaptureThread()
+{
+	// This thread does as little as possible - read a fragment from the device,
+	// hand it over, read again - so it is always back in the device read well
+	// before the next fragment completes, however long the resample/encode on
+	// the audio thread is taking. That is what keeps overruns (the pops in
+	// recordings) away under CPU contention.
+	ThreadTuning::Apply("libav-audio-in");
+
+	while (!abort_capture_)
+	{
+		AVPacket *pkt = getPacket();
+		int ret = av_read_frame(in_fmt_ctx_, pkt);
+		if (ret < 0)
+		{
+			recyclePacket(pkt);
+			if (abort_capture_)
+				break;
+			throw std::runtime_error("libav: cannot read audio in frame");
+		}
+
+		unsigned int head = audio_in_queue_.head.load(std::memory_order_relaxed);
+		if (head - audio_in_queue_.tail.load(std::memory_order_acquire) == MUX_QUEUE_SIZE)
+		{
+			// The audio thread has stalled very badly. Dropping here beats
+			// blocking, which would overrun the device and lose exactly the
+			// same samples less gracefully.
+			if (!audio_packets_dropped_++)
+				LOG(1, "libav: audio capture ring full, dropping");
+			recyclePacket(pkt);
+			continue;
+		}
+		audio_in_queue_.ring[head & MUX_QUEUE_MASK] = pkt;
+		audio_in_queue_.head.store(head + 1, std::memory_order_release);
+		audio_cv_.notify_one();
+	}
+
+	if (audio_packets_dropped_)
+		LOG(1, "libav: " << audio_packets_dropped_ << " audio packets dropped at capture");
+}
+
 void LibAvEncoder::audioThread()
 {
+	ThreadTuning::Apply("libav-audio");
 	const AVSampleFormat required_fmt = codec_ctx_[AudioOut]->sample_fmt;
 	// Amount of time to pre-record audio into the fifo before the first video frame.
 	constexpr std::chrono::milliseconds pre_record_time(10);
@@ -677,9 +915,24 @@ void LibAvEncoder::audioThread()
 
 	swr_init(conv);
 
-	AVPacket *in_pkt = av_packet_alloc();
 	AVPacket *out_pkt = av_packet_alloc();
 	AVFrame *in_frame = av_frame_alloc();
+	// Set the output frame up once; the encode loop below re-uses it (and its
+	// sample buffer, unless the codec still holds a reference) per chunk.
+	AVFrame *out_frame = av_frame_alloc();
+	out_frame->nb_samples = codec_ctx_[AudioOut]->frame_size;
+
+#if LIBAVUTIL_VERSION_MAJOR < 57
+	out_frame->channels = codec_ctx_[AudioOut]->channels;
+	out_frame->channel_layout = av_get_default_channel_layout(codec_ctx_[AudioOut]->channels);
+#else
+	av_channel_layout_copy(&out_frame->ch_layout, &codec_ctx_[AudioOut]->ch_layout);
+#endif
+
+	out_frame->format = required_fmt;
+	out_frame->sample_rate = codec_ctx_[AudioOut]->sample_rate;
+	av_frame_get_buffer(out_frame, 0);
+
 	uint8_t **samples = nullptr;
 	int sample_linesize = 0;
 
@@ -693,12 +946,23 @@ void LibAvEncoder::audioThread()
 	int64_t audio_start_ts = 0;
 	int64_t audio_samples_processed = 0;
 
-	while (!abort_audio_)
+	while (true)
 	{
-		// Audio In
-		ret = av_read_frame(in_fmt_ctx_, in_pkt);
-		if (ret < 0)
-			throw std::runtime_error("libav: cannot read audio in frame");
+		// Audio In: wait for the capture thread to hand a packet through the
+		// ring. Check the abort only when the ring is empty, so everything
+		// captured before shutdown still gets encoded.
+		unsigned int tail = audio_in_queue_.tail.load(std::memory_order_relaxed);
+		if (tail == audio_in_queue_.head.load(std::memory_order_acquire))
+		{
+			using namespace std::chrono_literals;
+			if (abort_audio_)
+				break;
+			std::unique_lock<std::mutex> lock(audio_mutex_);
+			audio_cv_.wait_for(lock, 100ms);
+			continue;
+		}
+		AVPacket *in_pkt = audio_in_queue_.ring[tail & MUX_QUEUE_MASK];
+		audio_in_queue_.tail.store(tail + 1, std::memory_order_release);
 
 		// Track the first audio timestamp for synchronization
 		if (!audio_start_ts && in_pkt->pts != AV_NOPTS_VALUE)
@@ -759,7 +1023,7 @@ void LibAvEncoder::audioThread()
 		av_audio_fifo_write(fifo, (void **)samples, num_output_samples);
 
 		av_frame_unref(in_frame);
-		av_packet_unref(in_pkt);
+		recyclePacket(in_pkt);
 
 		// Not yet ready to generate encoded audio!
 		if (!output_ready_ || av_audio_fifo_size(fifo) < codec_ctx_[AudioOut]->frame_size)
@@ -768,20 +1032,7 @@ void LibAvEncoder::audioThread()
 		// Audio Out
 		while (av_audio_fifo_size(fifo) >= codec_ctx_[AudioOut]->frame_size)
 		{
-			AVFrame *out_frame = av_frame_alloc();
-			out_frame->nb_samples = codec_ctx_[AudioOut]->frame_size;
-
-#if LIBAVUTIL_VERSION_MAJOR < 57
-			out_frame->channels = codec_ctx_[AudioOut]->channels;
-			out_frame->channel_layout = av_get_default_channel_layout(codec_ctx_[AudioOut]->channels);
-#else
-			av_channel_layout_copy(&out_frame->ch_layout, &codec_ctx_[AudioOut]->ch_layout);
-#endif
-
-			out_frame->format = required_fmt;
-			out_frame->sample_rate = codec_ctx_[AudioOut]->sample_rate;
-
-			av_frame_get_buffer(out_frame, 0);
+			av_frame_make_writable(out_frame);
 			av_audio_fifo_read(fifo, (void **)out_frame->data, codec_ctx_[AudioOut]->frame_size);
 
 			int64_t sample_time_us =
@@ -807,11 +1058,7 @@ void LibAvEncoder::audioThread()
 				throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
 
 			encode(out_pkt, AudioOut);
-			av_frame_free(&out_frame);
 		}
-
-		// Avoid spinning this thread.
-		std::this_thread::sleep_for(5ms);
 	}
 
 	// Flush the encoder
@@ -822,9 +1069,9 @@ void LibAvEncoder::audioThread()
 	av_freep(&samples[0]);
 	av_audio_fifo_free(fifo);
 
-	av_packet_free(&in_pkt);
 	av_packet_free(&out_pkt);
 	av_frame_free(&in_frame);
+	av_frame_free(&out_frame);
 }
 
 static Encoder *Create(VideoOptions *options, StreamInfo const &info)
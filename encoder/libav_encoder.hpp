@@ -7,12 +7,14 @@
 
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 extern "C"
 {
@@ -39,6 +41,14 @@ public:
 	~LibAvEncoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// Request a new rate control target; the video thread applies it between
+	// frames. Codec wrappers with runtime reconfiguration (libx264) pick it
+	// up from the next frame, others may ignore it.
+	bool SetBitrate(uint64_t bps) override
+	{
+		pending_bitrate_.store(bps, std::memory_order_relaxed);
+		return true;
+	}
 
 private:
 	void initVideoCodec(VideoOptions const *options, StreamInfo const &info);
@@ -50,22 +60,66 @@ private:
 	void encode(AVPacket *pkt, unsigned int stream_id);
 
 	void videoThread();
+	void audioCaptureThread();
 	void audioThread();
+	void muxThread();
 
 	static void releaseBuffer(void *opaque, uint8_t *data);
+	static void releaseDrmBuffer(void *opaque, uint8_t *data);
+
+	// Frame wrappers are recycled through a small pool rather than allocated
+	// per buffer, so the steady-state encode loop makes no allocator calls.
+	AVFrame *getFrame();
+	void recycleFrame(AVFrame *frame);
+	AVPacket *getPacket();
+	void recyclePacket(AVPacket *pkt);
 
 	std::atomic<bool> output_ready_;
+	std::atomic<uint64_t> pending_bitrate_ { 0 };
 	bool abort_video_;
+	bool abort_capture_;
 	bool abort_audio_;
+	bool abort_mux_;
 	uint64_t video_start_ts_;
 
 	std::queue<AVFrame *> frame_queue_;
+	std::vector<AVFrame *> frame_pool_;
+	std::mutex frame_pool_mutex_;
+	std::vector<AVPacket *> packet_pool_;
+	std::mutex packet_pool_mutex_;
 	std::mutex video_mutex_;
-	std::mutex output_mutex_;
 	std::condition_variable video_cv_;
 	std::thread video_thread_;
 	std::thread audio_thread_;
 
+	// The mux stage: the audio and video threads each feed a bounded
+	// single-producer single-consumer packet ring (no locks on the encode
+	// paths), drained by one mux thread. When the video ring backs up - e.g.
+	// during a disk stall - video packets are shed, non-keyframes first, so
+	// audio never queues behind video.
+	static constexpr unsigned int MUX_QUEUE_SIZE = 64;
+	static constexpr unsigned int MUX_QUEUE_MASK = MUX_QUEUE_SIZE - 1;
+	static constexpr unsigned int VIDEO_SHED_WATERMARK = 48;
+	struct MuxQueue
+	{
+		std::array<AVPacket *, MUX_QUEUE_SIZE> ring;
+		std::atomic<unsigned int> head { 0 }, tail { 0 };
+	};
+	MuxQueue mux_queue_[2]; // indexed by Video / AudioOut
+	std::thread mux_thread_;
+	std::mutex mux_mutex_; // parks the mux thread only, never taken by producers
+	std::condition_variable mux_cv_;
+	uint64_t video_packets_shed_;
+
+	// Audio capture runs on its own minimal thread - read a packet from the
+	// device, push it into another of those rings - so a slow resample/encode
+	// on the audio thread can never back up into the device and overrun it.
+	MuxQueue audio_in_queue_;
+	std::thread audio_capture_thread_;
+	std::mutex audio_mutex_; // parks the audio thread only, never taken by the capture thread
+	std::condition_variable audio_cv_;
+	uint64_t audio_packets_dropped_;
+
 	// The ordering in the enum below must not change!
 	enum Context { Video = 0, AudioOut = 1, AudioIn = 2 };
 	AVCodecContext *codec_ctx_[3];
@@ -73,10 +127,9 @@ private:
 	AVFormatContext *in_fmt_ctx_;
 	AVFormatContext *out_fmt_ctx_;
 
-	std::mutex drm_queue_lock_;
-	std::queue<std::unique_ptr<AVDRMFrameDescriptor>> drm_frame_queue_;
-
 	std::string output_file_;
 	bool output_initialised_;
 	bool elementary_stream_;
+	bool srt_output_;
+	bool rtmp_output_;
 };
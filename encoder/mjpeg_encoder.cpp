@@ -6,10 +6,15 @@
  */
 
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
 
 #include <jpeglib.h>
 
+#include "core/thread_tuning.hpp"
+#include "image/jpeg_markers.hpp"
+
 #include "mjpeg_encoder.hpp"
 
 #if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
@@ -21,62 +26,111 @@ typedef unsigned long jpeg_mem_len_t;
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
 	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
 {
+	num_threads_ = options->Get().encoder_threads;
+	if (!num_threads_)
+		num_threads_ = std::max(1u, std::thread::hardware_concurrency());
+	output_queue_.resize(num_threads_);
+
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
-	LOG(2, "Opened MjpegEncoder");
+	for (unsigned int i = 0; i < num_threads_; i++)
+		encode_thread_.emplace_back(std::bind(&MjpegEncoder::encodeThread, this, i));
+	LOG(2, "Opened MjpegEncoder with " << num_threads_ << " encode threads");
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
 	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
+	for (auto &thread : encode_thread_)
+		thread.join();
 	abortOutput_ = true;
 	output_thread_.join();
+	for (auto &buffer : free_buffers_)
+		free(buffer.mem);
 	LOG(2, "MjpegEncoder closed");
 }
 
 void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
 	std::lock_guard<std::mutex> lock(encode_mutex_);
+	// In low-latency mode, split the frame into horizontal bands of whole MCU
+	// rows (16 pixels for YUV420) and encode them concurrently. Each band is a
+	// complete JPEG whose entropy data gets stitched back together with restart
+	// markers, so single-frame latency drops by roughly the band count.
+	if (options_->Get().low_latency && num_threads_ > 1)
+	{
+		unsigned int mcu_rows = (info.height + 15) / 16;
+		unsigned int mcus_per_row = (info.width + 15) / 16;
+		unsigned int rows_per_band = (mcu_rows + num_threads_ - 1) / num_threads_;
+		unsigned int bands = (mcu_rows + rows_per_band - 1) / rows_per_band;
+		// The restart interval (one per band) must fit in the 16-bit DRI field.
+		if (bands > 1 && rows_per_band * mcus_per_row <= 65535)
+		{
+			auto group = std::make_shared<BandGroup>();
+			group->bands.resize(bands);
+			group->band_len.resize(bands);
+			group->remaining = bands;
+			group->height = info.height;
+			group->timestamp_us = timestamp_us;
+			group->index = index_;
+			for (unsigned int b = 0; b < bands; b++)
+			{
+				EncodeItem item = { mem, info, timestamp_us, index_ };
+				item.y_offset = b * rows_per_band * 16;
+				item.band_height = std::min(info.height - item.y_offset, rows_per_band * 16);
+				item.restart_mcus = rows_per_band * mcus_per_row;
+				item.band = b;
+				item.group = group;
+				encode_queue_.push(item);
+			}
+			index_++;
+			encode_cond_var_.notify_all();
+			return;
+		}
+	}
 	EncodeItem item = { mem, info, timestamp_us, index_++ };
 	encode_queue_.push(item);
 	encode_cond_var_.notify_all();
 }
 
 void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
+							  size_t &buffer_size, size_t &buffer_len)
 {
-	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
+	// Copied from YUV420_to_JPEG_fast in jpeg.cpp. A band (in low-latency
+	// mode) is encoded just like a short frame starting at y_offset.
+	unsigned int height = item.band_height ? item.band_height : item.info.height;
 	cinfo.image_width = item.info.width;
-	cinfo.image_height = item.info.height;
+	cinfo.image_height = height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = 0;
+	cinfo.restart_interval = item.restart_mcus;
 
 	jpeg_set_defaults(&cinfo);
 	cinfo.raw_data_in = TRUE;
 	jpeg_set_quality(&cinfo, options_->Get().quality, TRUE);
-	encoded_buffer = nullptr;
 	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
+	// Hand jpeg_mem_dest the pooled buffer (if we have one); libjpeg only
+	// reallocates when the JPEG outgrows it.
+	uint8_t *const pooled_buffer = encoded_buffer;
+	jpeg_mem_len_t jpeg_mem_len = buffer_size;
 	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
 	jpeg_start_compress(&cinfo, TRUE);
 
 	int stride2 = item.info.stride / 2;
-	uint8_t *Y = (uint8_t *)item.mem;
-	uint8_t *U = (uint8_t *)Y + item.info.stride * item.info.height;
-	uint8_t *V = (uint8_t *)U + stride2 * (item.info.height / 2);
-	uint8_t *Y_max = U - item.info.stride;
-	uint8_t *U_max = V - stride2;
+	uint8_t *Y_plane = (uint8_t *)item.mem;
+	uint8_t *U_plane = Y_plane + item.info.stride * item.info.height;
+	uint8_t *V_plane = U_plane + stride2 * (item.info.height / 2);
+	uint8_t *Y = Y_plane + item.y_offset * item.info.stride;
+	uint8_t *U = U_plane + (item.y_offset / 2) * stride2;
+	uint8_t *V = V_plane + (item.y_offset / 2) * stride2;
+	uint8_t *Y_max = U_plane - item.info.stride;
+	uint8_t *U_max = V_plane - stride2;
 	uint8_t *V_max = U_max + stride2 * (item.info.height / 2);
 
 	JSAMPROW y_rows[16];
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.info.height;)
+	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < height;)
 	{
 		for (int i = 0; i < 16; i++, Y_row += item.info.stride)
 			y_rows[i] = std::min(Y_row, Y_max);
@@ -89,10 +143,61 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 
 	jpeg_finish_compress(&cinfo);
 	buffer_len = jpeg_mem_len;
+	// If libjpeg grew the buffer it freed the pooled one; the exact new
+	// capacity isn't reported, so record the data size - the pool's buffers
+	// converge on the high-water mark after a few frames.
+	if (encoded_buffer != pooled_buffer)
+		buffer_size = buffer_len;
+}
+
+MjpegEncoder::OutputItem MjpegEncoder::joinBands(BandGroup &group, int num)
+{
+	unsigned int bands = group.bands.size();
+
+	// The shared stitcher joins the bands: band 0 keeps its headers (with the
+	// height patched back to the full frame), every other band contributes its
+	// entropy data behind a restart marker.
+	std::vector<JpegMarkers::Band> stitch_bands(bands);
+	for (unsigned int b = 0; b < bands; b++)
+		stitch_bands[b] = { group.bands[b].mem, group.band_len[b] };
+	size_t total = JpegMarkers::StitchedSize(stitch_bands);
+
+	uint8_t *out = nullptr;
+	size_t out_size = 0;
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex_);
+		if (!free_buffers_.empty())
+		{
+			out = free_buffers_.back().mem;
+			out_size = free_buffers_.back().size;
+			free_buffers_.pop_back();
+		}
+	}
+	if (out_size < total)
+	{
+		free(out);
+		out = (uint8_t *)malloc(total);
+		if (!out)
+			throw std::runtime_error("failed to allocate JPEG join buffer");
+		out_size = total;
+	}
+
+	size_t pos = JpegMarkers::Stitch(out, stitch_bands, group.height);
+
+	// The band buffers can go straight back in the pool; unlike whole frames
+	// they don't pass through the output thread.
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex_);
+		for (auto &band : group.bands)
+			free_buffers_.push_back(band);
+	}
+
+	return { out, out_size, pos, group.timestamp_us, group.index, num };
 }
 
 void MjpegEncoder::encodeThread(int num)
 {
+	ThreadTuning::Apply(("mjpeg-enc" + std::to_string(num)).c_str());
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	cinfo.err = jpeg_std_error(&jerr);
@@ -127,20 +232,51 @@ void MjpegEncoder::encodeThread(int num)
 			}
 		}
 
-		// Encode the buffer.
+		// Encode the buffer, re-using an output buffer from the pool when one
+		// is available.
 		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
+		size_t buffer_size = 0, buffer_len = 0;
+		{
+			std::lock_guard<std::mutex> lock(pool_mutex_);
+			if (!free_buffers_.empty())
+			{
+				encoded_buffer = free_buffers_.back().mem;
+				buffer_size = free_buffers_.back().size;
+				free_buffers_.pop_back();
+			}
+		}
 		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
+		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_size, buffer_len);
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
 		frames++;
 		// Don't return buffers until the output thread as that's where they're
 		// in order again.
 
+		if (encode_item.group)
+		{
+			// This was one band of a frame; the last worker to finish joins
+			// the bands and pushes the completed frame.
+			BandGroup &group = *encode_item.group;
+			group.bands[encode_item.band] = { encoded_buffer, buffer_size };
+			group.band_len[encode_item.band] = buffer_len;
+			if (group.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			{
+				encode_item.group.reset();
+				continue;
+			}
+			OutputItem output_item = joinBands(group, num);
+			encode_item.group.reset();
+			std::lock_guard<std::mutex> lock(output_mutex_);
+			output_queue_[num].push(output_item);
+			output_cond_var_.notify_one();
+			continue;
+		}
+
 		// We push this encoded buffer to another thread so that our
 		// application can take its time with the data without blocking the
 		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
+		OutputItem output_item = { encoded_buffer, buffer_size, buffer_len,
+								   encode_item.timestamp_us, encode_item.index, num };
 		std::lock_guard<std::mutex> lock(output_mutex_);
 		output_queue_[num].push(output_item);
 		output_cond_var_.notify_one();
@@ -149,6 +285,7 @@ void MjpegEncoder::encodeThread(int num)
 
 void MjpegEncoder::outputThread()
 {
+	ThreadTuning::Apply("mjpeg-output");
 	OutputItem item;
 	uint64_t index = 0;
 	while (true)
@@ -187,7 +324,11 @@ void MjpegEncoder::outputThread()
 		input_done_callback_(nullptr);
 
 		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
+		{
+			// Return the buffer to the pool for re-use.
+			std::lock_guard<std::mutex> lock(pool_mutex_);
+			free_buffers_.push_back({ (uint8_t *)item.mem, item.size });
+		}
 		index++;
 	}
 }
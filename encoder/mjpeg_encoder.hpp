@@ -7,10 +7,13 @@
 
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
@@ -25,8 +28,10 @@ public:
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 4;
+	// How many threads to use. Whichever thread is idle will pick up the next
+	// frame from the shared queue, so a stalled worker never strands frames.
+	// Sized from the hardware concurrency, or the --encoder-threads option.
+	unsigned int num_threads_;
 
 	// These threads do the actual encoding.
 	void encodeThread(int num);
@@ -40,28 +45,67 @@ private:
 	bool abortOutput_;
 	uint64_t index_;
 
+	// Pool of reusable output buffers. Once the buffers have grown to the
+	// high-water JPEG size, steady-state encoding makes no heap allocations per
+	// frame. The pool is shared between threads: in low-latency mode band
+	// buffers migrate from one worker to another, so per-thread pools would
+	// slowly drain.
+	struct PoolBuffer
+	{
+		uint8_t *mem;
+		size_t size;
+	};
+
+	// In low-latency mode a frame is split into horizontal bands encoded
+	// concurrently; the group collects the bands so the last worker to finish
+	// can join them with restart markers.
+	struct BandGroup
+	{
+		std::vector<PoolBuffer> bands;
+		std::vector<size_t> band_len;
+		std::atomic<unsigned int> remaining;
+		unsigned int height; // of the full frame
+		int64_t timestamp_us;
+		uint64_t index;
+	};
+
 	struct EncodeItem
 	{
 		void *mem;
 		StreamInfo info;
 		int64_t timestamp_us;
 		uint64_t index;
+		// Band fields, used only in low-latency mode.
+		unsigned int y_offset = 0;
+		unsigned int band_height = 0; // 0 means the whole frame
+		unsigned int restart_mcus = 0;
+		unsigned int band = 0;
+		std::shared_ptr<BandGroup> group;
 	};
 	std::queue<EncodeItem> encode_queue_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::vector<std::thread> encode_thread_;
+	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
+					size_t &buffer_size, size_t &buffer_len);
 
 	struct OutputItem
 	{
 		void *mem;
+		size_t size; // buffer capacity, for returning it to the pool
 		size_t bytes_used;
 		int64_t timestamp_us;
 		uint64_t index;
+		int thread;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
+	std::vector<std::queue<OutputItem>> output_queue_; // one per encode thread
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
+
+	// Stitch the bands of a finished group into a single JPEG.
+	OutputItem joinBands(BandGroup &group, int num);
+
+	std::vector<PoolBuffer> free_buffers_;
+	std::mutex pool_mutex_;
 };
@@ -9,6 +9,8 @@
 #include <iostream>
 #include <stdexcept>
 
+#include "core/thread_tuning.hpp"
+
 #include "null_encoder.hpp"
 
 NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options), abort_(false)
@@ -27,6 +29,16 @@ NullEncoder::~NullEncoder()
 // Push the buffer onto the output queue to be "encoded" and returned.
 void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
+	// Passthrough mode: when the application wants the dma-buf fd rather than
+	// the mapped data, hand it over right here - no queue hop or thread
+	// wakeup, and nobody need ever touch the actual bytes.
+	if (output_ready_fd_callback_)
+	{
+		// Input done first, as ever, so the metadata queue stays in step.
+		input_done_callback_(nullptr);
+		output_ready_fd_callback_(fd, size, timestamp_us, true);
+		return;
+	}
 	std::lock_guard<std::mutex> lock(output_mutex_);
 	OutputItem item = { mem, size, timestamp_us };
 	output_queue_.push(item);
@@ -37,6 +49,7 @@ void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 // of buffers limits the amount of queueing possible here...
 void NullEncoder::outputThread()
 {
+	ThreadTuning::Apply("null-output");
 	OutputItem item;
 	while (true)
 	{
@@ -5,8 +5,12 @@
  * dng.cpp - Save raw image as DNG file.
  */
 
+#include <algorithm>
+#include <functional>
 #include <limits>
 #include <map>
+#include <thread>
+#include <vector>
 
 #include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
@@ -76,10 +80,16 @@ static const std::map<PixelFormat, BayerFormat> bayer_formats =
 	{ formats::BGGR_PISP_COMP1, { "BGGR-16-PISP", 16, TIFF_BGGR, false, true } },
 };
 
-static void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+// The unpack/uncompress functions all work on an arbitrary band of rows so
+// that the bands can be handed out to worker threads, one per core.
+
+static void unpack_10bit(uint8_t const *src, StreamInfo const &info, unsigned int y_start, unsigned int y_end,
+						 uint16_t *dest)
 {
 	unsigned int w_align = info.width & ~3;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	src += y_start * info.stride;
+	dest += y_start * info.width;
+	for (unsigned int y = y_start; y < y_end; y++, src += info.stride)
 	{
 		uint8_t const *ptr = src;
 		unsigned int x;
@@ -95,10 +105,13 @@ static void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *d
 	}
 }
 
-static void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static void unpack_12bit(uint8_t const *src, StreamInfo const &info, unsigned int y_start, unsigned int y_end,
+						 uint16_t *dest)
 {
 	unsigned int w_align = info.width & ~1;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	src += y_start * info.stride;
+	dest += y_start * info.width;
+	for (unsigned int y = y_start; y < y_end; y++, src += info.stride)
 	{
 		uint8_t const *ptr = src;
 		unsigned int x;
@@ -112,11 +125,14 @@ static void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *d
 	}
 }
 
-static void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static void unpack_16bit(uint8_t const *src, StreamInfo const &info, unsigned int y_start, unsigned int y_end,
+						 uint16_t *dest)
 {
 	/* Assume the pixels in memory are already in native byte order */
 	unsigned int w = info.width;
-	for (unsigned int y = 0; y < info.height; y++)
+	src += y_start * info.stride;
+	dest += y_start * w;
+	for (unsigned int y = y_start; y < y_end; y++)
 	{
 		memcpy(dest, src, 2 * w);
 		dest += w;
@@ -215,11 +231,12 @@ static void subBlockFunction(uint16_t *d, uint32_t w)
 	d[6] = dequantize(q[3], qmode);
 }
 
-static void uncompress(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static void uncompress(uint8_t const *src, StreamInfo const &info, unsigned int y_start, unsigned int y_end,
+					   uint16_t *dest)
 {
 	// In all cases, the *decompressed* image must be a multiple of 8 columns wide.
 	unsigned int buf_stride_pixels = (info.width + 7) & ~7;
-	for (unsigned int y = 0; y < info.height; ++y)
+	for (unsigned int y = y_start; y < y_end; ++y)
 	{
 		uint16_t *dp = dest + y * buf_stride_pixels;
 		uint8_t const *sp = src + y * info.stride;
@@ -247,6 +264,32 @@ static void uncompress(uint8_t const *src, StreamInfo const &info, uint16_t *des
 	}
 }
 
+// Split the image into horizontal bands of rows and run the given unpack (or
+// uncompress) function on each band in its own thread. All the unpack loops
+// are row-independent, so this scales across however many cores we have.
+static void unpack_parallel(std::function<void(unsigned int, unsigned int)> const &band_fn, unsigned int height)
+{
+	unsigned int num_threads = std::min(std::max(std::thread::hardware_concurrency(), 1u), height);
+	if (num_threads <= 1)
+	{
+		band_fn(0, height);
+		return;
+	}
+
+	unsigned int rows_per_band = (height + num_threads - 1) / num_threads;
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < num_threads; t++)
+	{
+		unsigned int y_start = t * rows_per_band;
+		unsigned int y_end = std::min(y_start + rows_per_band, height);
+		if (y_start >= y_end)
+			break;
+		threads.emplace_back(band_fn, y_start, y_end);
+	}
+	for (auto &thread : threads)
+		thread.join();
+}
+
 struct Matrix
 {
 Matrix(float m0, float m1, float m2,
@@ -311,9 +354,12 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 	unsigned int buf_stride_pixels = info.width;
 	unsigned int buf_stride_pixels_padded = (buf_stride_pixels + 7) & ~7;
 	std::vector<uint16_t> buf(buf_stride_pixels_padded * info.height);
+	uint8_t const *src = mem[0].data();
+	uint16_t *dest = &buf[0];
 	if (bayer_format.compressed)
 	{
-		uncompress(mem[0].data(), info, &buf[0]);
+		unpack_parallel([=, &info](unsigned int y_start, unsigned int y_end) { uncompress(src, info, y_start, y_end, dest); },
+						info.height);
 		buf_stride_pixels = buf_stride_pixels_padded;
 	}
 	else if (bayer_format.packed)
@@ -321,15 +367,18 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		switch (bayer_format.bits)
 		{
 		case 10:
-			unpack_10bit(mem[0].data(), info, &buf[0]);
+			unpack_parallel([=, &info](unsigned int y_start, unsigned int y_end) { unpack_10bit(src, info, y_start, y_end, dest); },
+							info.height);
 			break;
 		case 12:
-			unpack_12bit(mem[0].data(), info, &buf[0]);
+			unpack_parallel([=, &info](unsigned int y_start, unsigned int y_end) { unpack_12bit(src, info, y_start, y_end, dest); },
+							info.height);
 			break;
 		}
 	}
 	else
-		unpack_16bit(mem[0].data(), info, &buf[0]);
+		unpack_parallel([=, &info](unsigned int y_start, unsigned int y_end) { unpack_16bit(src, info, y_start, y_end, dest); },
+						info.height);
 
 	// We need to fish out some metadata values for the DNG.
 	float black = 4096 * (1 << bayer_format.bits) / 65536.0;
@@ -476,10 +525,30 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		TIFFSetField(tif, TIFFTAG_BLACKLEVELREPEATDIM, &black_level_repeat_dim);
 		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 4, &black_levels);
 
-		for (unsigned int y = 0; y < info.height; y++)
+		if (buf_stride_pixels == info.width)
+		{
+			// The rows are contiguous in the buffer, so batch them into large
+			// strips - far fewer libtiff calls and write syscalls than going
+			// scanline by scanline.
+			const unsigned int rows_per_strip = 128;
+			TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+			for (unsigned int y = 0, strip = 0; y < info.height; y += rows_per_strip, strip++)
+			{
+				unsigned int num_rows = std::min(info.height - y, rows_per_strip);
+				tmsize_t strip_size = (tmsize_t)num_rows * info.width * sizeof(uint16_t);
+				if (TIFFWriteEncodedStrip(tif, strip, &buf[buf_stride_pixels * y], strip_size) < 0)
+					throw std::runtime_error("error writing DNG image data");
+			}
+		}
+		else
 		{
-			if (TIFFWriteScanline(tif, &buf[buf_stride_pixels * y], y, 0) != 1)
-				throw std::runtime_error("error writing DNG image data");
+			// Decompressed buffers can be padded wider than the image, so those
+			// rows must still go out one scanline at a time.
+			for (unsigned int y = 0; y < info.height; y++)
+			{
+				if (TIFFWriteScanline(tif, &buf[buf_stride_pixels * y], y, 0) != 1)
+					throw std::runtime_error("error writing DNG image data");
+			}
 		}
 
 		// We have to checkpoint before the directory offset is valid.
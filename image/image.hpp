@@ -21,6 +21,12 @@ struct StillOptions;
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_model,
 			   StillOptions const *options);
+// As above, but with a (hardware-scaled) lores image to be used as the source
+// for the EXIF thumbnail, avoiding a software downscale of the main image.
+void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+			   libcamera::Span<uint8_t> const &lores, StreamInfo const &lores_info,
+			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_model,
+			   StillOptions const *options);
 
 // In yuv.cpp:
 void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
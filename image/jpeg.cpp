@@ -8,10 +8,22 @@
 #include <cstdio>
 #include <cstring>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <libcamera/control_ids.h>
@@ -22,6 +34,7 @@
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
+#include "image/jpeg_markers.hpp"
 
 #ifndef MAKE_STRING
 #define MAKE_STRING "Raspberry Pi"
@@ -49,7 +62,6 @@ static void exif_set_string(ExifEntry *entry, char const *s);
 static void exif_read_tag(ExifData *exif, char const *str);
 
 static const ExifByteOrder exif_byte_order = EXIF_BYTE_ORDER_INTEL;
-static const unsigned int exif_image_offset = 20; // offset of image in JPEG buffer
 static const unsigned char exif_header[] = { 0xff, 0xd8, 0xff, 0xe1 };
 
 struct ExifException
@@ -253,15 +265,107 @@ void exif_read_tag(ExifData *exif, char const *str)
 	}
 }
 
-static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
-						 const unsigned int output_width, const unsigned int output_height,
-						 const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+// A pooled libjpeg encoder. The compress object and its growing output arena
+// survive from one capture to the next, so a warm still loop (think photobooth
+// keypress captures in zsl mode) doesn't rebuild the libjpeg state or re-grow
+// the destination buffer from scratch on every shot.
+class JpegEncoder
 {
+public:
+	JpegEncoder()
+	{
+		cinfo.err = jpeg_std_error(&jerr_);
+		jpeg_create_compress(&cinfo);
+	}
+	~JpegEncoder()
+	{
+		jpeg_destroy_compress(&cinfo);
+		free(buffer_);
+	}
+	// Attach the arena as the compressed output destination; call before
+	// jpeg_start_compress().
+	void SetDest()
+	{
+		out_ = buffer_;
+		out_len_ = capacity_;
+		jpeg_mem_dest(&cinfo, &out_, &out_len_);
+	}
+	// Call after jpeg_finish_compress(). If libjpeg outgrew the arena it
+	// replaced it with a malloc'd buffer (without freeing ours), so adopt the
+	// replacement for next time.
+	void Finish()
+	{
+		if (out_ != buffer_)
+		{
+			free(buffer_);
+			buffer_ = out_;
+			capacity_ = out_len_;
+		}
+	}
+	// For callers assembling the output themselves (the parallel band
+	// stitcher): grow the arena to len bytes and point the output at it.
+	uint8_t *Reserve(size_t len)
+	{
+		if (capacity_ < len)
+		{
+			free(buffer_);
+			buffer_ = (uint8_t *)malloc(len);
+			if (!buffer_)
+				throw std::runtime_error("failed to allocate JPEG buffer");
+			capacity_ = len;
+		}
+		out_ = buffer_;
+		out_len_ = len;
+		return buffer_;
+	}
+	void SetLen(size_t len) { out_len_ = len; }
+	uint8_t *Data() const { return out_; }
+	jpeg_mem_len_t Len() const { return out_len_; }
+
 	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
+private:
+	struct jpeg_error_mgr jerr_;
+	uint8_t *buffer_ = nullptr;
+	jpeg_mem_len_t capacity_ = 0;
+	uint8_t *out_ = nullptr;
+	jpeg_mem_len_t out_len_ = 0;
+};
+
+// The encoder pool, shared by the save workers and the parallel band threads.
+static std::mutex encoder_pool_mutex;
+static std::vector<std::unique_ptr<JpegEncoder>> encoder_pool;
+
+class PooledEncoder
+{
+public:
+	PooledEncoder()
+	{
+		{
+			std::lock_guard<std::mutex> lock(encoder_pool_mutex);
+			if (!encoder_pool.empty())
+				enc_ = std::move(encoder_pool.back()), encoder_pool.pop_back();
+		}
+		if (!enc_)
+			enc_ = std::make_unique<JpegEncoder>();
+	}
+	~PooledEncoder()
+	{
+		std::lock_guard<std::mutex> lock(encoder_pool_mutex);
+		encoder_pool.push_back(std::move(enc_));
+	}
+	JpegEncoder &operator*() const { return *enc_; }
+	JpegEncoder *operator->() const { return enc_.get(); }
+
+private:
+	std::unique_ptr<JpegEncoder> enc_;
+};
+
+static void YUYV_to_JPEG(JpegEncoder &enc, const uint8_t *input, StreamInfo const &info,
+						 const unsigned int output_width, const unsigned int output_height,
+						 const int quality, const unsigned int restart)
+{
+	struct jpeg_compress_struct &cinfo = enc.cinfo;
 
 	cinfo.image_width = output_width;
 	cinfo.image_height = output_height;
@@ -270,10 +374,9 @@ static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	cinfo.restart_interval = restart;
 
 	jpeg_set_defaults(&cinfo);
+	cinfo.raw_data_in = FALSE; // the encoder may previously have run in raw mode
 	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
+	enc.SetDest();
 	jpeg_start_compress(&cinfo, TRUE);
 
 	const unsigned int output_width3 = 3 * output_width;
@@ -304,21 +407,21 @@ static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	}
 
 	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+	enc.Finish();
 }
 
-static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
+static void YUV420_to_JPEG_fast(JpegEncoder &enc, const uint8_t *input, StreamInfo const &info,
 								const int quality, const unsigned int restart,
-								uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+								unsigned int y_offset = 0, unsigned int band_height = 0)
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
+	struct jpeg_compress_struct &cinfo = enc.cinfo;
 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
+	// A non-zero band_height encodes just that horizontal band of the image,
+	// starting at y_offset; the parallel encoder below uses this.
+	unsigned int height = band_height ? band_height : info.height;
 
 	cinfo.image_width = info.width;
-	cinfo.image_height = info.height;
+	cinfo.image_height = height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
 	cinfo.restart_interval = restart;
@@ -326,24 +429,25 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	jpeg_set_defaults(&cinfo);
 	cinfo.raw_data_in = TRUE;
 	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
+	enc.SetDest();
 	jpeg_start_compress(&cinfo, TRUE);
 
 	int stride2 = info.stride / 2;
-	uint8_t *Y = (uint8_t *)input;
-	uint8_t *U = (uint8_t *)Y + info.stride * info.height;
-	uint8_t *V = (uint8_t *)U + stride2 * (info.height / 2);
-	uint8_t *Y_max = U - info.stride;
-	uint8_t *U_max = V - stride2;
+	uint8_t *Y_plane = (uint8_t *)input;
+	uint8_t *U_plane = Y_plane + info.stride * info.height;
+	uint8_t *V_plane = U_plane + stride2 * (info.height / 2);
+	uint8_t *Y = Y_plane + y_offset * info.stride;
+	uint8_t *U = U_plane + (y_offset / 2) * stride2;
+	uint8_t *V = V_plane + (y_offset / 2) * stride2;
+	uint8_t *Y_max = U_plane - info.stride;
+	uint8_t *U_max = V_plane - stride2;
 	uint8_t *V_max = U_max + stride2 * (info.height / 2);
 
 	JSAMPROW y_rows[16];
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < info.height;)
+	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < height;)
 	{
 		for (int i = 0; i < 16; i++, Y_row += info.stride)
 			y_rows[i] = std::min(Y_row, Y_max);
@@ -355,25 +459,249 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	}
 
 	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+	enc.Finish();
 }
 
-static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
+// Encode the image as horizontal bands of whole MCU rows, one per core, and
+// stitch the results into a single bitstream with restart markers at the band
+// joins. On big stills the encode time divides by nearly the core count.
+static void YUV420_to_JPEG_parallel(JpegEncoder &enc, const uint8_t *input, StreamInfo const &info, const int quality)
+{
+	unsigned int mcu_rows = (info.height + 15) / 16;
+	unsigned int mcus_per_row = (info.width + 15) / 16;
+	unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+	unsigned int rows_per_band = (mcu_rows + num_threads - 1) / num_threads;
+	unsigned int bands = (mcu_rows + rows_per_band - 1) / rows_per_band;
+	// One restart interval per band; it must fit the 16-bit DRI field.
+	unsigned int dri = rows_per_band * mcus_per_row;
+
+	if (bands < 2 || dri > 65535)
+	{
+		YUV420_to_JPEG_fast(enc, input, info, quality, 0);
+		return;
+	}
+
+	// Each band thread takes an encoder from the pool, so repeated captures
+	// reuse the same per-band compress objects and arenas.
+	std::vector<std::unique_ptr<PooledEncoder>> band_enc(bands);
+	std::vector<std::thread> threads;
+	for (unsigned int b = 0; b < bands; b++)
+	{
+		band_enc[b] = std::make_unique<PooledEncoder>();
+		unsigned int y_offset = b * rows_per_band * 16;
+		unsigned int band_height = std::min(info.height - y_offset, rows_per_band * 16);
+		threads.emplace_back([=, &info, &band_enc]() {
+			YUV420_to_JPEG_fast(**band_enc[b], input, info, quality, dri, y_offset, band_height);
+		});
+	}
+	for (auto &thread : threads)
+		thread.join();
+
+	// The shared stitcher joins the bands: band 0 keeps its headers, the rest
+	// contribute entropy data behind cycling restart markers.
+	std::vector<JpegMarkers::Band> stitch_bands(bands);
+	for (unsigned int b = 0; b < bands; b++)
+		stitch_bands[b] = { (**band_enc[b]).Data(), (**band_enc[b]).Len() };
+	uint8_t *jpeg_buffer = enc.Reserve(JpegMarkers::StitchedSize(stitch_bands));
+	enc.SetLen(JpegMarkers::Stitch(jpeg_buffer, stitch_bands, info.height));
+}
+
+static int xioctl(int fd, unsigned long ctl, void *arg)
+{
+	int ret, num_tries = 10;
+	do
+	{
+		ret = ioctl(fd, ctl, arg);
+	} while (ret == -1 && errno == EINTR && num_tries-- > 0);
+	return ret;
+}
+
+// Hardware JPEG encode via the V4L2 image codec, one shot and synchronous
+// (the still path needs the bytes in hand before the EXIF gets assembled).
+// Having only a mapping and not the frame's dma-buf down here, the input is
+// copied into the codec's MMAP buffer - still far cheaper than a libjpeg
+// encode, and the DCT no longer occupies a core. Returns false, leaving enc
+// untouched, when there is no codec or it refuses the format; a hard failure
+// is remembered so non-Pi platforms don't re-probe the device every shot.
+
+static bool YUV420_to_JPEG_hw(JpegEncoder &enc, const uint8_t *input, StreamInfo const &info, const int quality)
+{
+	static std::atomic<bool> hw_usable = true;
+	if (!hw_usable)
+		return false;
+
+	const char device_name[] = "/dev/video31"; // the bcm2835-codec JPEG encoder
+	int fd = open(device_name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		hw_usable = false;
+		return false;
+	}
+
+	void *in_mem = MAP_FAILED, *out_mem = MAP_FAILED;
+	size_t in_size = 0, out_size = 0;
+	bool streaming = false, ok = false;
+
+	do
+	{
+		v4l2_control ctrl = {};
+		ctrl.id = V4L2_CID_JPEG_COMPRESSION_QUALITY;
+		ctrl.value = quality;
+		xioctl(fd, VIDIOC_S_CTRL, &ctrl); // best effort
+
+		v4l2_format fmt = {};
+		fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		fmt.fmt.pix_mp.width = info.width;
+		fmt.fmt.pix_mp.height = info.height;
+		fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+		fmt.fmt.pix_mp.plane_fmt[0].bytesperline = info.stride;
+		fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+		fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_JPEG;
+		fmt.fmt.pix_mp.num_planes = 1;
+		if (xioctl(fd, VIDIOC_S_FMT, &fmt) < 0 || fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_YUV420 ||
+			fmt.fmt.pix_mp.width != info.width || fmt.fmt.pix_mp.height != info.height)
+		{
+			hw_usable = false;
+			break;
+		}
+		unsigned int hw_stride = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+
+		fmt = {};
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		fmt.fmt.pix_mp.width = info.width;
+		fmt.fmt.pix_mp.height = info.height;
+		fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_JPEG;
+		fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+		fmt.fmt.pix_mp.num_planes = 1;
+		if (xioctl(fd, VIDIOC_S_FMT, &fmt) < 0)
+		{
+			hw_usable = false;
+			break;
+		}
+
+		// One buffer on each queue; map them and copy the frame in, minding
+		// that the codec may want a different stride from the camera's.
+		v4l2_requestbuffers reqbufs = {};
+		reqbufs.count = 1;
+		reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		reqbufs.memory = V4L2_MEMORY_MMAP;
+		if (xioctl(fd, VIDIOC_REQBUFS, &reqbufs) < 0 || !reqbufs.count)
+			break;
+		reqbufs = {};
+		reqbufs.count = 1;
+		reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		reqbufs.memory = V4L2_MEMORY_MMAP;
+		if (xioctl(fd, VIDIOC_REQBUFS, &reqbufs) < 0 || !reqbufs.count)
+			break;
+
+		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+		v4l2_buffer buffer = {};
+		buffer.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = 0;
+		buffer.length = 1;
+		buffer.m.planes = planes;
+		if (xioctl(fd, VIDIOC_QUERYBUF, &buffer) < 0)
+			break;
+		in_size = buffer.m.planes[0].length;
+		in_mem = mmap(0, in_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buffer.m.planes[0].m.mem_offset);
+		if (in_mem == MAP_FAILED)
+			break;
+
+		uint8_t *dst = (uint8_t *)in_mem;
+		uint8_t const *src = input;
+		unsigned int copy = std::min(info.stride, hw_stride);
+		for (unsigned int y = 0; y < info.height; y++, dst += hw_stride, src += info.stride)
+			memcpy(dst, src, copy);
+		dst = (uint8_t *)in_mem + hw_stride * info.height;
+		src = input + info.stride * info.height;
+		for (unsigned int y = 0; y < info.height; y++, dst += hw_stride / 2, src += info.stride / 2)
+			memcpy(dst, src, copy / 2); // the U then V half-height planes
+
+		buffer.m.planes[0].bytesused = buffer.m.planes[0].length;
+		if (xioctl(fd, VIDIOC_QBUF, &buffer) < 0)
+			break;
+
+		buffer = {};
+		memset(planes, 0, sizeof(planes));
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = 0;
+		buffer.length = 1;
+		buffer.m.planes = planes;
+		if (xioctl(fd, VIDIOC_QUERYBUF, &buffer) < 0)
+			break;
+		out_size = buffer.m.planes[0].length;
+		out_mem = mmap(0, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buffer.m.planes[0].m.mem_offset);
+		if (out_mem == MAP_FAILED)
+			break;
+		if (xioctl(fd, VIDIOC_QBUF, &buffer) < 0)
+			break;
+
+		v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		if (xioctl(fd, VIDIOC_STREAMON, &type) < 0)
+			break;
+		streaming = true;
+		type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		if (xioctl(fd, VIDIOC_STREAMON, &type) < 0)
+			break;
+
+		pollfd p = { fd, POLLIN, 0 };
+		if (poll(&p, 1, 1000) <= 0)
+			break;
+
+		buffer = {};
+		memset(planes, 0, sizeof(planes));
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.length = 1;
+		buffer.m.planes = planes;
+		if (xioctl(fd, VIDIOC_DQBUF, &buffer) < 0 || (buffer.flags & V4L2_BUF_FLAG_ERROR))
+			break;
+
+		size_t bytes = buffer.m.planes[0].bytesused;
+		memcpy(enc.Reserve(bytes), out_mem, bytes);
+		enc.SetLen(bytes);
+		ok = true;
+	} while (false);
+
+	if (streaming)
+	{
+		v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		xioctl(fd, VIDIOC_STREAMOFF, &type);
+		type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		xioctl(fd, VIDIOC_STREAMOFF, &type);
+	}
+	if (in_mem != MAP_FAILED)
+		munmap(in_mem, in_size);
+	if (out_mem != MAP_FAILED)
+		munmap(out_mem, out_size);
+	close(fd);
+	if (!ok && hw_usable)
+		LOG(1, "Hardware JPEG encode failed, falling back to libjpeg");
+	return ok;
+}
+
+static void YUV420_to_JPEG(JpegEncoder &enc, const uint8_t *input, StreamInfo const &info,
 						   const unsigned int output_width, const unsigned int output_height,
-						   const int quality, const unsigned int restart, uint8_t *&jpeg_buffer,
-						   jpeg_mem_len_t &jpeg_len)
+						   const int quality, const unsigned int restart)
 {
 	if (info.width == output_width && info.height == output_height)
 	{
-		YUV420_to_JPEG_fast(input, info, quality, restart, jpeg_buffer, jpeg_len);
+		// Prefer the hardware codec for unscaled stills (a requested restart
+		// interval forces libjpeg, which honours it). Full-resolution software
+		// encodes run in parallel bands, unless the caller asked for that
+		// restart interval (which the band stitching would not preserve).
+		if (!restart && YUV420_to_JPEG_hw(enc, input, info, quality))
+			return;
+		if (restart)
+			YUV420_to_JPEG_fast(enc, input, info, quality, restart);
+		else
+			YUV420_to_JPEG_parallel(enc, input, info, quality);
 		return;
 	}
 
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
+	struct jpeg_compress_struct &cinfo = enc.cinfo;
 
 	cinfo.image_width = output_width;
 	cinfo.image_height = output_height;
@@ -382,10 +710,9 @@ static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	cinfo.restart_interval = restart;
 
 	jpeg_set_defaults(&cinfo);
+	cinfo.raw_data_in = FALSE; // the encoder may previously have run in raw mode
 	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
+	enc.SetDest();
 	jpeg_start_compress(&cinfo, TRUE);
 
 	const unsigned int output_width3 = 3 * output_width;
@@ -420,23 +747,87 @@ static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	}
 
 	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+	enc.Finish();
 }
 
-static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info, const int output_width, const int output_height,
-						const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+static void YUV_to_JPEG(JpegEncoder &enc, const uint8_t *input, StreamInfo const &info, const int output_width,
+						const int output_height, const int quality, const unsigned int restart)
 {
 	if (info.pixel_format == libcamera::formats::YUYV)
-		YUYV_to_JPEG(input, info, output_width, output_height, quality, restart, jpeg_buffer, jpeg_len);
+		YUYV_to_JPEG(enc, input, info, output_width, output_height, quality, restart);
 	else if (info.pixel_format == libcamera::formats::YUV420)
-		YUV420_to_JPEG(input, info, output_width, output_height, quality, restart, jpeg_buffer, jpeg_len);
+		YUV420_to_JPEG(enc, input, info, output_width, output_height, quality, restart);
 	else
 		throw std::runtime_error("unsupported YUV format in JPEG encode");
 }
 
+// The EXIF skeleton pool. Building the ExifData tree - and in particular
+// parsing any command-line supplied tags - is the same work every shot, so
+// pooled trees keep their fixed tags and each capture only rewrites the
+// entries that vary (timestamps, exposure metadata, thumbnail offsets).
+static std::mutex exif_pool_mutex;
+static std::vector<ExifData *> exif_pool;
+
+static ExifData *acquire_exif(StillOptions const *options)
+{
+	{
+		std::lock_guard<std::mutex> lock(exif_pool_mutex);
+		if (!exif_pool.empty())
+		{
+			ExifData *exif = exif_pool.back();
+			exif_pool.pop_back();
+			return exif;
+		}
+	}
+
+	ExifData *exif = exif_data_new();
+	if (!exif)
+		throw std::runtime_error("failed to allocate EXIF data");
+
+	try
+	{
+		exif_data_set_byte_order(exif, exif_byte_order);
+
+		// The fixed EXIF tags.
+		ExifEntry *entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_MAKE);
+		exif_set_string(entry, MAKE_STRING);
+		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SOFTWARE);
+		exif_set_string(entry, "rpicam-apps");
+
+		// Command-line supplied tags - parsed only when the skeleton is built.
+		for (auto &exif_item : options->Get().exif)
+		{
+			LOG(2, "Processing EXIF item: " << exif_item);
+			exif_read_tag(exif, exif_item.c_str());
+		}
+	}
+	catch (std::exception const &e)
+	{
+		exif_data_unref(exif);
+		throw;
+	}
+	return exif;
+}
+
+static void release_exif(ExifData *exif)
+{
+	std::lock_guard<std::mutex> lock(exif_pool_mutex);
+	exif_pool.push_back(exif);
+}
+
+// Drop a tag if present - needed when reusing a pooled skeleton and this
+// capture's metadata doesn't supply a value the previous one did.
+static void exif_remove_tag(ExifData *exif, ExifIfd ifd, ExifTag tag)
+{
+	ExifEntry *entry = exif_content_get_entry(exif->ifd[ifd], tag);
+	if (entry)
+		exif_content_remove_entry(exif->ifd[ifd], entry);
+}
+
 static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+							 libcamera::Span<uint8_t> const &lores, StreamInfo const &lores_info,
 							 ControlList const &metadata, std::string const &cam_model, StillOptions const *options,
-							 uint8_t *&exif_buffer, unsigned int &exif_len, uint8_t *&thumb_buffer,
+							 uint8_t *&exif_buffer, unsigned int &exif_len, JpegEncoder &thumb_enc,
 							 jpeg_mem_len_t &thumb_len)
 {
 	exif_buffer = nullptr;
@@ -444,19 +835,11 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 
 	try
 	{
-		exif = exif_data_new();
-		if (!exif)
-			throw std::runtime_error("failed to allocate EXIF data");
-		exif_data_set_byte_order(exif, exif_byte_order);
+		// Start from a pooled skeleton and update the varying tags.
+		exif = acquire_exif(options);
 
-		// First add some fixed EXIF tags.
-
-		ExifEntry *entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_MAKE);
-		exif_set_string(entry, MAKE_STRING);
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_MODEL);
+		ExifEntry *entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_MODEL);
 		exif_set_string(entry, cam_model.c_str());
-		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SOFTWARE);
-		exif_set_string(entry, "rpicam-apps");
 		entry = exif_create_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME);
 		std::time_t raw_time;
 		std::time(&raw_time);
@@ -479,6 +862,8 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			ExifRational exposure = { (ExifLong)*exposure_time, 1000000 };
 			exif_set_rational(entry->data, exif_byte_order, exposure);
 		}
+		else
+			exif_remove_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME);
 		auto ag = metadata.get(libcamera::controls::AnalogueGain);
 		if (ag)
 		{
@@ -489,6 +874,8 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			LOG(2, "Ag " << *ag << " Dg " << *dg << " Total " << gain);
 			exif_set_short(entry->data, exif_byte_order, 100 * gain);
 		}
+		else
+			exif_remove_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS);
 		auto lp = metadata.get(libcamera::controls::LensPosition);
 		if (lp)
 		{
@@ -496,13 +883,8 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			ExifRational dist = { 1000, (ExifLong)(1000.0 * *lp) };
 			exif_set_rational(entry->data, exif_byte_order, dist);
 		}
-
-		// Command-line supplied tags.
-		for (auto &exif_item : options->Get().exif)
-		{
-			LOG(2, "Processing EXIF item: " << exif_item);
-			exif_read_tag(exif, exif_item.c_str());
-		}
+		else
+			exif_remove_tag(exif, EXIF_IFD_EXIF, EXIF_TAG_SUBJECT_DISTANCE);
 
 		if (options->Get().thumb_quality)
 		{
@@ -531,15 +913,26 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			// Next create the JPEG for the thumbnail, we need to do this now so that we can
 			// go back and fill in the correct values for the thumbnail offsets/length.
 
+			// Prefer a hardware-scaled lores image as the thumbnail source when
+			// the caller supplied one - downscaling the full resolution frame
+			// in software is much the most expensive part of making the EXIF.
+			uint8_t const *thumb_src = (uint8_t const *)mem[0].data();
+			StreamInfo const *thumb_info = &info;
+			if (!lores.empty() && (lores_info.pixel_format == libcamera::formats::YUV420 ||
+								   lores_info.pixel_format == libcamera::formats::YUYV))
+			{
+				thumb_src = lores.data();
+				thumb_info = &lores_info;
+			}
+
 			int q = options->Get().thumb_quality;
 			for (; q > 0; q -= 5)
 			{
-				YUV_to_JPEG((uint8_t *)(mem[0].data()), info, options->Get().thumb_width, options->Get().thumb_height,
-							q, 0, thumb_buffer, thumb_len);
+				YUV_to_JPEG(thumb_enc, thumb_src, *thumb_info, options->Get().thumb_width,
+							options->Get().thumb_height, q, 0);
+				thumb_len = thumb_enc.Len();
 				if (thumb_len < 60000) // entire EXIF data must be < 65536, so this should be safe
 					break;
-				free(thumb_buffer);
-				thumb_buffer = nullptr;
 			}
 			LOG(2, "Thumbnail size " << thumb_len);
 			if (q <= 0)
@@ -555,28 +948,30 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 		// And create the EXIF data buffer *again*.
 
 		exif_data_save_data(exif, &exif_buffer, &exif_len);
-		exif_data_unref(exif);
+		release_exif(exif);
 		exif = nullptr;
 	}
 	catch (std::exception const &e)
 	{
+		// Don't return a possibly half-updated skeleton to the pool.
 		if (exif)
 			exif_data_unref(exif);
 		if (exif_buffer)
 			free(exif_buffer);
-		if (thumb_buffer)
-			free(thumb_buffer);
 		throw;
 	}
 }
 
-void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info, ControlList const &metadata,
+void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+			   libcamera::Span<uint8_t> const &lores, StreamInfo const &lores_info, ControlList const &metadata,
 			   std::string const &filename, std::string const &cam_model, StillOptions const *options)
 {
 	FILE *fp = nullptr;
-	uint8_t *thumb_buffer = nullptr;
 	unsigned char *exif_buffer = nullptr;
-	uint8_t *jpeg_buffer = nullptr;
+
+	// Pooled encoders for the thumbnail and the main image; their compressed
+	// output stays valid (in their arenas) until they go out of scope.
+	PooledEncoder thumb_enc, main_enc;
 
 	try
 	{
@@ -589,14 +984,15 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 
 		jpeg_mem_len_t thumb_len = 0; // stays zero if no thumbnail
 		unsigned int exif_len;
-		create_exif_data(mem, info, metadata, cam_model, options, exif_buffer, exif_len, thumb_buffer, thumb_len);
+		create_exif_data(mem, info, lores, lores_info, metadata, cam_model, options, exif_buffer, exif_len,
+						 *thumb_enc, thumb_len);
 
 		// Make the full size JPEG (could probably be more efficient if we had
 		// YUV422 or YUV420 planar format).
 
-		jpeg_mem_len_t jpeg_len;
-		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->Get().quality,
-					options->Get().restart, jpeg_buffer, jpeg_len);
+		YUV_to_JPEG(*main_enc, (uint8_t *)(mem[0].data()), info, info.width, info.height, options->Get().quality,
+					options->Get().restart);
+		jpeg_mem_len_t jpeg_len = main_enc->Len();
 		LOG(2, "JPEG size is " << jpeg_len);
 
 		// Write everything out.
@@ -607,10 +1003,19 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 
 		LOG(2, "EXIF data len " << exif_len);
 
+		// Strip the encoder's SOI and any APP0/APP1 segments; the remaining
+		// segments follow the EXIF APP1 written above. (libjpeg always emits
+		// a 20 byte SOI+JFIF header, but the hardware codec's may differ.)
+		uint8_t const *jpeg_data = main_enc->Data();
+		size_t image_offset = 2;
+		while (image_offset + 4 <= jpeg_len && jpeg_data[image_offset] == 0xff &&
+			   (jpeg_data[image_offset + 1] == 0xe0 || jpeg_data[image_offset + 1] == 0xe1))
+			image_offset += 2 + ((jpeg_data[image_offset + 2] << 8) | jpeg_data[image_offset + 3]);
+
 		if (fwrite(exif_header, sizeof(exif_header), 1, fp) != 1 || fputc((exif_len + thumb_len + 2) >> 8, fp) == EOF ||
 			fputc((exif_len + thumb_len + 2) & 0xff, fp) == EOF || fwrite(exif_buffer, exif_len, 1, fp) != 1 ||
-			(thumb_len && fwrite(thumb_buffer, thumb_len, 1, fp) != 1) ||
-			fwrite(jpeg_buffer + exif_image_offset, jpeg_len - exif_image_offset, 1, fp) != 1)
+			(thumb_len && fwrite(thumb_enc->Data(), thumb_len, 1, fp) != 1) ||
+			fwrite(jpeg_data + image_offset, jpeg_len - image_offset, 1, fp) != 1)
 			throw std::runtime_error("failed to write file - output probably corrupt");
 
 		if (fp != stdout)
@@ -619,18 +1024,18 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 
 		free(exif_buffer);
 		exif_buffer = nullptr;
-		free(thumb_buffer);
-		thumb_buffer = nullptr;
-		free(jpeg_buffer);
-		jpeg_buffer = nullptr;
 	}
 	catch (std::exception const &e)
 	{
 		if (fp)
 			fclose(fp);
 		free(exif_buffer);
-		free(thumb_buffer);
-		free(jpeg_buffer);
 		throw;
 	}
 }
+
+void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info, ControlList const &metadata,
+			   std::string const &filename, std::string const &cam_model, StillOptions const *options)
+{
+	jpeg_save(mem, info, {}, {}, metadata, filename, cam_model, options);
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * jpeg_markers.cpp - shared JPEG bitstream helpers.
+ */
+
+#include <cstring>
+
+#include "jpeg_markers.hpp"
+
+namespace JpegMarkers
+{
+
+size_t FindSegment(uint8_t const *mem, size_t len, uint8_t marker)
+{
+	size_t p = 2; // skip SOI
+	while (p + 4 <= len && mem[p] == 0xff)
+	{
+		if (mem[p + 1] == marker)
+			return p;
+		if (mem[p + 1] == 0xda) // SOS - entropy data follows, give up
+			break;
+		p += 2 + ((mem[p + 2] << 8) | mem[p + 3]);
+	}
+	return 0;
+}
+
+// A band's entropy data starts right after its SOS segment.
+static size_t entropy_start(Band const &band)
+{
+	size_t sos = FindSegment(band.mem, band.len, 0xda);
+	return sos + 2 + ((band.mem[sos + 2] << 8) | band.mem[sos + 3]);
+}
+
+size_t StitchedSize(std::vector<Band> const &bands)
+{
+	size_t total = bands[0].len - 2 + 2; // drop band 0's EOI, add ours
+	for (unsigned int b = 1; b < bands.size(); b++)
+		total += 2 + bands[b].len - 2 - entropy_start(bands[b]);
+	return total;
+}
+
+size_t Stitch(uint8_t *dst, std::vector<Band> const &bands, unsigned int height)
+{
+	size_t pos = bands[0].len - 2;
+	memcpy(dst, bands[0].mem, pos);
+	// Each band was compressed with its own (shorter) height; restore the
+	// full frame height in the SOF segment.
+	size_t sof = FindSegment(dst, pos, 0xc0);
+	if (sof)
+	{
+		dst[sof + 5] = height >> 8;
+		dst[sof + 6] = height & 0xff;
+	}
+	for (unsigned int b = 1; b < bands.size(); b++)
+	{
+		// Restart markers cycle RST0-RST7 in interval order.
+		dst[pos++] = 0xff;
+		dst[pos++] = 0xd0 + ((b - 1) & 7);
+		size_t start = entropy_start(bands[b]);
+		size_t entropy_len = bands[b].len - 2 - start;
+		memcpy(dst + pos, bands[b].mem + start, entropy_len);
+		pos += entropy_len;
+	}
+	dst[pos++] = 0xff;
+	dst[pos++] = 0xd9; // EOI
+	return pos;
+}
+
+} // namespace JpegMarkers
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * jpeg_markers.hpp - shared JPEG bitstream helpers.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Marker-level JPEG surgery shared by the still JPEG writer and the mjpeg
+// encoder, which both encode an image as horizontal bands of whole MCU rows
+// (one complete JPEG per band) and stitch the results back into a single
+// bitstream with restart markers at the band joins.
+
+namespace JpegMarkers
+{
+
+// Find the offset of a marker segment in a JPEG's headers. Before SOS the
+// stream is plain marker segments (no entropy data, so no false matches) and
+// can be walked by length fields. Returns 0 if the marker isn't found.
+size_t FindSegment(uint8_t const *mem, size_t len, uint8_t marker);
+
+struct Band
+{
+	uint8_t const *mem;
+	size_t len;
+};
+
+// Stitch separately encoded bands of one image into a single bitstream: band
+// 0 keeps its headers (with the full image height patched back into the SOF
+// segment), every other band contributes its entropy data behind a restart
+// marker (cycling RST0-RST7). The bands must all have been encoded with the
+// same tables and a DRI of one restart interval per band. StitchedSize()
+// returns the number of output bytes Stitch() will write.
+size_t StitchedSize(std::vector<Band> const &bands);
+size_t Stitch(uint8_t *dst, std::vector<Band> const &bands, unsigned int height);
+
+} // namespace JpegMarkers
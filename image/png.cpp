@@ -5,12 +5,14 @@
  * png.cpp - Encode image as png and write to file.
  */
 
+#include <algorithm>
 #include <cstdio>
 #include <string>
 
 #include <libcamera/formats.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
@@ -45,9 +47,15 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		// Set image attributes.
 		png_set_IHDR(png_ptr, info_ptr, info.width, info.height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
 					 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-		// These settings get us most of the compression, but are much faster.
+		// The compression effort is configurable. At the default level 1 the
+		// AVG filter plus zlib's RLE strategy gets us most of the compression
+		// at a fraction of the cost of the libpng defaults; higher levels
+		// revert to the full match-finding strategy for smaller files.
+		int level = std::clamp(options->Get().png_level, 0, 9);
 		png_set_filter(png_ptr, 0, PNG_FILTER_AVG);
-		png_set_compression_level(png_ptr, 1);
+		png_set_compression_level(png_ptr, level);
+		if (level <= 1)
+			png_set_compression_strategy(png_ptr, Z_RLE);
 
 		// Set up the image data.
 		png_byte **row_ptrs = (png_byte **)png_malloc(png_ptr, info.height * sizeof(png_byte *));
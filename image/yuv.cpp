@@ -5,11 +5,68 @@
  * yuv.cpp - dummy stills encoder to save uncompressed data
  */
 
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include <libcamera/formats.h>
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+static int open_output(std::string const &filename)
+{
+	int fd = filename == "-" ? STDOUT_FILENO : open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("failed to open file " + filename);
+	return fd;
+}
+
+// Write rows straight out of the mapped capture buffer with writev() - no
+// intermediate copies through stdio. Rows are batched up into each syscall,
+// and when the stride matches the row length the whole range collapses into
+// a single contiguous iovec.
+static void write_rows(int fd, uint8_t const *ptr, size_t length, size_t stride, unsigned int rows,
+					   std::string const &filename)
+{
+	constexpr unsigned int MAX_IOVECS = 64;
+	struct iovec iov[MAX_IOVECS];
+	while (rows)
+	{
+		unsigned int n = 0;
+		if (stride == length)
+		{
+			iov[0].iov_base = const_cast<uint8_t *>(ptr);
+			iov[0].iov_len = (size_t)rows * length;
+			ptr += iov[0].iov_len;
+			n = 1, rows = 0;
+		}
+		else
+		{
+			for (; n < MAX_IOVECS && rows; n++, rows--, ptr += stride)
+			{
+				iov[n].iov_base = const_cast<uint8_t *>(ptr);
+				iov[n].iov_len = length;
+			}
+		}
+		// writev can return short, so restart from wherever it got to.
+		unsigned int first = 0;
+		while (first < n)
+		{
+			ssize_t written = writev(fd, iov + first, n - first);
+			if (written < 0)
+				throw std::runtime_error("failed to write file " + filename);
+			while (first < n && (size_t)written >= iov[first].iov_len)
+				written -= iov[first++].iov_len;
+			if (first < n)
+			{
+				iov[first].iov_base = (uint8_t *)iov[first].iov_base + written;
+				iov[first].iov_len -= written;
+			}
+		}
+	}
+}
+
 static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 						std::string const &filename, StillOptions const *options)
 {
@@ -20,37 +77,30 @@ static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, Stream
 			throw std::runtime_error("both width and height must be even");
 		if (mem.size() != 1)
 			throw std::runtime_error("incorrect number of planes in YUV420 data");
-		FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "w");
-		if (!fp)
-			throw std::runtime_error("failed to open file " + filename);
+		int fd = open_output(filename);
 		try
 		{
 			uint8_t *Y = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < h; j++)
+			if (options->Get().preserve_stride)
 			{
-				if (fwrite(Y + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			uint8_t *U = Y + stride * h;
-			h /= 2, w /= 2, stride /= 2;
-			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(U + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				// Keep the padding, so the whole buffer goes out as one write.
+				write_rows(fd, Y, mem[0].size(), mem[0].size(), 1, filename);
 			}
-			uint8_t *V = U + stride * h;
-			for (unsigned int j = 0; j < h; j++)
+			else
 			{
-				if (fwrite(V + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				write_rows(fd, Y, w, stride, h, filename);
+				uint8_t *U = Y + stride * h;
+				h /= 2, w /= 2, stride /= 2;
+				write_rows(fd, U, w, stride, h, filename);
+				write_rows(fd, U + stride * h, w, stride, h, filename);
 			}
-			if (fp != stdout)
-				fclose(fp);
+			if (fd != STDOUT_FILENO)
+				close(fd);
 		}
 		catch (std::exception const &e)
 		{
-			if (fp != stdout)
-				fclose(fp);
+			if (fd != STDOUT_FILENO)
+				close(fd);
 			throw;
 		}
 	}
@@ -117,27 +167,25 @@ static void rgb_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInf
 {
 	if (options->Get().encoding != "rgb24" && options->Get().encoding != "rgb48")
 		throw std::runtime_error("encoding should be set to rgb");
-	FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "w");
-	if (!fp)
-		throw std::runtime_error("failed to open file " + filename);
+	int fd = open_output(filename);
 	try
 	{
 		uint8_t *ptr = (uint8_t *)mem[0].data();
 		unsigned int wr_stride = 3 * info.width;
 		if (options->Get().encoding == "rgb48")
 			wr_stride *= 2;
-		for (unsigned int j = 0; j < info.height; j++, ptr += info.stride)
-		{
-			if (fwrite(ptr, wr_stride, 1, fp) != 1)
-				throw std::runtime_error("failed to write file " + filename);
-		}
-		if (fp != stdout)
-			fclose(fp);
+		size_t whole = (size_t)info.stride * info.height;
+		if (options->Get().preserve_stride)
+			write_rows(fd, ptr, whole, whole, 1, filename);
+		else
+			write_rows(fd, ptr, wr_stride, info.stride, info.height, filename);
+		if (fd != STDOUT_FILENO)
+			close(fd);
 	}
 	catch (std::exception const &e)
 	{
-		if (fp != stdout)
-			fclose(fp);
+		if (fd != STDOUT_FILENO)
+			close(fd);
 		throw;
 	}
 }
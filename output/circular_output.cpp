@@ -5,18 +5,77 @@
  * circular_output.cpp - Write output to circular buffer which we save on exit.
  */
 
+#include <algorithm>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "circular_output.hpp"
 
-// We're going to align the frames within the buffer to friendly byte boundaries
-static constexpr int ALIGN = 16; // power of 2, please
+// How much we copy out of the ring per write while flushing in the background.
+// Big enough for efficient disk I/O, small enough that capture never waits
+// long for the lock.
+static constexpr size_t FLUSH_CHUNK = 4 << 20;
+
+static void write_all(int fd, uint8_t const *p, size_t n)
+{
+	while (n)
+	{
+		ssize_t written = write(fd, p, n);
+		if (written < 0)
+			throw std::runtime_error("failed to write circular buffer");
+		p += written, n -= written;
+	}
+}
+
+CircularBuffer::CircularBuffer(size_t size) : size_(size), rptr_(0), wptr_(0)
+{
+	memfd_ = memfd_create("circular-output", MFD_CLOEXEC);
+	if (memfd_ < 0 || ftruncate(memfd_, size_) < 0)
+		throw std::runtime_error("failed to create circular buffer memfd");
+	map_ = (uint8_t *)mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+	if (map_ == MAP_FAILED)
+		throw std::runtime_error("failed to map circular buffer");
+}
 
-struct Header
+CircularBuffer::~CircularBuffer()
 {
-	unsigned int length;
-	bool keyframe;
-	int64_t timestamp;
-};
-static_assert(sizeof(Header) % ALIGN == 0, "Header should have aligned size");
+	munmap(map_, size_);
+	close(memfd_);
+}
+
+void CircularBuffer::Write(const void *ptr, size_t n, bool keyframe, int64_t timestamp)
+{
+	// First make sure there's enough space.
+	while (n > Available())
+	{
+		if (frames_.empty())
+			throw std::runtime_error("circular buffer too small");
+		frames_.pop_front();
+		rptr_ = frames_.empty() ? wptr_ : frames_.front().offset;
+	}
+	frames_.push_back({ wptr_, static_cast<unsigned int>(n), keyframe, timestamp, sequence_++ });
+	size_t first = std::min(n, size_ - wptr_);
+	memcpy(map_ + wptr_, ptr, first);
+	memcpy(map_, (const uint8_t *)ptr + first, n - first);
+	wptr_ = (wptr_ + n) % size_;
+}
+
+void CircularBuffer::ReadFrame(Frame const &frame, uint8_t *dest) const
+{
+	size_t first = std::min((size_t)frame.length, size_ - frame.offset);
+	memcpy(dest, map_ + frame.offset, first);
+	memcpy(dest + first, map_, frame.length - first);
+}
+
+void CircularBuffer::Dump(int fd, Frame const &first) const
+{
+	size_t len = (wptr_ + size_ - first.offset) % size_;
+	size_t chunk = std::min(len, size_ - first.offset);
+	write_all(fd, map_ + first.offset, chunk);
+	write_all(fd, map_, len - chunk);
+}
 
 // Size of buffer (options->Get().circular) is given in megabytes.
 CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), cb_(options->Get().circular << 20)
@@ -30,66 +89,139 @@ CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), c
 	}
 	if (!fp_)
 		throw std::runtime_error("could not open output file");
+
+	flush_thread_ = std::thread(&CircularOutput::flushThread, this);
 }
 
 CircularOutput::~CircularOutput()
 {
-	// We do have to skip to the first I frame before dumping stuff to disk. If there are
-	// no I frames you will get nothing. Caveat emptor, methinks.
-	unsigned int total = 0, frames = 0;
-	bool seen_keyframe = false;
-	Header header;
-	FILE *fp = fp_; // can't capture a class member in a lambda
-	while (!cb_.Empty())
 	{
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		seen_keyframe |= header.keyframe;
-		if (seen_keyframe)
+		std::lock_guard<std::mutex> lock(mutex_);
+		quit_ = true;
+	}
+	cond_var_.notify_all();
+	flush_thread_.join();
+
+	if (!triggered_ && !cb_.Empty())
+	{
+		// Never flushed at runtime: everything from the first I frame onwards
+		// goes out in (at most) two contiguous writes straight from the
+		// mapping. If there are no I frames you will get nothing. Caveat
+		// emptor, methinks.
+		auto const &records = cb_.Frames();
+		auto first = std::find_if(records.begin(), records.end(),
+								  [](CircularBuffer::Frame const &f) { return f.keyframe; });
+		if (first != records.end())
 		{
-			cb_.Read([fp](void *src, int n) { fwrite(src, 1, n, fp); }, header.length);
-			cb_.Skip((ALIGN - header.length) & (ALIGN - 1));
-			total += header.length;
+			cb_.Dump(fileno(fp_), *first);
+			for (auto it = first; it != records.end(); ++it)
+			{
+				total_ += it->length;
+				if (fp_timestamps_)
+					Output::timestampReady(it->timestamp);
+				frames_written_++;
+			}
+		}
+	}
+	else
+	{
+		// A flush was triggered at some point; write out whatever the
+		// background thread hadn't got to yet.
+		while (true)
+		{
+			gatherFrames(FLUSH_CHUNK);
+			if (staging_.empty())
+				break;
+			write_all(fileno(fp_), staging_.data(), staging_.size());
 			if (fp_timestamps_)
 			{
-				Output::timestampReady(header.timestamp);
+				for (int64_t timestamp : staging_timestamps_)
+					Output::timestampReady(timestamp);
 			}
-			frames++;
 		}
-		else
-			cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
 	}
 	fclose(fp_);
-	LOG(1, "Wrote " << total << " bytes (" << frames << " frames)");
+	LOG(1, "Wrote " << total_ << " bytes (" << frames_written_ << " frames)");
+}
+
+void CircularOutput::Signal()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		flushing_ = !flushing_;
+		triggered_ |= flushing_;
+		LOG(1, "Circular buffer flush " << (flushing_ ? "started" : "stopped"));
+	}
+	cond_var_.notify_all();
 }
 
 void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
-	// First make sure there's enough space.
-	int pad = (ALIGN - size) & (ALIGN - 1);
-	while (size + pad + sizeof(Header) > cb_.Available())
 	{
-		if (cb_.Empty())
-			throw std::runtime_error("circular buffer too small");
-		Header header;
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		std::lock_guard<std::mutex> lock(mutex_);
+		cb_.Write(mem, size, !!(flags & FLAG_KEYFRAME), timestamp_us);
+	}
+	cond_var_.notify_all();
+}
+
+void CircularOutput::gatherFrames(size_t max_bytes)
+{
+	staging_.clear();
+	staging_timestamps_.clear();
+	for (auto const &frame : cb_.Frames())
+	{
+		if (frame.sequence < next_sequence_)
+			continue; // already written
+		if (frame.sequence != next_sequence_)
+			need_keyframe_ = true; // frames were evicted before we got to them
+		next_sequence_ = frame.sequence + 1;
+		if (need_keyframe_)
+		{
+			if (!frame.keyframe)
+				continue;
+			need_keyframe_ = false;
+		}
+		if (!staging_.empty() && staging_.size() + frame.length > max_bytes)
+		{
+			next_sequence_ = frame.sequence; // come back for this one
+			break;
+		}
+		size_t pos = staging_.size();
+		staging_.resize(pos + frame.length);
+		cb_.ReadFrame(frame, &staging_[pos]);
+		staging_timestamps_.push_back(frame.timestamp);
+		total_ += frame.length;
+		frames_written_++;
+	}
+}
+
+void CircularOutput::flushThread()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!quit_)
+	{
+		if (!flushing_)
+		{
+			cond_var_.wait(lock);
+			continue;
+		}
+		gatherFrames(FLUSH_CHUNK);
+		if (staging_.empty())
+		{
+			cond_var_.wait(lock);
+			continue;
+		}
+		// Copying a bounded chunk out under the lock and writing it with the
+		// lock released means capture never waits on the disk.
+		lock.unlock();
+		write_all(fileno(fp_), staging_.data(), staging_.size());
+		if (fp_timestamps_)
+		{
+			for (int64_t timestamp : staging_timestamps_)
+				Output::timestampReady(timestamp);
+		}
+		lock.lock();
 	}
-	Header header = { static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us };
-	cb_.Write(&header, sizeof(header));
-	cb_.Write(mem, size);
-	cb_.Pad(pad);
 }
 
 void CircularOutput::timestampReady(int64_t timestamp)
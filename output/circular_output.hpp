@@ -7,62 +7,86 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 #include "output.hpp"
 
-// A simple circular buffer implementation used by the CircularOutput class.
+// A circular buffer backed by a memfd mapping. Frame payloads are stored
+// back-to-back in the mapping, with the frame boundaries kept in a separate
+// record list, so that the entire run of buffered frames can be dumped with
+// at most two large contiguous writes straight from the mapping - no
+// frame-by-frame copying when flushing half a gigabyte at shutdown.
 
 class CircularBuffer
 {
 public:
-	CircularBuffer(size_t size) : size_(size), buf_(size), rptr_(0), wptr_(0) {}
-	bool Empty() const { return rptr_ == wptr_; }
-	size_t Available() const { return wptr_ == rptr_ ? size_ - 1 : (size_ - wptr_ + rptr_) % size_ - 1; }
-	void Skip(unsigned int n) { rptr_ = (rptr_ + n) % size_; }
-	// The dst function allows bytes read to go straight to memory or a file etc.
-	void Read(std::function<void(void *src, unsigned int n)> dst, unsigned int n)
-	{
-		if (rptr_ + n >= size_)
-		{
-			dst(&buf_[rptr_], size_ - rptr_);
-			n -= size_ - rptr_;
-			rptr_ = 0;
-		}
-		dst(&buf_[rptr_], n);
-		rptr_ += n;
-	}
-	void Pad(unsigned int n) { wptr_ = (wptr_ + n) % size_; }
-	void Write(const void *ptr, unsigned int n)
+	struct Frame
 	{
-		if (wptr_ + n >= size_)
-		{
-			memcpy(&buf_[wptr_], ptr, size_ - wptr_);
-			n -= size_ - wptr_;
-			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr_;
-			wptr_ = 0;
-		}
-		memcpy(&buf_[wptr_], ptr, n);
-		wptr_ += n;
-	}
+		size_t offset;
+		unsigned int length;
+		bool keyframe;
+		int64_t timestamp;
+		uint64_t sequence; // monotonic, so a reader can tell when frames were evicted under it
+	};
+
+	CircularBuffer(size_t size);
+	~CircularBuffer();
+
+	bool Empty() const { return frames_.empty(); }
+	size_t Available() const { return size_ - 1 - (wptr_ + size_ - rptr_) % size_; }
+	// Append a frame, dropping the oldest buffered frames if there's no room.
+	void Write(const void *ptr, size_t n, bool keyframe, int64_t timestamp);
+	std::deque<Frame> const &Frames() const { return frames_; }
+	// Copy one frame's payload out of the mapping.
+	void ReadFrame(Frame const &frame, uint8_t *dest) const;
+	// Write everything from the given frame onwards to the fd, as at most two
+	// contiguous writes (the buffered data can wrap around at most once).
+	void Dump(int fd, Frame const &first) const;
 
 private:
 	const size_t size_;
-	std::vector<uint8_t> buf_;
+	uint8_t *map_;
+	int memfd_;
 	size_t rptr_, wptr_;
+	uint64_t sequence_ = 0;
+	std::deque<Frame> frames_;
 };
 
-// Write frames to a circular buffer, and dump them to disk when we quit.
+// Write frames to a circular buffer, and dump them to disk when we quit - or,
+// from the moment Signal() triggers a flush, stream them to disk continuously
+// on a background thread while capture carries on filling the ring, giving
+// gap-free pre+post event recording. A second Signal() goes back to buffering.
 
 class CircularOutput : public Output
 {
 public:
 	CircularOutput(VideoOptions const *options);
 	~CircularOutput();
+	void Signal() override; // toggle flushing the ring to disk
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 	void timestampReady(int64_t timestamp) override;
 
 private:
+	void flushThread();
+	// Gather up to max_bytes of flushable frames into staging_ (call with the lock held).
+	void gatherFrames(size_t max_bytes);
+
 	CircularBuffer cb_;
 	FILE *fp_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::thread flush_thread_;
+	bool flushing_ = false;
+	bool triggered_ = false; // has a flush ever been requested?
+	bool quit_ = false;
+	bool need_keyframe_ = true;
+	uint64_t next_sequence_ = 0;
+	uint64_t total_ = 0, frames_written_ = 0;
+	std::vector<uint8_t> staging_;
+	std::vector<int64_t> staging_timestamps_;
 };
@@ -5,16 +5,392 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include "file_output.hpp"
 
+#include "config.h"
+
+// Writeback pacing. Left to itself the kernel lets dirty pages pile up and
+// then writes back a huge span at once, which on an SD card can stall the
+// whole system for several frames; --flush only empties the stdio buffer and
+// bounds neither the stall nor the data-loss window. This thread asks for
+// writeback in bounded chunks instead: each time a chunk's worth of new data
+// exists (or a time budget expires, whichever is sooner) it starts asynchronous
+// writeback of that span and waits for the span before it - so at most two
+// chunks are ever dirty, a slow card is absorbed here rather than in the
+// output path, and no more than a chunk or so is lost on power failure.
+// Retired files (segment rollover) get their fdatasync and close here too,
+// keeping rollover cheap.
+
+class FileSyncer
+{
+public:
+	static constexpr off_t CHUNK_SIZE = 1 << 20;
+	static constexpr std::chrono::milliseconds MAX_DELAY { 1000 };
+
+	FileSyncer() { thread_ = std::thread(&FileSyncer::syncThread, this); }
+
+	~FileSyncer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			quit_ = true;
+		}
+		cv_.notify_one();
+		thread_.join();
+	}
+
+	// Note bytes appended to the current file; wakes the syncer once a whole
+	// chunk is dirty. A new fd resets the per-file accounting.
+	void Wrote(int fd, size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (fd != fd_)
+			fd_ = fd, written_ = kicked_ = synced_ = 0;
+		written_ += bytes;
+		if (written_ - kicked_ >= CHUNK_SIZE)
+			cv_.notify_one();
+	}
+
+	// Take ownership of an fd being closed, so the final fdatasync and the
+	// close itself happen off the output path.
+	void Retire(int fd)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			retired_.push_back(fd);
+			if (fd == fd_)
+				fd_ = -1;
+		}
+		cv_.notify_one();
+	}
+
+private:
+	void syncThread()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true)
+		{
+			bool timed_out = cv_.wait_for(lock, MAX_DELAY) == std::cv_status::timeout;
+			if (quit_)
+				break;
+
+			while (!retired_.empty())
+			{
+				int fd = retired_.front();
+				retired_.pop_front();
+				lock.unlock();
+				fdatasync(fd);
+				close(fd);
+				lock.lock();
+			}
+
+			// On the timer path sync everything outstanding; otherwise stop at
+			// a chunk boundary so writeback requests stay nicely aligned.
+			off_t end = timed_out ? written_ : written_ & ~(CHUNK_SIZE - 1);
+			if (fd_ >= 0 && end > kicked_)
+			{
+				int fd = fd_;
+				off_t start = kicked_, waited = synced_;
+				lock.unlock();
+				sync_file_range(fd, start, end - start, SYNC_FILE_RANGE_WRITE);
+				sync_file_range(fd, waited, start - waited,
+								SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+				lock.lock();
+				if (fd == fd_) // the file may have been retired while we worked
+					synced_ = start, kicked_ = end;
+			}
+		}
+		// Anything still retired must be synced and closed before we go.
+		while (!retired_.empty())
+		{
+			fdatasync(retired_.front());
+			close(retired_.front());
+			retired_.pop_front();
+		}
+	}
+
+	std::thread thread_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	bool quit_ = false;
+	int fd_ = -1;
+	off_t written_ = 0; // bytes handed to the kernel for the current file
+	off_t kicked_ = 0; // writeback requested up to here
+	off_t synced_ = 0; // writeback completed (waited for) up to here
+	std::deque<int> retired_;
+};
+
+// Writer for pipe outputs (-o - into a downstream muxer). fwrite() into a pipe
+// copies every byte twice - into the stdio buffer and again into the pipe -
+// whereas vmsplice() just makes the pipe reference our pages. The catch is
+// that the pipe keeps referencing a page until the reader has consumed it, so
+// a page must never be rewritten while it might still be in the pipe. Frames
+// are therefore copied (once) into a page-aligned ring whose pages are only
+// reused after at least a whole pipe's worth of newer data has been spliced:
+// the pipe holds at most pipe_size unread bytes, in order, so anything older
+// than that has certainly been read. Each frame starts on a fresh page, since
+// the pipe references whole pages, not byte ranges.
+
+class PipeWriter
+{
+public:
+	// Ask for a bigger pipe so keyframe bursts don't block on the reader.
+	static constexpr int PIPE_TARGET_SIZE = 1 << 20;
+
+	PipeWriter(int fd) : fd_(fd)
+	{
+		int size = fcntl(fd_, F_SETPIPE_SZ, PIPE_TARGET_SIZE);
+		if (size < 0)
+			size = fcntl(fd_, F_GETPIPE_SZ);
+		pipe_size_ = size > 0 ? size : 65536;
+		page_size_ = sysconf(_SC_PAGESIZE);
+		ring_size_ = 2 * ((pipe_size_ + page_size_ - 1) & ~(size_t)(page_size_ - 1));
+		ring_.resize(ring_size_ + page_size_);
+		// Align the ring start to a page, as the reuse accounting is per page.
+		base_ = (uint8_t *)(((uintptr_t)ring_.data() + page_size_ - 1) & ~(uintptr_t)(page_size_ - 1));
+		page_stamp_.resize(ring_size_ / page_size_, 0);
+	}
+
+	void Write(const void *mem, size_t size)
+	{
+		const uint8_t *p = (const uint8_t *)mem;
+		while (size)
+		{
+			if (head_ == ring_size_)
+				head_ = 0;
+			size_t chunk = std::min({ size, ring_size_ - head_, (size_t)pipe_size_ });
+
+			// The pages about to be rewritten must have left the pipe; they
+			// have once a pipe's worth of data was spliced after them. If the
+			// reader is so far behind that they haven't, just write() this
+			// frame - a copy, but never a torn page downstream.
+			uint64_t oldest = 0;
+			for (size_t i = head_ / page_size_; i <= (head_ + chunk - 1) / page_size_; i++)
+				oldest = std::max(oldest, page_stamp_[i]);
+			if (oldest && spliced_ - oldest < (uint64_t)pipe_size_)
+			{
+				plainWrite(p, size);
+				return;
+			}
+
+			memcpy(base_ + head_, p, chunk);
+			iovec iov = { base_ + head_, chunk };
+			while (iov.iov_len)
+			{
+				ssize_t written = vmsplice(fd_, &iov, 1, 0);
+				if (written < 0)
+					throw std::runtime_error("failed to write output bytes to pipe");
+				iov.iov_base = (uint8_t *)iov.iov_base + written;
+				iov.iov_len -= written;
+			}
+			spliced_ += chunk;
+			for (size_t i = head_ / page_size_; i <= (head_ + chunk - 1) / page_size_; i++)
+				page_stamp_[i] = spliced_;
+
+			// The next frame starts on a fresh page.
+			head_ = (head_ + chunk + page_size_ - 1) & ~(size_t)(page_size_ - 1);
+			p += chunk, size -= chunk;
+		}
+	}
+
+private:
+	void plainWrite(const uint8_t *p, size_t size)
+	{
+		while (size)
+		{
+			ssize_t written = write(fd_, p, size);
+			if (written < 0)
+				throw std::runtime_error("failed to write output bytes to pipe");
+			p += written, size -= written;
+		}
+	}
+
+	int fd_;
+	int pipe_size_;
+	size_t page_size_, ring_size_;
+	std::vector<uint8_t> ring_;
+	uint8_t *base_;
+	size_t head_ = 0;
+	uint64_t spliced_ = 0; // cumulative bytes handed to the pipe by vmsplice
+	std::vector<uint64_t> page_stamp_; // value of spliced_ when the page last entered the pipe
+};
+
+#if LIBURING_PRESENT
+
+#include <liburing.h>
+
+// Asynchronous writer: a small pool of buffers registered with the kernel,
+// written out with IORING_OP_WRITE_FIXED. Frames are copied into a pool
+// buffer and submitted; completions are harvested opportunistically, and we
+// only ever block when the whole (bounded) in-flight budget is used up - so
+// a storage latency spike is absorbed by the pool rather than stalling the
+// encoder's output thread.
+struct UringWriter
+{
+	static constexpr unsigned int DEPTH = 8;
+	static constexpr size_t BUF_SIZE = 1 << 19; // 512KB
+
+	UringWriter(int fd) : fd(fd)
+	{
+		if (io_uring_queue_init(DEPTH, &ring, 0) < 0)
+			throw std::runtime_error("failed to initialise io_uring");
+		iovs.resize(DEPTH);
+		for (unsigned int i = 0; i < DEPTH; i++)
+		{
+			iovs[i].iov_base = new uint8_t[BUF_SIZE];
+			iovs[i].iov_len = BUF_SIZE;
+			free_bufs.push_back(i);
+		}
+		if (io_uring_register_buffers(&ring, iovs.data(), DEPTH) < 0)
+			throw std::runtime_error("failed to register io_uring buffers");
+	}
+	~UringWriter()
+	{
+		Drain();
+		io_uring_queue_exit(&ring);
+		for (auto &iov : iovs)
+			delete[] (uint8_t *)iov.iov_base;
+	}
+
+	// Harvest completions; when wait is set, block until at least one arrives.
+	void reap(bool wait)
+	{
+		struct io_uring_cqe *cqe;
+		while (in_flight)
+		{
+			int ret = wait ? io_uring_wait_cqe(&ring, &cqe) : io_uring_peek_cqe(&ring, &cqe);
+			if (ret < 0)
+			{
+				if (!wait)
+					break; // nothing ready yet
+				throw std::runtime_error("io_uring wait failed");
+			}
+			if (cqe->res < 0)
+				throw std::runtime_error("failed to write output bytes");
+			free_bufs.push_back((unsigned int)(uintptr_t)io_uring_cqe_get_data(cqe));
+			io_uring_cqe_seen(&ring, cqe);
+			in_flight--;
+			wait = false;
+		}
+	}
+
+	void Write(const void *mem, size_t size)
+	{
+		const uint8_t *p = (const uint8_t *)mem;
+		while (size)
+		{
+			reap(free_bufs.empty());
+			unsigned int buf = free_bufs.back();
+			free_bufs.pop_back();
+			size_t chunk = std::min(size, BUF_SIZE);
+			memcpy(iovs[buf].iov_base, p, chunk);
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&ring); // can't fail: depth == pool size
+			io_uring_prep_write_fixed(sqe, fd, iovs[buf].iov_base, chunk, offset, buf);
+			io_uring_sqe_set_data(sqe, (void *)(uintptr_t)buf);
+			io_uring_submit(&ring);
+			in_flight++;
+			offset += chunk, p += chunk, size -= chunk;
+		}
+	}
+
+	void Drain()
+	{
+		while (in_flight)
+			reap(true);
+	}
+
+	struct io_uring ring;
+	int fd;
+	off_t offset = 0;
+	std::vector<iovec> iovs;
+	std::vector<unsigned int> free_bufs;
+	unsigned int in_flight = 0;
+};
+
+#else
+
+// Stub so that ~FileOutput can destroy the (never created) unique_ptr.
+struct UringWriter
+{
+	int fd;
+	void Write(const void *mem, size_t size) {}
+	void Drain() {}
+};
+
+#endif
+
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0), async_io_(options->Get().async_io)
 {
+#if !LIBURING_PRESENT
+	if (async_io_)
+	{
+		LOG_ERROR("WARNING: built without liburing, --async-io ignored");
+		async_io_ = false;
+	}
+#endif
+	// Only segment/split mode ever rolls over to another file, so only then
+	// is there a "next" file worth preparing in advance.
+	if ((options_->Get().segment || options_->Get().split) && options_->Get().output != "-" &&
+		!options_->Get().output.empty())
+		prepare_thread_ = std::thread(&FileOutput::prepareThread, this);
 }
 
 FileOutput::~FileOutput()
 {
+	if (prepare_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(prepare_mutex_);
+			prepare_quit_ = true;
+		}
+		prepare_cv_.notify_one();
+		prepare_thread_.join();
+	}
 	closeFile();
+	if (prepared_fd_ >= 0)
+	{
+		// A file was pre-created but never used; don't leave it behind.
+		close(prepared_fd_);
+		unlink(prepared_name_.c_str());
+	}
+}
+
+void FileOutput::prepareThread()
+{
+	std::unique_lock<std::mutex> lock(prepare_mutex_);
+	while (true)
+	{
+		prepare_cv_.wait(lock, [this] { return prepare_quit_ || !next_name_.empty(); });
+		if (prepare_quit_)
+			return;
+		std::string name;
+		std::swap(name, next_name_);
+		lock.unlock();
+		int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0 && options_->Get().segment && options_->Get().bitrate)
+		{
+			// Preallocate roughly a segment's worth, so the first writes don't
+			// pay for block allocation either. KEEP_SIZE leaves the file its
+			// written length if the segment comes up short.
+			off_t hint = (off_t)(options_->Get().bitrate.bps() / 8 * options_->Get().segment / 1000);
+			if (hint)
+				fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, hint);
+		}
+		lock.lock();
+		prepared_name_ = name;
+		prepared_fd_ = fd; // -1 on failure; openFile falls back to opening inline
+	}
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
@@ -22,7 +398,7 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if ((fp_ == nullptr && !uring_ && !pipe_) ||
 		(options_->Get().segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->Get().segment) ||
 		(options_->Get().split && (flags & FLAG_RESTART)))
@@ -32,19 +408,44 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 	}
 
 	LOG(2, "FileOutput: output buffer " << mem << " size " << size);
-	if (fp_ && size)
+	if (pipe_ && size)
+		pipe_->Write(mem, size); // data reaches the pipe immediately, so --flush has nothing to do
+	else if (uring_ && size)
+	{
+		uring_->Write(mem, size);
+		if (syncer_)
+			syncer_->Wrote(uring_->fd, size);
+	}
+	else if (fp_ && size)
 	{
 		if (fwrite(mem, size, 1, fp_) != 1)
 			throw std::runtime_error("failed to write output bytes");
 		if (options_->Get().flush)
 			fflush(fp_);
+		// (For buffered stdio the count runs a little ahead of what has
+		// actually reached the kernel; sync_file_range on pages not yet
+		// written is harmless, so the pacing is merely approximate.)
+		if (syncer_)
+			syncer_->Wrote(fileno(fp_), size);
 	}
 }
 
 void FileOutput::openFile(int64_t timestamp_us)
 {
 	if (options_->Get().output == "-")
-		fp_ = stdout;
+	{
+		// When stdout is really a pipe (the usual "-o - | muxer" deployment),
+		// splice the encoded pages into it rather than copying them through
+		// stdio and the pipe buffer.
+		struct stat st;
+		if (fstat(fileno(stdout), &st) == 0 && S_ISFIFO(st.st_mode))
+		{
+			pipe_ = std::make_unique<PipeWriter>(fileno(stdout));
+			LOG(2, "FileOutput: writing to pipe with vmsplice");
+		}
+		else
+			fp_ = stdout;
+	}
 	else if (!options_->Get().output.empty())
 	{
 		// Generate the next output file name.
@@ -56,23 +457,93 @@ void FileOutput::openFile(int64_t timestamp_us)
 		if (n < 0)
 			throw std::runtime_error("failed to generate filename");
 
-		fp_ = fopen(filename, "w");
-		if (!fp_)
+		// Take the pre-created file if the background thread has it ready,
+		// otherwise open one right here (always the case for the first file).
+		int fd = -1;
+		if (prepare_thread_.joinable())
+		{
+			std::lock_guard<std::mutex> lock(prepare_mutex_);
+			if (prepared_fd_ >= 0 && prepared_name_ == filename)
+				std::swap(fd, prepared_fd_);
+			else if (prepared_fd_ >= 0)
+			{
+				// We prepared the wrong file (can happen after a wrap); bin it.
+				close(prepared_fd_);
+				unlink(prepared_name_.c_str());
+				prepared_fd_ = -1;
+			}
+		}
+		if (fd < 0)
+			fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
 			throw std::runtime_error("failed to open output file " + std::string(filename));
+		if (async_io_)
+			uring_ = std::make_unique<UringWriter>(fd);
+		else
+		{
+			fp_ = fdopen(fd, "w");
+			if (!fp_)
+			{
+				close(fd);
+				throw std::runtime_error("failed to open output file " + std::string(filename));
+			}
+		}
 		LOG(2, "FileOutput: opened output file " << filename);
 
+		// Real files get their writeback paced by the background syncer.
+		if (!syncer_)
+			syncer_ = std::make_unique<FileSyncer>();
+
 		file_start_time_ms_ = timestamp_us / 1000;
+
+		// And ask for the file after this one to be created in the background.
+		if (prepare_thread_.joinable())
+		{
+			char next_name[256];
+			if (snprintf(next_name, sizeof(next_name), options_->Get().output.c_str(), count_) >= 0)
+			{
+				{
+					std::lock_guard<std::mutex> lock(prepare_mutex_);
+					next_name_ = next_name;
+				}
+				prepare_cv_.notify_one();
+			}
+		}
 	}
 }
 
 void FileOutput::closeFile()
 {
+	pipe_.reset(); // everything written is already in the pipe; stdout isn't ours to close
+	if (uring_)
+	{
+		int fd = uring_->fd;
+		uring_.reset(); // drains all in-flight writes
+		// The final fdatasync and close happen on the syncer thread, so
+		// segment rollover doesn't wait for the card.
+		if (syncer_)
+			syncer_->Retire(fd);
+		else
+			close(fd);
+	}
 	if (fp_)
 	{
 		if (options_->Get().flush)
 			fflush(fp_);
 		if (fp_ != stdout)
-			fclose(fp_);
+		{
+			if (syncer_)
+			{
+				// Keep a handle on the file description so the syncer can
+				// fdatasync it after fclose has flushed the last of the data.
+				int fd = dup(fileno(fp_));
+				fclose(fp_);
+				if (fd >= 0)
+					syncer_->Retire(fd);
+			}
+			else
+				fclose(fp_);
+		}
 		fp_ = nullptr;
 	}
 }
@@ -7,8 +7,18 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
 #include "output.hpp"
 
+struct UringWriter; // asynchronous io_uring writer, available when built with liburing
+class FileSyncer; // background writeback pacing (sync_file_range/fdatasync)
+class PipeWriter; // vmsplice-based writer for pipe outputs (-o -)
+
 class FileOutput : public Output
 {
 public:
@@ -21,7 +31,23 @@ protected:
 private:
 	void openFile(int64_t timestamp_us);
 	void closeFile();
+	void prepareThread();
 	FILE *fp_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
+	bool async_io_;
+	std::unique_ptr<UringWriter> uring_;
+	std::unique_ptr<FileSyncer> syncer_;
+	std::unique_ptr<PipeWriter> pipe_;
+
+	// In segment/split mode the next file is created (and fallocated) ahead
+	// of time on this thread, so rollover is just an fd swap with no
+	// filesystem metadata work in the output path.
+	std::thread prepare_thread_;
+	std::mutex prepare_mutex_;
+	std::condition_variable prepare_cv_;
+	std::string next_name_; // name to prepare; empty when nothing requested
+	std::string prepared_name_;
+	int prepared_fd_ = -1;
+	bool prepare_quit_ = false;
 };
@@ -0,0 +1,425 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * mp4_output.cpp - mux H.264 into fragmented MP4 while recording.
+ *
+ * Selected for -o <file>.mp4 with the V4L2 H.264 encoder. The elementary
+ * stream is wrapped into fragmented MP4 as it is produced - one moof+mdat
+ * per GOP - so there is no post-processing remux re-reading gigabytes off
+ * the card afterwards, and no global index to rewrite at the end: a crash
+ * or power cut loses at most the fragment being assembled, everything
+ * already flushed stays playable.
+ *
+ * Fragmented MP4 is written by hand here (a few fixed box layouts for one
+ * video track) rather than through libavformat, which this tree only loads
+ * as an optional encoder plugin.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "mp4_output.hpp"
+
+// All MP4 box fields are big-endian; these append to the assembly buffer.
+
+static void put_u8(std::vector<uint8_t> &v, uint8_t x)
+{
+	v.push_back(x);
+}
+
+static void put_u16(std::vector<uint8_t> &v, uint16_t x)
+{
+	v.push_back(x >> 8);
+	v.push_back(x);
+}
+
+static void put_u32(std::vector<uint8_t> &v, uint32_t x)
+{
+	v.push_back(x >> 24);
+	v.push_back(x >> 16);
+	v.push_back(x >> 8);
+	v.push_back(x);
+}
+
+static void put_u64(std::vector<uint8_t> &v, uint64_t x)
+{
+	put_u32(v, x >> 32);
+	put_u32(v, x);
+}
+
+static void put_tag(std::vector<uint8_t> &v, char const *tag)
+{
+	v.insert(v.end(), tag, tag + 4);
+}
+
+// Boxes nest, so remember where each one's size field goes and patch it in
+// when the box is closed.
+
+static size_t open_box(std::vector<uint8_t> &v, char const *tag)
+{
+	size_t pos = v.size();
+	put_u32(v, 0);
+	put_tag(v, tag);
+	return pos;
+}
+
+static void close_box(std::vector<uint8_t> &v, size_t pos)
+{
+	uint32_t size = v.size() - pos;
+	v[pos] = size >> 24;
+	v[pos + 1] = size >> 16;
+	v[pos + 2] = size >> 8;
+	v[pos + 3] = size;
+}
+
+// Track timescale: microseconds, matching the encoder's timestamps exactly.
+static constexpr uint32_t TIMESCALE = 1000000;
+
+Mp4Output::Mp4Output(VideoOptions const *options) : Output(options)
+{
+	fp_ = fopen(options->Get().output.c_str(), "w");
+	if (!fp_)
+		throw std::runtime_error("failed to open output file " + options->Get().output);
+
+	// Enough for a typical GOP of 1080p30 H.264; grows (once) if not.
+	frag_data_.reserve(2 << 20);
+	samples_.reserve(256);
+	box_.reserve(4096);
+
+	// Until the second frame fixes the real value, assume nominal framerate
+	// for the corner case of a single-sample fragment.
+	last_duration_us_ = 1000000.0 / options->Get().framerate.value_or(DEFAULT_FRAMERATE);
+
+	LOG(2, "Muxing to fragmented MP4 " << options->Get().output);
+}
+
+Mp4Output::~Mp4Output()
+{
+	if (!samples_.empty())
+		writeFragment();
+	fclose(fp_);
+}
+
+// ftyp plus a moov whose track carries no samples - they all arrive in
+// fragments - and whose avcC holds the SPS/PPS captured from the bitstream.
+
+void Mp4Output::writeInitSegment()
+{
+	std::vector<uint8_t> &v = box_;
+	v.clear();
+
+	size_t ftyp = open_box(v, "ftyp");
+	put_tag(v, "isom");
+	put_u32(v, 0x200);
+	put_tag(v, "isom");
+	put_tag(v, "iso5");
+	put_tag(v, "iso6");
+	put_tag(v, "mp41");
+	close_box(v, ftyp);
+
+	unsigned int width = options_->Get().width, height = options_->Get().height;
+
+	size_t moov = open_box(v, "moov");
+	{
+		size_t mvhd = open_box(v, "mvhd");
+		put_u32(v, 0); // version/flags
+		put_u32(v, 0); // creation time
+		put_u32(v, 0); // modification time
+		put_u32(v, TIMESCALE);
+		put_u32(v, 0); // duration unknown - it's live
+		put_u32(v, 0x00010000); // rate 1.0
+		put_u16(v, 0x0100); // volume 1.0
+		put_u16(v, 0);
+		put_u32(v, 0);
+		put_u32(v, 0);
+		// Identity matrix.
+		put_u32(v, 0x00010000), put_u32(v, 0), put_u32(v, 0);
+		put_u32(v, 0), put_u32(v, 0x00010000), put_u32(v, 0);
+		put_u32(v, 0), put_u32(v, 0), put_u32(v, 0x40000000);
+		for (int i = 0; i < 6; i++)
+			put_u32(v, 0); // predefined
+		put_u32(v, 2); // next track id
+		close_box(v, mvhd);
+
+		size_t trak = open_box(v, "trak");
+		{
+			size_t tkhd = open_box(v, "tkhd");
+			put_u32(v, 3); // version 0, flags: enabled | in movie
+			put_u32(v, 0), put_u32(v, 0); // times
+			put_u32(v, 1); // track id
+			put_u32(v, 0); // reserved
+			put_u32(v, 0); // duration
+			put_u32(v, 0), put_u32(v, 0); // reserved
+			put_u16(v, 0); // layer
+			put_u16(v, 0); // alternate group
+			put_u16(v, 0); // volume
+			put_u16(v, 0);
+			put_u32(v, 0x00010000), put_u32(v, 0), put_u32(v, 0);
+			put_u32(v, 0), put_u32(v, 0x00010000), put_u32(v, 0);
+			put_u32(v, 0), put_u32(v, 0), put_u32(v, 0x40000000);
+			put_u32(v, width << 16);
+			put_u32(v, height << 16);
+			close_box(v, tkhd);
+
+			size_t mdia = open_box(v, "mdia");
+			{
+				size_t mdhd = open_box(v, "mdhd");
+				put_u32(v, 0);
+				put_u32(v, 0), put_u32(v, 0);
+				put_u32(v, TIMESCALE);
+				put_u32(v, 0);
+				put_u16(v, 0x55c4); // language "und"
+				put_u16(v, 0);
+				close_box(v, mdhd);
+
+				size_t hdlr = open_box(v, "hdlr");
+				put_u32(v, 0);
+				put_u32(v, 0);
+				put_tag(v, "vide");
+				put_u32(v, 0), put_u32(v, 0), put_u32(v, 0);
+				char const name[] = "VideoHandler";
+				v.insert(v.end(), name, name + sizeof(name));
+				close_box(v, hdlr);
+
+				size_t minf = open_box(v, "minf");
+				{
+					size_t vmhd = open_box(v, "vmhd");
+					put_u32(v, 1);
+					put_u16(v, 0), put_u16(v, 0), put_u16(v, 0), put_u16(v, 0);
+					close_box(v, vmhd);
+
+					size_t dinf = open_box(v, "dinf");
+					size_t dref = open_box(v, "dref");
+					put_u32(v, 0);
+					put_u32(v, 1);
+					size_t url = open_box(v, "url ");
+					put_u32(v, 1); // self-contained
+					close_box(v, url);
+					close_box(v, dref);
+					close_box(v, dinf);
+
+					size_t stbl = open_box(v, "stbl");
+					{
+						size_t stsd = open_box(v, "stsd");
+						put_u32(v, 0);
+						put_u32(v, 1);
+						size_t avc1 = open_box(v, "avc1");
+						for (int i = 0; i < 6; i++)
+							put_u8(v, 0); // reserved
+						put_u16(v, 1); // data reference index
+						put_u16(v, 0), put_u16(v, 0);
+						put_u32(v, 0), put_u32(v, 0), put_u32(v, 0);
+						put_u16(v, width);
+						put_u16(v, height);
+						put_u32(v, 0x00480000); // 72dpi
+						put_u32(v, 0x00480000);
+						put_u32(v, 0);
+						put_u16(v, 1); // frame count
+						for (int i = 0; i < 32; i++)
+							put_u8(v, 0); // compressor name
+						put_u16(v, 0x18); // depth
+						put_u16(v, 0xffff); // predefined
+						size_t avcC = open_box(v, "avcC");
+						put_u8(v, 1); // configuration version
+						put_u8(v, sps_[1]); // profile
+						put_u8(v, sps_[2]); // profile compat
+						put_u8(v, sps_[3]); // level
+						put_u8(v, 0xff); // 4-byte NAL lengths
+						put_u8(v, 0xe1); // 1 SPS
+						put_u16(v, sps_.size());
+						v.insert(v.end(), sps_.begin(), sps_.end());
+						put_u8(v, 1); // 1 PPS
+						put_u16(v, pps_.size());
+						v.insert(v.end(), pps_.begin(), pps_.end());
+						close_box(v, avcC);
+						close_box(v, avc1);
+						close_box(v, stsd);
+
+						// Empty sample tables - everything lives in fragments.
+						static char const *empties[] = { "stts", "stsc", "stco" };
+						for (char const *tag : empties)
+						{
+							size_t box = open_box(v, tag);
+							put_u32(v, 0);
+							put_u32(v, 0);
+							close_box(v, box);
+						}
+						size_t stsz = open_box(v, "stsz");
+						put_u32(v, 0);
+						put_u32(v, 0);
+						put_u32(v, 0);
+						close_box(v, stsz);
+					}
+					close_box(v, stbl);
+				}
+				close_box(v, minf);
+			}
+			close_box(v, mdia);
+		}
+		close_box(v, trak);
+
+		size_t mvex = open_box(v, "mvex");
+		size_t trex = open_box(v, "trex");
+		put_u32(v, 0);
+		put_u32(v, 1); // track id
+		put_u32(v, 1); // default sample description index
+		put_u32(v, 0); // default duration
+		put_u32(v, 0); // default size
+		put_u32(v, 0); // default flags
+		close_box(v, trex);
+		close_box(v, mvex);
+	}
+	close_box(v, moov);
+
+	if (fwrite(v.data(), v.size(), 1, fp_) != 1)
+		throw std::runtime_error("failed to write MP4 init segment");
+	init_written_ = true;
+}
+
+void Mp4Output::writeFragment()
+{
+	std::vector<uint8_t> &v = box_;
+	v.clear();
+
+	size_t moof = open_box(v, "moof");
+	{
+		size_t mfhd = open_box(v, "mfhd");
+		put_u32(v, 0);
+		put_u32(v, sequence_++);
+		close_box(v, mfhd);
+
+		size_t traf = open_box(v, "traf");
+		{
+			size_t tfhd = open_box(v, "tfhd");
+			put_u32(v, 0x020000); // default-base-is-moof
+			put_u32(v, 1); // track id
+			close_box(v, tfhd);
+
+			size_t tfdt = open_box(v, "tfdt");
+			put_u8(v, 1); // version 1: 64-bit time
+			put_u8(v, 0), put_u8(v, 0), put_u8(v, 0);
+			put_u64(v, decode_time_us_);
+			close_box(v, tfdt);
+
+			size_t trun = open_box(v, "trun");
+			put_u32(v, 0x000701); // data offset, durations, sizes, flags
+			put_u32(v, samples_.size());
+			size_t data_offset_pos = v.size();
+			put_u32(v, 0); // patched below
+			for (size_t i = 0; i < samples_.size(); i++)
+			{
+				// The last sample's duration isn't known until the next frame
+				// arrives; reuse the previous one, which is exact for any
+				// constant framerate.
+				int64_t duration = i + 1 < samples_.size()
+									   ? samples_[i + 1].timestamp_us - samples_[i].timestamp_us
+									   : last_duration_us_;
+				duration = std::max<int64_t>(duration, 0);
+				last_duration_us_ = duration;
+				decode_time_us_ += duration;
+				put_u32(v, duration);
+				put_u32(v, samples_[i].size);
+				put_u32(v, samples_[i].keyframe ? 0x02000000 : 0x01010000);
+			}
+			close_box(v, trun);
+
+			// Sample data starts after the whole moof plus the mdat header.
+			uint32_t data_offset = (v.size() - moof) + 8;
+			v[data_offset_pos] = data_offset >> 24;
+			v[data_offset_pos + 1] = data_offset >> 16;
+			v[data_offset_pos + 2] = data_offset >> 8;
+			v[data_offset_pos + 3] = data_offset;
+		}
+		close_box(v, traf);
+	}
+	close_box(v, moof);
+
+	size_t mdat = open_box(v, "mdat");
+	close_box(v, mdat);
+	v[v.size() - 8] = (frag_data_.size() + 8) >> 24;
+	v[v.size() - 7] = (frag_data_.size() + 8) >> 16;
+	v[v.size() - 6] = (frag_data_.size() + 8) >> 8;
+	v[v.size() - 5] = (frag_data_.size() + 8);
+
+	if (fwrite(v.data(), v.size(), 1, fp_) != 1 ||
+		(frag_data_.size() && fwrite(frag_data_.data(), frag_data_.size(), 1, fp_) != 1))
+		throw std::runtime_error("failed to write MP4 fragment");
+	// Push each completed fragment to the device; that's the crash-safety.
+	fflush(fp_);
+	if (options_->Get().flush)
+		fdatasync(fileno(fp_));
+
+	samples_.clear();
+	frag_data_.clear();
+}
+
+// Split the Annex B buffer into NAL units: SPS/PPS are captured for the init
+// segment (and stripped - they live in the avcC), everything else is length
+// prefixed into the fragment's sample.
+
+void Mp4Output::appendFrame(uint8_t const *data, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	size_t sample_start = frag_data_.size();
+	size_t pos = 0;
+	while (pos + 3 < size)
+	{
+		// Find the next start code (00 00 01, possibly with extra zero bytes).
+		if (data[pos] || data[pos + 1] || data[pos + 2] != 1)
+		{
+			pos++;
+			continue;
+		}
+		size_t nal_start = pos + 3;
+		size_t nal_end = size;
+		for (size_t p = nal_start; p + 3 <= size; p++)
+		{
+			if (!data[p] && !data[p + 1] && data[p + 2] == 1)
+			{
+				nal_end = p;
+				break;
+			}
+		}
+		while (nal_end > nal_start && !data[nal_end - 1])
+			nal_end--; // a trailing zero belongs to a 4-byte start code
+		size_t nal_size = nal_end - nal_start;
+		uint8_t nal_type = data[nal_start] & 0x1f;
+		if (nal_type == 7)
+			sps_.assign(data + nal_start, data + nal_end);
+		else if (nal_type == 8)
+			pps_.assign(data + nal_start, data + nal_end);
+		else if (nal_type != 9 && nal_size) // drop access unit delimiters
+		{
+			put_u32(frag_data_, nal_size);
+			frag_data_.insert(frag_data_.end(), data + nal_start, data + nal_end);
+		}
+		pos = nal_end;
+	}
+
+	size_t sample_size = frag_data_.size() - sample_start;
+	if (sample_size)
+		samples_.push_back({ sample_size, timestamp_us, keyframe });
+}
+
+void Mp4Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	bool keyframe = !!(flags & FLAG_KEYFRAME);
+
+	// Fragments start on keyframes, so everything assembled for the previous
+	// GOP gets written (and flushed) first.
+	if (keyframe && !samples_.empty())
+		writeFragment();
+
+	if (first_timestamp_us_ < 0)
+		first_timestamp_us_ = timestamp_us;
+
+	appendFrame((uint8_t const *)mem, size, timestamp_us - first_timestamp_us_, keyframe);
+
+	// The init segment needs the SPS/PPS, which arrive with the first
+	// keyframe; nothing can be written until then.
+	if (!init_written_ && !sps_.empty() && !pps_.empty())
+		writeInitSegment();
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * mp4_output.hpp - mux H.264 into fragmented MP4 while recording.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "output.hpp"
+
+class Mp4Output : public Output
+{
+public:
+	Mp4Output(VideoOptions const *options);
+	~Mp4Output();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	// One entry per sample in the fragment being assembled; the vectors below
+	// are reserved up front and reused, so steady-state muxing allocates
+	// nothing.
+	struct Sample
+	{
+		size_t size;
+		int64_t timestamp_us;
+		bool keyframe;
+	};
+
+	void appendFrame(uint8_t const *data, size_t size, int64_t timestamp_us, bool keyframe);
+	void writeInitSegment();
+	void writeFragment();
+
+	FILE *fp_;
+	std::vector<uint8_t> sps_, pps_;
+	std::vector<uint8_t> frag_data_; // length-prefixed sample data
+	std::vector<Sample> samples_; // the fragment's sample index
+	std::vector<uint8_t> box_; // moof/init segment assembly buffer
+	uint32_t sequence_ = 1;
+	int64_t first_timestamp_us_ = -1;
+	int64_t last_duration_us_ = 0;
+	uint64_t decode_time_us_ = 0;
+	bool init_written_ = false;
+};
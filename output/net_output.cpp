@@ -5,12 +5,20 @@
  * net_output.cpp - send output over network.
  */
 
+#include <thread>
+
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 
 #include "net_output.hpp"
 
-NetOutput::NetOutput(VideoOptions const *options) : Output(options)
+NetOutput::NetOutput(VideoOptions const *options)
+	: Output(options), mtu_(options->Get().udp_mtu), pace_bps_(options->Get().udp_pace.bps()), tokens_(0),
+	  last_send_(std::chrono::steady_clock::now())
 {
 	char protocol[4];
 	int start, end, a, b, c, d, port;
@@ -86,6 +94,15 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 		saddr_ptr_ = NULL; // sendto doesn't want these for tcp
 		sockaddr_in_size_ = 0;
+
+		// At tens of Mbps the copy into the socket buffers is a visible CPU
+		// cost, so ask for zerocopy transmission; older kernels refuse and we
+		// just carry on copying.
+		int enable = 1;
+		if (setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0)
+			zerocopy_ = true;
+		else
+			LOG(2, "NetOutput: MSG_ZEROCOPY not available");
 	}
 	else
 		throw std::runtime_error("unrecognised network protocol " + options->Get().output);
@@ -96,19 +113,242 @@ NetOutput::~NetOutput()
 	close(fd_);
 }
 
+void NetOutput::SetBitrateFeedbackCallback(BitrateFeedbackCallback callback)
+{
+	base_bps_ = options_->Get().bitrate.bps();
+	if (!base_bps_)
+	{
+		LOG(1, "NetOutput: bitrate feedback needs --bitrate, ignoring");
+		return;
+	}
+	target_bps_ = base_bps_;
+	last_adapt_ = std::chrono::steady_clock::now();
+	bitrate_feedback_callback_ = callback;
+}
+
+void NetOutput::adaptBitrate()
+{
+	using namespace std::chrono;
+	auto now = steady_clock::now();
+	if (now - last_adapt_ < 1s)
+		return;
+	last_adapt_ = now;
+
+	// SIOCOUTQ reports the bytes the kernel is still sitting on: unacked for
+	// TCP, not yet on the wire for UDP. More than half a second's worth at
+	// the current rate means the link can't keep up.
+	int queued;
+	if (ioctl(fd_, SIOCOUTQ, &queued) < 0)
+		return;
+
+	uint64_t target = target_bps_;
+	if ((uint64_t)queued * 8 > target / 2)
+	{
+		// Step down sharply, but keep some floor under the quality.
+		target = std::max(target * 3 / 4, base_bps_ / 8);
+		clear_checks_ = 0;
+	}
+	else if ((uint64_t)queued * 8 < target / 10 && target < base_bps_ && ++clear_checks_ >= 3)
+	{
+		// Step back up gently, only after a few consecutive clear checks.
+		target = std::min(target * 5 / 4, base_bps_);
+		clear_checks_ = 0;
+	}
+
+	if (target != target_bps_)
+	{
+		LOG(1, "NetOutput: link " << (target < target_bps_ ? "congested" : "recovering") << ", bitrate now "
+								  << target / 1000 << " kbps");
+		target_bps_ = target;
+		bitrate_feedback_callback_(target);
+	}
+}
+
 // Maximum size that sendto will accept.
 constexpr size_t MAX_UDP_SIZE = 65507;
 
 void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
 {
 	LOG(2, "NetOutput: output buffer " << mem << " size " << size);
-	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
+	if (bitrate_feedback_callback_)
+		adaptBitrate();
+	if (pace_bps_ && saddr_ptr_)
+		pace(size);
+	if (mtu_ && saddr_ptr_)
+	{
+		sendFrameBatched((uint8_t *)mem, size);
+		return;
+	}
+	if (!saddr_ptr_)
+	{
+		sendFrameTcp((uint8_t *)mem, size);
+		return;
+	}
 	for (uint8_t *ptr = (uint8_t *)mem; size;)
 	{
-		size_t bytes_to_send = std::min(size, max_size);
+		size_t bytes_to_send = std::min(size, MAX_UDP_SIZE);
 		if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0)
 			throw std::runtime_error("failed to send data on socket");
 		ptr += bytes_to_send;
 		size -= bytes_to_send;
 	}
 }
+
+// Frames smaller than this are not worth pinning - the kernel copies small
+// zerocopy sends anyway - and get corked with MSG_MORE instead so they
+// coalesce into the next frame's first segment rather than making a tiny
+// packet of their own.
+constexpr size_t ZEROCOPY_THRESHOLD = 16384;
+
+// The V4L2 codec recycles its capture buffers round-robin (it has 12); keep
+// fewer frames than that in flight so no buffer is handed back to the codec
+// and rewritten while the NIC still holds its pages.
+constexpr size_t MAX_ZEROCOPY_FRAMES = 8;
+
+void NetOutput::sendFrameTcp(uint8_t *ptr, size_t size)
+{
+	if (!zerocopy_ || size < ZEROCOPY_THRESHOLD)
+	{
+		int flags = size < ZEROCOPY_THRESHOLD ? MSG_MORE : 0;
+		while (size)
+		{
+			ssize_t sent = send(fd_, ptr, size, flags);
+			if (sent < 0)
+				throw std::runtime_error("failed to send data on socket");
+			ptr += sent;
+			size -= sent;
+		}
+		return;
+	}
+
+	while (size)
+	{
+		ssize_t sent = send(fd_, ptr, size, MSG_ZEROCOPY);
+		if (sent < 0)
+		{
+			// ENOBUFS means the per-socket pinned-pages budget is spent:
+			// wait for some completions and try again.
+			if (errno == ENOBUFS)
+			{
+				reapZerocopyCompletions(true);
+				continue;
+			}
+			throw std::runtime_error("failed to send data on socket");
+		}
+		zc_next_id_++; // the kernel numbers each zerocopy send() call
+		ptr += sent;
+		size -= sent;
+	}
+	zc_pending_frames_.push_back(zc_next_id_ - 1);
+
+	reapZerocopyCompletions(false);
+	while (zc_pending_frames_.size() > MAX_ZEROCOPY_FRAMES)
+		reapZerocopyCompletions(true);
+
+	// If the kernel tells us it copied after all (no scatter-gather on this
+	// path, say), stop paying the error-queue overhead for nothing.
+	if (zerocopy_copied_ && zc_pending_frames_.empty())
+	{
+		LOG(1, "NetOutput: kernel is copying zerocopy sends, disabling MSG_ZEROCOPY");
+		zerocopy_ = false;
+	}
+}
+
+void NetOutput::reapZerocopyCompletions(bool wait)
+{
+	while (true)
+	{
+		char control[128];
+		msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				throw std::runtime_error("failed to read socket error queue");
+			if (!wait || zc_pending_frames_.empty())
+				return;
+			// The error queue signals readiness through POLLERR. Completions
+			// need the peer's ACKs, so a stalled link makes us block here -
+			// just as a plain send() would block on a full socket buffer.
+			pollfd p = { fd_, 0, 0 };
+			if (poll(&p, 1, 1000) < 0)
+				throw std::runtime_error("failed to poll socket error queue");
+			continue;
+		}
+
+		for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if ((cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) &&
+				(cm->cmsg_level != SOL_IPV6 || cm->cmsg_type != IPV6_RECVERR))
+				continue;
+			sock_extended_err serr;
+			memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+			if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// ee_info..ee_data is the completed range of send numbers.
+			if ((int32_t)(serr.ee_data + 1 - zc_completed_) > 0)
+				zc_completed_ = serr.ee_data + 1;
+			if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zerocopy_copied_ = true;
+		}
+
+		while (!zc_pending_frames_.empty() && (int32_t)(zc_completed_ - zc_pending_frames_.front()) > 0)
+			zc_pending_frames_.pop_front();
+
+		if (!wait || zc_pending_frames_.size() <= MAX_ZEROCOPY_FRAMES)
+			return;
+	}
+}
+
+void NetOutput::sendFrameBatched(uint8_t *ptr, size_t size)
+{
+	// One datagram per MTU-sized chunk, all of them handed to the kernel with
+	// a single sendmmsg per frame instead of one syscall per datagram.
+	constexpr unsigned int MAX_BATCH = 256;
+	mmsghdr msgs[MAX_BATCH];
+	iovec iovs[MAX_BATCH];
+	while (size)
+	{
+		unsigned int n = 0;
+		for (; n < MAX_BATCH && size; n++)
+		{
+			size_t chunk = std::min(size, (size_t)mtu_);
+			iovs[n] = { ptr, chunk };
+			msgs[n] = {};
+			msgs[n].msg_hdr.msg_name = (void *)saddr_ptr_;
+			msgs[n].msg_hdr.msg_namelen = sockaddr_in_size_;
+			msgs[n].msg_hdr.msg_iov = &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			ptr += chunk;
+			size -= chunk;
+		}
+		unsigned int done = 0;
+		while (done < n)
+		{
+			int sent = sendmmsg(fd_, msgs + done, n - done, 0);
+			if (sent < 0)
+				throw std::runtime_error("failed to send data on socket");
+			done += sent;
+		}
+	}
+}
+
+void NetOutput::pace(size_t size)
+{
+	using namespace std::chrono;
+	// Allow bursts of up to 100ms worth of data.
+	double bucket_size = pace_bps_ / 80.0;
+	auto now = steady_clock::now();
+	tokens_ = std::min(tokens_ + duration<double>(now - last_send_).count() * pace_bps_ / 8, bucket_size);
+	last_send_ = now;
+	if (size > tokens_)
+	{
+		// Wait until the deficit has been covered, then the bucket is empty.
+		std::this_thread::sleep_for(duration<double>((size - tokens_) * 8 / pace_bps_));
+		tokens_ = 0;
+		last_send_ = steady_clock::now();
+	}
+	else
+		tokens_ -= size;
+}
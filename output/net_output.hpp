@@ -7,6 +7,9 @@
 
 #pragma once
 
+#include <chrono>
+#include <deque>
+
 #include <netinet/in.h>
 
 #include "output.hpp"
@@ -17,12 +20,47 @@ public:
 	NetOutput(VideoOptions const *options);
 	~NetOutput();
 
+	// Enables adaptive bitrate: once a second the socket send queue is
+	// inspected, and when it backs up the callback is asked for a lower
+	// bitrate (stepping back up again once the link recovers). Needs
+	// --bitrate as the ceiling to adapt below.
+	void SetBitrateFeedbackCallback(BitrateFeedbackCallback callback) override;
+
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	// Fragment the frame into MTU-sized chunks and submit them all with a
+	// single sendmmsg call.
+	void sendFrameBatched(uint8_t *ptr, size_t size);
+	// TCP transmission without copying the bitstream into the socket buffers;
+	// falls back to plain (corked) sends for small frames and on sockets
+	// where zerocopy doesn't work.
+	void sendFrameTcp(uint8_t *ptr, size_t size);
+	void reapZerocopyCompletions(bool wait);
+	// Token-bucket pacer to smooth out (keyframe) bursts.
+	void pace(size_t size);
+	void adaptBitrate();
+
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	unsigned int mtu_;
+	uint64_t pace_bps_;
+	double tokens_;
+	std::chrono::steady_clock::time_point last_send_;
+	BitrateFeedbackCallback bitrate_feedback_callback_;
+	uint64_t base_bps_ = 0; // the configured bitrate, our ceiling
+	uint64_t target_bps_ = 0;
+	unsigned int clear_checks_ = 0;
+	std::chrono::steady_clock::time_point last_adapt_;
+	// MSG_ZEROCOPY bookkeeping: the kernel numbers zerocopy sends and reports
+	// completed ranges on the error queue; we note the last send of each
+	// frame so we know when the NIC has let go of that frame's pages.
+	bool zerocopy_ = false;
+	bool zerocopy_copied_ = false; // kernel fell back to copying
+	uint32_t zc_next_id_ = 0;
+	uint32_t zc_completed_ = 0;
+	std::deque<uint32_t> zc_pending_frames_;
 };
@@ -8,22 +8,39 @@
 #include <cinttypes>
 #include <stdexcept>
 
+#include "core/frame_trace.hpp"
+#include "core/stats.hpp"
+
 #include "circular_output.hpp"
 #include "file_output.hpp"
+#include "mp4_output.hpp"
 #include "net_output.hpp"
+#include "rtsp_output.hpp"
+#include "shm_output.hpp"
+#include "tee_output.hpp"
 #include "uvc_output.hpp"
 #include "output.hpp"
 
 Output::Output(VideoOptions const *options)
-	: options_(options), fp_timestamps_(nullptr), state_(WAITING_KEYFRAME), time_offset_(0), last_timestamp_(0),
-	  buf_metadata_(std::cout.rdbuf()), of_metadata_()
+	: options_(options), fp_timestamps_(nullptr), state_(WAITING_KEYFRAME), pts_binary_(false), pts_count_(0),
+	  time_offset_(0), last_timestamp_(0), last_raw_timestamp_(-1), buf_metadata_(std::cout.rdbuf()), of_metadata_()
 {
 	if (!options->Get().save_pts.empty())
 	{
-		fp_timestamps_ = fopen(options->Get().save_pts.c_str(), "w");
+		pts_binary_ = options->Get().save_pts_format == "binary";
+		fp_timestamps_ = fopen(options->Get().save_pts.c_str(), pts_binary_ ? "wb" : "w");
 		if (!fp_timestamps_)
 			throw std::runtime_error("Failed to open timestamp file " + options->Get().save_pts);
-		fprintf(fp_timestamps_, "# timecode format v2\n");
+		if (pts_binary_)
+		{
+			// Fixed size header, then native-endian int64 microsecond records.
+			// utils/pts2txt.py converts back to the text format.
+			static const char magic[8] = { 'R', 'P', 'T', 'S', 1, 0, 0, 0 };
+			fwrite(magic, sizeof(magic), 1, fp_timestamps_);
+			pts_ring_.resize(512);
+		}
+		else
+			fprintf(fp_timestamps_, "# timecode format v2\n");
 	}
 	if (!options->Get().metadata.empty())
 	{
@@ -43,7 +60,11 @@ Output::Output(VideoOptions const *options)
 Output::~Output()
 {
 	if (fp_timestamps_)
+	{
+		if (pts_count_)
+			flushTimestamps();
 		fclose(fp_timestamps_);
+	}
 	if (!options_->Get().metadata.empty())
 		stop_metadata_output(buf_metadata_, options_->Get().metadata_format);
 }
@@ -66,22 +87,75 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 	if (state_ != RUNNING)
 		return;
 
+	// A slice-mode encoder delivers several buffers per frame, all carrying the
+	// frame's timestamp; anything per-frame below happens on the first only.
+	bool new_frame = timestamp_us != last_raw_timestamp_;
+	last_raw_timestamp_ = timestamp_us;
+
 	// Frig the timestamps to be continuous after a pause.
 	if (flags & FLAG_RESTART)
 		time_offset_ = timestamp_us - last_timestamp_;
 	last_timestamp_ = timestamp_us - time_offset_;
 
-	outputBuffer(mem, size, last_timestamp_, flags);
+	{
+		// The frame's presentation timestamp identifies it in the trace.
+		FrameTrace::Span span("output", last_timestamp_);
+		outputBuffer(mem, size, last_timestamp_, flags);
+	}
+
+	static std::atomic<uint64_t> &output_bytes = Stats::Get().Counter("output.bytes");
+	output_bytes.fetch_add(size, std::memory_order_relaxed);
 
 	// Save timestamps to a file, if that was requested.
-	if (fp_timestamps_)
+	if (fp_timestamps_ && new_frame)
 	{
 		timestampReady(last_timestamp_);
 	}
 
-	if (!options_->Get().metadata.empty())
+	if (!options_->Get().metadata.empty() && new_frame)
 	{
-		libcamera::ControlList metadata = metadata_queue_.front();
+		libcamera::ControlList metadata = std::move(metadata_queue_.front());
+		write_metadata(buf_metadata_, options_->Get().metadata_format, metadata, !metadata_started_);
+		metadata_started_ = true;
+		metadata_queue_.pop();
+	}
+}
+
+void Output::OutputReadyFd(int fd, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	// Same state machine as OutputReady, but the frame is identified by its
+	// dma-buf fd and the data never gets mapped here.
+	uint32_t flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
+	if (!enable_)
+		state_ = DISABLED;
+	else if (state_ == DISABLED)
+		state_ = WAITING_KEYFRAME;
+	if (state_ == WAITING_KEYFRAME && keyframe)
+		state_ = RUNNING, flags |= FLAG_RESTART;
+	if (state_ != RUNNING)
+		return;
+
+	bool new_frame = timestamp_us != last_raw_timestamp_;
+	last_raw_timestamp_ = timestamp_us;
+
+	if (flags & FLAG_RESTART)
+		time_offset_ = timestamp_us - last_timestamp_;
+	last_timestamp_ = timestamp_us - time_offset_;
+
+	{
+		FrameTrace::Span span("output", last_timestamp_);
+		outputBufferFd(fd, size, last_timestamp_, flags);
+	}
+
+	static std::atomic<uint64_t> &output_bytes = Stats::Get().Counter("output.bytes");
+	output_bytes.fetch_add(size, std::memory_order_relaxed);
+
+	if (fp_timestamps_ && new_frame)
+		timestampReady(last_timestamp_);
+
+	if (!options_->Get().metadata.empty() && new_frame)
+	{
+		libcamera::ControlList metadata = std::move(metadata_queue_.front());
 		write_metadata(buf_metadata_, options_->Get().metadata_format, metadata, !metadata_started_);
 		metadata_started_ = true;
 		metadata_queue_.pop();
@@ -90,28 +164,59 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 
 void Output::timestampReady(int64_t timestamp)
 {
+	if (pts_binary_)
+	{
+		// Just store the record; formatting and I/O happen once per batch.
+		pts_ring_[pts_count_++] = timestamp;
+		if (pts_count_ == pts_ring_.size())
+			flushTimestamps();
+		return;
+	}
 	fprintf(fp_timestamps_, "%" PRId64 ".%03" PRId64 "\n", timestamp / 1000, timestamp % 1000);
 	if (options_->Get().flush)
 		fflush(fp_timestamps_);
 }
 
+void Output::flushTimestamps()
+{
+	if (fwrite(pts_ring_.data(), sizeof(int64_t), pts_count_, fp_timestamps_) != pts_count_)
+		throw std::runtime_error("failed to write timestamps");
+	pts_count_ = 0;
+	if (options_->Get().flush)
+		fflush(fp_timestamps_);
+}
+
 void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	// Supply this so that a vanilla Output gives you an object that outputs no buffers.
 }
 
+void Output::outputBufferFd(int fd, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// As above, for fd-based outputs.
+}
+
 Output *Output::Create(VideoOptions const *options)
 {
 	bool libav = options->Get().codec == "libav" ||
 				 (options->Get().codec == "h264" && options->GetPlatform() != Platform::VC4);
 	const std::string out_file = options->Get().output;
 
-	if (!libav && (strncmp(out_file.c_str(), "udp://", 6) == 0 || strncmp(out_file.c_str(), "tcp://", 6) == 0))
+	if (options->Get().outputs.size() > 1)
+		return new TeeOutput(options);
+	else if (!libav && strncmp(out_file.c_str(), "rtsp://", 7) == 0)
+		return new RtspOutput(options);
+	else if (!libav && (strncmp(out_file.c_str(), "udp://", 6) == 0 || strncmp(out_file.c_str(), "tcp://", 6) == 0))
 		return new NetOutput(options);
+	else if (strncmp(out_file.c_str(), "shm://", 6) == 0)
+		return new ShmOutput(options);
 	else if (options->Get().circular)
 		return new CircularOutput(options);
 	else if (strncmp(out_file.c_str(), "/dev/video", 10) == 0)
 		return new UVCOutput(options);
+	else if (!libav && options->Get().codec == "h264" && out_file.size() > 4 &&
+			 out_file.compare(out_file.size() - 4, 4, ".mp4") == 0)
+		return new Mp4Output(options);
 	else if (!out_file.empty())
 		return new FileOutput(options);
 	else
@@ -10,9 +10,13 @@
 #include <cstdio>
 
 #include <atomic>
+#include <functional>
+#include <vector>
 
 #include "core/video_options.hpp"
 
+typedef std::function<void(uint64_t)> BitrateFeedbackCallback;
+
 class Output
 {
 public:
@@ -22,6 +26,17 @@ public:
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+	// Fd-based variant for outputs that pass the frame's dma-buf along instead
+	// of touching the data; wire it up (via SetEncodeOutputReadyFdCallback) when
+	// WantsFd() says so. Only the NullEncoder delivers frames this way.
+	void OutputReadyFd(int fd, size_t size, int64_t timestamp_us, bool keyframe);
+	virtual bool WantsFd() const { return false; }
+	// Outputs that can sense backpressure on their transport (NetOutput
+	// watches its socket send queue) report a recommended bitrate through
+	// this callback, which applications typically wire to
+	// RPiCamEncoder::SetEncoderBitrate(). The base class has no transport to
+	// watch and ignores it.
+	virtual void SetBitrateFeedbackCallback(BitrateFeedbackCallback) {}
 	void MetadataReady(libcamera::ControlList &metadata);
 
 protected:
@@ -32,6 +47,7 @@ protected:
 		FLAG_RESTART = 2
 	};
 	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+	virtual void outputBufferFd(int fd, size_t size, int64_t timestamp_us, uint32_t flags);
 	virtual void timestampReady(int64_t timestamp);
 	VideoOptions const *options_;
 	FILE *fp_timestamps_;
@@ -43,10 +59,20 @@ private:
 		WAITING_KEYFRAME = 1,
 		RUNNING = 2
 	};
+	void flushTimestamps();
 	State state_;
 	std::atomic<bool> enable_;
+	// In binary mode timestamps accumulate in this preallocated ring and are
+	// written out a batch at a time, not one printf per frame.
+	bool pts_binary_;
+	std::vector<int64_t> pts_ring_;
+	size_t pts_count_;
 	int64_t time_offset_;
 	int64_t last_timestamp_;
+	// Slice-mode encoders deliver a frame as several buffers sharing its
+	// timestamp; per-frame bookkeeping (the pts file, the metadata queue)
+	// triggers only when the timestamp moves on.
+	int64_t last_raw_timestamp_;
 	std::streambuf *buf_metadata_;
 	std::ofstream of_metadata_;
 	bool metadata_started_ = false;
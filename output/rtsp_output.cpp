@@ -0,0 +1,413 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * rtsp_output.cpp - in-process RTSP/RTP server output.
+ */
+
+#include <cstring>
+#include <random>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "rtsp_output.hpp"
+
+static constexpr unsigned int RTP_MTU = 1400; // payload bytes per RTP packet
+static constexpr unsigned int MAX_QUEUE_PACKETS = 512; // per client, roughly half a second at 25Mbps
+static constexpr uint8_t PAYLOAD_TYPE = 96;
+
+// ----- Small helpers -----
+
+static std::string base64(uint8_t const *data, size_t len)
+{
+	static const char tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < len; i += 3)
+	{
+		uint32_t v = data[i] << 16;
+		if (i + 1 < len)
+			v |= data[i + 1] << 8;
+		if (i + 2 < len)
+			v |= data[i + 2];
+		out += tab[(v >> 18) & 63];
+		out += tab[(v >> 12) & 63];
+		out += i + 1 < len ? tab[(v >> 6) & 63] : '=';
+		out += i + 2 < len ? tab[v & 63] : '=';
+	}
+	return out;
+}
+
+// Find the next Annex-B NAL unit in [p, end). Returns nullptr when there are
+// no more, otherwise the start of the NAL payload, with *nal_end set to the
+// byte after it ends (i.e. the next start code, or end).
+static uint8_t const *next_nal(uint8_t const *p, uint8_t const *end, uint8_t const **nal_end)
+{
+	while (p + 3 <= end && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+		p++;
+	if (p + 3 > end)
+		return nullptr;
+	p += 3;
+	uint8_t const *q = p;
+	while (q + 3 <= end && !(q[0] == 0 && q[1] == 0 && q[2] == 1))
+		q++;
+	if (q + 3 > end)
+		q = end;
+	else if (q > p && q[-1] == 0) // 4-byte start code
+		q--;
+	*nal_end = q;
+	return p;
+}
+
+// ----- Construction / shutdown -----
+
+RtspOutput::RtspOutput(VideoOptions const *options) : Output(options)
+{
+	if (options->Get().codec != "h264")
+		throw std::runtime_error("rtsp output supports the h264 codec only");
+
+	int port = 8554;
+	char const *colon = strrchr(options->Get().output.c_str() + strlen("rtsp://"), ':');
+	if (colon && sscanf(colon + 1, "%d", &port) != 1)
+		throw std::runtime_error("bad rtsp address " + options->Get().output);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open rtsp listen socket");
+	int enable = 1;
+	setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = INADDR_ANY;
+	saddr.sin_port = htons(port);
+	if (bind(listen_fd_, (sockaddr *)&saddr, sizeof(saddr)) < 0 || listen(listen_fd_, 4) < 0)
+		throw std::runtime_error("failed to bind rtsp listen socket");
+
+	if (pipe(quit_pipe_) < 0)
+		throw std::runtime_error("failed to create rtsp quit pipe");
+
+	ssrc_ = std::random_device{}();
+	server_thread_ = std::thread(&RtspOutput::serverThread, this);
+	LOG(1, "RTSP server listening on port " << port);
+}
+
+RtspOutput::~RtspOutput()
+{
+	quit_ = true;
+	[[maybe_unused]] ssize_t n = write(quit_pipe_[1], "x", 1);
+	server_thread_.join();
+	{
+		std::lock_guard<std::mutex> lock(clients_mutex_);
+		for (auto &client : clients_)
+		{
+			{
+				std::lock_guard<std::mutex> client_lock(client->mutex);
+				client->dead = true;
+			}
+			client->cv.notify_one();
+			client->sender.join();
+			close(client->ctrl_fd);
+			if (client->rtp_fd >= 0)
+				close(client->rtp_fd);
+			if (client->dropped)
+				LOG(1, "RTSP client dropped " << client->dropped << " late packets");
+		}
+		clients_.clear();
+	}
+	close(listen_fd_);
+	close(quit_pipe_[0]);
+	close(quit_pipe_[1]);
+}
+
+// ----- RTSP control plane -----
+
+std::string RtspOutput::makeSdp() const
+{
+	std::stringstream sdp;
+	sdp << "v=0\r\n"
+		<< "o=- 0 0 IN IP4 0.0.0.0\r\n"
+		<< "s=rpicam-vid\r\n"
+		<< "t=0 0\r\n"
+		<< "m=video 0 RTP/AVP " << (int)PAYLOAD_TYPE << "\r\n"
+		<< "c=IN IP4 0.0.0.0\r\n"
+		<< "a=rtpmap:" << (int)PAYLOAD_TYPE << " H264/90000\r\n";
+	std::lock_guard<std::mutex> lock(sprop_mutex_);
+	if (!sps_.empty() && !pps_.empty())
+		sdp << "a=fmtp:" << (int)PAYLOAD_TYPE << " packetization-mode=1;sprop-parameter-sets="
+			<< base64(sps_.data(), sps_.size()) << "," << base64(pps_.data(), pps_.size()) << "\r\n";
+	else
+		sdp << "a=fmtp:" << (int)PAYLOAD_TYPE << " packetization-mode=1\r\n";
+	sdp << "a=control:streamid=0\r\n";
+	return sdp.str();
+}
+
+// Read and answer one RTSP request. Returns false when the connection should
+// be closed.
+bool RtspOutput::handleRequest(Client &client)
+{
+	char buf[2048];
+	ssize_t len = recv(client.ctrl_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return false;
+	buf[len] = 0;
+	// Interleaved RTCP from the client arrives on this socket too; ignore it.
+	if (buf[0] == '$')
+		return true;
+
+	char method[16] = {};
+	sscanf(buf, "%15s", method);
+	int cseq = 0;
+	char const *p = strcasestr(buf, "CSeq:");
+	if (p)
+		sscanf(p + 5, "%d", &cseq);
+
+	std::stringstream resp;
+	if (!strcmp(method, "OPTIONS"))
+		resp << "RTSP/1.0 200 OK\r\nCSeq: " << cseq
+			 << "\r\nPublic: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN\r\n\r\n";
+	else if (!strcmp(method, "DESCRIBE"))
+	{
+		std::string sdp = makeSdp();
+		resp << "RTSP/1.0 200 OK\r\nCSeq: " << cseq << "\r\nContent-Type: application/sdp\r\nContent-Length: "
+			 << sdp.size() << "\r\n\r\n" << sdp;
+	}
+	else if (!strcmp(method, "SETUP"))
+	{
+		char const *transport = strcasestr(buf, "Transport:");
+		if (!transport)
+			return false;
+		client.session = std::random_device{}();
+		if (strcasestr(transport, "interleaved") || strcasestr(transport, "TCP"))
+		{
+			int ch = 0;
+			char const *il = strcasestr(transport, "interleaved=");
+			if (il)
+				sscanf(il + 12, "%d", &ch);
+			client.interleaved = true;
+			client.channel = ch;
+			resp << "RTSP/1.0 200 OK\r\nCSeq: " << cseq << "\r\nTransport: RTP/AVP/TCP;unicast;interleaved="
+				 << ch << "-" << ch + 1 << "\r\nSession: " << client.session << "\r\n\r\n";
+		}
+		else
+		{
+			int rtp_port = 0, rtcp_port = 0;
+			char const *cp = strcasestr(transport, "client_port=");
+			if (!cp || sscanf(cp + 12, "%d-%d", &rtp_port, &rtcp_port) < 1)
+				return false;
+			client.rtp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+			if (client.rtp_fd < 0)
+				return false;
+			socklen_t addr_len = sizeof(client.rtp_addr);
+			getpeername(client.ctrl_fd, (sockaddr *)&client.rtp_addr, &addr_len);
+			client.rtp_addr.sin_port = htons(rtp_port);
+			sockaddr_in local = {};
+			socklen_t local_len = sizeof(local);
+			getsockname(client.rtp_fd, (sockaddr *)&local, &local_len);
+			resp << "RTSP/1.0 200 OK\r\nCSeq: " << cseq << "\r\nTransport: RTP/AVP;unicast;client_port="
+				 << rtp_port << "-" << rtcp_port << ";server_port=" << ntohs(local.sin_port) << "-"
+				 << ntohs(local.sin_port) + 1 << "\r\nSession: " << client.session << "\r\n\r\n";
+		}
+	}
+	else if (!strcmp(method, "PLAY"))
+	{
+		resp << "RTSP/1.0 200 OK\r\nCSeq: " << cseq << "\r\nSession: " << client.session << "\r\n\r\n";
+		std::lock_guard<std::mutex> lock(client.mutex);
+		client.playing = true;
+	}
+	else if (!strcmp(method, "TEARDOWN"))
+	{
+		resp << "RTSP/1.0 200 OK\r\nCSeq: " << cseq << "\r\n\r\n";
+		std::string s = resp.str();
+		[[maybe_unused]] ssize_t n = send(client.ctrl_fd, s.c_str(), s.size(), MSG_NOSIGNAL);
+		return false;
+	}
+	else
+		resp << "RTSP/1.0 405 Method Not Allowed\r\nCSeq: " << cseq << "\r\n\r\n";
+
+	std::string s = resp.str();
+	return send(client.ctrl_fd, s.c_str(), s.size(), MSG_NOSIGNAL) == (ssize_t)s.size();
+}
+
+void RtspOutput::serverThread()
+{
+	while (!quit_)
+	{
+		std::vector<pollfd> fds;
+		fds.push_back({ quit_pipe_[0], POLLIN, 0 });
+		fds.push_back({ listen_fd_, POLLIN, 0 });
+		{
+			std::lock_guard<std::mutex> lock(clients_mutex_);
+			for (auto &client : clients_)
+				fds.push_back({ client->ctrl_fd, POLLIN, 0 });
+		}
+		if (poll(fds.data(), fds.size(), 1000) < 0)
+			continue;
+		if (fds[0].revents)
+			break;
+		if (fds[1].revents & POLLIN)
+		{
+			int fd = accept(listen_fd_, NULL, NULL);
+			if (fd >= 0)
+			{
+				auto client = std::make_unique<Client>();
+				client->ctrl_fd = fd;
+				client->sender = std::thread(&RtspOutput::senderThread, this, client.get());
+				std::lock_guard<std::mutex> lock(clients_mutex_);
+				clients_.push_back(std::move(client));
+				LOG(1, "RTSP client connected");
+			}
+		}
+		// Service control requests, and reap clients that went away.
+		std::lock_guard<std::mutex> lock(clients_mutex_);
+		for (auto it = clients_.begin(); it != clients_.end();)
+		{
+			Client &client = **it;
+			bool keep = true;
+			for (auto &pfd : fds)
+			{
+				if (pfd.fd == client.ctrl_fd && pfd.revents)
+					keep = handleRequest(client);
+			}
+			{
+				std::lock_guard<std::mutex> client_lock(client.mutex);
+				keep = keep && !client.dead;
+				client.dead = !keep;
+			}
+			if (!keep)
+			{
+				client.cv.notify_one();
+				client.sender.join();
+				close(client.ctrl_fd);
+				if (client.rtp_fd >= 0)
+					close(client.rtp_fd);
+				if (client.dropped)
+					LOG(1, "RTSP client dropped " << client.dropped << " late packets");
+				it = clients_.erase(it);
+				LOG(1, "RTSP client disconnected");
+			}
+			else
+				++it;
+		}
+	}
+}
+
+// ----- RTP data plane -----
+
+void RtspOutput::senderThread(Client *client)
+{
+	std::unique_lock<std::mutex> lock(client->mutex);
+	while (true)
+	{
+		client->cv.wait(lock, [client] { return client->dead || !client->queue.empty(); });
+		if (client->dead)
+			return;
+		PacketPtr packet = std::move(client->queue.front());
+		client->queue.pop_front();
+		lock.unlock();
+		ssize_t sent;
+		if (client->interleaved)
+		{
+			uint8_t framing[4] = { '$', client->channel, (uint8_t)(packet->size() >> 8), (uint8_t)packet->size() };
+			iovec iov[2] = { { framing, 4 }, { packet->data(), packet->size() } };
+			msghdr msg = {};
+			msg.msg_iov = iov;
+			msg.msg_iovlen = 2;
+			sent = sendmsg(client->ctrl_fd, &msg, MSG_NOSIGNAL);
+		}
+		else
+			sent = sendto(client->rtp_fd, packet->data(), packet->size(), 0, (sockaddr *)&client->rtp_addr,
+						  sizeof(client->rtp_addr));
+		lock.lock();
+		if (sent < 0)
+			client->dead = true; // server thread will reap us
+	}
+}
+
+void RtspOutput::enqueuePacket(PacketPtr const &packet)
+{
+	std::lock_guard<std::mutex> lock(clients_mutex_);
+	for (auto &client : clients_)
+	{
+		std::lock_guard<std::mutex> client_lock(client->mutex);
+		if (!client->playing || client->dead)
+			continue;
+		if (client->queue.size() >= MAX_QUEUE_PACKETS)
+		{
+			// This client can't keep up; drop rather than block the encoder.
+			client->queue.pop_front();
+			client->dropped++;
+		}
+		client->queue.push_back(packet);
+		client->cv.notify_one();
+	}
+}
+
+void RtspOutput::packetizeNal(uint8_t const *nal, size_t len, uint32_t rtp_ts, bool last_in_frame)
+{
+	auto make_packet = [this, rtp_ts](size_t payload_len, bool marker) {
+		auto packet = std::make_shared<std::vector<uint8_t>>(12 + payload_len);
+		uint8_t *p = packet->data();
+		p[0] = 0x80; // V=2
+		p[1] = PAYLOAD_TYPE | (marker ? 0x80 : 0);
+		uint16_t seq = rtp_seq_++;
+		p[2] = seq >> 8, p[3] = seq & 0xff;
+		p[4] = rtp_ts >> 24, p[5] = rtp_ts >> 16, p[6] = rtp_ts >> 8, p[7] = rtp_ts;
+		p[8] = ssrc_ >> 24, p[9] = ssrc_ >> 16, p[10] = ssrc_ >> 8, p[11] = ssrc_;
+		return packet;
+	};
+
+	if (len <= RTP_MTU)
+	{
+		// Single NAL unit packet.
+		PacketPtr packet = make_packet(len, last_in_frame);
+		memcpy(packet->data() + 12, nal, len);
+		enqueuePacket(packet);
+	}
+	else
+	{
+		// FU-A fragmentation.
+		uint8_t indicator = (nal[0] & 0xe0) | 28;
+		uint8_t type = nal[0] & 0x1f;
+		nal++, len--;
+		bool start = true;
+		while (len)
+		{
+			size_t chunk = std::min((size_t)RTP_MTU - 2, len);
+			bool end = chunk == len;
+			PacketPtr packet = make_packet(chunk + 2, end && last_in_frame);
+			packet->data()[12] = indicator;
+			packet->data()[13] = type | (start ? 0x80 : 0) | (end ? 0x40 : 0);
+			memcpy(packet->data() + 14, nal, chunk);
+			enqueuePacket(packet);
+			nal += chunk, len -= chunk;
+			start = false;
+		}
+	}
+}
+
+void RtspOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t /*flags*/)
+{
+	uint8_t const *end = (uint8_t const *)mem + size;
+	uint32_t rtp_ts = (uint32_t)((timestamp_us * 9) / 100); // 90kHz clock
+
+	// Collect the NALs first so we know which one ends the access unit.
+	std::vector<std::pair<uint8_t const *, size_t>> nals;
+	uint8_t const *nal_end;
+	for (uint8_t const *nal = next_nal((uint8_t const *)mem, end, &nal_end); nal;
+		 nal = next_nal(nal_end, end, &nal_end))
+	{
+		uint8_t type = nal[0] & 0x1f;
+		if (type == 7 || type == 8)
+		{
+			// Stash the parameter sets for the SDP; they travel in-band too.
+			std::lock_guard<std::mutex> lock(sprop_mutex_);
+			(type == 7 ? sps_ : pps_).assign(nal, nal_end);
+		}
+		nals.push_back({ nal, (size_t)(nal_end - nal) });
+	}
+	for (unsigned int i = 0; i < nals.size(); i++)
+		packetizeNal(nals[i].first, nals[i].second, rtp_ts, i + 1 == nals.size());
+}
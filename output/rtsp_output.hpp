@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * rtsp_output.hpp - in-process RTSP/RTP server output.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "output.hpp"
+
+// Serve the H.264 bitstream directly over RTSP/RTP, with no external
+// streaming process in the path. Frames are packetized once (single NAL unit
+// packets, or FU-A fragments for large NALs) into refcounted packets shared
+// by every connected client; each client has its own bounded send queue and
+// sender thread, and late clients have packets dropped rather than ever
+// blocking the encoder's output callback.
+
+class RtspOutput : public Output
+{
+public:
+	RtspOutput(VideoOptions const *options);
+	~RtspOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	using PacketPtr = std::shared_ptr<std::vector<uint8_t>>;
+
+	struct Client
+	{
+		int ctrl_fd = -1; // RTSP control connection
+		int rtp_fd = -1; // per-client UDP socket, or -1 when interleaved
+		sockaddr_in rtp_addr = {};
+		bool interleaved = false;
+		uint8_t channel = 0;
+		bool playing = false;
+		bool dead = false;
+		uint32_t session = 0;
+		uint64_t dropped = 0;
+		std::deque<PacketPtr> queue;
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::thread sender;
+	};
+
+	void serverThread();
+	void senderThread(Client *client);
+	bool handleRequest(Client &client);
+	void packetizeNal(uint8_t const *nal, size_t len, uint32_t rtp_ts, bool last_in_frame);
+	void enqueuePacket(PacketPtr const &packet);
+	std::string makeSdp() const;
+
+	int listen_fd_;
+	std::thread server_thread_;
+	bool quit_ = false;
+	int quit_pipe_[2]; // wakes the server thread's poll on shutdown
+
+	std::mutex clients_mutex_;
+	std::vector<std::unique_ptr<Client>> clients_;
+
+	// Shared RTP session state - every client sees the same packet stream.
+	uint16_t rtp_seq_ = 0;
+	uint32_t ssrc_;
+
+	// Cached parameter sets for the SDP and for clients joining mid-stream.
+	mutable std::mutex sprop_mutex_;
+	std::vector<uint8_t> sps_, pps_;
+};
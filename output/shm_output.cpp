@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * shm_output.cpp - share frames with a co-resident process, zero-copy.
+ *
+ * Selected with -o shm://<socket-path> and --codec yuv420. Frames stay in the
+ * dma-buf the camera wrote them to; each one is announced to the (single)
+ * consumer on a unix SEQPACKET socket as a ShmFrameMsg plus the buffer's fd
+ * in an SCM_RIGHTS message, and the consumer releases it with a one byte
+ * reply. No encode, no decode and no copies - the alternative of streaming
+ * H.264 over localhost costs a codec round trip just to move pixels.
+ *
+ * With nobody connected, or with the consumer holding too many frames,
+ * frames are simply dropped: a slow analytics process must never back up
+ * into the capture pipeline.
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "shm_output.hpp"
+
+ShmOutput::ShmOutput(VideoOptions const *options) : Output(options)
+{
+	path_ = options->Get().output.substr(6); // skip "shm://"
+	if (path_.empty() || path_.size() >= sizeof(sockaddr_un::sun_path))
+		throw std::runtime_error("invalid shm socket path " + path_);
+
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to create shm socket");
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+	unlink(path_.c_str()); // stale socket from a previous run
+	if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 1) < 0)
+		throw std::runtime_error("unable to listen on shm socket " + path_);
+
+	LOG(2, "Sharing frames on " << path_);
+}
+
+ShmOutput::~ShmOutput()
+{
+	dropClient();
+	if (listen_fd_ >= 0)
+		close(listen_fd_);
+	unlink(path_.c_str());
+	if (frames_dropped_)
+		LOG(1, "Shm output dropped " << frames_dropped_ << " frames");
+}
+
+void ShmOutput::tryAccept()
+{
+	int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	LOG(2, "Shm consumer connected");
+	dropClient(); // only one consumer at a time
+	client_fd_ = fd;
+	in_flight_ = 0;
+}
+
+void ShmOutput::reapReleases()
+{
+	uint8_t token;
+	ssize_t ret;
+	while ((ret = recv(client_fd_, &token, sizeof(token), MSG_DONTWAIT)) == sizeof(token))
+	{
+		if (in_flight_)
+			in_flight_--;
+	}
+	if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+	{
+		LOG(2, "Shm consumer disconnected");
+		dropClient();
+	}
+}
+
+void ShmOutput::dropClient()
+{
+	if (client_fd_ >= 0)
+		close(client_fd_);
+	client_fd_ = -1;
+	in_flight_ = 0;
+}
+
+void ShmOutput::outputBufferFd(int fd, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	tryAccept();
+	if (client_fd_ < 0)
+		return;
+	reapReleases();
+	if (client_fd_ < 0)
+		return;
+
+	if (in_flight_ >= MAX_IN_FLIGHT)
+	{
+		if (!(frames_dropped_++ & 0xff))
+			LOG(1, "Shm consumer too slow, dropping frames");
+		return;
+	}
+
+	ShmFrameMsg msg = {};
+	msg.version = PROTOCOL_VERSION;
+	msg.flags = flags;
+	msg.width = options_->Get().width;
+	msg.height = options_->Get().height;
+	msg.size = size;
+	msg.timestamp_us = timestamp_us;
+
+	iovec iov = { &msg, sizeof(msg) };
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	msghdr hdr = {};
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(client_fd_, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			frames_dropped_++; // socket buffer full - treat like a slow consumer
+		else
+		{
+			LOG(2, "Shm consumer disconnected");
+			dropClient();
+		}
+		return;
+	}
+	in_flight_++;
+}
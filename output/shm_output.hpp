@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * shm_output.hpp - share frames with a co-resident process, zero-copy.
+ */
+
+#pragma once
+
+#include "output.hpp"
+
+// One of these precedes every frame on the socket; the frame's dma-buf fd
+// arrives in the accompanying SCM_RIGHTS control message. The consumer mmaps
+// the fd, and sends a single byte back on the socket when it has finished with
+// the frame ("release") - until then the producer counts it as in flight.
+
+struct ShmFrameMsg
+{
+	uint32_t version; // ShmOutput::PROTOCOL_VERSION
+	uint32_t flags; // Output::Flag values
+	uint32_t width, height; // as configured; the buffer may be stride-padded
+	uint64_t size;
+	int64_t timestamp_us;
+};
+
+class ShmOutput : public Output
+{
+public:
+	static constexpr uint32_t PROTOCOL_VERSION = 1;
+
+	ShmOutput(VideoOptions const *options);
+	~ShmOutput();
+	bool WantsFd() const override { return true; }
+
+protected:
+	void outputBufferFd(int fd, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	void tryAccept();
+	void reapReleases();
+	void dropClient();
+
+	// Frames the consumer may hold unreleased before we start dropping. Each
+	// held frame's camera buffer can be rewritten once it cycles back round
+	// the pool, so keep this (plus the pipeline depth) below --buffer-count.
+	static constexpr unsigned int MAX_IN_FLIGHT = 2;
+
+	std::string path_;
+	int listen_fd_ = -1;
+	int client_fd_ = -1;
+	unsigned int in_flight_ = 0;
+	uint64_t frames_dropped_ = 0;
+};
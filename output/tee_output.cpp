@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * tee_output.cpp - fan encoded buffers out to several outputs
+ */
+
+#include "tee_output.hpp"
+
+// How many frames a sink may queue up before we conclude it can't keep up
+// and start dropping for it.
+constexpr unsigned int MAX_QUEUE_FRAMES = 32;
+
+TeeOutput::TeeOutput(VideoOptions const *options) : Output(options)
+{
+	// Create a child output for each name given on the command line. The child
+	// creation code dispatches on the "output" option, so substitute each name
+	// in turn; restricting "outputs" to the single name stops Output::Create
+	// recursing back into us. The timestamp/metadata files and the initial
+	// pause state are handled here by the base class once, not per sink.
+	std::vector<std::string> names = options->Get().outputs;
+	std::string save_pts = options->Get().save_pts;
+	std::string metadata = options->Get().metadata;
+	bool pause = options->Get().pause;
+	options->Set().save_pts.clear();
+	options->Set().metadata.clear();
+	options->Set().pause = false;
+
+	for (auto const &name : names)
+	{
+		options->Set().output = name;
+		options->Set().outputs = { name };
+		std::unique_ptr<Sink> sink = std::make_unique<Sink>();
+		sink->name = name;
+		sink->output = std::unique_ptr<Output>(Output::Create(options));
+		sinks_.push_back(std::move(sink));
+	}
+
+	options->Set().outputs = names;
+	options->Set().output = names[0];
+	options->Set().save_pts = save_pts;
+	options->Set().metadata = metadata;
+	options->Set().pause = pause;
+
+	for (auto &sink : sinks_)
+		sink->thread = std::thread(&TeeOutput::sinkThread, this, sink.get());
+}
+
+TeeOutput::~TeeOutput()
+{
+	for (auto &sink : sinks_)
+	{
+		{
+			std::lock_guard<std::mutex> lock(sink->mutex);
+			sink->quit = true;
+		}
+		sink->cv.notify_one();
+	}
+	// The threads drain whatever is still queued before they exit.
+	for (auto &sink : sinks_)
+	{
+		sink->thread.join();
+		if (sink->dropped)
+			LOG(1, "TeeOutput: dropped " << sink->dropped << " frames for slow output " << sink->name);
+	}
+}
+
+void TeeOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// One copy, shared by every sink; the encoder's buffer can be returned as
+	// soon as we're done here, however far behind any individual sink is.
+	auto data = std::make_shared<std::vector<uint8_t>>((uint8_t *)mem, (uint8_t *)mem + size);
+
+	for (auto &sink : sinks_)
+	{
+		std::lock_guard<std::mutex> lock(sink->mutex);
+		if (sink->queue.size() >= MAX_QUEUE_FRAMES)
+		{
+			// This sink can't keep up. Throw away its backlog and resume it
+			// at the next keyframe so its stream stays decodable; the other
+			// sinks are unaffected.
+			sink->dropped += sink->queue.size();
+			sink->queue.clear();
+			sink->need_keyframe = true;
+		}
+		if (sink->need_keyframe)
+		{
+			if (!(flags & FLAG_KEYFRAME))
+			{
+				sink->dropped++;
+				continue;
+			}
+			sink->need_keyframe = false;
+		}
+		sink->queue.push_back({ data, timestamp_us, flags });
+		sink->cv.notify_one();
+	}
+}
+
+void TeeOutput::sinkThread(Sink *sink)
+{
+	while (true)
+	{
+		Frame frame;
+		{
+			std::unique_lock<std::mutex> lock(sink->mutex);
+			sink->cv.wait(lock, [sink] { return sink->quit || !sink->queue.empty(); });
+			if (sink->queue.empty())
+				return;
+			frame = std::move(sink->queue.front());
+			sink->queue.pop_front();
+		}
+		try
+		{
+			sink->output->OutputReady(frame.data->data(), frame.data->size(), frame.timestamp_us,
+									  frame.flags & FLAG_KEYFRAME);
+		}
+		catch (std::exception const &e)
+		{
+			// Don't let one broken sink take the whole capture down.
+			LOG_ERROR("TeeOutput: output " << sink->name << " failed: " << e.what());
+			return;
+		}
+	}
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * tee_output.hpp - fan encoded buffers out to several outputs
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+class TeeOutput : public Output
+{
+public:
+	TeeOutput(VideoOptions const *options);
+	~TeeOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	// Each frame is copied once and the copy shared between the sinks.
+	struct Frame
+	{
+		std::shared_ptr<std::vector<uint8_t>> data;
+		int64_t timestamp_us;
+		uint32_t flags;
+	};
+
+	// Every sink gets its own bounded queue and sender thread, so one slow
+	// sink can fall behind (and eventually drop frames) without stalling
+	// either the encoder or any of the other sinks.
+	struct Sink
+	{
+		std::string name;
+		std::unique_ptr<Output> output;
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<Frame> queue;
+		bool quit = false;
+		bool need_keyframe = false;
+		uint64_t dropped = 0;
+	};
+
+	void sinkThread(Sink *sink);
+
+	std::vector<std::unique_ptr<Sink>> sinks_;
+};
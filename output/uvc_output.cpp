@@ -1,14 +1,16 @@
 #include "uvc_output.hpp"
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <cstring>
 #include <stdexcept>
 #include <iostream>
 
-UVCOutput::UVCOutput(VideoOptions const *options) 
-    : Output(options), v4l2_fd_(-1), device_path_("/dev/video0"), 
+UVCOutput::UVCOutput(VideoOptions const *options)
+    : Output(options), v4l2_fd_(-1), device_path_("/dev/video0"),
       output_width_(1920), output_height_(1080),
+      zero_copy_(false), streaming_(false), buffer_index_(0), buffer_count_(0),
       frames_written_(0), bytes_written_(0), dropped_frames_(0)
 {
     // Parse device path from options if provided
@@ -81,7 +83,81 @@ bool UVCOutput::setupV4L2Device()
     }
 
     std::cout << "UVCOutput: Set MJPEG format " << output_width_ << "x" << output_height_ << std::endl;
-    
+
+    // Try to stream zero-copy; fall back to write() if the driver refuses.
+    zero_copy_ = setupZeroCopy();
+    if (zero_copy_) {
+        std::cout << "UVCOutput: Using zero-copy USERPTR streaming" << std::endl;
+    }
+
+    return true;
+}
+
+bool UVCOutput::setupZeroCopy()
+{
+    // Ask the gadget driver for USERPTR buffers so we can hand it the
+    // encoder's own buffer. The driver then maps (or DMAs from) our pages
+    // directly rather than us copying every frame through write().
+    struct v4l2_requestbuffers reqbufs = {};
+    reqbufs.count = 2;
+    reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    reqbufs.memory = V4L2_MEMORY_USERPTR;
+
+    if (ioctl(v4l2_fd_, VIDIOC_REQBUFS, &reqbufs) < 0 || reqbufs.count == 0) {
+        std::cout << "UVCOutput: USERPTR not supported, falling back to write()" << std::endl;
+        return false;
+    }
+
+    buffer_count_ = reqbufs.count;
+    return true;
+}
+
+bool UVCOutput::queueZeroCopy(void *mem, size_t size, int64_t timestamp_us)
+{
+    // Queue the caller's buffer directly. Our caller reclaims the memory the
+    // moment we return, so the frame must also be dequeued again before we
+    // do - the saving is the copy (the driver pins and reads our pages), not
+    // the wait for the transfer.
+    struct v4l2_buffer buf = {};
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = V4L2_MEMORY_USERPTR;
+    buf.index = buffer_index_;
+    buf.m.userptr = reinterpret_cast<unsigned long>(mem);
+    buf.length = size;
+    buf.bytesused = size;
+    buf.timestamp.tv_sec = timestamp_us / 1000000;
+    buf.timestamp.tv_usec = timestamp_us % 1000000;
+
+    if (ioctl(v4l2_fd_, VIDIOC_QBUF, &buf) < 0) {
+        std::cerr << "UVCOutput: VIDIOC_QBUF failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+    buffer_index_ = (buffer_index_ + 1) % buffer_count_;
+
+    if (!streaming_) {
+        int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        if (ioctl(v4l2_fd_, VIDIOC_STREAMON, &type) < 0) {
+            std::cerr << "UVCOutput: VIDIOC_STREAMON failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        streaming_ = true;
+    }
+
+    // Wait for the driver to hand the buffer back.
+    struct pollfd pfd = { v4l2_fd_, POLLOUT, 0 };
+    if (poll(&pfd, 1, 2000) <= 0) {
+        std::cerr << "UVCOutput: Timed out waiting for buffer" << std::endl;
+        return false;
+    }
+
+    struct v4l2_buffer dqbuf = {};
+    dqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    dqbuf.memory = V4L2_MEMORY_USERPTR;
+    if (ioctl(v4l2_fd_, VIDIOC_DQBUF, &dqbuf) < 0) {
+        std::cerr << "UVCOutput: VIDIOC_DQBUF failed: " << strerror(errno) << std::endl;
+        return false;
+    }
+
     return true;
 }
 
@@ -99,6 +175,17 @@ void UVCOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint3
         return;
     }
 
+    // Hand the buffer to the driver without copying, if we can.
+    if (zero_copy_) {
+        if (queueZeroCopy(mem, size, timestamp_us)) {
+            frames_written_++;
+            bytes_written_ += size;
+        } else {
+            dropped_frames_++;
+        }
+        return;
+    }
+
     // Write frame directly to V4L2 device
     ssize_t written = write(v4l2_fd_, mem, size);
     if (written < 0) {
@@ -137,6 +224,11 @@ bool UVCOutput::isMJPEGFrame(void *mem, size_t size)
 void UVCOutput::cleanup()
 {
     if (v4l2_fd_ >= 0) {
+        if (streaming_) {
+            int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+            ioctl(v4l2_fd_, VIDIOC_STREAMOFF, &type);
+            streaming_ = false;
+        }
         close(v4l2_fd_);
         v4l2_fd_ = -1;
     }
@@ -20,8 +20,18 @@ private:
     uint32_t output_width_;
     uint32_t output_height_;
 
+    // Zero-copy (USERPTR) streaming state. When the gadget driver accepts
+    // USERPTR buffers we queue the encoder's buffer directly instead of
+    // copying it through write().
+    bool zero_copy_;
+    bool streaming_;
+    uint32_t buffer_index_;
+    uint32_t buffer_count_;
+
     // Setup and validation
     bool setupV4L2Device();
+    bool setupZeroCopy();
+    bool queueZeroCopy(void *mem, size_t size, int64_t timestamp_us);
     bool isMJPEGFrame(void *mem, size_t size);
     void cleanup();
 
@@ -10,6 +10,13 @@
  * As the FoM rises or falls, the tone frequency also rises or falls accordingly.
  * Various parameters (e.g. frequency range, mapping type, duration) can be configured via JSON.
  * Note: Sound output hardware must be present for this stage to function.
+ *
+ * When the camera doesn't report a FocusFoM (fixed-focus modules, or pipelines
+ * without the control), the stage falls back to its own sharpness measure over
+ * the lores luma: the mean absolute horizontal gradient of a configurable
+ * region, sampled every vskip-th row. Configure minFoM/maxFoM to the measure's
+ * range in that case (it is reported in Q6, typically a few hundred to a
+ * couple of thousand for a sharp scene).
  */
 
 #include <chrono>
@@ -23,8 +30,11 @@
 #include <thread>
 
 #include "core/rpicam_app.hpp"
+#include "post_processing_stages/pixel_kernels.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
+using Stream = libcamera::Stream;
+
 class AcousticFocusStage : public PostProcessingStage
 {
 public:
@@ -42,6 +52,28 @@ public:
 		max_freq_ = params.get<int>("maxFreq", 3000);
 		duration_ = params.get<double>("duration", 0.1);
 		mapping_ = params.get<std::string>("mapping", "log");
+		// The sharpness fallback's evaluation region (as fractions of the lores
+		// image, like the motion detector's) and row subsampling.
+		roi_x_f_ = params.get<float>("roi_x", 0.0);
+		roi_y_f_ = params.get<float>("roi_y", 0.0);
+		roi_width_f_ = params.get<float>("roi_width", 1.0);
+		roi_height_f_ = params.get<float>("roi_height", 1.0);
+		vskip_ = std::max(params.get<int>("vskip", 2), 1);
+	}
+
+	void Configure() override
+	{
+		StreamInfo info;
+		stream_ = app_->LoresStream(&info);
+		if (!stream_)
+			return;
+
+		lores_stride_ = info.stride;
+		// Turn the fractions into pixel numbers, clamped inside the image.
+		roi_x_ = std::clamp<unsigned int>(roi_x_f_ * info.width, 0u, info.width);
+		roi_y_ = std::clamp<unsigned int>(roi_y_f_ * info.height, 0u, info.height);
+		roi_width_ = std::clamp<unsigned int>(roi_width_f_ * info.width, 0u, info.width - roi_x_);
+		roi_height_ = std::clamp<unsigned int>(roi_height_f_ * info.height, 0u, info.height - roi_y_);
 	}
 
 	bool Process(CompletedRequestPtr &completed_request) override
@@ -56,18 +88,25 @@ public:
 			last = now;
 
 			auto fom = completed_request->metadata.get(libcamera::controls::FocusFoM);
+			int measure = 0;
+			bool have_measure = false;
 			if (fom)
+				measure = *fom, have_measure = true;
+			else if (stream_ && roi_width_ >= 2 && roi_height_)
+				measure = measureSharpness(completed_request), have_measure = true;
+
+			if (have_measure)
 			{
 				int freq = min_freq_;
 				if (mapping_ == "log")
 				{
-					double norm = std::log(std::max(*fom, min_fom_)) - std::log(min_fom_);
+					double norm = std::log(std::max(measure, min_fom_)) - std::log(min_fom_);
 					double denom = std::log(max_fom_) - std::log(min_fom_);
 					freq = min_freq_ + static_cast<int>(norm / denom * (max_freq_ - min_freq_));
 				}
 				else
 				{ // linear
-					double norm = std::max(*fom, min_fom_) - min_fom_;
+					double norm = std::max(measure, min_fom_) - min_fom_;
 					double denom = max_fom_ - min_fom_;
 					freq = min_freq_ + static_cast<int>(norm / denom * (max_freq_ - min_freq_));
 				}
@@ -85,10 +124,32 @@ public:
 	}
 
 private:
+	int measureSharpness(CompletedRequestPtr &completed_request)
+	{
+		BufferReadSync r(app_, completed_request->buffers[stream_]);
+		uint8_t const *image = r.Get()[0].data();
+
+		// Sum the horizontal gradient energy of every vskip-th row of the
+		// region; the rows are contiguous luma samples, so the kernel runs
+		// vectorized over each.
+		uint64_t sum = 0;
+		unsigned int rows = 0;
+		for (unsigned int y = roi_y_; y < roi_y_ + roi_height_; y += vskip_, rows++)
+			sum += PixelKernels::SumAbsHorizDiffU8(image + y * lores_stride_ + roi_x_, roi_width_);
+
+		// Mean absolute gradient per pixel in Q6 fixed point.
+		return sum * 64 / ((uint64_t)rows * (roi_width_ - 1));
+	}
+
 	int min_fom_ = 1, max_fom_ = 2000;
 	int min_freq_ = 400, max_freq_ = 2000;
 	double duration_ = 0.1;
 	std::string mapping_ = "log";
+	float roi_x_f_ = 0.0, roi_y_f_ = 0.0, roi_width_f_ = 1.0, roi_height_f_ = 1.0;
+	int vskip_ = 2;
+	Stream *stream_ = nullptr;
+	unsigned int lores_stride_ = 0;
+	unsigned int roi_x_ = 0, roi_y_ = 0, roi_width_ = 0, roi_height_ = 0;
 };
 
 static PostProcessingStage *Create(RPiCamApp *app)
@@ -47,6 +47,14 @@ private:
 	double alpha_;
 	double adjusted_scale_;
 	int adjusted_thickness_;
+	bool overlay_;
+	std::string overlay_text_;
+	Mat overlay_canvas_;
+	// For the burn-in path the rasterized text is cached as a mask and only
+	// re-rendered when the expanded text changes (for timestamps, once a
+	// second); per frame the banner is just a cheap integer blend.
+	std::string cached_text_;
+	Mat text_mask_;
 };
 
 #define NAME "annotate_cv"
@@ -64,6 +72,9 @@ void AnnotateCvStage::Read(boost::property_tree::ptree const &params)
 	scale_ = params.get<double>("scale", 1.0);
 	thickness_ = params.get<int>("thickness", 2);
 	alpha_ = params.get<double>("alpha", 0.5);
+	// With "overlay" the text is composited by the display instead of being
+	// burned into (and costing a pass over) the stream itself.
+	overlay_ = params.get<bool>("overlay", false);
 }
 
 void AnnotateCvStage::Configure()
@@ -78,12 +89,15 @@ void AnnotateCvStage::Configure()
 	// rather harshly quantised, not much we can do about that.
 	adjusted_scale_ = scale_ * info_.width / 1200;
 	adjusted_thickness_ = std::max(thickness_ * info_.width / 700, 1u);
+
+	// The resolution is fixed from here on, so the overlay canvas can be
+	// allocated up front rather than on the first frame.
+	if (overlay_)
+		overlay_canvas_.create(info_.height, info_.width, CV_8UC4);
 }
 
 bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
 {
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	FrameInfo info(completed_request);
 
 	// Other post-processing stages can supply metadata to update the text.
@@ -95,20 +109,59 @@ bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
 	if (strftime(text_with_date, sizeof(text_with_date), text.c_str(), tm_ptr) != 0)
 		text = std::string(text_with_date);
 
-	uint8_t *ptr = (uint8_t *)buffer.data();
-	Mat im(info_.height, info_.width, CV_8U, ptr, info_.stride);
 	int font = FONT_HERSHEY_SIMPLEX;
 
-	int baseline = 0;
-	Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
+	if (overlay_)
+	{
+		// Only re-render and re-publish when the text actually changes (for
+		// timestamps, once a second); frames in between cost nothing.
+		if (text != overlay_text_)
+		{
+			overlay_canvas_.setTo(Scalar(0, 0, 0, 0));
+			int baseline = 0;
+			Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
+			rectangle(overlay_canvas_, Rect(0, 0, size.width, size.height + baseline),
+					  Scalar(bg_, bg_, bg_, alpha_ * 255), FILLED);
+			putText(overlay_canvas_, text, Point(0, size.height), font, adjusted_scale_, Scalar(fg_, fg_, fg_, 255),
+					adjusted_thickness_, 0);
+			if (app_->SetPreviewOverlay(overlay_canvas_.data, info_.width, info_.height, overlay_canvas_.step))
+				overlay_text_ = text;
+			else
+			{
+				LOG(1, "AnnotateCvStage: preview can't composite overlays, drawing into the image");
+				overlay_ = false;
+			}
+		}
+		if (overlay_)
+			return false;
+	}
+
+	if (text != cached_text_)
+	{
+		// Rasterize the text once into a banner-sized mask; frames in between
+		// changes reuse it below without touching OpenCV at all.
+		int baseline = 0;
+		Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
+		unsigned int banner_width = std::min<unsigned int>(size.width, info_.width);
+		unsigned int banner_height = std::min<unsigned int>(size.height + baseline, info_.height);
+		text_mask_ = Mat::zeros(banner_height, banner_width, CV_8U);
+		putText(text_mask_, text, Point(0, size.height), font, adjusted_scale_, 255, adjusted_thickness_, 0);
+		cached_text_ = text;
+	}
+
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	uint8_t *ptr = (uint8_t *)buffer.data();
 
-	// Can't find a handy "draw rectangle with alpha" function...
-	for (int y = 0; y < size.height + baseline; y++, ptr += info_.stride)
+	// Blend the background and stamp the cached glyphs, in Q8 integer arithmetic.
+	unsigned int inv_alpha_q8 = (1.0 - alpha_) * 256 + 0.5;
+	unsigned int bg_term = bg_ * alpha_ + 0.5;
+	for (int y = 0; y < text_mask_.rows; y++, ptr += info_.stride)
 	{
-		for (int x = 0; x < size.width; x++)
-			ptr[x] = bg_ * alpha_ + (1 - alpha_) * ptr[x];
+		uint8_t const *mask = text_mask_.ptr(y);
+		for (int x = 0; x < text_mask_.cols; x++)
+			ptr[x] = mask[x] ? fg_ : (ptr[x] * inv_alpha_q8 >> 8) + bg_term;
 	}
-	putText(im, text, Point(0, size.height), font, adjusted_scale_, fg_, adjusted_thickness_, 0);
 
 	return false;
 }
@@ -5,12 +5,21 @@
  * face_detect_cv_stage.cpp - Face Detector implementation, using OpenCV
  */
 
+// The Haar detector is expensive, so it runs on its own worker thread at a
+// configurable cadence (refresh_rate). In between detections the published
+// rectangles are no longer frozen: a sparse pyramidal Lucas-Kanade tracker
+// follows each face on the (small) lores image every frame, so downstream
+// consumers get per-frame-updated boxes for a fraction of the detector's
+// cost. Motion accumulated while a detection is in flight is applied to its
+// results when they land, since they describe an older frame.
+
 #include <algorithm>
-#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <iterator>
 #include <libcamera/stream.h>
 #include <memory>
+#include <thread>
 #include <vector>
 
 #include <libcamera/geometry.h>
@@ -21,6 +30,7 @@
 
 #include "opencv2/imgproc.hpp"
 #include "opencv2/objdetect.hpp"
+#include "opencv2/video/tracking.hpp"
 
 using namespace cv;
 
@@ -37,23 +47,21 @@ public:
 
 	void Configure() override;
 
+	void Start() override;
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 	void Stop() override;
 
 private:
-	void detectFeatures(cv::CascadeClassifier &cascade);
-	void drawFeatures(cv::Mat &img);
+	void detectThread();
+	void trackFaces(Mat const &prev, Mat const &cur);
+	void drawFeatures(cv::Mat &img, std::vector<cv::Rect> const &faces);
 
 	Stream *stream_;
 	StreamInfo low_res_info_;
 	Stream *full_stream_;
 	StreamInfo full_stream_info_;
-	std::unique_ptr<std::future<void>> future_ptr_;
-	std::mutex face_mutex_;
-	std::mutex future_ptr_mutex_;
-	Mat image_;
-	std::vector<cv::Rect> faces_;
 	CascadeClassifier cascade_;
 	std::string cascadeName_;
 	double scaling_factor_;
@@ -62,6 +70,37 @@ private:
 	int max_size_;
 	int refresh_rate_;
 	int draw_features_;
+
+	// The detector worker and its single-slot input mailbox. The worker runs
+	// on detect_image_ in place: Process() only refills it when no detection
+	// is pending, so no hand-off copy is needed.
+	std::thread detect_thread_;
+	std::mutex detect_mutex_;
+	std::condition_variable detect_cv_;
+	Mat detect_image_;
+	bool detect_pending_;
+	bool quit_;
+
+	// Tracking state. faces_ are in lores coordinates; accumulated_flow_ is the
+	// motion seen since the frame the in-flight detection was started on.
+	std::mutex face_mutex_;
+	std::vector<cv::Rect2f> faces_;
+	Point2f accumulated_flow_;
+
+	// All the per-frame images and scratch vectors are preallocated in
+	// Configure() (the resolutions are fixed by then), so Process() and the
+	// tracker make no heap allocations per frame. The two grey images are a
+	// ping-pong pair of current and previous frame.
+	Mat gray_[2];
+	unsigned int gray_index_ = 0;
+	bool have_prev_ = false;
+	std::vector<Point2f> prev_pts_, next_pts_;
+	std::vector<unsigned int> owner_;
+	std::vector<uchar> status_;
+	std::vector<float> err_;
+	std::vector<float> dx_, dy_, all_dx_, all_dy_;
+	std::vector<Rect> scaled_faces_;
+	std::vector<libcamera::Rectangle> face_rects_;
 };
 
 #define NAME "face_detect_cv"
@@ -108,6 +147,23 @@ void FaceDetectCvStage::Configure()
 	full_stream_info_ = app_->GetStreamInfo(full_stream_);
 	if (draw_features_ && full_stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("FaceDetectCvStage: drawing only supported for YUV420 images");
+
+	faces_.clear();
+	accumulated_flow_ = Point2f(0, 0);
+
+	// Size the scratch images now; create() is a no-op if nothing changed.
+	for (auto &gray : gray_)
+		gray.create(low_res_info_.height, low_res_info_.width, CV_8U);
+	detect_image_.create(low_res_info_.height, low_res_info_.width, CV_8U);
+	have_prev_ = false;
+	gray_index_ = 0;
+}
+
+void FaceDetectCvStage::Start()
+{
+	quit_ = false;
+	detect_pending_ = false;
+	detect_thread_ = std::thread(&FaceDetectCvStage::detectThread, this);
 }
 
 bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
@@ -115,28 +171,49 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 	if (!stream_)
 		return false;
 
+	Mat &gray = gray_[gray_index_];
 	{
-		std::unique_lock<std::mutex> lck(future_ptr_mutex_);
-		if (completed_request->sequence % refresh_rate_ == 0 &&
-			(!future_ptr_ || future_ptr_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+		BufferReadSync r(app_, completed_request->buffers[stream_]);
+		libcamera::Span<uint8_t> buffer = r.Get()[0];
+		uint8_t *ptr = (uint8_t *)buffer.data();
+		Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
+		image.copyTo(gray); // into the preallocated tracking reference
+	}
+
+	{
+		std::unique_lock<std::mutex> lck(detect_mutex_);
+		if (completed_request->sequence % refresh_rate_ == 0 && !detect_pending_)
 		{
-			BufferReadSync r(app_, completed_request->buffers[stream_]);
-			libcamera::Span<uint8_t> buffer = r.Get()[0];
-			uint8_t *ptr = (uint8_t *)buffer.data();
-			Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
-			image_ = image.clone();
-
-			future_ptr_ = std::make_unique<std::future<void>>();
-			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
+			gray.copyTo(detect_image_);
+			detect_pending_ = true;
+			{
+				std::unique_lock<std::mutex> lock(face_mutex_);
+				accumulated_flow_ = Point2f(0, 0);
+			}
+			detect_cv_.notify_one();
 		}
 	}
 
 	std::unique_lock<std::mutex> lock(face_mutex_);
 
-	std::vector<libcamera::Rectangle> temprect;
-	std::transform(faces_.begin(), faces_.end(), std::back_inserter(temprect),
-				   [](Rect &r) { return libcamera::Rectangle(r.x, r.y, r.width, r.height); });
-	completed_request->post_process_metadata.Set("detected_faces", temprect);
+	// Nudge the boxes along with the image motion since the last frame.
+	if (have_prev_ && !faces_.empty())
+		trackFaces(gray_[gray_index_ ^ 1], gray);
+	gray_index_ ^= 1; // this frame becomes the next frame's "previous"
+	have_prev_ = true;
+
+	// Scale faces to the size and location in the full res image for the consumers.
+	double scale_x = full_stream_info_.width / (double)low_res_info_.width;
+	double scale_y = full_stream_info_.height / (double)low_res_info_.height;
+	scaled_faces_.clear();
+	face_rects_.clear();
+	for (auto const &f : faces_)
+	{
+		scaled_faces_.push_back(Rect(f.x * scale_x, f.y * scale_y, f.width * scale_x, f.height * scale_y));
+		face_rects_.push_back(libcamera::Rectangle(scaled_faces_.back().x, scaled_faces_.back().y,
+												   scaled_faces_.back().width, scaled_faces_.back().height));
+	}
+	completed_request->post_process_metadata.Set("detected_faces", face_rects_);
 
 	if (draw_features_)
 	{
@@ -144,44 +221,113 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 		libcamera::Span<uint8_t> buffer = w.Get()[0];
 		uint8_t *ptr = (uint8_t *)buffer.data();
 		Mat image(full_stream_info_.height, full_stream_info_.width, CV_8U, ptr, full_stream_info_.stride);
-		drawFeatures(image);
+		drawFeatures(image, scaled_faces_);
 	}
 
 	return false;
 }
 
-void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
+void FaceDetectCvStage::trackFaces(Mat const &prev, Mat const &cur)
 {
-	equalizeHist(image_, image_);
+	// Seed a sparse 3x3 grid of points in each face and follow them with
+	// pyramidal LK; each face moves by the median displacement of its points.
+	// The scratch vectors are members whose capacity persists across frames.
+	prev_pts_.clear();
+	next_pts_.clear();
+	owner_.clear();
+	for (unsigned int i = 0; i < faces_.size(); i++)
+	{
+		for (int gy = 0; gy < 3; gy++)
+			for (int gx = 0; gx < 3; gx++)
+			{
+				Point2f pt(faces_[i].x + (gx + 0.5f) * faces_[i].width / 3,
+						   faces_[i].y + (gy + 0.5f) * faces_[i].height / 3);
+				if (pt.x >= 0 && pt.y >= 0 && pt.x < low_res_info_.width && pt.y < low_res_info_.height)
+					prev_pts_.push_back(pt), owner_.push_back(i);
+			}
+	}
+	if (prev_pts_.empty())
+		return;
 
-	std::vector<Rect> temp_faces;
-	cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
-							 Size(min_size_, min_size_), Size(max_size_, max_size_));
+	status_.clear();
+	err_.clear();
+	calcOpticalFlowPyrLK(prev, cur, prev_pts_, next_pts_, status_, err_, Size(15, 15), 2);
 
-	// Scale faces back to the size and location in the full res image.
-	double scale_x = full_stream_info_.width / (double)low_res_info_.width;
-	double scale_y = full_stream_info_.height / (double)low_res_info_.height;
-	for (auto &face : temp_faces)
+	all_dx_.clear();
+	all_dy_.clear();
+	for (unsigned int i = 0; i < faces_.size(); i++)
 	{
-		face.x *= scale_x;
-		face.y *= scale_y;
-		face.width *= scale_x;
-		face.height *= scale_y;
+		dx_.clear();
+		dy_.clear();
+		for (unsigned int j = 0; j < prev_pts_.size(); j++)
+		{
+			if (owner_[j] == i && status_[j])
+				dx_.push_back(next_pts_[j].x - prev_pts_[j].x), dy_.push_back(next_pts_[j].y - prev_pts_[j].y);
+		}
+		if (dx_.empty())
+			continue;
+		std::nth_element(dx_.begin(), dx_.begin() + dx_.size() / 2, dx_.end());
+		std::nth_element(dy_.begin(), dy_.begin() + dy_.size() / 2, dy_.end());
+		faces_[i].x = std::clamp(faces_[i].x + dx_[dx_.size() / 2], 0.0f, (float)low_res_info_.width - faces_[i].width);
+		faces_[i].y =
+			std::clamp(faces_[i].y + dy_[dy_.size() / 2], 0.0f, (float)low_res_info_.height - faces_[i].height);
+		all_dx_.insert(all_dx_.end(), dx_.begin(), dx_.end());
+		all_dy_.insert(all_dy_.end(), dy_.begin(), dy_.end());
+	}
+
+	// Remember the overall motion for compensating an in-flight detection.
+	if (!all_dx_.empty())
+	{
+		std::nth_element(all_dx_.begin(), all_dx_.begin() + all_dx_.size() / 2, all_dx_.end());
+		std::nth_element(all_dy_.begin(), all_dy_.begin() + all_dy_.size() / 2, all_dy_.end());
+		accumulated_flow_ += Point2f(all_dx_[all_dx_.size() / 2], all_dy_[all_dy_.size() / 2]);
+	}
+}
+
+void FaceDetectCvStage::detectThread()
+{
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lck(detect_mutex_);
+			detect_cv_.wait(lck, [this] { return quit_ || detect_pending_; });
+			if (quit_)
+				break;
+		}
+
+		// Work on detect_image_ in place: Process() won't refill it until
+		// detect_pending_ goes false again, so it's ours for the duration.
+		equalizeHist(detect_image_, detect_image_);
+
+		std::vector<Rect> temp_faces;
+		cascade_.detectMultiScale(detect_image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
+								  Size(min_size_, min_size_), Size(max_size_, max_size_));
+
+		{
+			// These results describe the frame the detection started on, so shift
+			// them by whatever motion the tracker has seen since.
+			std::unique_lock<std::mutex> lock(face_mutex_);
+			faces_.clear();
+			for (auto const &face : temp_faces)
+				faces_.push_back(Rect2f(face.x + accumulated_flow_.x, face.y + accumulated_flow_.y, face.width,
+										face.height));
+		}
+
+		std::unique_lock<std::mutex> lck(detect_mutex_);
+		detect_pending_ = false;
 	}
-	std::unique_lock<std::mutex> lock(face_mutex_);
-	faces_ = std::move(temp_faces);
 }
 
-void FaceDetectCvStage::drawFeatures(Mat &img)
+void FaceDetectCvStage::drawFeatures(Mat &img, std::vector<Rect> const &faces)
 {
 	const static Scalar colors[] = {
 		Scalar(255, 0, 0),	 Scalar(255, 128, 0), Scalar(255, 255, 0), Scalar(0, 255, 0),
 		Scalar(0, 128, 255), Scalar(0, 255, 255), Scalar(0, 0, 255),   Scalar(255, 0, 255)
 	};
 
-	for (size_t i = 0; i < faces_.size(); i++)
+	for (size_t i = 0; i < faces.size(); i++)
 	{
-		Rect r = faces_[i];
+		Rect r = faces[i];
 		Point center;
 		Scalar color = colors[i % 8];
 		int radius;
@@ -202,8 +348,13 @@ void FaceDetectCvStage::drawFeatures(Mat &img)
 
 void FaceDetectCvStage::Stop()
 {
-	if (future_ptr_)
-		future_ptr_->wait();
+	{
+		std::unique_lock<std::mutex> lck(detect_mutex_);
+		quit_ = true;
+	}
+	detect_cv_.notify_one();
+	if (detect_thread_.joinable())
+		detect_thread_.join();
 }
 
 static PostProcessingStage *Create(RPiCamApp *app)
@@ -72,7 +72,15 @@ public:
 
 		if (!_vdevice)
 		{
-			Expected<std::unique_ptr<VDevice>> vdevice_exp = VDevice::create();
+			// All stages in the process share this one virtual device. Ask for the
+			// round-robin model scheduler explicitly so that configs chaining several
+			// Hailo stages (e.g. detection + pose) have their model contexts
+			// interleaved on the hardware rather than serialized behind one another.
+			hailo_vdevice_params_t params;
+			hailo_init_vdevice_params(&params);
+			params.scheduling_algorithm = HAILO_SCHEDULING_ALGORITHM_ROUND_ROBIN;
+
+			Expected<std::unique_ptr<VDevice>> vdevice_exp = VDevice::create(params);
 			if (!vdevice_exp)
 			{
 				LOG_ERROR("Failed create vdevice, status = " << vdevice_exp.status());
@@ -162,6 +170,9 @@ void HailoPostProcessingStage::Read(boost::property_tree::ptree const &params)
 	hef_file_ = params.get<std::string>("hef_file", "");
 	hef_file_8_ = params.get<std::string>("hef_file_8", "");
 	hef_file_8L_ = params.get<std::string>("hef_file_8L", "");
+	// Number of inference jobs allowed in flight at once. Depths > 1 keep the
+	// accelerator's pipeline fed between frames at the cost of a little latency.
+	queue_depth_ = std::clamp(params.get<unsigned int>("queue_depth", 2), 1u, 8u);
 }
 
 void HailoPostProcessingStage::Configure()
@@ -231,14 +242,17 @@ int HailoPostProcessingStage::configureHailoRT()
 	}
 	configured_infer_model_ = std::make_shared<ConfiguredInferModel>(configured_infer_model_exp.release());
 
-	// Create infer bindings
-	Expected<ConfiguredInferModel::Bindings> bindings_exp = configured_infer_model_->create_bindings();
-	if (!bindings_exp)
+	// Create one set of infer bindings per in-flight job.
+	for (unsigned int i = 0; i < queue_depth_; i++)
 	{
-		LOG_ERROR("Failed to create infer bindings, status = " << bindings_exp.status());
-		return bindings_exp.status();
+		Expected<ConfiguredInferModel::Bindings> bindings_exp = configured_infer_model_->create_bindings();
+		if (!bindings_exp)
+		{
+			LOG_ERROR("Failed to create infer bindings, status = " << bindings_exp.status());
+			return bindings_exp.status();
+		}
+		bindings_.push_back(std::move(bindings_exp.release()));
 	}
-	bindings_ = std::move(bindings_exp.release());
 
 	hailo_3d_image_shape_t shape = infer_model_->inputs()[0].shape();
 	input_tensor_size_ = libcamera::Size(shape.width, shape.height);
@@ -253,11 +267,16 @@ hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncIn
 
 	std::scoped_lock<std::mutex> l(lock_);
 
+	// Rotate through the bindings pool so that up to queue_depth_ jobs can be
+	// queued on the device at once.
+	ConfiguredInferModel::Bindings &bindings = bindings_[next_bindings_];
+	next_bindings_ = (next_bindings_ + 1) % bindings_.size();
+
 	// Input tensor.
 	const std::string &input_name = infer_model_->get_input_names()[0];
 	size_t input_frame_size = infer_model_->input(input_name)->get_frame_size();
 
-	status = bindings_.input(input_name)->set_buffer(MemoryView((void *)(input), input_frame_size));
+	status = bindings.input(input_name)->set_buffer(MemoryView((void *)(input), input_frame_size));
 	if (status != HAILO_SUCCESS)
 	{
 		LOG_ERROR("Could not write to input stream with status " << status);
@@ -275,7 +294,7 @@ hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncIn
 			return status;
 		}
 
-		status = bindings_.output(output_name)->set_buffer(MemoryView(output_buffer.get(), output_size));
+		status = bindings.output(output_name)->set_buffer(MemoryView(output_buffer.get(), output_size));
 		if (status != HAILO_SUCCESS)
 		{
 			LOG_ERROR("Failed to set infer output buffer, status = " << status);
@@ -313,7 +332,7 @@ hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncIn
 	last_frame_ = this_frame;
 
 	// Dispatch the job.
-	Expected<AsyncInferJob> job_exp = configured_infer_model_->run_async(bindings_);
+	Expected<AsyncInferJob> job_exp = configured_infer_model_->run_async(bindings);
 	if (!job_exp)
 	{
 		LOG_ERROR("Failed to start async infer job, status = " << job_exp.status());
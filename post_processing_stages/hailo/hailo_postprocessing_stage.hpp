@@ -196,7 +196,11 @@ private:
 	std::mutex lock_;
 	bool init_ = false;
 	std::string hef_file_, hef_file_8_, hef_file_8L_;
-	hailort::ConfiguredInferModel::Bindings bindings_;
+	// Each in-flight async job needs its own bindings object, so we keep a pool
+	// of queue_depth_ of them and rotate through it as jobs are dispatched.
+	unsigned int queue_depth_;
+	std::vector<hailort::ConfiguredInferModel::Bindings> bindings_;
+	unsigned int next_bindings_ = 0;
 	std::chrono::time_point<std::chrono::steady_clock> last_frame_;
 	libcamera::Size input_tensor_size_;
 	hailo_device_identity_t device_id_;
@@ -65,6 +65,7 @@ private:
 	std::mutex lock_;
 	DlLib postproc_nms_;
 	YoloParamsNMS *yolo_params_ = nullptr;
+	PostProcFuncPtrNms filter_func_ = nullptr;
 
 	// Config params
 	std::string config_path_;
@@ -123,6 +124,11 @@ void YoloInference::Read(boost::property_tree::ptree const &params)
 	}
 	yolo_params_ = init(config_file, "");
 
+	// Look the filter function up once here rather than dlsym-ing every frame.
+	filter_func_ = reinterpret_cast<PostProcFuncPtrNms>(postproc_nms_.GetSymbol("filter"));
+	if (!filter_func_)
+		throw std::runtime_error("hailo postprocess library has no filter function");
+
 	HailoPostProcessingStage::Read(params);
 }
 
@@ -252,20 +258,33 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 	}
 
 	HailoROIPtr roi = MakeROI(output_tensors);
-	PostProcFuncPtrNms filter = reinterpret_cast<PostProcFuncPtrNms>(postproc_nms_.GetSymbol("filter"));
 
-	filter(roi, yolo_params_);
+	filter_func_(roi, yolo_params_);
 	std::vector<HailoDetectionPtr> detections = hailo_common::get_hailo_detections(roi);
 
+	// Reject detections below the confidence threshold before doing any of the
+	// box co-ordinate work on them.
+	detections.erase(std::remove_if(detections.begin(), detections.end(),
+									[this](HailoDetectionPtr const &d) { return d->get_confidence() < threshold_; }),
+					 detections.end());
+
+	// If there are too many, keep the most confident ones rather than whichever
+	// happened to come out of the network first.
+	if (detections.size() > max_detections_)
+	{
+		std::partial_sort(detections.begin(), detections.begin() + max_detections_, detections.end(),
+						  [](HailoDetectionPtr const &a, HailoDetectionPtr const &b)
+						  { return a->get_confidence() > b->get_confidence(); });
+		detections.resize(max_detections_);
+	}
+
 	LOG(2, "------");
 
 	// Translate results to the rpicam-apps Detection objects
 	std::vector<Detection> results;
+	results.reserve(detections.size());
 	for (auto const &d : detections)
 	{
-		if (d->get_confidence() < threshold_)
-			continue;
-
 		// Extract bounding box co-ordinates in the output image co-ordinates.
 		auto const &box = d->get_bbox();
 		const float x0 = std::max(box.xmin(), 0.0f);
@@ -275,9 +294,6 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 		libcamera::Rectangle r = ConvertInferenceCoordinates({ x0, y0, x1 - x0, y1 - y0 }, scaler_crops);
 		results.emplace_back(d->get_class_id(), d->get_label(), d->get_confidence(), r.x, r.y, r.width, r.height);
 		LOG(2, "Object: " << results.back().toString());
-
-		if (--max_detections_ == 0)
-			break;
 	}
 
 	LOG(2, "------");
@@ -10,6 +10,10 @@
 #include <memory>
 #include <vector>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <hailo/hailort.hpp>
 
 #include <libcamera/geometry.h>
@@ -37,13 +41,6 @@ namespace fs = std::filesystem;
 namespace
 {
 
-enum overlay_status_t
-{
-	OVERLAY_STATUS_UNINITIALIZED = -1,
-	OVERLAY_STATUS_OK,
-
-};
-
 const std::vector<cv::Scalar> color_table = {
 	cv::Scalar(255, 0, 0),	 cv::Scalar(0, 255, 0),	  cv::Scalar(0, 0, 255),	cv::Scalar(255, 255, 0),
 	cv::Scalar(0, 255, 255), cv::Scalar(255, 0, 255), cv::Scalar(255, 170, 0),	cv::Scalar(255, 0, 170),
@@ -57,57 +54,50 @@ cv::Scalar indexToColor(size_t index)
 	return color_table[index % color_table.size()];
 }
 
-class Parallel_pixel_opencv : public cv::ParallelLoopBody
+// Blend the mask colour into one row of RGB pixels wherever the mask confidence
+// is above threshold. alpha_q8 is the mask transparency in Q8 fixed point.
+void blend_mask_row(uint8_t *dst, const float *mask, int width, unsigned int alpha_q8, const uint8_t colour[3])
 {
-protected:
-	cv::Vec3b *p;
-	float transparency;
-	int image_cols;
-	int roi_cols;
-
-public:
-	Parallel_pixel_opencv(uint8_t *ptr, float transparency, int image_cols, int roi_cols)
-		: p((cv::Vec3b *)ptr), transparency(transparency), image_cols(image_cols), roi_cols(roi_cols)
-	{
-	}
-};
+	constexpr float CONFIDENCE = 0.5;
+	const unsigned int inv_q8 = 256 - alpha_q8;
+	int x = 0;
 
-class ParallelPixelClassConfMask : public Parallel_pixel_opencv
-{
-private:
-	float *mask_data;
-	cv::Scalar mask_color;
+#if defined(__ARM_NEON)
+	const float32x4_t conf = vdupq_n_f32(CONFIDENCE);
+	uint16x8_t colour_term[3];
+	for (int c = 0; c < 3; c++)
+		colour_term[c] = vdupq_n_u16(colour[c] * alpha_q8);
 
-public:
-	ParallelPixelClassConfMask(uint8_t *ptr, uint8_t *mask_data, float transparency, int image_cols, int roi_cols,
-							   cv::Scalar mask_color)
-		: Parallel_pixel_opencv(ptr, transparency, image_cols, roi_cols), mask_data((float *)mask_data),
-		  mask_color(mask_color)
+	for (; x + 8 <= width; x += 8)
 	{
+		// Mask confidences -> 8 lanes of all-ones/all-zeros.
+		uint16x4_t m0 = vmovn_u32(vcgtq_f32(vld1q_f32(mask + x), conf));
+		uint16x4_t m1 = vmovn_u32(vcgtq_f32(vld1q_f32(mask + x + 4), conf));
+		uint8x8_t sel = vmovn_u16(vcombine_u16(m0, m1));
+
+		// Blend all 8 pixels, then select blended/original lanes by the mask.
+		uint8x8x3_t px = vld3_u8(dst + 3 * x);
+		for (int c = 0; c < 3; c++)
+		{
+			uint16x8_t blended = vaddq_u16(vmulq_n_u16(vmovl_u8(px.val[c]), inv_q8), colour_term[c]);
+			px.val[c] = vbsl_u8(sel, vshrn_n_u16(blended, 8), px.val[c]);
+		}
+		vst3_u8(dst + 3 * x, px);
 	}
+#endif
 
-	virtual void operator()(const cv::Range &r) const
+	for (; x < width; x++)
 	{
-		constexpr float CONFIDENCE = 0.5;
-
-		for (int i = r.start; i != r.end; ++i)
+		if (mask[x] > CONFIDENCE)
 		{
-			if (mask_data[i] > CONFIDENCE) // confidence is above threshold
-			{
-				// i the index inside the full image, convert it to the index inside the ROI
-				int index = i / roi_cols * image_cols + i % roi_cols;
-
-				p[index][0] = p[index][0] * (1 - transparency) + mask_color[0] * transparency;
-				p[index][1] = p[index][1] * (1 - transparency) + mask_color[1] * transparency;
-				p[index][2] = p[index][2] * (1 - transparency) + mask_color[2] * transparency;
-			}
+			uint8_t *p = dst + 3 * x;
+			for (int c = 0; c < 3; c++)
+				p[c] = (p[c] * inv_q8 + colour[c] * alpha_q8) >> 8;
 		}
 	}
-};
+}
 
-template <typename T>
-void calc_destination_roi_and_resize_mask(cv::Mat &destinationROI, cv::Mat &image_planes, HailoROIPtr roi,
-										  HailoMaskPtr mask, cv::Mat &resized_mask_data, T data_ptr, int cv_type)
+void draw_conf_class_mask(cv::Mat &image_planes, HailoConfClassMaskPtr mask, HailoROIPtr roi, float *mask_buffer)
 {
 	HailoBBox bbox = roi->get_bbox();
 	int roi_xmin = bbox.xmin() * image_planes.cols;
@@ -120,50 +110,36 @@ void calc_destination_roi_and_resize_mask(cv::Mat &destinationROI, cv::Mat &imag
 	roi_ymin = std::clamp(roi_ymin, 0, image_planes.rows);
 	roi_width = std::clamp(roi_width, 0, image_planes.cols - roi_xmin);
 	roi_height = std::clamp(roi_height, 0, image_planes.rows - roi_ymin);
+	if (!roi_width || !roi_height)
+		return;
 
-	cv::Mat mat_data = cv::Mat(mask->get_height(), mask->get_width(), cv_type, (uint8_t *)data_ptr.data());
+	auto data = mask->get_data();
+	cv::Mat mat_data = cv::Mat(mask->get_height(), mask->get_width(), CV_32F, (uint8_t *)data.data());
 
+	// Upscale into the caller's pooled buffer; no allocation on this path.
+	cv::Mat resized_mask_data(roi_height, roi_width, CV_32F, mask_buffer);
 	cv::resize(mat_data, resized_mask_data, cv::Size(roi_width, roi_height), 0, 0, cv::INTER_LINEAR);
 
-	cv::Rect roi_rect(cv::Point(roi_xmin, roi_ymin), cv::Size(roi_width, roi_height));
-	destinationROI = image_planes(roi_rect);
-}
-
-overlay_status_t draw_conf_class_mask(cv::Mat &image_planes, HailoConfClassMaskPtr mask, HailoROIPtr roi,
-									  const uint mask_overlay_n_threads)
-{
-	cv::Mat resized_mask_data;
-	cv::Mat destinationROI;
-
-	calc_destination_roi_and_resize_mask(destinationROI, image_planes, roi, mask, resized_mask_data, mask->get_data(),
-										 CV_32F);
 	cv::Scalar mask_color = indexToColor(mask->get_class_id());
+	const uint8_t colour[3] = { (uint8_t)mask_color[0], (uint8_t)mask_color[1], (uint8_t)mask_color[2] };
+	const unsigned int alpha_q8 = std::clamp(mask->get_transparency(), 0.0f, 1.0f) * 256 + 0.5f;
 
-	if (mask_overlay_n_threads > 0)
-		cv::setNumThreads(mask_overlay_n_threads);
-
-	// perform efficient parallel matrix iteration and color every pixel its class color
-	cv::parallel_for_(cv::Range(0, destinationROI.rows * destinationROI.cols),
-					  ParallelPixelClassConfMask(destinationROI.data, resized_mask_data.data, mask->get_transparency(),
-												 image_planes.cols, destinationROI.cols, mask_color));
-
-	return OVERLAY_STATUS_OK;
+	for (int y = 0; y < roi_height; y++)
+		blend_mask_row(image_planes.ptr<uint8_t>(roi_ymin + y) + 3 * roi_xmin, mask_buffer + y * roi_width, roi_width,
+					   alpha_q8, colour);
 }
 
-overlay_status_t draw_all(cv::Mat &mat, HailoROIPtr roi, const uint mask_overlay_n_threads)
+void draw_all(cv::Mat &mat, HailoROIPtr roi, float *mask_buffer)
 {
-	overlay_status_t ret = OVERLAY_STATUS_UNINITIALIZED;
 	for (auto &obj : roi->get_objects())
 	{
 		if (obj->get_type() == HAILO_CONF_CLASS_MASK)
 		{
 			HailoConfClassMaskPtr mask = std::dynamic_pointer_cast<HailoConfClassMask>(obj);
 			if (mask->get_height() != 0 && mask->get_width() != 0)
-				draw_conf_class_mask(mat, mask, roi, mask_overlay_n_threads);
+				draw_conf_class_mask(mat, mask, roi, mask_buffer);
 		}
 	}
-	ret = OVERLAY_STATUS_OK;
-	return ret;
 }
 
 } // namespace
@@ -187,6 +163,8 @@ private:
 
 	DlLib postproc_;
 	Yolov5segParams *yolo_params_ = nullptr;
+	// One full-size mask plane, reused for every instance and every frame.
+	std::vector<float> mask_buffer_;
 
 	// Config params
 	bool show_results_;
@@ -235,6 +213,7 @@ void YoloSegmentation::Read(boost::property_tree::ptree const &params)
 void YoloSegmentation::Configure()
 {
 	HailoPostProcessingStage::Configure();
+	mask_buffer_.resize(InputTensorSize().width * InputTensorSize().height);
 }
 
 bool YoloSegmentation::Process(CompletedRequestPtr &completed_request)
@@ -344,7 +323,7 @@ bool YoloSegmentation::runInference(uint8_t *input, uint32_t *output)
 										 bbox.ymax() * float(InputTensorSize().height)),
 					  cv::Scalar(0, 0, 255), 1);
 
-		draw_all(image, detection, 0);
+		draw_all(image, detection, mask_buffer_.data());
 	}
 
 	return true;
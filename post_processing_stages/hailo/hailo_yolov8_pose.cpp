@@ -46,6 +46,7 @@ private:
 	void runInference(const uint8_t *input, uint32_t *output, const std::vector<Rectangle> &scaler_crops);
 
 	DlLib postproc_;
+	PostProcFuncPtr filter_func_ = nullptr;
 };
 
 YoloPose::YoloPose(RPiCamApp *app)
@@ -60,6 +61,11 @@ char const *YoloPose::Name() const
 
 void YoloPose::Read(boost::property_tree::ptree const &params)
 {
+	// Look the decode function up once here rather than dlsym-ing every frame.
+	filter_func_ = reinterpret_cast<PostProcFuncPtr>(postproc_.GetSymbol("yolov8"));
+	if (!filter_func_)
+		throw std::runtime_error("hailo pose postprocess library has no yolov8 function");
+
 	HailoPostProcessingStage::Read(params);
 }
 
@@ -170,12 +176,8 @@ void YoloPose::runInference(const uint8_t *input, uint32_t *output, const std::v
 		return;
 	}
 
-	PostProcFuncPtr filter = reinterpret_cast<PostProcFuncPtr>(postproc_.GetSymbol("yolov8"));
-	if (!filter)
-		return;
-
 	HailoROIPtr roi = MakeROI(output_tensors);
-	std::pair<std::vector<KeyPt>, std::vector<PairPairs>> keypoints_and_pairs = filter(roi);
+	std::pair<std::vector<KeyPt>, std::vector<PairPairs>> keypoints_and_pairs = filter_func_(roi);
 
 	std::vector<HailoDetectionPtr> detections = hailo_common::get_hailo_detections(roi);
 	cv::Mat image(InputTensorSize().height, InputTensorSize().width, CV_8UC3, (void *)input,
@@ -22,6 +22,10 @@
 // pixel manipulations, especially when it comes to colour, are a bit random. You have
 // been warned. Enjoy!
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <libcamera/stream.h>
 
 #include "core/rpicam_app.hpp"
@@ -31,6 +35,7 @@
 #include "image/image.hpp"
 
 #include "post_processing_stages/histogram.hpp"
+#include "post_processing_stages/pixel_kernels.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 #include "post_processing_stages/pwl.hpp"
 
@@ -40,6 +45,7 @@ struct LpFilterConfig
 {
 	double strength; // smaller value actually smoothes more
 	Pwl threshold; // defines the level of pixel differences that will be smoothed over
+	Pwl::Lut<double> threshold_lut; // threshold compiled to a LUT in Configure()
 };
 
 // A TonemapPoint gives a target value within the full dynamic range where we would like
@@ -73,6 +79,7 @@ struct LocalTonemapConfig
 {
 	Pwl pos_strength; // gain applied to local contrast when brighter than neighbourhood
 	Pwl neg_strength; // gain applied to local contrast when darker than neighbourhood
+	Pwl::Lut<double> pos_strength_lut, neg_strength_lut; // the above compiled to LUTs in Configure()
 	double colour_scale; // allows colour saturation to be increased or reduced slightly
 };
 
@@ -107,18 +114,15 @@ struct HdrImage
 
 static void add_Y_pixels(int16_t *dest, uint8_t const *src, int width, int stride, int height)
 {
-	for (int y = 0; y < height; y++, src += stride)
-	{
-		for (int x = 0; x < width; x++)
-			*(dest++) += src[x];
-	}
+	for (int y = 0; y < height; y++, src += stride, dest += width)
+		PixelKernels::AccumulateU8(dest, src, width);
 }
 
 // Add the new image buffer to this "accumulator" image. We just add them as
 // we don't have the horsepower to do any fancy alignment or anything.
-// Actually, spreading it across a few threads doesn't seem to help much, though
-// compiling with "gcc -mfpu=neon-fp-armv8 -ftree-vectorize" gives a big
-// improvement.
+// Actually, spreading it across a few threads doesn't seem to help much. The
+// accumulate kernel uses NEON explicitly so we don't depend on
+// "-ftree-vectorize" to get vectorized code here.
 
 void HdrImage::Accumulate(uint8_t const *src, int stride)
 {
@@ -130,11 +134,8 @@ void HdrImage::Accumulate(uint8_t const *src, int stride)
 	src += stride * height;
 
 	// U and V components
-	for (int y = 0; y < height; y++, src += stride2)
-	{
-		for (int x = 0; x < width2; x++)
-			*(dest++) += src[x] - 128;
-	}
+	for (int y = 0; y < height; y++, src += stride2, dest += width2)
+		PixelKernels::AccumulateU8(dest, src, width2, 128);
 
 	dynamic_range += 256;
 
@@ -144,8 +145,8 @@ void HdrImage::Accumulate(uint8_t const *src, int stride)
 // Forward pass of the IIR low pass filter.
 
 static void forward_pass(std::vector<double> &fwd_pixels, std::vector<double> &fwd_weight_sums, HdrImage const &in,
-						 std::vector<double> &weights, std::vector<double> &threshold, int width, int height, int size,
-						 double strength)
+						 std::vector<double> &weights, Pwl::Lut<double> const &threshold, int width, int height,
+						 int size, double strength)
 
 {
 	// (Should probably initialise the top/left elements of fwd_pixels/fwd_weight_sums...)
@@ -189,8 +190,8 @@ static void forward_pass(std::vector<double> &fwd_pixels, std::vector<double> &f
 
 HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
 {
-	// Cache threshold values, computing them would be slow.
-	std::vector<double> threshold = config.threshold.GenerateLut<double>();
+	// The threshold LUT was compiled once in Configure(), computing values here would be slow.
+	Pwl::Lut<double> const &threshold = config.threshold_lut;
 
 	// Cache values of e^(-x^2) for 0 <= x <= 3, it will be much quicker
 	std::vector<double> weights(31);
@@ -264,10 +265,8 @@ HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
 
 Histogram HdrImage::CalculateHistogram() const
 {
-	std::vector<uint32_t> bins(dynamic_range);
-	std::fill(bins.begin(), bins.end(), 0);
-	for (int i = 0; i < width * height; i++)
-		bins[P(i)]++;
+	std::vector<uint32_t> bins(dynamic_range, 0);
+	PixelKernels::AccumulateHistogramS16(&bins[0], dynamic_range, &pixels[0], width * height);
 	return Histogram(&bins[0], dynamic_range);
 }
 
@@ -302,10 +301,11 @@ void HdrImage::Tonemap(HdrImage const &lp, HdrConfig const &config)
 {
 	Pwl tonemap = CreateTonemap(config.global_tonemap);
 
-	// Make LUTs for the all the Pwls, it'll be much quicker.
-	std::vector<int> tonemap_lut = tonemap.GenerateLut<int>();
-	std::vector<double> pos_strength_lut = config.local_tonemap.pos_strength.GenerateLut<double>();
-	std::vector<double> neg_strength_lut = config.local_tonemap.neg_strength.GenerateLut<double>();
+	// The tone curve depends on this capture's histogram so must be compiled here,
+	// but the strength LUTs were compiled once in Configure().
+	Pwl::Lut<int> tonemap_lut = tonemap.Compile<int>(dynamic_range);
+	Pwl::Lut<double> const &pos_strength_lut = config.local_tonemap.pos_strength_lut;
+	Pwl::Lut<double> const &neg_strength_lut = config.local_tonemap.neg_strength_lut;
 	double colour_scale = config.local_tonemap.colour_scale;
 
 	int maxval = dynamic_range - 1;
@@ -338,6 +338,21 @@ void HdrImage::Tonemap(HdrImage const &lp, HdrConfig const &config)
 
 // Write image back out to 8-bit buffer with given stride.
 
+#if defined(__ARM_NEON)
+
+// Divide 8 chroma values by 16 (rounding towards zero, like integer division)
+// and recentre on 128, saturating to the 0-255 output range.
+
+static inline uint8x8_t extract_UV_pixels(int16_t const *src)
+{
+	int16x8_t p = vld1q_s16(src);
+	// Add 15 to negative values so the shift truncates towards zero.
+	p = vaddq_s16(p, vandq_s16(vshrq_n_s16(p, 15), vdupq_n_s16(15)));
+	return vqmovun_s16(vaddq_s16(vshrq_n_s16(p, 4), vdupq_n_s16(128)));
+}
+
+#endif
+
 void HdrImage::Extract(uint8_t *dest, int stride) const
 {
 	double ratio = dynamic_range / 256;
@@ -345,17 +360,38 @@ void HdrImage::Extract(uint8_t *dest, int stride) const
 	const int16_t *U_ptr = Y_ptr + width * height, *V_ptr = U_ptr + width * height / 4;
 	uint8_t *dest_y = dest;
 	uint8_t *dest_u = dest_y + stride * height, *dest_v = dest_u + stride * height / 4;
+#if defined(__ARM_NEON)
+	// After Scale() the dynamic range is always 4096, making ratio a shift by 4.
+	bool neon = ratio == 16;
+#else
+	bool neon = false;
+#endif
 
 	for (int y = 0; y < height; y++, dest_y += stride)
 	{
-		for (int x = 0; x < width; x++)
+		int x = 0;
+#if defined(__ARM_NEON)
+		if (neon)
+			for (; x + 8 <= width; x += 8, Y_ptr += 8)
+				vst1_u8(dest_y + x, vqshrun_n_s16(vld1q_s16(Y_ptr), 4));
+#endif
+		for (; x < width; x++)
 			dest_y[x] = *(Y_ptr++) / ratio;
 	}
 
 	int w = width / 2, h = height / 2, s = stride / 2;
 	for (int y = 0; y < h; y++, dest_u += s, dest_v += s)
 	{
-		for (int x = 0; x < w; x++)
+		int x = 0;
+#if defined(__ARM_NEON)
+		if (neon)
+			for (; x + 8 <= w; x += 8, U_ptr += 8, V_ptr += 8)
+			{
+				vst1_u8(dest_u + x, extract_UV_pixels(U_ptr));
+				vst1_u8(dest_v + x, extract_UV_pixels(V_ptr));
+			}
+#endif
+		for (; x < w; x++)
 		{
 			int U = *(U_ptr++) / ratio;
 			int V = *(V_ptr++) / ratio;
@@ -369,8 +405,8 @@ void HdrImage::Extract(uint8_t *dest, int stride) const
 
 void HdrImage::Scale(double factor)
 {
-	for (unsigned int i = 0; i < pixels.size(); i++)
-		pixels[i] *= factor;
+	// Q8 fixed point multiply, good to 1 part in 256 which is plenty for pixels.
+	PixelKernels::ScaleQ8S16(&pixels[0], pixels.size(), std::lround(factor * 256));
 	dynamic_range *= factor;
 }
 
@@ -460,6 +496,13 @@ void HdrStage::Configure()
 	acc_ = HdrImage(info_.width, info_.height, info_.width * info_.height * 3 / 2);
 	acc_.Clear();
 	lp_ = HdrImage(info_.width, info_.height, info_.width * info_.height);
+
+	// Compile the configured Pwls to LUTs once here, covering the full 4096-value
+	// dynamic range that the accumulator is scaled to in Process(), so the
+	// per-pixel loops only pay an indexed load.
+	config_.lp_filter.threshold_lut = config_.lp_filter.threshold.Compile<double>(4096);
+	config_.local_tonemap.pos_strength_lut = config_.local_tonemap.pos_strength.Compile<double>(4096);
+	config_.local_tonemap.neg_strength_lut = config_.local_tonemap.neg_strength.Compile<double>(4096);
 }
 
 bool HdrStage::Process(CompletedRequestPtr &completed_request)
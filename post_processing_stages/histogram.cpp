@@ -43,20 +43,28 @@ double Histogram::Quantile(double q, int first, int last) const
 	return first + frac;
 }
 
+// Interpolate a cumulative sum at a (fractional) bin position.
+
+static double interpolate(std::vector<uint64_t> const &cumulative, double bin)
+{
+	if (bin <= 0)
+		return 0;
+	else if (bin >= cumulative.size() - 1)
+		return cumulative.back();
+	int b = (int)bin;
+	return cumulative[b] + (bin - b) * (cumulative[b + 1] - cumulative[b]);
+}
+
 double Histogram::InterQuantileMean(double q_lo, double q_hi) const
 {
 	assert(q_hi > q_lo);
 	double p_lo = Quantile(q_lo);
 	double p_hi = Quantile(q_hi, (int)p_lo);
-	double sum_bin_freq = 0, cumul_freq = 0;
-	for (double p_next = floor(p_lo) + 1.0; p_next <= ceil(p_hi);
-	     p_lo = p_next, p_next += 1.0) {
-		int bin = floor(p_lo);
-		double freq = (cumulative_[bin + 1] - cumulative_[bin]) *
-			      (std::min(p_next, p_hi) - p_lo);
-		sum_bin_freq += bin * freq;
-		cumul_freq += freq;
-	}
+	// Within a bin the weighted sum grows linearly, so the mean comes straight
+	// from the cached cumulative sums at the two endpoints - no need to walk
+	// every bin in between.
+	double sum_bin_freq = interpolate(weighted_cumulative_, p_hi) - interpolate(weighted_cumulative_, p_lo);
+	double cumul_freq = interpolate(cumulative_, p_hi) - interpolate(cumulative_, p_lo);
 	// add 0.5 to give an average for bin mid-points
 	return sum_bin_freq / cumul_freq + 0.5;
 }
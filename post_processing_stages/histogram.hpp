@@ -19,11 +19,17 @@ public:
 	template<typename T> Histogram(T *histogram, int num)
 	{
 		assert(num);
+		// Both plain and bin-weighted cumulative sums are cached here, so
+		// quantile and inter-quantile mean queries never re-walk the bins.
 		cumulative_.reserve(num + 1);
+		weighted_cumulative_.reserve(num + 1);
 		cumulative_.push_back(0);
+		weighted_cumulative_.push_back(0);
 		for (int i = 0; i < num; i++)
-			cumulative_.push_back(cumulative_.back() +
-					      histogram[i]);
+		{
+			cumulative_.push_back(cumulative_.back() + histogram[i]);
+			weighted_cumulative_.push_back(weighted_cumulative_.back() + (uint64_t)i * histogram[i]);
+		}
 	}
 	uint32_t Bins() const { return cumulative_.size() - 1; }
 	uint64_t Total() const { return cumulative_[cumulative_.size() - 1]; }
@@ -33,8 +39,10 @@ public:
 	// histogram. Optionally provide limits to help.
 	double Quantile(double q, int first = -1, int last = -1) const;
 	// Return the average histogram bin value between the two quantiles.
+	// O(1) apart from locating the quantiles, thanks to the cached sums.
 	double InterQuantileMean(double q_lo, double q_hi) const;
 
 private:
 	std::vector<uint64_t> cumulative_;
+	std::vector<uint64_t> weighted_cumulative_; // of bin * frequency
 };
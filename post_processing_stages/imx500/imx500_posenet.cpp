@@ -166,9 +166,11 @@ float squared_distance(const Point &a, const Point &b)
 	return dy * dy + dx * dx;
 }
 
-std::vector<float> format_tensor(const float *data, unsigned int size, unsigned int div)
+void format_tensor(std::vector<float> &tensor, const float *data, unsigned int size, unsigned int div)
 {
-	std::vector<float> tensor(size * MAP_SIZE.width * MAP_SIZE.height);
+	const float inv_div = 1.0f / div;
+
+	tensor.resize(size * MAP_SIZE.width * MAP_SIZE.height);
 
 	for (unsigned int i = 0; i < size; i++)
 	{
@@ -177,12 +179,10 @@ std::vector<float> format_tensor(const float *data, unsigned int size, unsigned
 			for (unsigned int k = 0; k < MAP_SIZE.height; k++)
 			{
 				tensor[(size * MAP_SIZE.width * k) + (size * j) + i] =
-					data[(MAP_SIZE.width * MAP_SIZE.height * i) + (j * MAP_SIZE.height) + k] / div;
+					data[(MAP_SIZE.width * MAP_SIZE.height * i) + (j * MAP_SIZE.height) + k] * inv_div;
 			}
 		}
 	}
-
-	return tensor;
 }
 
 // Build an adjacency list of the pose graph.
@@ -201,7 +201,7 @@ AdjacencyList build_agency_list()
 	return adjacency_list;
 }
 
-bool pass_keypoint_nms(std::vector<PoseKeypoints> poses, const size_t num_poses, const KeypointWithScore &keypoint,
+bool pass_keypoint_nms(const std::vector<PoseKeypoints> &poses, const size_t num_poses, const KeypointWithScore &keypoint,
 					   const float squared_nms_radius)
 {
 	for (unsigned int i = 0; i < num_poses; ++i)
@@ -260,14 +260,15 @@ void build_bilinear_interpolation(const Point point, const unsigned int num_chan
 	*bottom_right = (y_ceil * MAP_SIZE.width + x_ceil) * num_channels;
 }
 
-// Sample the input tensor values at position (x, y) and at multiple channels.
+// Sample the input tensor values at position (x, y) and at a pair of channels.
 // The input tensor has shape [height, width, num_channels]. We bilinearly
-// sample its value at tensor(y, x, c), for c in the channels specified. This
-// is faster than calling the single channel interpolation function multiple
-// times because the computation of the positions needs to be done only once.
-std::vector<float> sample_tensor_at_multiple_channels(const std::vector<float> &tensor, const Point &point,
-													  const std::vector<int> &result_channels,
-													  unsigned int num_channels)
+// sample its value at tensor(y, x, c), for the two channels specified. This
+// is faster than calling the single channel interpolation function twice
+// because the computation of the positions needs to be done only once. The
+// result goes into caller storage - this runs in the innermost decode loops,
+// so it must not allocate.
+void sample_tensor_at_two_channels(const std::vector<float> &tensor, const Point &point, const int c0, const int c1,
+								   unsigned int num_channels, float result[2])
 {
 	int top_left, top_right, bottom_left, bottom_right;
 	float y_lerp, x_lerp;
@@ -275,14 +276,13 @@ std::vector<float> sample_tensor_at_multiple_channels(const std::vector<float> &
 	build_bilinear_interpolation(point, num_channels, &top_left, &top_right, &bottom_left, &bottom_right, &y_lerp,
 								 &x_lerp);
 
-	std::vector<float> result;
-	for (auto &c : result_channels)
+	const int channels[2] = { c0, c1 };
+	for (unsigned int i = 0; i < 2; i++)
 	{
-		result.push_back((1 - y_lerp) * ((1 - x_lerp) * tensor[top_left + c] + x_lerp * tensor[top_right + c]) +
-						 y_lerp * ((1 - x_lerp) * tensor[bottom_left + c] + x_lerp * tensor[bottom_right + c]));
+		const int c = channels[i];
+		result[i] = (1 - y_lerp) * ((1 - x_lerp) * tensor[top_left + c] + x_lerp * tensor[top_right + c]) +
+					y_lerp * ((1 - x_lerp) * tensor[bottom_left + c] + x_lerp * tensor[bottom_right + c]);
 	}
-
-	return result;
 }
 
 // Sample the input tensor values at position (x, y) and at a single channel.
@@ -291,8 +291,14 @@ std::vector<float> sample_tensor_at_multiple_channels(const std::vector<float> &
 float sample_tensor_at_single_channel(const std::vector<float> &tensor, const Point &point, unsigned int num_channels,
 									  const int c)
 {
-	std::vector<float> result = sample_tensor_at_multiple_channels(tensor, point, std::vector<int> { c }, num_channels);
-	return result[0];
+	int top_left, top_right, bottom_left, bottom_right;
+	float y_lerp, x_lerp;
+
+	build_bilinear_interpolation(point, num_channels, &top_left, &top_right, &bottom_left, &bottom_right, &y_lerp,
+								 &x_lerp);
+
+	return (1 - y_lerp) * ((1 - x_lerp) * tensor[top_left + c] + x_lerp * tensor[top_right + c]) +
+		   y_lerp * ((1 - x_lerp) * tensor[bottom_left + c] + x_lerp * tensor[bottom_right + c]);
 }
 
 KeypointQueue build_keypoint_queue(const std::vector<float> &scores, const std::vector<float> &short_offsets,
@@ -358,21 +364,19 @@ Point find_displaced_position(const std::vector<float> &short_offsets, const std
 							  const int offset_refinement_steps)
 {
 	float y = source.y, x = source.x;
+	float offsets[2];
 
 	// Follow the mid-range offsets.
-	std::vector<int> channels = { edge_id, NUM_EDGES + edge_id };
-
 	// Total size of mid_offsets is height x width x 2*2*num_edges
-	std::vector<float> offsets = sample_tensor_at_multiple_channels(mid_offsets, source, channels, 2 * 2 * NUM_EDGES);
+	sample_tensor_at_two_channels(mid_offsets, source, edge_id, NUM_EDGES + edge_id, 2 * 2 * NUM_EDGES, offsets);
 	y = std::clamp(y + offsets[0], 0.0f, MAP_SIZE.height - 1.0f);
 	x = std::clamp(x + offsets[1], 0.0f, MAP_SIZE.width - 1.0f);
 
 	// Refine by the short-range offsets.
-	channels[0] = target_id;
-	channels[1] = NUM_KEYPOINTS + target_id;
 	for (int i = 0; i < offset_refinement_steps; ++i)
 	{
-		offsets = sample_tensor_at_multiple_channels(short_offsets, Point { y, x }, channels, 2 * NUM_KEYPOINTS);
+		sample_tensor_at_two_channels(short_offsets, Point { y, x }, target_id, NUM_KEYPOINTS + target_id,
+									  2 * NUM_KEYPOINTS, offsets);
 		y = std::clamp(y + offsets[0], 0.0f, MAP_SIZE.height - 1.0f);
 		x = std::clamp(x + offsets[1], 0.0f, MAP_SIZE.width - 1.0f);
 	}
@@ -385,7 +389,7 @@ void backtrack_decode_pose(const std::vector<float> &scores, const std::vector<f
 						   const AdjacencyList &adjacency_list, PoseKeypoints &pose_keypoints,
 						   PoseKeypointScores &keypoint_scores, unsigned int offset_refinement_steps)
 {
-	const float root_score = sample_tensor_at_single_channel(scores, root.point, root.id, NUM_KEYPOINTS);
+	const float root_score = sample_tensor_at_single_channel(scores, root.point, NUM_KEYPOINTS, root.id);
 
 	// Used in order to put candidate keypoints in a priority queue w.r.t. their
 	// score. Keypoints with higher score have higher priority and will be
@@ -521,6 +525,11 @@ private:
 	std::vector<LtResults> lt_results_;
 	std::mutex lt_lock_;
 
+	// Per-frame scratch tensors, reused to avoid reallocating ~200KB per frame.
+	std::vector<float> scores_;
+	std::vector<float> short_offsets_;
+	std::vector<float> mid_offsets_;
+
 	// Config params:
 	float threshold_;
 	unsigned int max_detections_;
@@ -594,14 +603,15 @@ bool PoseNet::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
-	std::vector<float> scores =
-		format_tensor((float *)output->data(), NUM_HEATMAPS / (MAP_SIZE.width * MAP_SIZE.height), 1);
-	std::vector<float> short_offsets = format_tensor((float *)output->data() + NUM_HEATMAPS,
-													 NUM_SHORT_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
-	std::vector<float> mid_offsets = format_tensor((float *)output->data() + NUM_HEATMAPS + NUM_SHORT_OFFSETS,
-												   NUM_MID_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
+	// The stage's executor thread is the only caller here, so the scratch
+	// tensors can live in the stage and be reused from frame to frame.
+	format_tensor(scores_, (float *)output->data(), NUM_HEATMAPS / (MAP_SIZE.width * MAP_SIZE.height), 1);
+	format_tensor(short_offsets_, (float *)output->data() + NUM_HEATMAPS,
+				  NUM_SHORT_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
+	format_tensor(mid_offsets_, (float *)output->data() + NUM_HEATMAPS + NUM_SHORT_OFFSETS,
+				  NUM_MID_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
 
-	std::vector<PoseResults> results = decodeAllPoses(scores, short_offsets, mid_offsets);
+	std::vector<PoseResults> results = decodeAllPoses(scores_, short_offsets_, mid_offsets_);
 	translateCoordinates(results, *scaler_crop);
 
 	std::vector<std::vector<libcamera::Point>> locations;
@@ -675,7 +685,8 @@ std::vector<PoseResults> PoseNet::decodeAllPoses(const std::vector<float> &score
 	const float min_score_logit = log_odds(threshold_);
 
 	KeypointQueue queue = build_keypoint_queue(scores, short_offsets, min_score_logit);
-	AdjacencyList adjacency_list = build_agency_list();
+	// The pose graph never changes, so build its adjacency list only once.
+	static const AdjacencyList adjacency_list = build_agency_list();
 
 	std::vector<int> indices(NUM_KEYPOINTS);
 
@@ -683,7 +694,7 @@ std::vector<PoseResults> PoseNet::decodeAllPoses(const std::vector<float> &score
 	// root part score order.
 	std::vector<float> all_instance_scores;
 
-	std::vector<PoseKeypoints> scratch_poses(NUM_KEYPOINTS);
+	std::vector<PoseKeypoints> scratch_poses(max_detections_);
 	std::vector<PoseKeypointScores> scratch_keypoint_scores(max_detections_);
 
 	unsigned int pose_counter = 0;
@@ -113,6 +113,20 @@ void IMX500PostProcessingStage::Read(boost::property_tree::ptree const &params)
 		norm_shift_ = PostProcessingStage::GetJsonArray<uint8_t>(pt, "norm_shift", { 0, 0, 0, 0 });
 		div_val_ = PostProcessingStage::GetJsonArray<int16_t>(pt, "div_val", { 1, 1, 1, 1 });
 		div_shift_ = pt.get<unsigned int>("div_shift", 0);
+
+		// The normalisation depends only on the sample value and its channel, so
+		// precompute it here as a small LUT rather than redoing the shifts and
+		// division for every tensor element saved.
+		for (unsigned int channel = 0; channel < 4; channel++)
+		{
+			for (unsigned int i = 0; i < 256; i++)
+			{
+				int16_t sample = static_cast<int8_t>(i);
+				sample = (sample << norm_shift_[channel]) - conv_reg_signed(norm_val_[channel]);
+				sample = ((sample << div_shift_) / div_val_[channel]) & 0xFF;
+				norm_lut_[channel][i] = static_cast<uint8_t>(sample);
+			}
+		}
 	}
 
 	/* Load the network firmware. */
@@ -150,14 +164,13 @@ bool IMX500PostProcessingStage::Process(CompletedRequestPtr &completed_request)
 		// There is a chance that this may be called through multiple threads, so serialize the file access.
 		std::scoped_lock<std::mutex> l(lock_);
 
+		// Normalise through the precomputed per-channel LUT into a buffer and
+		// write it out in one go, rather than doing the maths and a put() per byte.
+		tensor_save_buffer_.resize(input->size());
 		for (unsigned int i = 0; i < input->size(); i++)
-		{
-			const unsigned int channel = i % 3; // Assume RGB interleaved format.
-			int16_t sample = static_cast<int8_t>(input->data()[i]);
-			sample = (sample << norm_shift_[channel]) - conv_reg_signed(norm_val_[channel]);
-			sample = ((sample << div_shift_) / div_val_[channel]) & 0xFF;
-			input_tensor_file_.put(static_cast<uint8_t>(sample));
-		}
+			tensor_save_buffer_[i] = norm_lut_[i % 3][input->data()[i]]; // Assume RGB interleaved format.
+		input_tensor_file_.write(reinterpret_cast<const char *>(tensor_save_buffer_.data()),
+								 tensor_save_buffer_.size());
 
 		if (--save_frames_ == 0)
 			input_tensor_file_.close();
@@ -172,7 +185,15 @@ Rectangle IMX500PostProcessingStage::ConvertInferenceCoordinates(const std::vect
 	// Convert the inference image co-ordinates into the final ISP output co-ordinates.
 	const Size &isp_output_size = output_stream_->configuration().size;
 	const Size &sensor_output_size = raw_stream_->configuration().size;
-	const Rectangle sensor_crop = scaler_crop.scaledBy(sensor_output_size, full_sensor_resolution_.size());
+
+	// The crop-dependent part of the transform only changes when the scaler crop
+	// does (e.g. during a digital zoom), so refresh it then, not per detection.
+	if (scaler_crop != cached_scaler_crop_)
+	{
+		cached_sensor_crop_ = scaler_crop.scaledBy(sensor_output_size, full_sensor_resolution_.size());
+		cached_scaler_crop_ = scaler_crop;
+	}
+	const Rectangle &sensor_crop = cached_sensor_crop_;
 
 	if (coords.size() != 4)
 		return {};
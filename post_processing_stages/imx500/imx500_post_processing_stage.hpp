@@ -74,5 +74,11 @@ private:
 	std::vector<uint8_t> norm_shift_;
 	std::vector<int16_t> div_val_;
 	unsigned int div_shift_;
+	uint8_t norm_lut_[4][256];
+	std::vector<uint8_t> tensor_save_buffer_;
 	std::mutex lock_;
+
+	// Cached crop-dependent part of the inference co-ordinate transform.
+	mutable libcamera::Rectangle cached_scaler_crop_;
+	mutable libcamera::Rectangle cached_sensor_crop_;
 };
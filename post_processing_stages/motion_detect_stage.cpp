@@ -24,6 +24,9 @@
 
 #include "core/rpicam_app.hpp"
 
+#include "encoder/encoder.hpp"
+
+#include "post_processing_stages/pixel_kernels.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 using Stream = libcamera::Stream;
@@ -62,6 +65,11 @@ private:
 	unsigned int roi_x_, roi_y_;
 	unsigned int roi_width_, roi_height_;
 	unsigned int region_threshold_;
+	// Resolved in Configure() so the per-pixel loop needs no branching: the
+	// vectorized kernel applies when the samples are contiguous (hskip 1) and
+	// the threshold parameters fit the Q8 fixed-point arithmetic.
+	bool use_kernel_;
+	uint16_t difference_m_q8_;
 	std::vector<uint8_t> previous_frame_;
 	bool first_time_;
 	bool motion_detected_;
@@ -122,6 +130,10 @@ void MotionDetectStage::Configure()
 		LOG(1, "Lores: " << info.width << "x" << info.height << " roi: (" << roi_x_ << "," << roi_y_ << ") "
 						 << roi_width_ << "x" << roi_height_ << " threshold: " << region_threshold_);
 
+	difference_m_q8_ = std::clamp(config_.difference_m, 0.0f, 1.0f) * 256 + 0.5f;
+	use_kernel_ = config_.hskip == 1 && config_.difference_m >= 0.0 && config_.difference_m <= 1.0 &&
+				  config_.difference_c >= 0 && config_.difference_c <= 255;
+
 	previous_frame_.resize(roi_width_ * roi_height_);
 	first_time_ = true;
 	motion_detected_ = false;
@@ -154,6 +166,7 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 		}
 
 		completed_request->post_process_metadata.Set("motion_detect.result", motion_detected_);
+		completed_request->post_process_metadata.Set("roi.regions", std::vector<RegionOfInterest>());
 
 		return false;
 	}
@@ -167,15 +180,24 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 	{
 		uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
 		uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
+		if (use_kernel_)
+		{
+			// The samples are contiguous here (hskip is 1, see Configure()). The
+			// kernel's Q8 threshold, difference > (old * m_q8 >> 8) + c, matches
+			// the scalar arithmetic below to within one grey level.
+			regions += PixelKernels::CountAbsDiffExceedingQ8(old_value_ptr, new_value_ptr, roi_width_,
+															 difference_m_q8_, config_.difference_c);
+			continue;
+		}
 		for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
 		{
 			int new_value = *new_value_ptr;
 			int old_value = *old_value_ptr;
 			*(old_value_ptr++) = new_value;
 			regions += std::abs(new_value - old_value) > config_.difference_m * old_value + config_.difference_c;
-			motion_detected = regions >= region_threshold_;
 		}
 	}
+	motion_detected = regions >= region_threshold_;
 
 	if (config_.verbose && motion_detected != motion_detected_)
 		LOG(1, "Motion " << (motion_detected ? "detected" : "stopped")
@@ -184,6 +206,14 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 	motion_detected_ = motion_detected;
 	completed_request->post_process_metadata.Set("motion_detect.result", motion_detected);
 
+	// Tell the encoder where the action is: the analysis region matters while
+	// it contains motion, otherwise the whole frame is background. The roi
+	// fractions apply to the lores and the encoded frame alike.
+	std::vector<RegionOfInterest> roi_regions;
+	if (motion_detected)
+		roi_regions.push_back({ config_.roi_x, config_.roi_y, config_.roi_width, config_.roi_height, 1.0f });
+	completed_request->post_process_metadata.Set("roi.regions", roi_regions);
+
 	return false;
 }
 
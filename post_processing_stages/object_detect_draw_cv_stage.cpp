@@ -32,9 +32,14 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	void drawDetections(Mat &image, std::vector<Detection> const &detections, Scalar const &colour);
+
 	Stream *stream_;
 	int line_thickness_;
 	double font_size_;
+	bool overlay_;
+	std::string overlay_signature_;
+	Mat overlay_canvas_;
 };
 
 #define NAME "object_detect_draw_cv"
@@ -47,30 +52,27 @@ char const *ObjectDetectDrawCvStage::Name() const
 void ObjectDetectDrawCvStage::Configure()
 {
 	stream_ = app_->GetMainStream();
+	// The resolution is fixed from here on, so the overlay canvas can be
+	// allocated up front rather than on the first frame.
+	if (stream_ && overlay_)
+	{
+		StreamInfo info = app_->GetStreamInfo(stream_);
+		overlay_canvas_.create(info.height, info.width, CV_8UC4);
+	}
 }
 
 void ObjectDetectDrawCvStage::Read(boost::property_tree::ptree const &params)
 {
 	line_thickness_ = params.get<int>("line_thickness", 1);
 	font_size_ = params.get<double>("font_size", 1.0);
+	// With "overlay" the boxes are composited by the display rather than
+	// burned into the recorded stream.
+	overlay_ = params.get<bool>("overlay", false);
 }
 
-bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
+void ObjectDetectDrawCvStage::drawDetections(Mat &image, std::vector<Detection> const &detections,
+											 Scalar const &colour)
 {
-	if (!stream_)
-		return false;
-
-	BufferWriteSync w(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = w.Get()[0];
-	uint32_t *ptr = (uint32_t *)buffer.data();
-	StreamInfo info = app_->GetStreamInfo(stream_);
-
-	std::vector<Detection> detections;
-
-	completed_request->post_process_metadata.Get("object_detect.results", detections);
-
-	Mat image(info.height, info.width, CV_8U, ptr, info.stride);
-	Scalar colour = Scalar(255, 255, 255);
 	int font = FONT_HERSHEY_SIMPLEX;
 
 	for (auto &detection : detections)
@@ -85,6 +87,48 @@ bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
 		Point text_origin(detection.box.x + 5, detection.box.y + size.height + 5);
 		putText(image, text, text_origin, font, font_size_, colour, 2);
 	}
+}
+
+bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	StreamInfo info = app_->GetStreamInfo(stream_);
+
+	std::vector<Detection> detections;
+
+	completed_request->post_process_metadata.Get("object_detect.results", detections);
+
+	if (overlay_)
+	{
+		// Detections typically persist across several frames, so only
+		// re-render the overlay when they actually change.
+		std::stringstream signature;
+		for (auto &detection : detections)
+			signature << detection.toString() << ";";
+		if (signature.str() != overlay_signature_)
+		{
+			overlay_canvas_.setTo(Scalar(0, 0, 0, 0));
+			drawDetections(overlay_canvas_, detections, Scalar(255, 255, 255, 255));
+			if (app_->SetPreviewOverlay(overlay_canvas_.data, info.width, info.height, overlay_canvas_.step))
+				overlay_signature_ = signature.str();
+			else
+			{
+				LOG(1, "ObjectDetectDrawCvStage: preview can't composite overlays, drawing into the image");
+				overlay_ = false;
+			}
+		}
+		if (overlay_)
+			return false;
+	}
+
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	uint32_t *ptr = (uint32_t *)buffer.data();
+
+	Mat image(info.height, info.width, CV_8U, ptr, info.stride);
+	drawDetections(image, detections, Scalar(255, 255, 255));
 
 	return false;
 }
@@ -5,6 +5,8 @@
  * object_detect_tf_stage.cpp - object detector
  */
 
+#include "encoder/encoder.hpp"
+
 #include "object_detect.hpp"
 #include "tf_stage.hpp"
 
@@ -95,6 +97,17 @@ void ObjectDetectTfStage::checkConfiguration()
 void ObjectDetectTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
 	completed_request->post_process_metadata.Set("object_detect.results", output_results_);
+
+	// Also rate the detection boxes as regions of interest for the encoder,
+	// weighted by confidence. The boxes are in main stream pixels, so scale
+	// them back to fractions of the frame.
+	std::vector<RegionOfInterest> regions;
+	for (auto const &detection : output_results_)
+		regions.push_back({ (float)detection.box.x / main_stream_info_.width,
+							(float)detection.box.y / main_stream_info_.height,
+							(float)detection.box.width / main_stream_info_.width,
+							(float)detection.box.height / main_stream_info_.height, detection.confidence });
+	completed_request->post_process_metadata.Set("roi.regions", regions);
 }
 
 static unsigned int area(const Rectangle &r)
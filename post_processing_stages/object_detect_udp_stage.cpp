@@ -11,6 +11,7 @@
 
 #include "object_detect.hpp"
 
+#include <chrono>
 #include <string>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -27,6 +28,11 @@ using Stream = libcamera::Stream;
 
 // Define the start delimiter for our binary protocol
 constexpr static uint32_t START_DELIMITER = 0xDDCCBBAA; // little-endian representation of 0xAA, 0xBB, 0xCC, 0xDD
+// Magic number for the batched binary format ("BDET" little-endian).
+constexpr static uint32_t BATCH_MAGIC = 0x54454442;
+constexpr static uint8_t BATCH_VERSION = 1;
+// Stay safely under the maximum UDP payload.
+constexpr static size_t MAX_DATAGRAM_SIZE = 60000;
 #define UDP_IP_DEFAULT false
 #define UDP_IP "127.0.0.1"
 #define UDP_PORT 12347
@@ -41,17 +47,30 @@ public:
 	void Read(boost::property_tree::ptree const &params) override;
 
 	void Configure() override;
-	
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	void Stop() override;
+
 	virtual ~ObjectDetectUDPStage() override;
-	
+
 private:
+	void serializeFrame(uint64_t sequence, const std::vector<Detection> &detections);
+	void flush();
+
 	Stream *stream_;
 	std::string udp_broadcast_address = "127.0.0.1";
 	u_int16_t udp_broadcast_port = 12345;
 	int sockfd_;
 	struct sockaddr_in servaddr_;
+
+	// Batched binary mode state.
+	bool batch_mode_;
+	unsigned int batch_frames_;
+	unsigned int flush_ms_;
+	std::vector<uint8_t> send_buffer_;
+	unsigned int buffered_frames_ = 0;
+	std::chrono::steady_clock::time_point first_buffered_;
 };
 
 #define NAME "object_detect_udp"
@@ -106,12 +125,22 @@ void ObjectDetectUDPStage::Read(boost::property_tree::ptree const &params)
 {
 	udp_broadcast_address = params.get<std::string>("ip", UDP_IP);
 	udp_broadcast_port = params.get<u_int16_t>("port", UDP_PORT);
+
+	// "batched" selects the compact binary format with several frames per
+	// datagram; the default remains the original one-datagram-per-detection
+	// format for existing consumers.
+	batch_mode_ = params.get<std::string>("format", "legacy") == "batched";
+	batch_frames_ = std::min(params.get<unsigned int>("batch_frames", 4), 255u); // count is a u8 on the wire
+	flush_ms_ = params.get<unsigned int>("flush_ms", 50);
+
+	if (batch_mode_)
+		send_buffer_.reserve(MAX_DATAGRAM_SIZE);
 }
 
 template <typename T>
-void append(std::vector<char> &buffer, const T &value)
+void append(std::vector<uint8_t> &buffer, const T &value)
 {
-	const char *raw = reinterpret_cast<const char *>(&value);
+	const uint8_t *raw = reinterpret_cast<const uint8_t *>(&value);
 	buffer.insert(buffer.end(), raw, raw + sizeof(T));
 }
 
@@ -126,15 +155,24 @@ bool ObjectDetectUDPStage::Process(CompletedRequestPtr &completed_request)
 	if (sockfd_ == -1)
 		return false;
 
+	if (batch_mode_)
+	{
+		serializeFrame(completed_request->sequence, detections);
+
+		// Flush on frame count, on deadline, or if the next frame might not fit.
+		auto age = std::chrono::steady_clock::now() - first_buffered_;
+		if (buffered_frames_ >= batch_frames_ ||
+			age >= std::chrono::milliseconds(flush_ms_) ||
+			send_buffer_.size() > MAX_DATAGRAM_SIZE - 10000)
+			flush();
+
+		return false;
+	}
+
 	for (auto &detection : detections)
 	{
-		// Draw rectangle and text on the image
-		std::stringstream text_stream;
-		text_stream << detection.name << " " << (int)(detection.confidence * 100) << "%";
-		std::string text = text_stream.str();
-		
 		// Use a vector to dynamically build the binary message
-		std::vector<char> udp_data_buffer;
+		std::vector<uint8_t> udp_data_buffer;
 
 		// 1. Add start delimiter (4 bytes)
 		append(udp_data_buffer, START_DELIMITER);
@@ -173,6 +211,62 @@ bool ObjectDetectUDPStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
+// Batched binary datagram layout (all fields little-endian, no padding):
+//   u32 magic "BDET", u8 version, u8 frame count
+//   per frame: u64 frame sequence, u16 detection count
+//     per detection: u32 category, f32 confidence, i32 x, y, width, height,
+//                    u8 name length, name bytes (no terminator)
+void ObjectDetectUDPStage::serializeFrame(uint64_t sequence, const std::vector<Detection> &detections)
+{
+	if (send_buffer_.empty())
+	{
+		append(send_buffer_, BATCH_MAGIC);
+		send_buffer_.push_back(BATCH_VERSION);
+		send_buffer_.push_back(0); // frame count, filled in as frames are added
+		first_buffered_ = std::chrono::steady_clock::now();
+	}
+
+	append(send_buffer_, sequence);
+	append(send_buffer_, (uint16_t)std::min<size_t>(detections.size(), UINT16_MAX));
+
+	for (auto const &detection : detections)
+	{
+		append(send_buffer_, (uint32_t)detection.category);
+		append(send_buffer_, detection.confidence);
+		append(send_buffer_, (int32_t)detection.box.x);
+		append(send_buffer_, (int32_t)detection.box.y);
+		append(send_buffer_, (int32_t)detection.box.width);
+		append(send_buffer_, (int32_t)detection.box.height);
+
+		const uint8_t name_len = std::min<size_t>(detection.name.size(), UINT8_MAX);
+		send_buffer_.push_back(name_len);
+		send_buffer_.insert(send_buffer_.end(), detection.name.begin(), detection.name.begin() + name_len);
+	}
+
+	send_buffer_[5] = ++buffered_frames_;
+}
+
+void ObjectDetectUDPStage::flush()
+{
+	if (send_buffer_.empty())
+		return;
+
+	const ssize_t bytes_sent = sendto(sockfd_, send_buffer_.data(), send_buffer_.size(), 0,
+									  (const struct sockaddr *)&servaddr_, sizeof(servaddr_));
+	if (bytes_sent < 0)
+		perror("Failed to send UDP message");
+
+	// clear() keeps the reserved capacity, so steady state does not reallocate.
+	send_buffer_.clear();
+	buffered_frames_ = 0;
+}
+
+void ObjectDetectUDPStage::Stop()
+{
+	if (batch_mode_ && sockfd_ != -1)
+		flush();
+}
+
 static PostProcessingStage *Create(RPiCamApp *app)
 {
 	return new ObjectDetectUDPStage(app);
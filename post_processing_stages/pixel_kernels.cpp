@@ -0,0 +1,242 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * pixel_kernels.cpp - shared vectorized pixel kernels for post-processing stages.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "pixel_kernels.hpp"
+
+namespace PixelKernels
+{
+
+void AccumulateU8(int16_t *acc, uint8_t const *src, unsigned int len, int bias)
+{
+	unsigned int i = 0;
+#if defined(__ARM_NEON)
+	int16x8_t bias16 = vdupq_n_s16(bias);
+	for (; i + 8 <= len; i += 8)
+	{
+		int16x8_t s = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(src + i)));
+		vst1q_s16(acc + i, vaddq_s16(vld1q_s16(acc + i), vsubq_s16(s, bias16)));
+	}
+#endif
+	for (; i < len; i++)
+		acc[i] += src[i] - bias;
+}
+
+unsigned int CountAbsDiffExceedingQ8(uint8_t *prev, uint8_t const *cur, unsigned int len, uint16_t m_q8, uint8_t c)
+{
+	unsigned int count = 0, i = 0;
+#if defined(__ARM_NEON)
+	uint32x4_t count4 = vdupq_n_u32(0);
+	uint16x8_t c16 = vdupq_n_u16(c);
+	for (; i + 16 <= len; i += 16)
+	{
+		uint8x16_t new8 = vld1q_u8(cur + i), old8 = vld1q_u8(prev + i);
+		vst1q_u8(prev + i, new8);
+		uint8x16_t diff8 = vabdq_u8(new8, old8);
+		uint16x8_t old_lo = vmovl_u8(vget_low_u8(old8)), old_hi = vmovl_u8(vget_high_u8(old8));
+		uint16x8_t thresh_lo = vaddq_u16(vshrq_n_u16(vmulq_n_u16(old_lo, m_q8), 8), c16);
+		uint16x8_t thresh_hi = vaddq_u16(vshrq_n_u16(vmulq_n_u16(old_hi, m_q8), 8), c16);
+		uint16x8_t gt_lo = vcgtq_u16(vmovl_u8(vget_low_u8(diff8)), thresh_lo);
+		uint16x8_t gt_hi = vcgtq_u16(vmovl_u8(vget_high_u8(diff8)), thresh_hi);
+		// Comparison lanes are 0 or 0xffff; shift down to 0 or 1 and accumulate.
+		count4 = vpadalq_u16(count4, vshrq_n_u16(gt_lo, 15));
+		count4 = vpadalq_u16(count4, vshrq_n_u16(gt_hi, 15));
+	}
+	uint32x2_t sum2 = vadd_u32(vget_low_u32(count4), vget_high_u32(count4));
+	count += vget_lane_u32(vpadd_u32(sum2, sum2), 0);
+#endif
+	for (; i < len; i++)
+	{
+		int new_value = cur[i], old_value = prev[i];
+		prev[i] = new_value;
+		count += std::abs(new_value - old_value) > ((old_value * m_q8) >> 8) + c;
+	}
+	return count;
+}
+
+void ScaleQ8S16(int16_t *data, unsigned int len, int16_t factor_q8)
+{
+	unsigned int i = 0;
+#if defined(__ARM_NEON)
+	for (; i + 8 <= len; i += 8)
+	{
+		int16x8_t p = vld1q_s16(data + i);
+		int16x4_t lo = vshrn_n_s32(vmull_n_s16(vget_low_s16(p), factor_q8), 8);
+		int16x4_t hi = vshrn_n_s32(vmull_n_s16(vget_high_s16(p), factor_q8), 8);
+		vst1q_s16(data + i, vcombine_s16(lo, hi));
+	}
+#endif
+	for (; i < len; i++)
+		data[i] = (data[i] * factor_q8) >> 8;
+}
+
+void AccumulateHistogramS16(uint32_t *bins, int num_bins, int16_t const *src, unsigned int len)
+{
+	// Four interleaved sets of bins so that consecutive pixels with the same
+	// value don't serialise on a store-to-load dependency. The extra sets are
+	// thread-local so frame-rate callers (the HDR stage) don't allocate.
+	thread_local std::vector<uint32_t> scratch;
+	scratch.assign(3 * num_bins, 0);
+	uint32_t *b0 = bins, *b1 = &scratch[0], *b2 = b1 + num_bins, *b3 = b2 + num_bins;
+	unsigned int i = 0;
+	for (; i + 4 <= len; i += 4)
+	{
+		b0[src[i]]++;
+		b1[src[i + 1]]++;
+		b2[src[i + 2]]++;
+		b3[src[i + 3]]++;
+	}
+	for (; i < len; i++)
+		b0[src[i]]++;
+	// The binning itself can't vectorise (scattered stores), but the final
+	// merge of the lanes can.
+	int v = 0;
+#if defined(__ARM_NEON)
+	for (; v + 4 <= num_bins; v += 4)
+	{
+		uint32x4_t sum = vaddq_u32(vld1q_u32(b1 + v), vld1q_u32(b2 + v));
+		sum = vaddq_u32(sum, vld1q_u32(b3 + v));
+		vst1q_u32(b0 + v, vaddq_u32(vld1q_u32(b0 + v), sum));
+	}
+#endif
+	for (; v < num_bins; v++)
+		b0[v] += b1[v] + b2[v] + b3[v];
+}
+
+uint32_t SumAbsHorizDiffU8(uint8_t const *src, unsigned int len)
+{
+	if (len < 2)
+		return 0;
+	uint32_t sum = 0;
+	unsigned int i = 0;
+#if defined(__ARM_NEON)
+	uint32x4_t sum4 = vdupq_n_u32(0);
+	for (; i + 17 <= len; i += 16)
+	{
+		// The two loads overlap by one sample, giving each lane its right-hand
+		// neighbour's value.
+		uint8x16_t a = vld1q_u8(src + i), b = vld1q_u8(src + i + 1);
+		sum4 = vpadalq_u16(sum4, vpaddlq_u8(vabdq_u8(a, b)));
+	}
+	uint32x2_t sum2 = vadd_u32(vget_low_u32(sum4), vget_high_u32(sum4));
+	sum += vget_lane_u32(vpadd_u32(sum2, sum2), 0);
+#endif
+	for (; i + 1 < len; i++)
+		sum += std::abs(src[i + 1] - src[i]);
+	return sum;
+}
+
+// The conversion coefficients in Q6 fixed point: R = Y + 1.402 V,
+// G = Y - 0.345 U - 0.714 V, B = Y + 1.771 U (U and V centred on 128).
+static constexpr int RV_Q6 = 90, GU_Q6 = 22, GV_Q6 = 46, BU_Q6 = 113;
+
+void Yuv420RowToRgb(uint8_t *dst, uint8_t const *src_y, uint8_t const *src_u, uint8_t const *src_v, unsigned int width)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t c128 = vdupq_n_s16(128);
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16_t y16 = vld1q_u8(src_y + x);
+		// Duplicate each chroma sample across its two pixels.
+		uint8x8x2_t uz = vzip_u8(vld1_u8(src_u + x / 2), vld1_u8(src_u + x / 2));
+		uint8x8x2_t vz = vzip_u8(vld1_u8(src_v + x / 2), vld1_u8(src_v + x / 2));
+		int16x8_t y_lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y16)));
+		int16x8_t y_hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y16)));
+		int16x8_t u_lo = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uz.val[0])), c128);
+		int16x8_t u_hi = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uz.val[1])), c128);
+		int16x8_t v_lo = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vz.val[0])), c128);
+		int16x8_t v_hi = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vz.val[1])), c128);
+
+		int16x8_t r_lo = vaddq_s16(y_lo, vshrq_n_s16(vmulq_n_s16(v_lo, RV_Q6), 6));
+		int16x8_t r_hi = vaddq_s16(y_hi, vshrq_n_s16(vmulq_n_s16(v_hi, RV_Q6), 6));
+		int16x8_t g_lo = vsubq_s16(
+			y_lo, vshrq_n_s16(vaddq_s16(vmulq_n_s16(u_lo, GU_Q6), vmulq_n_s16(v_lo, GV_Q6)), 6));
+		int16x8_t g_hi = vsubq_s16(
+			y_hi, vshrq_n_s16(vaddq_s16(vmulq_n_s16(u_hi, GU_Q6), vmulq_n_s16(v_hi, GV_Q6)), 6));
+		int16x8_t b_lo = vaddq_s16(y_lo, vshrq_n_s16(vmulq_n_s16(u_lo, BU_Q6), 6));
+		int16x8_t b_hi = vaddq_s16(y_hi, vshrq_n_s16(vmulq_n_s16(u_hi, BU_Q6), 6));
+
+		// The saturating narrows do the clamping to [0, 255] for us.
+		uint8x16x3_t rgb;
+		rgb.val[0] = vcombine_u8(vqmovun_s16(r_lo), vqmovun_s16(r_hi));
+		rgb.val[1] = vcombine_u8(vqmovun_s16(g_lo), vqmovun_s16(g_hi));
+		rgb.val[2] = vcombine_u8(vqmovun_s16(b_lo), vqmovun_s16(b_hi));
+		vst3q_u8(dst + 3 * x, rgb);
+	}
+#endif
+	for (; x < width; x++)
+	{
+		int Y = src_y[x], U = src_u[x / 2] - 128, V = src_v[x / 2] - 128;
+		int R = Y + ((RV_Q6 * V) >> 6);
+		int G = Y - ((GU_Q6 * U + GV_Q6 * V) >> 6);
+		int B = Y + ((BU_Q6 * U) >> 6);
+		dst[3 * x] = std::clamp(R, 0, 255);
+		dst[3 * x + 1] = std::clamp(G, 0, 255);
+		dst[3 * x + 2] = std::clamp(B, 0, 255);
+	}
+}
+
+void Yuv420RowPairToRgb(uint8_t *dst0, uint8_t *dst1, uint8_t const *src_y0, uint8_t const *src_y1,
+						uint8_t const *src_u, uint8_t const *src_v, unsigned int width)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t c128 = vdupq_n_s16(128);
+	for (; x + 16 <= width; x += 16)
+	{
+		// All the chroma work - load, duplicate across the pixel pairs, widen,
+		// multiply out the contributions - happens once for the two rows.
+		uint8x8x2_t uz = vzip_u8(vld1_u8(src_u + x / 2), vld1_u8(src_u + x / 2));
+		uint8x8x2_t vz = vzip_u8(vld1_u8(src_v + x / 2), vld1_u8(src_v + x / 2));
+		int16x8_t u_lo = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uz.val[0])), c128);
+		int16x8_t u_hi = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uz.val[1])), c128);
+		int16x8_t v_lo = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vz.val[0])), c128);
+		int16x8_t v_hi = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vz.val[1])), c128);
+
+		int16x8_t r_off_lo = vshrq_n_s16(vmulq_n_s16(v_lo, RV_Q6), 6);
+		int16x8_t r_off_hi = vshrq_n_s16(vmulq_n_s16(v_hi, RV_Q6), 6);
+		int16x8_t g_off_lo = vshrq_n_s16(vaddq_s16(vmulq_n_s16(u_lo, GU_Q6), vmulq_n_s16(v_lo, GV_Q6)), 6);
+		int16x8_t g_off_hi = vshrq_n_s16(vaddq_s16(vmulq_n_s16(u_hi, GU_Q6), vmulq_n_s16(v_hi, GV_Q6)), 6);
+		int16x8_t b_off_lo = vshrq_n_s16(vmulq_n_s16(u_lo, BU_Q6), 6);
+		int16x8_t b_off_hi = vshrq_n_s16(vmulq_n_s16(u_hi, BU_Q6), 6);
+
+		auto convert_row = [&](uint8_t *dst, uint8_t const *src_y) {
+			uint8x16_t y16 = vld1q_u8(src_y + x);
+			int16x8_t y_lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y16)));
+			int16x8_t y_hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y16)));
+			uint8x16x3_t rgb;
+			rgb.val[0] = vcombine_u8(vqmovun_s16(vaddq_s16(y_lo, r_off_lo)), vqmovun_s16(vaddq_s16(y_hi, r_off_hi)));
+			rgb.val[1] = vcombine_u8(vqmovun_s16(vsubq_s16(y_lo, g_off_lo)), vqmovun_s16(vsubq_s16(y_hi, g_off_hi)));
+			rgb.val[2] = vcombine_u8(vqmovun_s16(vaddq_s16(y_lo, b_off_lo)), vqmovun_s16(vaddq_s16(y_hi, b_off_hi)));
+			vst3q_u8(dst + 3 * x, rgb);
+		};
+		convert_row(dst0, src_y0);
+		convert_row(dst1, src_y1);
+	}
+#endif
+	for (; x < width; x++)
+	{
+		int U = src_u[x / 2] - 128, V = src_v[x / 2] - 128;
+		int r_off = (RV_Q6 * V) >> 6, g_off = (GU_Q6 * U + GV_Q6 * V) >> 6, b_off = (BU_Q6 * U) >> 6;
+		dst0[3 * x] = std::clamp(src_y0[x] + r_off, 0, 255);
+		dst0[3 * x + 1] = std::clamp(src_y0[x] - g_off, 0, 255);
+		dst0[3 * x + 2] = std::clamp(src_y0[x] + b_off, 0, 255);
+		dst1[3 * x] = std::clamp(src_y1[x] + r_off, 0, 255);
+		dst1[3 * x + 1] = std::clamp(src_y1[x] - g_off, 0, 255);
+		dst1[3 * x + 2] = std::clamp(src_y1[x] + b_off, 0, 255);
+	}
+}
+
+} // namespace PixelKernels
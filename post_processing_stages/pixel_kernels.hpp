@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * pixel_kernels.hpp - shared vectorized pixel kernels for post-processing stages.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// Small library of row-level pixel primitives shared by the post-processing
+// stages, so that each stage doesn't have to re-implement its own inner loops.
+// On Arm the kernels use NEON explicitly (so we don't depend on
+// "-ftree-vectorize"); elsewhere they fall back to equivalent scalar code.
+// The dispatch is a compile-time decision - the instruction set is fixed when
+// the application is built, so there is nothing to probe for at runtime.
+//
+// The fixed point variants (Q6/Q8) match their floating point equivalents to
+// within one grey level, which is plenty for 8-bit pixels.
+
+namespace PixelKernels
+{
+
+// acc[i] += src[i] - bias, for len samples. The bias is applied to centre
+// chroma samples; pass 0 for luma.
+void AccumulateU8(int16_t *acc, uint8_t const *src, unsigned int len, int bias = 0);
+
+// Count the samples where |cur[i] - prev[i]| > ((prev[i] * m_q8) >> 8) + c,
+// copying cur into prev as it goes. This is the motion detector's fused
+// compare-and-update primitive; m_q8 is the threshold slope in Q8 fixed point.
+unsigned int CountAbsDiffExceedingQ8(uint8_t *prev, uint8_t const *cur, unsigned int len, uint16_t m_q8, uint8_t c);
+
+// data[i] = (data[i] * factor_q8) >> 8, for len samples.
+void ScaleQ8S16(int16_t *data, unsigned int len, int16_t factor_q8);
+
+// Add len samples into bins. Every sample must lie in [0, num_bins). Histogram
+// accumulation doesn't vectorize, but the implementation interleaves several
+// sets of bins so that runs of equal-valued pixels don't serialise on a
+// store-to-load dependency.
+void AccumulateHistogramS16(uint32_t *bins, int num_bins, int16_t const *src, unsigned int len);
+
+// Sum of |src[i + 1] - src[i]| over a row of len samples: the horizontal
+// gradient energy, which serves as a cheap focus/sharpness measure.
+uint32_t SumAbsHorizDiffU8(uint8_t const *src, unsigned int len);
+
+// Convert one row of YUV420 to interleaved RGB. The chroma rows are
+// horizontally subsampled by two, so chroma sample i covers pixels 2i and
+// 2i + 1; for the two image rows sharing a chroma row, call this twice with
+// the same src_u/src_v pointers.
+void Yuv420RowToRgb(uint8_t *dst, uint8_t const *src_y, uint8_t const *src_u, uint8_t const *src_v,
+					unsigned int width);
+
+// As Yuv420RowToRgb, but for both image rows sharing one chroma row at once:
+// the chroma terms are loaded, widened and multiplied once and applied to both
+// luma rows, saving half the chroma work of two single-row calls.
+void Yuv420RowPairToRgb(uint8_t *dst0, uint8_t *dst1, uint8_t const *src_y0, uint8_t const *src_y1,
+						uint8_t const *src_u, uint8_t const *src_v, unsigned int width);
+
+} // namespace PixelKernels
@@ -62,10 +62,12 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	void drawFeatures(cv::Mat &img, std::vector<Point> locations, std::vector<float> confidences);
+	void drawFeatures(cv::Mat &img, std::vector<Point> const &locations, std::vector<float> const &confidences);
 
 	Stream *stream_;
 	float confidence_threshold_;
+	// Scratch for Process(), so drawing is allocation-free per frame.
+	std::vector<Point> cv_locations_;
 };
 
 #define NAME "plot_pose_cv"
@@ -103,28 +105,27 @@ bool PlotPoseCvStage::Process(CompletedRequestPtr &completed_request)
 	unsigned int i = 0;
 	for (auto const &loc : lib_locations)
 	{
-		std::vector<cv::Rect> rects;
-		std::vector<Point> cv_locations;
-
 		std::vector<float> &conf = confidences[i];
 
 		if (!conf.empty() && !loc.empty())
 		{
 			Mat image(info.height, info.width, CV_8U, ptr, info.stride);
+			cv_locations_.clear();
 			for (libcamera::Point lib_location : loc)
 			{
 				Point cv_location;
 				cv_location.x = lib_location.x;
 				cv_location.y = lib_location.y;
-				cv_locations.push_back(cv_location);
+				cv_locations_.push_back(cv_location);
 			}
-			drawFeatures(image, cv_locations, conf);
+			drawFeatures(image, cv_locations_, conf);
 		}
 	}
 	return false;
 }
 
-void PlotPoseCvStage::drawFeatures(Mat &img, std::vector<cv::Point> locations, std::vector<float> confidences)
+void PlotPoseCvStage::drawFeatures(Mat &img, std::vector<cv::Point> const &locations,
+								   std::vector<float> const &confidences)
 {
 	Scalar colour = Scalar(255, 255, 255);
 	int radius = 5;
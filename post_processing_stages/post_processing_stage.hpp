@@ -9,6 +9,7 @@
 
 #include <chrono>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -23,6 +24,7 @@
 
 namespace libcamera
 {
+class Stream;
 struct StreamConfiguration;
 }
 
@@ -61,6 +63,20 @@ public:
 	static std::vector<uint8_t> Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
 	static void Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
 
+	// As above, but dispatching on the source format: when the stream already
+	// carries RGB (because the ISP was asked to produce it - see AdjustConfig
+	// with the "lores" use case) this is just a centre crop and copy, otherwise
+	// the YUV420 conversion runs as before.
+	static void ToRgb(uint8_t *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
+
+	// Return the stream's image for this request converted to RGB at the size
+	// given by dst_info (cropping as per Yuv420ToRgb). The conversion is cached
+	// on the request, keyed on the stream and output size, so stages chained in
+	// a pipeline share a single conversion, and the backing buffers are pooled
+	// to avoid a per-frame allocation.
+	std::shared_ptr<std::vector<uint8_t> const> CachedRgb(CompletedRequestPtr const &completed_request,
+														  libcamera::Stream *stream, StreamInfo &dst_info);
+
 protected:
 	// Helper to calculate the execution time of any callable object and return it in as a std::chrono::duration.
 	// For functions returning a value, the simplest thing would be to wrap the call in a lambda and capture
@@ -85,6 +85,33 @@ public:
 			lut[x] = Eval(x, &span);
 		return lut;
 	}
+	// A function "compiled" to a fixed-size table over the integer domain
+	// [0, size), so evaluating it in a per-pixel loop is a single indexed load
+	// with no interval search. Build these once in Read()/Configure(), not per
+	// frame. Values outside the function's domain evaluate to the nearest
+	// domain endpoint.
+	template <typename T> class Lut
+	{
+	public:
+		Lut() {}
+		Lut(Pwl const &pwl, unsigned int size) : lut_(size)
+		{
+			Interval domain = pwl.Domain();
+			int span = 0;
+			for (unsigned int x = 0; x < size; x++)
+				lut_[x] = pwl.Eval(domain.Clip(x), &span);
+		}
+		T operator[](unsigned int x) const { return lut_[x]; }
+		unsigned int Size() const { return lut_.size(); }
+		bool Empty() const { return lut_.empty(); }
+	private:
+		std::vector<T> lut_;
+	};
+	// Compile the function; by default the table just covers its domain.
+	template <typename T> Lut<T> Compile(unsigned int size = 0) const
+	{
+		return Lut<T>(*this, size ? size : Domain().end + 1);
+	}
 	Pwl &operator*=(double d);
 	void Debug(FILE *fp = stderr) const;
 
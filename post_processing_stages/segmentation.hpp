@@ -11,14 +11,60 @@
 #include <string>
 #include <vector>
 
+// The mask is carried run-length encoded: each run gives a label and the
+// number of consecutive pixels carrying it, scanning rows left to right, top
+// to bottom. Masks are overwhelmingly made of long single-label runs, so this
+// is far smaller (and cheaper to copy into and out of the metadata) than the
+// full width * height label image.
+
 struct Segmentation
 {
-	Segmentation(int w, int h, std::vector<std::string> l, const std::vector<uint8_t> &s)
-		: width(w), height(h), labels(l), segmentation(s)
+	struct Run
+	{
+		uint8_t label;
+		uint32_t length;
+	};
+
+	Segmentation(int w, int h, std::vector<std::string> l, std::vector<Run> r)
+		: width(w), height(h), labels(std::move(l)), runs(std::move(r))
+	{
+	}
+
+	// Iterate the mask one pixel's label at a time without decompressing it.
+	class const_iterator
 	{
+	public:
+		const_iterator(std::vector<Run> const &runs, size_t index) : runs_(&runs), index_(index), pos_(0) {}
+		uint8_t operator*() const { return (*runs_)[index_].label; }
+		const_iterator &operator++()
+		{
+			if (++pos_ == (*runs_)[index_].length)
+				index_++, pos_ = 0;
+			return *this;
+		}
+		bool operator==(const_iterator const &other) const { return index_ == other.index_ && pos_ == other.pos_; }
+		bool operator!=(const_iterator const &other) const { return !(*this == other); }
+
+	private:
+		std::vector<Run> const *runs_;
+		size_t index_;
+		uint32_t pos_;
+	};
+	const_iterator begin() const { return const_iterator(runs, 0); }
+	const_iterator end() const { return const_iterator(runs, runs.size()); }
+
+	// Decompress to the full per-pixel label image, for consumers that want it.
+	std::vector<uint8_t> Decode() const
+	{
+		std::vector<uint8_t> image;
+		image.reserve((size_t)width * height);
+		for (auto const &run : runs)
+			image.insert(image.end(), run.length, run.label);
+		return image;
 	}
+
 	int width;
 	int height;
 	std::vector<std::string> labels;
-	std::vector<uint8_t> segmentation;
+	std::vector<Run> runs;
 };
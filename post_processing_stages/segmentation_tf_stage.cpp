@@ -24,7 +24,7 @@ struct SegmentationTfConfig : public TfConfig
 class SegmentationTfStage : public TfStage
 {
 public:
-	SegmentationTfStage(RPiCamApp *app) : TfStage(app, WIDTH, HEIGHT), segmentation_(WIDTH * HEIGHT)
+	SegmentationTfStage(RPiCamApp *app) : TfStage(app, WIDTH, HEIGHT)
 	{
 		config_ = std::make_unique<SegmentationTfConfig>();
 	}
@@ -47,7 +47,7 @@ protected:
 
 private:
 	std::vector<std::string> labels_;
-	std::vector<uint8_t> segmentation_;
+	std::vector<Segmentation::Run> runs_; // the mask, run-length encoded
 };
 
 void SegmentationTfStage::readLabelsFile(const std::string &file_name)
@@ -83,12 +83,14 @@ void SegmentationTfStage::checkConfiguration()
 
 void SegmentationTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
-	// Store the segmentation in image metadata.
+	// Store the segmentation in image metadata. The RLE runs are a small
+	// fraction of the full label image, so this copy is now cheap.
 	completed_request->post_process_metadata.Set("segmentation.result",
-												Segmentation(WIDTH, HEIGHT, labels_, segmentation_));
+												Segmentation(WIDTH, HEIGHT, labels_, runs_));
 
-	// Optionally, draw the segmentation in the bottom right corner of the main image.
-	if (!config()->draw)
+	// Optionally, draw the segmentation in the bottom right corner of the main
+	// image. There's no mask to paint until the first inference has completed.
+	if (!config()->draw || runs_.empty())
 		return;
 
 	BufferWriteSync w(app_, completed_request->buffers[main_stream_]);
@@ -97,12 +99,23 @@ void SegmentationTfStage::applyResults(CompletedRequestPtr &completed_request)
 	int x_offset = main_stream_info_.width - WIDTH;
 	int scale = 255 / labels_.size();
 
+	// Paint the runs directly; each one becomes (part of) a memset.
+	size_t run_idx = 0;
+	uint32_t consumed = 0;
 	for (int y = 0; y < HEIGHT; y++)
 	{
-		uint8_t *src = &segmentation_[y * WIDTH];
 		uint8_t *dst = buffer.data() + (y + y_offset) * main_stream_info_.stride + x_offset;
-		for (int x = 0; x < WIDTH; x++)
-			*(dst++) = scale * *(src++);
+		int x = 0;
+		while (x < WIDTH)
+		{
+			Segmentation::Run const &run = runs_[run_idx];
+			int n = std::min<uint32_t>(run.length - consumed, WIDTH - x);
+			memset(dst + x, scale * run.label, n);
+			x += n;
+			consumed += n;
+			if (consumed == run.length)
+				run_idx++, consumed = 0;
+		}
 	}
 
 	// Also make it greyscale.
@@ -122,20 +135,24 @@ void SegmentationTfStage::applyResults(CompletedRequestPtr &completed_request)
 void SegmentationTfStage::interpretOutputs()
 {
 	float *output = interpreter_->tensor(interpreter_->outputs()[0])->data.f;
-	uint8_t *seg_ptr = &segmentation_[0];
 	int num_categories = labels_.size();
 	std::vector<std::pair<size_t, int>> hist(num_categories);
 	std::generate(hist.begin(), hist.end(), [i = 0]() mutable { return std::pair<size_t, int>(0, i++); });
 
-	// Extract the segmentation from the output tensor. Also accumulate a histogram.
+	// Extract the segmentation from the output tensor, run-length encoding it
+	// as we scan. Also accumulate a histogram.
 
+	runs_.clear();
 	for (int y = 0; y < HEIGHT; y++)
 	{
 		for (int x = 0; x < WIDTH; x++, output += num_categories)
 		{
 			// For each pixel we get a "confidence" value for every category - pick the largest.
 			int index = std::max_element(output, output + num_categories) - output;
-			*(seg_ptr++) = index;
+			if (!runs_.empty() && runs_.back().label == index)
+				runs_.back().length++;
+			else
+				runs_.push_back({ (uint8_t)index, 1 });
 			hist[index].first++;
 		}
 	}
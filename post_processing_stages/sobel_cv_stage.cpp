@@ -2,21 +2,108 @@
 /*
  * Copyright (C) 2021, Raspberry Pi (Trading) Limited
  *
- * sobel_cv_stage.cpp - Sobel filter implementation, using OpenCV
+ * sobel_cv_stage.cpp - Sobel filter implementation
  */
 
+// This stage originally wrapped OpenCV's Sobel(), but for a fixed 3x3 kernel
+// over 8-bit luma a hand-written fixed-point version is several times faster
+// and loses the OpenCV dependency. The stage keeps its "sobel_cv" name so
+// existing post-processing files continue to work.
+//
+// The image is processed in place, one row at a time, with small ring buffers
+// holding the three in-flight rows of intermediate results: a [1 2 1]
+// horizontally-filtered copy of the source rows, and the 3x3 (Gaussian)
+// smoothed rows the gradients are computed from. Writing output row y only
+// needs source rows up to y + 2, so nothing is overwritten before it is read.
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <libcamera/stream.h>
 
 #include "core/rpicam_app.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
-#include "opencv2/core.hpp"
-#include "opencv2/imgproc.hpp"
+using Stream = libcamera::Stream;
 
-using namespace cv;
+// Horizontal [1 2 1] filter of one source row, edges replicated.
 
-using Stream = libcamera::Stream;
+static void hblur_row(uint8_t const *src, uint16_t *dest, unsigned int width)
+{
+	dest[0] = 3 * src[0] + src[1];
+	unsigned int x = 1;
+#if defined(__ARM_NEON)
+	for (; x + 8 <= width - 1; x += 8)
+	{
+		uint16x8_t sum = vaddl_u8(vld1_u8(src + x - 1), vld1_u8(src + x + 1));
+		sum = vaddq_u16(sum, vshlq_n_u16(vmovl_u8(vld1_u8(src + x)), 1));
+		vst1q_u16(dest + x, sum);
+	}
+#endif
+	for (; x < width - 1; x++)
+		dest[x] = src[x - 1] + 2 * src[x] + src[x + 1];
+	dest[width - 1] = src[width - 2] + 3 * src[width - 1];
+}
+
+// Vertical [1 2 1] over three horizontally-filtered rows, completing the 3x3
+// smoothing. dest must have one padding byte each side, which we fill by
+// replication so the gradient pass needs no edge special cases.
+
+static void vblur_row(uint16_t const *above, uint16_t const *row, uint16_t const *below, uint8_t *dest,
+					  unsigned int width)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 8 <= width; x += 8)
+	{
+		uint16x8_t sum = vaddq_u16(vld1q_u16(above + x), vld1q_u16(below + x));
+		sum = vaddq_u16(sum, vshlq_n_u16(vld1q_u16(row + x), 1));
+		vst1_u8(dest + x, vrshrn_n_u16(sum, 4));
+	}
+#endif
+	for (; x < width; x++)
+		dest[x] = (above[x] + 2 * row[x] + below[x] + 8) >> 4;
+	dest[-1] = dest[0];
+	dest[width] = dest[width - 1];
+}
+
+// One output row of |Gx|/2 + |Gy|/2 from three smoothed rows. Both gradients
+// are differences of two [1 2 1]-weighted sums, so the magnitudes come
+// straight from absolute differences of unsigned sums.
+
+static void sobel_row(uint8_t const *above, uint8_t const *row, uint8_t const *below, uint8_t *dest,
+					  unsigned int width)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 8 <= width; x += 8)
+	{
+		uint16x8_t top_l = vmovl_u8(vld1_u8(above + x - 1)), top_c = vmovl_u8(vld1_u8(above + x));
+		uint16x8_t top_r = vmovl_u8(vld1_u8(above + x + 1));
+		uint16x8_t mid_l = vmovl_u8(vld1_u8(row + x - 1)), mid_r = vmovl_u8(vld1_u8(row + x + 1));
+		uint16x8_t bot_l = vmovl_u8(vld1_u8(below + x - 1)), bot_c = vmovl_u8(vld1_u8(below + x));
+		uint16x8_t bot_r = vmovl_u8(vld1_u8(below + x + 1));
+
+		uint16x8_t left = vaddq_u16(vaddq_u16(top_l, bot_l), vshlq_n_u16(mid_l, 1));
+		uint16x8_t right = vaddq_u16(vaddq_u16(top_r, bot_r), vshlq_n_u16(mid_r, 1));
+		uint16x8_t top = vaddq_u16(vaddq_u16(top_l, top_r), vshlq_n_u16(top_c, 1));
+		uint16x8_t bottom = vaddq_u16(vaddq_u16(bot_l, bot_r), vshlq_n_u16(bot_c, 1));
+
+		uint16x8_t mag = vrhaddq_u16(vabdq_u16(right, left), vabdq_u16(bottom, top));
+		vst1_u8(dest + x, vqmovn_u16(mag));
+	}
+#endif
+	for (; x < width; x++)
+	{
+		int left = above[x - 1] + 2 * row[x - 1] + below[x - 1];
+		int right = above[x + 1] + 2 * row[x + 1] + below[x + 1];
+		int top = above[x - 1] + 2 * above[x] + above[x + 1];
+		int bottom = below[x - 1] + 2 * below[x] + below[x + 1];
+		dest[x] = std::min((std::abs(right - left) + std::abs(bottom - top) + 1) / 2, 255);
+	}
+}
 
 class SobelCvStage : public PostProcessingStage
 {
@@ -32,8 +119,13 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	uint8_t *blurRow(unsigned int y) { return &blur_rows_[y % 3][1]; }
+
 	Stream *stream_;
 	int ksize_ = 3;
+	// Ring buffers for the rows in flight, allocated once in Configure().
+	std::vector<uint16_t> hblur_rows_[3];
+	std::vector<uint8_t> blur_rows_[3]; // padded by one pixel each side
 };
 
 #define NAME "sobel_cv"
@@ -53,6 +145,16 @@ void SobelCvStage::Configure()
 	stream_ = app_->GetMainStream();
 	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("SobelCvStage: only YUV420 format supported");
+
+	if (ksize_ != 3)
+		LOG(1, "SobelCvStage: only ksize 3 is supported, ignoring " << ksize_);
+
+	StreamInfo info = app_->GetStreamInfo(stream_);
+	for (int i = 0; i < 3; i++)
+	{
+		hblur_rows_[i].resize(info.width);
+		blur_rows_[i].resize(info.width + 2);
+	}
 }
 
 bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
@@ -61,34 +163,34 @@ bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
 	BufferWriteSync w(app_, completed_request->buffers[stream_]);
 	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	uint8_t *ptr = (uint8_t *)buffer.data();
-
-	//Everything beyond this point is image processing...
-
-	uint8_t value = 128;
-	int num = (info.stride * info.height) / 2;
-	Mat src = Mat(info.height, info.width, CV_8U, ptr, info.stride);
-	int scale = 1;
-	int delta = 0;
-	int ddepth = CV_16S;
-
-	memset(ptr + info.stride * info.height, value, num);
-
-	// Remove noise by blurring with a Gaussian filter ( kernal size = 3 )
-	GaussianBlur(src, src, Size(3, 3), 0, 0, BORDER_DEFAULT);
-
-	Mat grad_x, grad_y;
-
-	//Scharr(src_gray, grad_x, ddepth, 1, 0, scale, delta, BORDER_DEFAULT);
-	Sobel(src, grad_x, ddepth, 1, 0, ksize_, scale, delta, BORDER_DEFAULT);
-	//Scharr(src_gray, grad_y, ddepth, 0, 1, scale, delta, BORDER_DEFAULT);
-	Sobel(src, grad_y, ddepth, 0, 1, ksize_, scale, delta, BORDER_DEFAULT);
-
-	// converting back to CV_8U
-	convertScaleAbs(grad_x, grad_x);
-	convertScaleAbs(grad_y, grad_y);
-
-	//weight the x and y gradients and add their magnitudes
-	addWeighted(grad_x, 0.5, grad_y, 0.5, 0, src);
+	unsigned int width = info.width, height = info.height, stride = info.stride;
+
+	// Flatten the chroma planes to grey.
+	memset(ptr + stride * height, 128, (stride * height) / 2);
+
+	if (width < 2 || height < 2)
+		return false;
+
+	// Prime the pipeline: smoothed row 0 (the off-image row replicates row 0).
+	hblur_row(ptr, &hblur_rows_[0][0], width);
+	hblur_row(ptr + stride, &hblur_rows_[1][0], width);
+	vblur_row(&hblur_rows_[0][0], &hblur_rows_[0][0], &hblur_rows_[1][0], blurRow(0), width);
+
+	for (unsigned int y = 0; y < height; y++)
+	{
+		// Produce smoothed row y + 1 before row y is overwritten below.
+		if (y + 1 < height)
+		{
+			if (y + 2 < height)
+				hblur_row(ptr + (y + 2) * stride, &hblur_rows_[(y + 2) % 3][0], width);
+			vblur_row(&hblur_rows_[y % 3][0], &hblur_rows_[(y + 1) % 3][0],
+					  &hblur_rows_[std::min(y + 2, height - 1) % 3][0], blurRow(y + 1), width);
+		}
+
+		uint8_t *above = blurRow(y ? y - 1 : 0);
+		uint8_t *below = blurRow(std::min(y + 1, height - 1));
+		sobel_row(above, blurRow(y), below, ptr + y * stride, width);
+	}
 
 	return false;
 }
@@ -20,6 +20,7 @@ void TfStage::Read(boost::property_tree::ptree const &params)
 	config_->verbose = params.get<int>("verbose", 0);
 	config_->normalisation_offset = params.get<float>("normalisation_offset", 127.5);
 	config_->normalisation_scale = params.get<float>("normalisation_scale", 127.5);
+	config_->xnnpack_threads = params.get<int>("xnnpack_threads", 0);
 
 	initialise();
 
@@ -41,6 +42,24 @@ void TfStage::initialise()
 	if (config_->number_of_threads != -1)
 		interpreter_->SetNumThreads(config_->number_of_threads);
 
+#if TF_STAGE_HAVE_XNNPACK
+	// Apply the XNNPACK delegate explicitly when a thread count is configured,
+	// otherwise models can end up leaving most of the SoC idle.
+	if (config_->xnnpack_threads > 0)
+	{
+		TfLiteXNNPackDelegateOptions options = TfLiteXNNPackDelegateOptionsDefault();
+		options.num_threads = config_->xnnpack_threads;
+		xnnpack_delegate_.reset(TfLiteXNNPackDelegateCreate(&options));
+		if (interpreter_->ModifyGraphWithDelegate(xnnpack_delegate_.get()) != kTfLiteOk)
+			LOG_ERROR("TfStage: Failed to apply XNNPACK delegate");
+		else if (config_->verbose)
+			LOG(1, "TfStage: XNNPACK delegate using " << config_->xnnpack_threads << " threads");
+	}
+#else
+	if (config_->xnnpack_threads > 0)
+		LOG(1, "TfStage: XNNPACK delegate not available in this TFLite build");
+#endif
+
 	if (interpreter_->AllocateTensors() != kTfLiteOk)
 		throw std::runtime_error("TfStage: Failed to allocate tensors");
 
@@ -60,6 +79,15 @@ void TfStage::initialise()
 		throw std::runtime_error("TfStage: Input tensor size mismatch");
 }
 
+void TfStage::AdjustConfig(std::string const &use_case, StreamConfiguration *config)
+{
+	// The model wants RGB, so ask for the lores stream in RGB and let the ISP
+	// do the conversion, rather than converting on the CPU for every inference.
+	// ("rgb" maps to BGR888, matching the lores format names in the JSON file.)
+	if (use_case == "lores")
+		config->pixelFormat = libcamera::formats::BGR888;
+}
+
 void TfStage::Configure()
 {
 	lores_stream_ = app_->LoresStream();
@@ -90,31 +118,43 @@ void TfStage::Configure()
 	checkConfiguration();
 }
 
+void TfStage::Start()
+{
+	quit_ = false;
+	inference_pending_ = false;
+	inference_thread_ = std::thread(&TfStage::inferenceThread, this);
+}
+
 bool TfStage::Process(CompletedRequestPtr &completed_request)
 {
 	if (!lores_stream_)
 		return false;
 
 	{
-		std::unique_lock<std::mutex> lck(future_mutex_);
+		std::unique_lock<std::mutex> lck(inference_mutex_);
 		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
-			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+			!inference_pending_)
 		{
-			BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
-			libcamera::Span<uint8_t> buffer = r.Get()[0];
-
-			// Copy the lores image here and let the asynchronous thread convert it to RGB.
-			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
-			// memory into cached memory, which is then *much* quicker.
-			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
-
-			future_ = std::make_unique<std::future<void>>();
-			*future_ = std::async(std::launch::async, [this] {
-				auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this).count();
-
-				if (config_->verbose)
-					LOG(1, "TfStage: Inference time: " << time_taken << " ms");
-			});
+			StreamInfo tf_info;
+			tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
+			if (interpreter_->tensor(interpreter_->inputs()[0])->type == kTfLiteUInt8)
+			{
+				// Quantized models take the conversion output straight into the
+				// input tensor, with no intermediate buffer at all. The inference
+				// is idle here (checked above), so the tensor is ours to fill.
+				BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
+				ToRgb(interpreter_->typed_input_tensor<uint8_t>(0), r.Get()[0].data(), lores_info_, tf_info);
+			}
+			else
+			{
+				// Float models convert via the shared per-request cache: any other
+				// stage wanting the same conversion reuses it, and the buffers are
+				// pooled, so this replaces the old copy-then-convert.
+				rgb_image_ = CachedRgb(completed_request, lores_stream_, tf_info);
+			}
+
+			inference_pending_ = true;
+			inference_cv_.notify_one();
 		}
 	}
 
@@ -124,24 +164,40 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
+void TfStage::inferenceThread()
+{
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lck(inference_mutex_);
+			inference_cv_.wait(lck, [this] { return quit_ || inference_pending_; });
+			if (quit_)
+				break;
+		}
+
+		auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this).count();
+		if (config_->verbose)
+			LOG(1, "TfStage: Inference time: " << time_taken << " ms");
+
+		std::unique_lock<std::mutex> lck(inference_mutex_);
+		inference_pending_ = false;
+	}
+}
+
 void TfStage::runInference()
 {
 	int input = interpreter_->inputs()[0];
-	StreamInfo tf_info;
-	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
-	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info);
 
-	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
-	{
-		uint8_t *tensor = interpreter_->typed_tensor<uint8_t>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = rgb_image[i];
-	}
-	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
+	// Quantized models had the image converted straight into their tensor in
+	// Process(); float models still need the normalisation pass here.
+	if (interpreter_->tensor(input)->type == kTfLiteFloat32)
 	{
+		std::vector<uint8_t> const &rgb_image = *rgb_image_;
 		float *tensor = interpreter_->typed_tensor<float>(input);
+		float scale = 1.0f / config_->normalisation_scale, offset = config_->normalisation_offset;
 		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = (rgb_image[i] - config_->normalisation_offset) / config_->normalisation_scale;
+			tensor[i] = (rgb_image[i] - offset) * scale;
+		rgb_image_.reset(); // the tensor is filled, let the buffer go back to the pool
 	}
 
 	if (interpreter_->Invoke() != kTfLiteOk)
@@ -153,6 +209,11 @@ void TfStage::runInference()
 
 void TfStage::Stop()
 {
-	if (future_)
-		future_->wait();
+	{
+		std::unique_lock<std::mutex> lck(inference_mutex_);
+		quit_ = true;
+	}
+	inference_cv_.notify_one();
+	if (inference_thread_.joinable())
+		inference_thread_.join();
 }
@@ -7,8 +7,10 @@
 
 #pragma once
 
+#include <condition_variable>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 #include <libcamera/stream.h>
@@ -18,6 +20,13 @@
 #include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/kernels/register.h"
 
+#if defined(__has_include)
+#if __has_include("tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h")
+#include "tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h"
+#define TF_STAGE_HAVE_XNNPACK 1
+#endif
+#endif
+
 #include "core/rpicam_app.hpp"
 #include "core/stream_info.hpp"
 
@@ -36,6 +45,7 @@ struct TfConfig
 	bool verbose = false;
 	float normalisation_offset = 127.5;
 	float normalisation_scale = 127.5;
+	int xnnpack_threads = 0; // 0 leaves the delegate to TFLite's defaults
 };
 
 class TfStage : public PostProcessingStage
@@ -51,8 +61,12 @@ public:
 
 	void Read(boost::property_tree::ptree const &params) override;
 
+	void AdjustConfig(std::string const &use_case, StreamConfiguration *config) override;
+
 	void Configure() override;
 
+	void Start() override;
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 	void Stop() override;
@@ -93,14 +107,26 @@ protected:
 	StreamInfo main_stream_info_;
 
 	std::unique_ptr<tflite::FlatBufferModel> model_;
+#if TF_STAGE_HAVE_XNNPACK
+	// Declared before the interpreter so it outlives it on destruction.
+	std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate *)> xnnpack_delegate_ { nullptr,
+																					TfLiteXNNPackDelegateDelete };
+#endif
 	std::unique_ptr<tflite::Interpreter> interpreter_;
 
 private:
 	void initialise();
+	void inferenceThread();
 	void runInference();
 
-	std::mutex future_mutex_;
-	std::unique_ptr<std::future<void>> future_;
-	std::vector<uint8_t> lores_copy_;
+	// Inference runs on a persistent worker thread against a snapshot of the
+	// lores frame, so Process() always returns immediately and attaches the
+	// latest completed results, one refresh cycle stale.
+	std::thread inference_thread_;
+	std::mutex inference_mutex_;
+	std::condition_variable inference_cv_;
+	bool inference_pending_;
+	bool quit_;
+	std::shared_ptr<std::vector<uint8_t> const> rgb_image_;
 	std::mutex output_mutex_;
 };
@@ -5,6 +5,11 @@
  * drm_preview.cpp - DRM-based preview window.
  */
 
+#include <mutex>
+
+#include <poll.h>
+#include <sys/mman.h>
+
 #include <drm.h>
 #include <drm_fourcc.h>
 #include <drm_mode.h>
@@ -32,6 +37,9 @@ public:
 		w = max_image_width_;
 		h = max_image_height_;
 	}
+	// Composite an ARGB image over the video on a second plane, so that
+	// annotations never touch (or cost us a pass over) the video buffers.
+	virtual bool SetOverlay(uint8_t const *argb, unsigned int width, unsigned int height, unsigned int stride) override;
 
 private:
 	struct Buffer
@@ -46,6 +54,9 @@ private:
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
 	void findCrtc();
 	void findPlane();
+	void findPlaneProperties();
+	void handleEvents(bool block);
+	static void flipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data);
 	int drmfd_;
 	int conId_;
 	uint32_t crtcId_;
@@ -63,6 +74,30 @@ private:
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
 	bool first_time_;
+	// Atomic modesetting state. Commits are nonblocking; the buffer being
+	// replaced is handed back when the kernel's flip event arrives rather
+	// than us waiting out a vblank in Show().
+	bool atomic_;
+	bool async_flip_;
+	struct
+	{
+		uint32_t fb_id, crtc_id;
+		uint32_t src_x, src_y, src_w, src_h;
+		uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+	} plane_props_;
+	int pending_fd_; // committed, flip event not yet seen
+	int displayed_fd_; // on screen, released by the next flip event
+	// Overlay plane state: a dumb buffer we own, composited above the video.
+	void findOverlayPlane();
+	void freeOverlayBuffer();
+	uint32_t overlay_plane_id_;
+	uint32_t overlay_bo_handle_;
+	uint32_t overlay_fb_handle_;
+	uint8_t *overlay_map_;
+	size_t overlay_map_size_;
+	unsigned int overlay_width_, overlay_height_, overlay_stride_;
+	bool overlay_visible_;
+	std::mutex overlay_mutex_;
 };
 
 #define ERRSTR strerror(errno)
@@ -242,7 +277,54 @@ void DrmPreview::findPlane()
 	drmModeFreePlaneResources(planes);
 }
 
-DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+static uint32_t get_property_id(int fd, uint32_t object_id, uint32_t object_type, char const *name)
+{
+	drmModeObjectPropertiesPtr properties = drmModeObjectGetProperties(fd, object_id, object_type);
+	uint32_t id = 0;
+
+	for (unsigned int i = 0; properties && i < properties->count_props; i++)
+	{
+		drmModePropertyPtr prop = drmModeGetProperty(fd, properties->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name))
+			id = prop->prop_id;
+		drmModeFreeProperty(prop);
+		if (id)
+			break;
+	}
+	if (properties)
+		drmModeFreeObjectProperties(properties);
+	return id;
+}
+
+void DrmPreview::findPlaneProperties()
+{
+	plane_props_.fb_id = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "FB_ID");
+	plane_props_.crtc_id = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+	plane_props_.src_x = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "SRC_X");
+	plane_props_.src_y = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+	plane_props_.src_w = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "SRC_W");
+	plane_props_.src_h = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "SRC_H");
+	plane_props_.crtc_x = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+	plane_props_.crtc_y = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+	plane_props_.crtc_w = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+	plane_props_.crtc_h = get_property_id(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+
+	if (!plane_props_.fb_id || !plane_props_.crtc_id || !plane_props_.src_x || !plane_props_.src_y ||
+		!plane_props_.src_w || !plane_props_.src_h || !plane_props_.crtc_x || !plane_props_.crtc_y ||
+		!plane_props_.crtc_w || !plane_props_.crtc_h)
+	{
+		LOG(1, "DrmPreview: plane properties missing, using legacy modesetting");
+		atomic_ = false;
+	}
+}
+
+DrmPreview::DrmPreview(Options const *options)
+	: Preview(options), last_fd_(-1), first_time_(true), atomic_(false), async_flip_(options->Get().async_flip),
+	  pending_fd_(-1), displayed_fd_(-1), overlay_plane_id_(0), overlay_bo_handle_(0), overlay_fb_handle_(0),
+	  overlay_map_(nullptr), overlay_map_size_(0), overlay_width_(0), overlay_height_(0), overlay_stride_(0),
+	  overlay_visible_(false)
 {
 	drmfd_ = drmOpen("vc4", NULL);
 	if (drmfd_ < 0)
@@ -264,6 +346,13 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 		findCrtc();
 		out_fourcc_ = DRM_FORMAT_YUV420;
 		findPlane();
+		findOverlayPlane();
+
+		atomic_ = drmSetClientCap(drmfd_, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+		if (atomic_)
+			findPlaneProperties();
+		if (!atomic_ && async_flip_)
+			LOG(1, "DrmPreview: async flips need atomic modesetting, ignored");
 	}
 	catch (std::exception const &e)
 	{
@@ -283,9 +372,123 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 
 DrmPreview::~DrmPreview()
 {
+	freeOverlayBuffer();
 	close(drmfd_);
 }
 
+// Look for a second plane on our CRTC that can scan out ARGB8888, for the
+// annotation overlay. It's not an error if there isn't one - SetOverlay just
+// reports overlays as unavailable.
+void DrmPreview::findOverlayPlane()
+{
+	drmModePlaneResPtr planes = drmModeGetPlaneResources(drmfd_);
+	if (!planes)
+		return;
+
+	for (unsigned int i = 0; i < planes->count_planes && !overlay_plane_id_; ++i)
+	{
+		drmModePlanePtr plane = drmModeGetPlane(drmfd_, planes->planes[i]);
+		if (!plane)
+			continue;
+		if (plane->plane_id != planeId_ && (plane->possible_crtcs & (1 << crtcIdx_)))
+		{
+			for (unsigned int j = 0; j < plane->count_formats; ++j)
+			{
+				if (plane->formats[j] == DRM_FORMAT_ARGB8888)
+				{
+					overlay_plane_id_ = plane->plane_id;
+					break;
+				}
+			}
+		}
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(planes);
+}
+
+void DrmPreview::freeOverlayBuffer()
+{
+	if (overlay_map_)
+		munmap(overlay_map_, overlay_map_size_), overlay_map_ = nullptr;
+	if (overlay_fb_handle_)
+		drmModeRmFB(drmfd_, overlay_fb_handle_), overlay_fb_handle_ = 0;
+	if (overlay_bo_handle_)
+	{
+		drm_mode_destroy_dumb destroy = {};
+		destroy.handle = overlay_bo_handle_;
+		drmIoctl(drmfd_, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+		overlay_bo_handle_ = 0;
+	}
+	overlay_width_ = overlay_height_ = 0;
+}
+
+bool DrmPreview::SetOverlay(uint8_t const *argb, unsigned int width, unsigned int height, unsigned int stride)
+{
+	std::lock_guard<std::mutex> lock(overlay_mutex_);
+	if (!overlay_plane_id_)
+		return false;
+
+	if (!argb || !width || !height)
+	{
+		// A framebuffer of zero takes the plane away again.
+		if (overlay_visible_)
+			drmModeSetPlane(drmfd_, overlay_plane_id_, crtcId_, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		overlay_visible_ = false;
+		return true;
+	}
+
+	if (width != overlay_width_ || height != overlay_height_)
+	{
+		freeOverlayBuffer();
+
+		drm_mode_create_dumb create = {};
+		create.width = width;
+		create.height = height;
+		create.bpp = 32;
+		if (drmIoctl(drmfd_, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0)
+			return false;
+		overlay_bo_handle_ = create.handle;
+		overlay_stride_ = create.pitch;
+		overlay_map_size_ = create.size;
+
+		uint32_t offsets[4] = {}, pitches[4] = { create.pitch }, bo_handles[4] = { create.handle };
+		if (drmModeAddFB2(drmfd_, width, height, DRM_FORMAT_ARGB8888, bo_handles, pitches, offsets,
+						  &overlay_fb_handle_, 0))
+		{
+			freeOverlayBuffer();
+			return false;
+		}
+
+		drm_mode_map_dumb map = {};
+		map.handle = create.handle;
+		if (drmIoctl(drmfd_, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0)
+		{
+			freeOverlayBuffer();
+			return false;
+		}
+		overlay_map_ = (uint8_t *)mmap(nullptr, create.size, PROT_WRITE, MAP_SHARED, drmfd_, map.offset);
+		if (overlay_map_ == MAP_FAILED)
+		{
+			overlay_map_ = nullptr;
+			freeOverlayBuffer();
+			return false;
+		}
+		overlay_width_ = width;
+		overlay_height_ = height;
+	}
+
+	for (unsigned int y = 0; y < height; y++)
+		memcpy(overlay_map_ + y * overlay_stride_, argb + y * stride, width * 4);
+
+	// The display scales the overlay to cover the preview window for us.
+	if (drmModeSetPlane(drmfd_, overlay_plane_id_, crtcId_, overlay_fb_handle_, 0, x_, y_, width_, height_, 0, 0,
+						width << 16, height << 16))
+		return false;
+	overlay_visible_ = true;
+	return true;
+}
+
 // DRM doesn't seem to have userspace definitions of its enums, but the properties
 // contain enum-name-to-value tables. So the code below ends up using strings and
 // searching for name matches. I suppose it works...
@@ -389,6 +592,34 @@ void DrmPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 		throw std::runtime_error("drmModeAddFB2 failed: " + std::string(ERRSTR));
 }
 
+void DrmPreview::flipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	DrmPreview *me = (DrmPreview *)user_data;
+	// Our commit has taken effect, so the buffer it replaced is off screen now.
+	if (me->displayed_fd_ >= 0)
+		me->done_callback_(me->displayed_fd_);
+	me->displayed_fd_ = me->pending_fd_;
+	me->pending_fd_ = -1;
+}
+
+void DrmPreview::handleEvents(bool block)
+{
+	while (pending_fd_ >= 0)
+	{
+		pollfd pfd = { drmfd_, POLLIN, 0 };
+		if (poll(&pfd, 1, block ? 1000 : 0) <= 0)
+		{
+			if (block)
+				LOG(1, "DrmPreview: timed out waiting for flip event");
+			return;
+		}
+		drmEventContext ctx = {};
+		ctx.version = DRM_EVENT_CONTEXT_VERSION;
+		ctx.page_flip_handler = &DrmPreview::flipHandler;
+		drmHandleEvent(drmfd_, &ctx);
+	}
+}
+
 void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
 {
 	Buffer &buffer = buffers_[fd];
@@ -402,6 +633,48 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	else
 		w = height_ * info.width / info.height, x_off = (width_ - w) / 2;
 
+	if (atomic_)
+	{
+		// Harvest any flip that has completed since last time.
+		handleEvents(false);
+		if (pending_fd_ >= 0)
+		{
+			// The display hasn't picked up our previous commit yet. Skip this
+			// frame rather than stalling the capture loop behind the display.
+			done_callback_(fd);
+			return;
+		}
+
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.fb_id, buffer.fb_handle);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_id, crtcId_);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.src_x, 0);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.src_y, 0);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.src_w, buffer.info.width << 16);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.src_h, buffer.info.height << 16);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_x, x_off + x_);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_y, y_off + y_);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_w, w);
+		drmModeAtomicAddProperty(req, planeId_, plane_props_.crtc_h, h);
+
+		uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+		if (async_flip_)
+			flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+		int ret = drmModeAtomicCommit(drmfd_, req, flags, this);
+		if (ret < 0 && async_flip_)
+		{
+			// Not every plane/kernel combination allows async flips.
+			LOG(1, "DrmPreview: async flips not supported here, reverting to vblank-synced");
+			async_flip_ = false;
+			ret = drmModeAtomicCommit(drmfd_, req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, this);
+		}
+		drmModeAtomicFree(req);
+		if (ret < 0)
+			throw std::runtime_error("drmModeAtomicCommit failed: " + std::string(ERRSTR));
+		pending_fd_ = fd;
+		return;
+	}
+
 	if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_off + x_, y_off + y_, w, h, 0, 0,
 						buffer.info.width << 16, buffer.info.height << 16))
 		throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
@@ -412,6 +685,10 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 
 void DrmPreview::Reset()
 {
+	// Let an outstanding commit land before its framebuffer disappears.
+	if (atomic_)
+		handleEvents(true);
+	pending_fd_ = displayed_fd_ = -1;
 	for (auto &it : buffers_)
 	{
 		drmModeRmFB(drmfd_, it.second.fb_handle);
@@ -5,8 +5,13 @@
  * egl_preview.cpp - X/EGL-based preview window.
  */
 
+#include <condition_variable>
 #include <map>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <thread>
+#include <tuple>
 
 // Include libcamera stuff before X11, as X11 #defines both Status and None
 // which upsets the libcamera headers.
@@ -58,6 +63,7 @@ private:
 	};
 	void makeWindow(char const *name);
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
+	void fenceThread();
 	::Display *display_;
 	EGLDisplay egl_display_;
 	Window window_;
@@ -74,6 +80,17 @@ private:
 	int height_;
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
+	// With EGL_KHR_fence_sync, each displayed buffer gets a GPU fence and is
+	// handed back from this thread as soon as the GPU has read it, rather
+	// than being held hostage until the next (compositor-paced) swap.
+	bool fence_sync_;
+	std::thread fence_thread_;
+	std::mutex fence_mutex_;
+	std::condition_variable fence_cv_;
+	std::condition_variable fence_drain_cv_;
+	std::queue<std::pair<int, EGLSyncKHR>> fence_queue_;
+	bool fence_busy_ = false;
+	bool fence_quit_ = false;
 };
 
 static GLint compile_shader(GLenum target, const char *source)
@@ -188,15 +205,58 @@ EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1),
 	height_ = options_->Get().preview_height;
 	makeWindow("rpicam-app");
 
+	fence_sync_ = epoxy_has_egl_extension(egl_display_, "EGL_KHR_fence_sync");
+	if (fence_sync_)
+		fence_thread_ = std::thread(&EglPreview::fenceThread, this);
+	else
+		LOG(1, "EglPreview: no EGL_KHR_fence_sync, buffers released on the following frame");
+
 	// gl_setup() has to happen later, once we're sure we're in the display thread.
 }
 
 EglPreview::~EglPreview()
 {
+	if (fence_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(fence_mutex_);
+			fence_quit_ = true;
+		}
+		fence_cv_.notify_one();
+		fence_thread_.join();
+	}
 	EglPreview::Reset();
 	eglDestroyContext(egl_display_, egl_context_);
 }
 
+void EglPreview::fenceThread()
+{
+	while (true)
+	{
+		int fd;
+		EGLSyncKHR sync;
+		{
+			std::unique_lock<std::mutex> lock(fence_mutex_);
+			fence_cv_.wait(lock, [this] { return fence_quit_ || !fence_queue_.empty(); });
+			if (fence_queue_.empty())
+				return;
+			std::tie(fd, sync) = fence_queue_.front();
+			fence_queue_.pop();
+			fence_busy_ = true;
+		}
+		// Block here, not in Show(): the capture loop gets its buffer back
+		// the moment the GPU is done with it.
+		eglClientWaitSyncKHR(egl_display_, sync, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+		eglDestroySyncKHR(egl_display_, sync);
+		done_callback_(fd);
+		{
+			std::lock_guard<std::mutex> lock(fence_mutex_);
+			fence_busy_ = false;
+		}
+		fence_drain_cv_.notify_one();
+	}
+}
+
 static void no_border(Display *display, Window window)
 {
 	static const unsigned MWM_HINTS_DECORATIONS = (1 << 1);
@@ -424,6 +484,22 @@ void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
 	EGLBoolean success [[maybe_unused]] = eglSwapBuffers(egl_display_, egl_surface_);
+
+	// Preferably, release the buffer on an explicit GPU fence; failing that,
+	// fall back to holding it until the frame after has been swapped.
+	if (fence_sync_)
+	{
+		EGLSyncKHR sync = eglCreateSyncKHR(egl_display_, EGL_SYNC_FENCE_KHR, NULL);
+		if (sync != EGL_NO_SYNC_KHR)
+		{
+			{
+				std::lock_guard<std::mutex> lock(fence_mutex_);
+				fence_queue_.push({ fd, sync });
+			}
+			fence_cv_.notify_one();
+			return;
+		}
+	}
 	if (last_fd_ >= 0)
 		done_callback_(last_fd_);
 	last_fd_ = fd;
@@ -431,6 +507,12 @@ void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 
 void EglPreview::Reset()
 {
+	if (fence_thread_.joinable())
+	{
+		// Let any buffers still fenced to the GPU come back first.
+		std::unique_lock<std::mutex> lock(fence_mutex_);
+		fence_drain_cv_.wait(lock, [this] { return fence_queue_.empty() && !fence_busy_; });
+	}
 	for (auto &it : buffers_)
 		glDeleteTextures(1, &it.second.texture);
 	buffers_.clear();
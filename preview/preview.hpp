@@ -34,6 +34,14 @@ public:
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) = 0;
+	// Supply an ARGB8888 image that the preview composites over the video on a
+	// display plane, scaled to the window; a null image removes the overlay.
+	// Returns false when this preview can't do overlays, in which case the
+	// caller will have to draw into the video buffer itself.
+	virtual bool SetOverlay(uint8_t const *argb, unsigned int width, unsigned int height, unsigned int stride)
+	{
+		return false;
+	}
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() = 0;
@@ -11,6 +11,10 @@
 #include <string.h>
 #include <thread>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 // This header must be before the QT headers, as the latter #defines slot and emit!
 #include "core/options.hpp"
 
@@ -55,6 +59,60 @@ protected:
 	QSize sizeHint() const override { return size; }
 };
 
+#if defined(__ARM_NEON)
+
+// Convert a row of per-pixel Y/U/V samples to packed RGB888, 16 pixels per
+// iteration. Coefficients are Q6 fixed point; the maths is done at 32 bits
+// and narrowed with saturation, which gives us the 0-255 clamp for free.
+static void yuv_to_rgb_row_neon(uint8_t const *Y, uint8_t const *U, uint8_t const *V, uint8_t *dest,
+								unsigned int count, int16_t offsetY, int16_t const coeffs[5])
+{
+	int16_t const cY = coeffs[0], cVR = coeffs[1], cUG = coeffs[2], cVG = coeffs[3], cUB = coeffs[4];
+
+	for (unsigned int x = 0; x + 16 <= count; x += 16)
+	{
+		uint8x16_t y8 = vld1q_u8(Y + x), u8 = vld1q_u8(U + x), v8 = vld1q_u8(V + x);
+		uint8x16x3_t rgb;
+
+		for (int half = 0; half < 2; half++)
+		{
+			uint8x8_t yh = half ? vget_high_u8(y8) : vget_low_u8(y8);
+			uint8x8_t uh = half ? vget_high_u8(u8) : vget_low_u8(u8);
+			uint8x8_t vh = half ? vget_high_u8(v8) : vget_low_u8(v8);
+			int16x8_t y = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(yh)), vdupq_n_s16(offsetY));
+			int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uh)), vdupq_n_s16(128));
+			int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vh)), vdupq_n_s16(128));
+
+			int32x4_t ylo = vmull_n_s16(vget_low_s16(y), cY), yhi = vmull_n_s16(vget_high_s16(y), cY);
+			int32x4_t rlo = vmlal_n_s16(ylo, vget_low_s16(v), cVR);
+			int32x4_t rhi = vmlal_n_s16(yhi, vget_high_s16(v), cVR);
+			int32x4_t glo = vmlal_n_s16(vmlal_n_s16(ylo, vget_low_s16(u), cUG), vget_low_s16(v), cVG);
+			int32x4_t ghi = vmlal_n_s16(vmlal_n_s16(yhi, vget_high_s16(u), cUG), vget_high_s16(v), cVG);
+			int32x4_t blo = vmlal_n_s16(ylo, vget_low_s16(u), cUB);
+			int32x4_t bhi = vmlal_n_s16(yhi, vget_high_s16(u), cUB);
+
+			uint8x8_t r = vqmovun_s16(vcombine_s16(vqshrn_n_s32(rlo, 6), vqshrn_n_s32(rhi, 6)));
+			uint8x8_t g = vqmovun_s16(vcombine_s16(vqshrn_n_s32(glo, 6), vqshrn_n_s32(ghi, 6)));
+			uint8x8_t b = vqmovun_s16(vcombine_s16(vqshrn_n_s32(blo, 6), vqshrn_n_s32(bhi, 6)));
+			if (half)
+			{
+				rgb.val[0] = vcombine_u8(vget_low_u8(rgb.val[0]), r);
+				rgb.val[1] = vcombine_u8(vget_low_u8(rgb.val[1]), g);
+				rgb.val[2] = vcombine_u8(vget_low_u8(rgb.val[2]), b);
+			}
+			else
+			{
+				rgb.val[0] = vcombine_u8(r, r);
+				rgb.val[1] = vcombine_u8(g, g);
+				rgb.val[2] = vcombine_u8(b, b);
+			}
+		}
+		vst3q_u8(dest + 3 * x, rgb);
+	}
+}
+
+#endif
+
 class QtPreview : public Preview
 {
 public:
@@ -70,18 +128,79 @@ public:
 		// As a hint, reserve twice the binned width for our widest current camera (V3)
 		tmp_stripe_.reserve(4608);
 		thread_ = std::thread(&QtPreview::threadFunc, this, options);
-		std::unique_lock lock(mutex_);
-		while (!pane_)
-			cond_var_.wait(lock);
+		{
+			std::unique_lock lock(mutex_);
+			while (!pane_)
+				cond_var_.wait(lock);
+		}
+		convert_thread_ = std::thread(&QtPreview::convertThread, this);
 		LOG(2, "Made Qt preview");
 	}
 	~QtPreview()
 	{
+		{
+			std::lock_guard lock(frame_mutex_);
+			quit_ = true;
+		}
+		frame_cv_.notify_one();
+		convert_thread_.join();
 		application_->exit();
 		thread_.join();
 	}
 	void SetInfoText(const std::string &text) override { main_window_->setWindowTitle(QString::fromStdString(text)); }
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override
+	{
+		// Just post the frame to the conversion thread so the camera thread
+		// isn't taxed for it. If the previous frame hasn't been converted yet
+		// it gets dropped - the conversion can't hold the capture loop up.
+		std::lock_guard lock(frame_mutex_);
+		if (frame_valid_)
+			done_callback_(frame_fd_);
+		frame_fd_ = fd;
+		frame_span_ = span;
+		frame_info_ = info;
+		frame_valid_ = true;
+		frame_cv_.notify_one();
+	}
+	// Reset the preview window, clearing the current buffers and being ready to
+	// show new ones.
+	void Reset() override
+	{
+		// Don't sit on a buffer that the rest of the app thinks is in use.
+		std::lock_guard lock(frame_mutex_);
+		if (frame_valid_)
+			done_callback_(frame_fd_), frame_valid_ = false;
+	}
+	// Check if preview window has been shut down.
+	bool Quit() override { return main_window_->quit; }
+	// There is no particular limit to image sizes, though large images will be very slow.
+	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override { w = h = 0; }
+
+private:
+	void convertThread()
+	{
+		while (true)
+		{
+			int fd;
+			libcamera::Span<uint8_t> span;
+			StreamInfo info;
+			{
+				std::unique_lock lock(frame_mutex_);
+				frame_cv_.wait(lock, [this] { return quit_ || frame_valid_; });
+				if (quit_)
+				{
+					if (frame_valid_)
+						done_callback_(frame_fd_), frame_valid_ = false;
+					return;
+				}
+				fd = frame_fd_, span = frame_span_, info = frame_info_;
+				frame_valid_ = false;
+			}
+			convertFrame(span, info);
+			done_callback_(fd);
+		}
+	}
+	void convertFrame(libcamera::Span<uint8_t> span, StreamInfo const &info)
 	{
 		// Quick and simple nearest-neighbour-ish resampling is used here.
 		// We further share U,V samples between adjacent output pixel pairs
@@ -135,6 +254,14 @@ public:
 		uint8_t *U_row = Y_row + info.stride;
 		uint8_t *V_row = U_row + (info.stride >> 1);
 
+#if defined(__ARM_NEON)
+		auto q6 = [](float c) { return (int16_t)(c * 64.0f + (c < 0 ? -0.5f : 0.5f)); };
+		int16_t const coeffs[5] = { q6(coeffY), q6(coeffVR), q6(coeffUG), q6(coeffVG), q6(coeffUB) };
+		y_samples_.resize(window_width_);
+		u_samples_.resize(window_width_);
+		v_samples_.resize(window_width_);
+#endif
+
 		// Possibly this should be locked in case a repaint is happening? In practice the risk
 		// is only that there might be some tearing, so I don't think we worry. We could speed
 		// it up by getting the ISP to supply RGB, but I'm not sure I want to handle that extra
@@ -149,7 +276,25 @@ public:
 			memcpy(U_row, Y_start + ((4 * info.height + row) >> 1) * (info.stride >> 1), info.stride >> 1);
 			memcpy(V_row, Y_start + ((5 * info.height + row) >> 1) * (info.stride >> 1), info.stride >> 1);
 
-			for (unsigned int x = 0; x < window_width_; x += 2)
+#if defined(__ARM_NEON)
+			// Gather the (possibly rescaled) samples per output pixel, then
+			// let the vector kernel do the arithmetic 16 pixels at a time.
+			// Any sub-16-pixel remainder falls through to the scalar loop.
+			unsigned int simd_width = window_width_ & ~15u;
+			for (unsigned int x = 0; x < simd_width; x++)
+			{
+				y_samples_[x] = Y_row[x_pos >> 16];
+				u_samples_[x] = U_row[x_pos >> 17];
+				v_samples_[x] = V_row[x_pos >> 17];
+				x_pos += x_step;
+			}
+			yuv_to_rgb_row_neon(&y_samples_[0], &u_samples_[0], &v_samples_[0], dest, simd_width, offsetY, coeffs);
+			dest += 3 * simd_width;
+#else
+			unsigned int simd_width = 0;
+#endif
+
+			for (unsigned int x = simd_width; x < window_width_; x += 2)
 			{
 				int Y0 = Y_row[x_pos >> 16];
 				x_pos += x_step;
@@ -177,19 +322,7 @@ public:
 		}
 
 		pane_->update();
-
-		// Return the buffer to the camera system.
-		done_callback_(fd);
 	}
-	// Reset the preview window, clearing the current buffers and being ready to
-	// show new ones.
-	void Reset() override {}
-	// Check if preview window has been shut down.
-	bool Quit() override { return main_window_->quit; }
-	// There is no particular limit to image sizes, though large images will be very slow.
-	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override { w = h = 0; }
-
-private:
 	void threadFunc(Options const *options)
 	{
 		// This acts as Qt's event loop. Really Qt prefers to own the application's event loop
@@ -218,6 +351,17 @@ private:
 	std::mutex mutex_;
 	std::condition_variable cond_var_;
 	std::vector<uint8_t> tmp_stripe_;
+	// The frame most recently posted by Show(), waiting for the conversion
+	// thread; only ever one - newer frames replace older ones.
+	std::thread convert_thread_;
+	std::mutex frame_mutex_;
+	std::condition_variable frame_cv_;
+	int frame_fd_ = -1;
+	libcamera::Span<uint8_t> frame_span_;
+	StreamInfo frame_info_;
+	bool frame_valid_ = false;
+	bool quit_ = false;
+	std::vector<uint8_t> y_samples_, u_samples_, v_samples_;
 };
 
 static Preview *Create(Options const *options)
@@ -0,0 +1,47 @@
+#!/usr/bin/python3
+#
+# rpicam-apps binary timestamp file converter
+# Copyright (C) 2023, Raspberry Pi Ltd.
+#
+# Convert a binary timestamp file (rpicam-vid --save-pts --save-pts-format
+# binary) to the usual "timecode format v2" text file, for tools that expect
+# it (such as mkvmerge or utils/timestamp.py).
+#
+import argparse
+import struct
+import sys
+
+MAGIC = b'RPTS'
+
+
+def convert(infile, outfile):
+    header = infile.read(8)
+    if len(header) != 8 or header[:4] != MAGIC:
+        raise RuntimeError('not a binary timestamp file')
+    version = struct.unpack('<I', header[4:])[0]
+    if version != 1:
+        raise RuntimeError(f'unknown binary timestamp version {version}')
+
+    print('# timecode format v2', file=outfile)
+    while True:
+        record = infile.read(8)
+        if not record:
+            break
+        if len(record) != 8:
+            raise RuntimeError('truncated timestamp record')
+        timestamp_us = struct.unpack('<q', record)[0]
+        print(f'{timestamp_us // 1000}.{timestamp_us % 1000:03}', file=outfile)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Convert binary --save-pts files to text')
+    parser.add_argument('input', help='binary timestamp file to read')
+    parser.add_argument('output', nargs='?', help='text timestamp file to write (default stdout)')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as infile:
+        if args.output:
+            with open(args.output, 'w') as outfile:
+                convert(infile, outfile)
+        else:
+            convert(infile, sys.stdout)